@@ -0,0 +1,110 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+/* Bump allocator. Memory is carved out of large blocks and only handed back
+ * all at once, when the arena is released or destroyed, so freeing a whole
+ * data set costs one delete per block instead of one per object. Only
+ * trivially destructible types can be placed in an arena since no
+ * destructors are ever run. */
+class Arena
+{
+public:
+    explicit Arena(size_t block_size = 1 << 20)
+        : pos_(nullptr), end_(nullptr), block_size_(block_size), reserved_(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    Arena(Arena&& other) noexcept
+        : blocks_(std::move(other.blocks_)), pos_(other.pos_), end_(other.end_), block_size_(other.block_size_), reserved_(other.reserved_)
+    {
+        other.pos_ = other.end_ = nullptr;
+        other.reserved_ = 0;
+    }
+
+    Arena& operator=(Arena&& other) noexcept
+    {
+        std::swap(blocks_, other.blocks_);
+        std::swap(pos_, other.pos_);
+        std::swap(end_, other.end_);
+        std::swap(block_size_, other.block_size_);
+        std::swap(reserved_, other.reserved_);
+        return *this;
+    }
+
+    // uninitialized memory, `align` has to be a power of two
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+    {
+        char* start = align_up(pos_, align);
+        if (pos_ == nullptr || bytes > size_t(end_ - start))
+        {
+            // requests bigger than a quarter block get a block of their own,
+            // so they do not throw away the rest of the current one
+            if (bytes + align > block_size_ / 4)
+            {
+                blocks_.emplace_back(new char[bytes + align]);
+                reserved_ += bytes + align;
+                return align_up(blocks_.back().get(), align);
+            }
+            blocks_.emplace_back(new char[block_size_]);
+            reserved_ += block_size_;
+            pos_ = blocks_.back().get();
+            end_ = pos_ + block_size_;
+            start = align_up(pos_, align);
+        }
+        pos_ = start + bytes;
+        return start;
+    }
+
+    // uninitialized array of n T
+    template <typename T>
+    T* allocate_array(size_t n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // copies the characters into the arena
+    std::string_view store(std::string_view text)
+    {
+        if (text.empty()) return std::string_view();
+        char* copy = static_cast<char*>(allocate(text.size(), 1));
+        std::memcpy(copy, text.data(), text.size());
+        return std::string_view(copy, text.size());
+    }
+
+    // frees every block; everything allocated so far becomes invalid
+    void release()
+    {
+        blocks_.clear();
+        pos_ = end_ = nullptr;
+        reserved_ = 0;
+    }
+
+    size_t bytes_reserved() const { return reserved_; }
+
+private:
+    static char* align_up(char* pointer, size_t align)
+    {
+        return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(pointer) + align - 1) & ~uintptr_t(align - 1));
+    }
+
+    std::vector< std::unique_ptr<char[]> > blocks_;
+    char* pos_;
+    char* end_;
+    size_t block_size_;
+    size_t reserved_;
+};
+
+#endif
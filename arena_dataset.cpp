@@ -0,0 +1,488 @@
+#include "arena_dataset.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fast_parser.h"
+#include "line_tokens.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+/* Products of one piece of the data file. Review users are indices into
+ * `users` and review products indices into `products`; the strings are
+ * copied into the chunk's own arena, which the dataset takes over. */
+struct ArenaChunk
+{
+    Arena strings;
+    vector<ArenaProduct> products;
+    vector<ArenaReview> reviews;
+    vector<string_view> similar;
+    vector<string_view> categories;
+    vector<string_view> users;           // distinct reviewers in order of first appearance
+    int num_purchases = 0;
+};
+
+
+/* Copies the words from pos to end into the chunk's arena, joined by single
+ * spaces like join_words. */
+string_view store_words(ArenaChunk& chunk, const char* pos, const char* end)
+{
+    char* joined = static_cast<char*>(chunk.strings.allocate(max<ptrdiff_t>(end - pos, 1), 1));
+    size_t length = 0;
+    for (string_view word = next_token(pos, end); !word.empty(); word = next_token(pos, end))
+    {
+        if (length > 0) joined[length++] = ' ';
+        copy(word.begin(), word.end(), joined + length);
+        length += word.size();
+    }
+    return string_view(joined, length);
+}
+
+
+void start_product(ArenaChunk& chunk, ArenaProduct& product)
+{
+    product = ArenaProduct();
+    product.first_review = chunk.reviews.size();
+    product.first_similar = chunk.similar.size();
+    product.first_category = chunk.categories.size();
+}
+
+
+void finish_product(ArenaChunk& chunk, ArenaProduct& product)
+{
+    product.num_reviews = chunk.reviews.size() - product.first_review;
+    product.num_similar = chunk.similar.size() - product.first_similar;
+    product.num_categories = chunk.categories.size() - product.first_category;
+    chunk.products.push_back(product);
+}
+
+
+/* parse_chunk for the arena layout, same rules for which lines count and
+ * which product is kept at the end of the chunk. */
+void parse_arena_chunk(const char* pos, const char* end, bool last_chunk, ArenaChunk& chunk)
+{
+    LineTokens tokens;
+    unordered_map<string_view, uint32_t> local_users;
+    vector<uint32_t> reviewed_by;        // local user -> 1 + last product the user reviewed
+
+    ArenaProduct current;
+    start_product(chunk, current);
+
+    while (pos < end)
+    {
+        const char* line = pos;
+        const char* eol = line_end(pos, end);
+        pos = eol < end ? eol + 1 : end;
+
+        // blank lines terminate a product record
+        if (eol - line <= 1)
+        {
+            finish_product(chunk, current);
+            start_product(chunk, current);
+            continue;
+        }
+
+        tokenize(line, eol, tokens);
+        if (tokens.count == 0) continue;
+
+        string_view first = tokens.token[0];
+        if (first == ID && tokens.count > 1)
+        {
+            current.id = to_int(tokens.token[1]);
+        }
+        else if (first == ASIN && tokens.count > 1)
+        {
+            current.asin = chunk.strings.store(tokens.token[1]);
+        }
+        else if (first == TITLE)
+        {
+            // re-joined with single spaces straight into the arena
+            current.title = store_words(chunk, first.data() + first.size(), eol);
+        }
+        else if (first == GROUP && tokens.count > 1)
+        {
+            current.group = store_words(chunk, tokens.token[1].data(), eol);
+        }
+        else if (first == SALESRANK && tokens.count > 1)
+        {
+            current.salesrank = to_int(tokens.token[1]);
+        }
+        else if (first == SIMILAR && tokens.count > 1)
+        {
+            if (to_int(tokens.token[1]) > 0)
+            {
+                const char* similar_pos = tokens.token[1].data() + tokens.token[1].size();
+                for (string_view asin = next_token(similar_pos, eol); !asin.empty(); asin = next_token(similar_pos, eol))
+                {
+                    chunk.similar.push_back(chunk.strings.store(asin));
+                }
+            }
+        }
+        else if (starts_with(first, '|'))
+        {
+            chunk.categories.push_back(store_words(chunk, first.data(), eol));
+        }
+        else if (first == REVIEW && tokens.count > 4)
+        {
+            current.total_reviews = to_int(tokens.token[2]);
+            current.downloaded_reviews = to_int(tokens.token[4]);
+            current.avg_rating = to_double(tokens.last);
+
+            chunk.num_purchases += current.total_reviews;
+        }
+        else if ((starts_with(first, '1') || starts_with(first, '2')) && tokens.count > 6)
+        {
+            // date  cutomer: <user>  rating: <n>  votes: <n>  helpful: <n>
+            string_view user_view = tokens.token[2];
+            auto inserted = local_users.emplace(user_view, chunk.users.size());
+            if (inserted.second)
+            {
+                chunk.users.push_back(chunk.strings.store(user_view));
+                reviewed_by.push_back(0);
+            }
+            uint32_t user = inserted.first->second;
+
+            // the first review by a user wins, same as map::insert in parse_file
+            if (reviewed_by[user] == chunk.products.size() + 1) continue;
+            reviewed_by[user] = chunk.products.size() + 1;
+
+            ArenaReview review;
+            review.date = chunk.strings.store(first);
+            review.user = user;
+            review.product = chunk.products.size();
+            review.rating = to_int(tokens.token[4]);
+            review.votes = to_int(tokens.token[6]);
+            review.helpful = to_int(tokens.last);
+            chunk.reviews.push_back(review);
+        }
+    }
+
+    if (last_chunk)
+    {
+        finish_product(chunk, current);
+    }
+    else
+    {
+        chunk.reviews.resize(current.first_review);
+        chunk.similar.resize(current.first_similar);
+        chunk.categories.resize(current.first_category);
+    }
+}
+
+
+/* Moves the chunks (in file order) into the dataset's flat arrays. */
+void merge_arena_chunks(vector<ArenaChunk>& chunks, unsigned threads, ArenaDataset& data)
+{
+    // node ids in order of first appearance in the file
+    unordered_map<string_view, uint32_t> global_ids;
+    vector<string_view> names;
+    vector< vector<uint32_t> > chunk_user_ids(chunks.size());
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        chunk_user_ids[c].reserve(chunks[c].users.size());
+        for (string_view user : chunks[c].users)
+        {
+            auto inserted = global_ids.emplace(user, names.size());
+            if (inserted.second)
+            {
+                names.push_back(user);
+            }
+            chunk_user_ids[c].push_back(inserted.first->second);
+        }
+        data.num_purchases += chunks[c].num_purchases;
+    }
+
+    data.num_users = names.size();
+    data.users = data.arena.allocate_array<string_view>(names.size());
+    copy(names.begin(), names.end(), data.users);
+
+    /* a later record with the same asin replaces the earlier one, as the
+     * repeated asin_to_product[asin] assignments in parse_file do */
+    vector< pair<uint32_t, uint32_t> > order;    // (chunk, product)
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        for (size_t p = 0; p < chunks[c].products.size(); p++)
+        {
+            order.emplace_back(c, p);
+        }
+    }
+    auto product_of = [&](const pair<uint32_t, uint32_t>& entry) -> const ArenaProduct& { return chunks[entry.first].products[entry.second]; };
+    stable_sort(order.begin(), order.end(), [&](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) { return product_of(a).asin < product_of(b).asin; });
+
+    vector< pair<uint32_t, uint32_t> > kept;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        if (i + 1 < order.size() && product_of(order[i + 1]).asin == product_of(order[i]).asin) continue;
+        kept.push_back(order[i]);
+    }
+
+    // final positions of every product's ranges
+    data.num_products = kept.size();
+    data.products = data.arena.allocate_array<ArenaProduct>(kept.size());
+    for (size_t p = 0; p < kept.size(); p++)
+    {
+        ArenaProduct& product = data.products[p];
+        product = product_of(kept[p]);
+        product.first_review = data.num_reviews;
+        product.first_similar = data.num_similar;
+        product.first_category = data.num_categories;
+        data.num_reviews += product.num_reviews;
+        data.num_similar += product.num_similar;
+        data.num_categories += product.num_categories;
+    }
+    data.reviews = data.arena.allocate_array<ArenaReview>(data.num_reviews);
+    data.similar = data.arena.allocate_array<string_view>(data.num_similar);
+    data.categories = data.arena.allocate_array<string_view>(data.num_categories);
+
+    parallel_for(kept.size(), threads, [&](size_t p, unsigned)
+    {
+        const ArenaChunk& chunk = chunks[kept[p].first];
+        const ArenaProduct& from = chunk.products[kept[p].second];
+        const ArenaProduct& to = data.products[p];
+
+        for (uint32_t i = 0; i < from.num_reviews; i++)
+        {
+            ArenaReview review = chunk.reviews[from.first_review + i];
+            review.user = chunk_user_ids[kept[p].first][review.user];
+            review.product = p;
+            data.reviews[to.first_review + i] = review;
+        }
+        copy(chunk.similar.begin() + from.first_similar, chunk.similar.begin() + from.first_similar + from.num_similar, data.similar + to.first_similar);
+        copy(chunk.categories.begin() + from.first_category, chunk.categories.begin() + from.first_category + from.num_categories, data.categories + to.first_category);
+    });
+
+    for (ArenaChunk& chunk : chunks)
+    {
+        data.strings.push_back(move(chunk.strings));
+    }
+}
+
+
+bool same_strings(const string_view* begin, const string_view* end, const vector<string>& strings)
+{
+    return size_t(end - begin) == strings.size() && equal(begin, end, strings.begin());
+}
+
+
+/* What a forked child of report_arena_layout sends back. */
+struct LayoutTiming
+{
+    double load_seconds;
+    double teardown_seconds;
+    size_t products;
+};
+
+
+/* Runs measure(timing) in a child process and returns its timings and peak
+ * resident set size in kilobytes. Returns false if the child failed. */
+template <typename Measure>
+bool measure_in_child(Measure measure, LayoutTiming& timing, long& max_rss_kb)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        LayoutTiming result = LayoutTiming();
+        bool ok = measure(result);
+        ok = ok && write(fds[1], &result, sizeof(result)) == ssize_t(sizeof(result));
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool ok = read(fds[0], &timing, sizeof(timing)) == ssize_t(sizeof(timing));
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return false;
+    }
+    max_rss_kb = usage.ru_maxrss;
+    return ok;
+}
+
+}
+
+
+size_t ArenaDataset::memory_bytes() const
+{
+    size_t bytes = arena.bytes_reserved();
+    for (const Arena& chunk_strings : strings)
+    {
+        bytes += chunk_strings.bytes_reserved();
+    }
+    return bytes;
+}
+
+
+void ArenaDataset::clear()
+{
+    arena.release();
+    strings.clear();
+    products = nullptr;
+    reviews = nullptr;
+    similar = nullptr;
+    categories = nullptr;
+    users = nullptr;
+    num_products = num_reviews = num_similar = num_categories = num_users = 0;
+    num_purchases = 0;
+}
+
+
+bool parse_file_arena(const string& filename, ArenaDataset& data, unsigned threads)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        return false;
+    }
+
+    vector<const char*> bounds = record_chunks(file.data(), file.data() + file.size(), threads);
+    vector<ArenaChunk> chunks(bounds.size() - 1);
+    parallel_for(chunks.size(), threads, [&](size_t i, unsigned)
+    {
+        parse_arena_chunk(bounds[i], bounds[i + 1], i + 1 == chunks.size(), chunks[i]);
+    });
+
+    merge_arena_chunks(chunks, threads, data);
+    return true;
+}
+
+
+bool same_dataset(const ArenaDataset& arena, ParsedData& parsed)
+{
+    if (arena.num_products != parsed.asin_to_product.size() || arena.num_purchases != parsed.num_purchases)
+    {
+        return false;
+    }
+    if (arena.num_users != parsed.user_vector.size() || !equal(arena.users, arena.users + arena.num_users, parsed.user_vector.begin()))
+    {
+        return false;
+    }
+
+    size_t p = 0;
+    for (auto it = parsed.asin_to_product.begin(); it != parsed.asin_to_product.end(); ++it, ++p)
+    {
+        const ArenaProduct& a = arena.products[p];
+        const Product* b = it->second;
+        if (a.asin != it->first || a.title != b->title || a.group != b->group || a.id != b->id || a.salesrank != b->salesrank
+            || a.total_reviews != b->total_reviews || a.downloaded_reviews != b->downloaded_reviews || a.avg_rating != b->avg_rating)
+        {
+            return false;
+        }
+        if (!same_strings(arena.similar_begin(a), arena.similar_end(a), *b->similar)
+            || !same_strings(arena.categories_begin(a), arena.categories_end(a), *b->categories))
+        {
+            return false;
+        }
+
+        if (a.num_reviews != b->reviews->size())
+        {
+            return false;
+        }
+        for (const ArenaReview* review = arena.reviews_begin(a); review != arena.reviews_end(a); ++review)
+        {
+            auto found = b->reviews->find(string(arena.users[review->user]));
+            if (found == b->reviews->end() || review->product != p)
+            {
+                return false;
+            }
+            const Review* other = found->second;
+            if (review->date != other->date || review->rating != other->rating || review->votes != other->votes
+                || review->helpful != other->helpful || other->product_id != a.asin)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+void report_arena_layout(const string& filename, unsigned threads)
+{
+    LayoutTiming heap_timing, arena_timing;
+    long heap_rss = 0, arena_rss = 0;
+
+    bool heap_ok = measure_in_child([&](LayoutTiming& timing)
+    {
+        ParsedData data;
+        Stopwatch timer;
+        if (!parse_file_mapped(filename, data.asin_to_product, data.user_to_nodeid, data.nodeid_to_user, data.users_to_products, data.num_purchases, data.user_vector, threads))
+        {
+            return false;
+        }
+        timing.load_seconds = timer.elapsed_seconds();
+        timing.products = data.asin_to_product.size();
+
+        // only the products and reviews, the part the arena layout replaces
+        timer.reset();
+        cleanHeap(data.asin_to_product);
+        data.asin_to_product.clear();
+        timing.teardown_seconds = timer.elapsed_seconds();
+        return true;
+    }, heap_timing, heap_rss);
+
+    bool arena_ok = measure_in_child([&](LayoutTiming& timing)
+    {
+        ArenaDataset data;
+        Stopwatch timer;
+        if (!parse_file_arena(filename, data, threads))
+        {
+            return false;
+        }
+        timing.load_seconds = timer.elapsed_seconds();
+        timing.products = data.num_products;
+
+        timer.reset();
+        data.clear();
+        timing.teardown_seconds = timer.elapsed_seconds();
+        return true;
+    }, arena_timing, arena_rss);
+
+    if (!heap_ok || !arena_ok)
+    {
+        cerr << "could not load " << filename << endl;
+        return;
+    }
+
+    cout << "Product*/Review* layout: load " << heap_timing.load_seconds << "s, free products " << heap_timing.teardown_seconds
+         << "s, peak RSS " << heap_rss / 1024.0 << " MB" << endl;
+    cout << "arena layout:            load " << arena_timing.load_seconds << "s, free products " << arena_timing.teardown_seconds
+         << "s, peak RSS " << arena_rss / 1024.0 << " MB" << endl;
+    cout << "load speedup: " << heap_timing.load_seconds / arena_timing.load_seconds << "x, peak RSS "
+         << 100.0 * arena_rss / max(1L, heap_rss) << "% of the Product* layout" << endl;
+
+    // the layouts have to agree
+    ParsedData parsed;
+    ArenaDataset arena;
+    parse_file_mapped(filename, parsed.asin_to_product, parsed.user_to_nodeid, parsed.nodeid_to_user, parsed.users_to_products, parsed.num_purchases, parsed.user_vector, threads);
+    parse_file_arena(filename, arena, threads);
+    cout << arena.num_products << " products, " << arena.num_reviews << " reviews in " << arena.memory_bytes() / (1024.0 * 1024.0)
+         << " MB of arena blocks, " << (same_dataset(arena, parsed) ? "contents match" : "CONTENTS DIFFER") << endl;
+}
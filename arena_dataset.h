@@ -0,0 +1,98 @@
+#ifndef ARENA_DATASET_H
+#define ARENA_DATASET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "parse_data.h"
+
+
+/* Review in the arena layout. The reviewer and the reviewed product are
+ * indices instead of strings, so a review no longer carries its own copy
+ * of the asin. */
+struct ArenaReview
+{
+    std::string_view date;   // date that the review was created
+    uint32_t user;           // reviewer node id, same numbering as user_to_nodeid
+    uint32_t product;        // index of the reviewed product in ArenaDataset::products
+    int32_t rating;          // number of stars given to product by this rating (1-5)
+    int32_t votes;           // number of people who voted on if the review was helpful
+    int32_t helpful;         // number of people who found the review helpful
+};
+
+
+/* Product in the arena layout. Reviews, similar asins and categories are
+ * [first, first + count) ranges of the dataset's flat arrays. */
+struct ArenaProduct
+{
+    std::string_view asin;      // amazon product ID
+    std::string_view title;     // name of the item
+    std::string_view group;     // major category (books, music, etc.)
+    double avg_rating;          // average star rating from all of the reviews
+    int32_t id;                 // index in the database
+    int32_t salesrank;          // amazon salesrank score
+    int32_t total_reviews;      // number of total product reviews
+    int32_t downloaded_reviews; // number of reviews captured in the dataset
+    uint32_t first_review, num_reviews;
+    uint32_t first_similar, num_similar;
+    uint32_t first_category, num_categories;
+};
+
+
+/* The products and reviews of a data file with every object and string
+ * placed in arenas owned by the dataset. Products are in asin order and the
+ * reviews of a product are stored next to each other in file order (the
+ * first review by a user wins, as in parse_file). Nothing is freed one by
+ * one: clear() and the destructor just drop the arena blocks. */
+struct ArenaDataset
+{
+    Arena arena;                         // the flat arrays below
+    std::vector<Arena> strings;          // characters of every string_view, one arena per parsed chunk
+
+    ArenaProduct* products = nullptr;
+    size_t num_products = 0;
+    ArenaReview* reviews = nullptr;
+    size_t num_reviews = 0;
+    std::string_view* similar = nullptr;
+    size_t num_similar = 0;
+    std::string_view* categories = nullptr;
+    size_t num_categories = 0;
+    std::string_view* users = nullptr;   // node id -> amazon user id
+    size_t num_users = 0;
+    int num_purchases = 0;               // sum of the reviews: total: counts
+
+    ArenaDataset() {}
+    ArenaDataset(const ArenaDataset&) = delete;
+    ArenaDataset& operator=(const ArenaDataset&) = delete;
+
+    const ArenaReview* reviews_begin(const ArenaProduct& product) const { return reviews + product.first_review; }
+    const ArenaReview* reviews_end(const ArenaProduct& product) const { return reviews + product.first_review + product.num_reviews; }
+    const std::string_view* similar_begin(const ArenaProduct& product) const { return similar + product.first_similar; }
+    const std::string_view* similar_end(const ArenaProduct& product) const { return similar + product.first_similar + product.num_similar; }
+    const std::string_view* categories_begin(const ArenaProduct& product) const { return categories + product.first_category; }
+    const std::string_view* categories_end(const ArenaProduct& product) const { return categories + product.first_category + product.num_categories; }
+
+    size_t memory_bytes() const;
+    void clear();
+};
+
+
+/* Loads the data file into the arena layout, parsing chunks concurrently
+ * the way parse_file_mapped does. Returns false if the file could not be
+ * mapped. */
+bool parse_file_arena(const std::string& filename, ArenaDataset& data, unsigned threads = 1);
+
+/* Returns true if the arena dataset holds the same products, reviews and
+ * users as a parse_file load. */
+bool same_dataset(const ArenaDataset& arena, ParsedData& parsed);
+
+/* Loads the data file once into the Product* / Review* layout and once into
+ * the arena layout, each in a forked child so the peak resident set sizes
+ * do not mix, and prints load time, teardown time and peak RSS of both. */
+void report_arena_layout(const std::string& filename, unsigned threads);
+
+#endif
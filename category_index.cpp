@@ -0,0 +1,186 @@
+#include "category_index.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+#include "instrument.h"
+
+using namespace std;
+
+
+namespace {
+
+// "Rock[40]" -> name "Rock", id "40"; labels without brackets have no id
+void split_label(const string& label, string& name, string& id)
+{
+    size_t open = label.rfind('[');
+    if (open == string::npos || label.back() != ']')
+    {
+        name = label;
+        id.clear();
+        return;
+    }
+    name = label.substr(0, open);
+    id = label.substr(open + 1, label.size() - open - 2);
+}
+
+}
+
+
+size_t CategoryIndex::memory_bytes() const
+{
+    size_t bytes = parent.size() * sizeof(uint32_t) + product_group.size() + offsets.size() * sizeof(uint64_t)
+                 + categories.size() * sizeof(uint32_t) + signature.size() * sizeof(uint64_t);
+    for (const string& text : label) bytes += sizeof(string) + text.capacity();
+    for (const string& text : groups) bytes += sizeof(string) + text.capacity();
+    return bytes;
+}
+
+
+vector<uint32_t> CategoryIndex::find_categories(const string& name) const
+{
+    vector<uint32_t> found;
+    string node_name, node_id;
+    for (uint32_t node = 0; node < num_nodes(); node++)
+    {
+        split_label(label[node], node_name, node_id);
+        if (label[node] == name || node_name == name || (!node_id.empty() && node_id == name))
+        {
+            found.push_back(node);
+        }
+    }
+    return found;
+}
+
+
+uint32_t CategoryIndex::find_group(const string& name) const
+{
+    auto found = find(groups.begin(), groups.end(), name);
+    return found == groups.end() ? NO_ID : min<size_t>(found - groups.begin(), MAX_GROUPS - 1);
+}
+
+
+string CategoryIndex::path(uint32_t node) const
+{
+    vector<uint32_t> chain;
+    for (uint32_t n = node; n != NO_ID; n = parent[n])
+    {
+        chain.push_back(n);
+    }
+    string text;
+    for (auto n = chain.rbegin(); n != chain.rend(); ++n)
+    {
+        text += "|" + label[*n];
+    }
+    return text;
+}
+
+
+void build_category_index(const map<string, Product*>& asin_to_product, const IdIndex& ids, CategoryIndex& index)
+{
+    INSTRUMENT_SCOPE("build_category_index");
+    index = CategoryIndex();
+    unordered_map<string, uint32_t> nodes;       // parent id + '|' + label -> node
+    unordered_map<string, uint32_t> group_ids;
+
+    index.product_group.assign(ids.num_products(), 0);
+    index.signature.assign(ids.num_products(), 0);
+    index.offsets.assign(1, 0);
+
+    vector<uint32_t> product_nodes;
+    string key;
+    uint32_t product = 0;
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it, ++product)
+    {
+        const Product* p = it->second;
+
+        auto group = group_ids.emplace(p->group, index.groups.size());
+        if (group.second) index.groups.push_back(p->group);
+        index.product_group[product] = min<size_t>(group.first->second, MAX_GROUPS - 1);
+
+        product_nodes.clear();
+        for (const string& category_path : *p->categories)
+        {
+            uint32_t parent = NO_ID;
+            size_t start = 0;
+            while (start < category_path.size())
+            {
+                size_t bar = category_path.find('|', start);
+                if (bar == string::npos) bar = category_path.size();
+                if (bar > start)
+                {
+                    string label = category_path.substr(start, bar - start);
+                    key = to_string(parent) + "|" + label;
+                    auto node = nodes.emplace(key, index.parent.size());
+                    if (node.second)
+                    {
+                        index.parent.push_back(parent);
+                        index.label.push_back(label);
+                    }
+                    parent = node.first->second;
+                    product_nodes.push_back(parent);
+                }
+                start = bar + 1;
+            }
+        }
+
+        sort(product_nodes.begin(), product_nodes.end());
+        product_nodes.erase(unique(product_nodes.begin(), product_nodes.end()), product_nodes.end());
+        index.categories.insert(index.categories.end(), product_nodes.begin(), product_nodes.end());
+        index.offsets.push_back(index.categories.size());
+    }
+
+    // the bits depend on the final tree size
+    for (product = 0; product < index.num_products(); product++)
+    {
+        for (uint64_t c = index.offsets[product]; c < index.offsets[product + 1]; c++)
+        {
+            index.signature[product] |= index.node_bit(index.categories[c]);
+        }
+    }
+}
+
+
+void CategorySet::add(const CategoryIndex& index, uint32_t node)
+{
+    if (nodes.size() <= node / 64) nodes.resize(node / 64 + 1, 0);
+    nodes[node / 64] |= uint64_t(1) << (node % 64);
+    signature |= index.node_bit(node);
+}
+
+
+bool compile_category_filter(const CategoryIndex& index, const vector<string>& groups, const vector<string>& required, const vector<string>& boosted, double boost, CategoryFilter& filter)
+{
+    filter = CategoryFilter();
+    filter.boost = boost;
+    for (const string& name : groups)
+    {
+        uint32_t group = index.find_group(name);
+        if (group == NO_ID)
+        {
+            cerr << "unknown group " << name << endl;
+            return false;
+        }
+        filter.group_mask |= uint64_t(1) << group;
+    }
+
+    // both sets cover every node, so contains() never reads past the end
+    CategorySet* sets[] = {&filter.required, &filter.boosted};
+    const vector<string>* names[] = {&required, &boosted};
+    for (int s = 0; s < 2; s++)
+    {
+        for (const string& name : *names[s])
+        {
+            vector<uint32_t> found = index.find_categories(name);
+            if (found.empty())
+            {
+                cerr << "unknown category " << name << endl;
+                return false;
+            }
+            for (uint32_t node : found) sets[s]->add(index, node);
+        }
+        sets[s]->nodes.resize((index.num_nodes() + 63) / 64, 0);
+    }
+    return true;
+}
@@ -0,0 +1,123 @@
+#ifndef CATEGORY_INDEX_H
+#define CATEGORY_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "id_index.h"
+#include "parse_data.h"
+
+
+const size_t MAX_GROUPS = 64;
+
+
+/* Groups and categories of every product, interned so that recommendation
+ * filters run on integers. The categories: paths (|Books[283155]|
+ * Subjects[1000]|...) form one tree: a node is a path component under its
+ * parent, so every path prefix is a node. Each product holds the sorted ids
+ * of all nodes on its paths, which makes a product part of every category
+ * above it. Next to that list every product has a 64 bit signature with one
+ * hashed bit per node, so most products outside a filter are rejected by a
+ * single AND. Trees of at most 64 nodes give every node its own bit, and
+ * the signature alone answers membership. Groups get a bit each, at most
+ * MAX_GROUPS of them; any further groups share the last bit. */
+struct CategoryIndex
+{
+    // tree
+    std::vector<uint32_t> parent;           // NO_ID for top level categories
+    std::vector<std::string> label;         // path component as written, e.g. "Rock[40]"
+
+    // groups
+    std::vector<std::string> groups;        // group names, by group id
+    std::vector<uint8_t> product_group;     // group id of each product
+
+    // per product
+    std::vector<uint64_t> offsets;          // num_products + 1
+    std::vector<uint32_t> categories;       // sorted node ids, ancestors included
+    std::vector<uint64_t> signature;        // one bit per node, see node_bit
+
+    size_t num_nodes() const { return parent.size(); }
+    size_t num_products() const { return product_group.size(); }
+    size_t memory_bytes() const;
+
+    bool exact_signatures() const { return num_nodes() <= 64; }
+    uint64_t node_bit(uint32_t node) const
+    {
+        return uint64_t(1) << (exact_signatures() ? node : (node * 0x9E3779B97F4A7C15ull) >> 58);
+    }
+
+    /* Nodes whose label is name, or whose name or bracketed id is name:
+     * "Rock", "40" and "Rock[40]" all find the node Rock[40]. */
+    std::vector<uint32_t> find_categories(const std::string& name) const;
+
+    /* Group id of a group name, or NO_ID. */
+    uint32_t find_group(const std::string& name) const;
+
+    /* The path of a node from the top, "|Music[5174]|Styles[301668]|...". */
+    std::string path(uint32_t node) const;
+};
+
+
+void build_category_index(const std::map<std::string, Product*>& asin_to_product, const IdIndex& ids, CategoryIndex& index);
+
+
+/* A set of categories as a bitset over the nodes plus the OR of their
+ * signature bits. */
+struct CategorySet
+{
+    std::vector<uint64_t> nodes;
+    uint64_t signature = 0;
+
+    bool empty() const { return signature == 0; }
+    void add(const CategoryIndex& index, uint32_t node);
+
+    /* True if the product lies in one of the categories. */
+    bool contains(const CategoryIndex& index, uint32_t product) const
+    {
+        if ((index.signature[product] & signature) == 0) return false;
+        if (index.exact_signatures()) return true;
+        for (uint64_t c = index.offsets[product]; c < index.offsets[product + 1]; c++)
+        {
+            uint32_t node = index.categories[c];
+            if ((nodes[node >> 6] >> (node & 63)) & 1) return true;
+        }
+        return false;
+    }
+};
+
+
+/* Filter and boost of one recommendation request, compiled from names once
+ * and then applied to every candidate: a candidate must be in one of the
+ * groups (if any are given) and in one of the required categories (if any
+ * are given), and its score is multiplied by boost if it is in one of the
+ * boosted categories. */
+struct CategoryFilter
+{
+    uint64_t group_mask = 0;                // 0: any group
+    CategorySet required;
+    CategorySet boosted;
+    double boost = 1;
+
+    bool active() const { return group_mask != 0 || !required.empty() || !boosted.empty(); }
+
+    bool admits(const CategoryIndex& index, uint32_t product) const
+    {
+        if (group_mask != 0 && ((group_mask >> index.product_group[product]) & 1) == 0) return false;
+        return required.empty() || required.contains(index, product);
+    }
+
+    double score(const CategoryIndex& index, uint32_t product, double score) const
+    {
+        return !boosted.empty() && boosted.contains(index, product) ? score * boost : score;
+    }
+};
+
+
+/* Resolves group and category names (see find_categories) into a filter.
+ * Returns false, naming the culprit on stderr, if a name matches nothing. */
+bool compile_category_filter(const CategoryIndex& index, const std::vector<std::string>& groups, const std::vector<std::string>& required, const std::vector<std::string>& boosted, double boost, CategoryFilter& filter);
+
+#endif
@@ -0,0 +1,211 @@
+#include "csr_graph.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "instrument.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// minimum time each scan in the layout report runs for
+const double MIN_SCAN_SECONDS = 0.5;
+
+}
+
+
+size_t tree_node_bytes(size_t value_size)
+{
+    const size_t node_header = 32;   // color, parent, left, right
+    const size_t malloc_overhead = 8;
+    size_t chunk = node_header + value_size + malloc_overhead;
+    return (chunk + 15) / 16 * 16;
+}
+
+
+void CsrGraph::clear()
+{
+    offsets.assign(1, 0);
+    neighbors.clear();
+    weights.clear();
+}
+
+
+void CsrGraph::append_row(vector< pair<uint32_t, double> >& row)
+{
+    sort(row.begin(), row.end());
+    row.erase(unique(row.begin(), row.end()), row.end());
+    for (auto& edge : row)
+    {
+        neighbors.push_back(edge.first);
+        weights.push_back(edge.second);
+    }
+    offsets.push_back(neighbors.size());
+}
+
+
+void make_product_graph_csr(map<string, Product*>& asin_to_product, map< string, set< string > >& users_to_products, const IdIndex& ids, CsrGraph& graph)
+{
+    INSTRUMENT_SCOPE("make_product_graph_csr");
+    graph.clear();
+
+    vector< pair<uint32_t, double> > row;
+    for (uint32_t product = 0; product < ids.num_products(); product++)
+    {
+        const string& first_product_string = ids.asins[product];
+        Product* first_product = asin_to_product[first_product_string];
+
+        row.clear();
+        for (const string& second_product_string : *first_product->similar)
+        {
+            uint32_t second = ids.product_id(second_product_string);
+            if (second == NO_ID) continue;
+
+            // number of users that bought object j
+            int o_j = asin_to_product[second_product_string]->reviews->size();
+            double weight = 0;
+            if (o_j != 0)
+            {
+                double score = scoreUsersWhoPurchasedBothProducts(first_product_string, second_product_string, users_to_products, asin_to_product);
+                weight = (1.0 / double(o_j)) * score;
+            }
+            row.emplace_back(second, weight);
+        }
+        graph.append_row(row);
+    }
+    graph.neighbors.shrink_to_fit();
+    graph.weights.shrink_to_fit();
+}
+
+
+void product_graph_to_csr(const IdIndex& ids, const map<string, set< pair<string, double>> >& product_graph, CsrGraph& graph)
+{
+    graph.clear();
+
+    vector< pair<uint32_t, double> > row;
+    for (uint32_t product = 0; product < ids.num_products(); product++)
+    {
+        row.clear();
+        auto edges = product_graph.find(ids.asins[product]);
+        if (edges != product_graph.end())
+        {
+            for (auto& edge : edges->second)
+            {
+                uint32_t neighbor = ids.product_id(edge.first);
+                if (neighbor != NO_ID)
+                {
+                    row.emplace_back(neighbor, edge.second);
+                }
+            }
+        }
+        graph.append_row(row);
+    }
+    graph.neighbors.shrink_to_fit();
+    graph.weights.shrink_to_fit();
+}
+
+
+void rank_baseline_prediction_csr(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, vector<uint32_t>& out)
+{
+    INSTRUMENT_COUNT("baseline queries", 1);
+    rank_scaled_baseline_prediction(user, k, user_items, graph, [](const uint32_t*) { return 1.0; }, out);
+}
+
+
+set<uint32_t> make_baseline_prediction_csr(uint32_t user, const UserItems& user_items, const CsrGraph& graph)
+{
+    vector<uint32_t> ranked;
+    rank_baseline_prediction_csr(user, NUMBER_IN_RECOMMENTATION_SET, user_items, graph, ranked);
+    return set<uint32_t>(ranked.begin(), ranked.end());
+}
+
+
+void check_baseline_predictions_csr(const set< pair<string, string> >& test_set, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph)
+{
+    INSTRUMENT_SCOPE("check_baseline_predictions_csr");
+    int numCorrect = 0;
+    for (auto test_it = test_set.begin(); test_it != test_set.end(); ++test_it)
+    {
+        uint32_t user = ids.user_id(test_it->first);
+        uint32_t product = ids.product_id(test_it->second);
+        if (user == NO_ID || user >= user_items.num_users()) continue;
+
+        set<uint32_t> predictions = make_baseline_prediction_csr(user, user_items, graph);
+        if (predictions.find(product) != predictions.end()) numCorrect++;
+    }
+
+    cout << "Number of Correct Predictions: " << numCorrect << endl;
+    cout << "Percentage Correct: " << 100.0 * (numCorrect / double(test_set.size())) << "%" << endl;
+}
+
+
+void report_product_graph_layout(const IdIndex& ids, const map<string, set< pair<string, double>> >& product_graph, const CsrGraph& graph)
+{
+    typedef set< pair<string, double> > EdgeSet;
+
+    // map of sets: one outer node per product with edges, one set node per edge
+    size_t map_edges = 0;
+    size_t map_bytes = 0;
+    for (auto it = product_graph.begin(); it != product_graph.end(); ++it)
+    {
+        map_bytes += tree_node_bytes(sizeof(pair<const string, EdgeSet>));
+        if (it->first.capacity() > 15) map_bytes += it->first.capacity() + 1;
+        for (auto& edge : it->second)
+        {
+            map_bytes += tree_node_bytes(sizeof(pair<string, double>));
+            if (edge.first.capacity() > 15) map_bytes += edge.first.capacity() + 1;
+        }
+        map_edges += it->second.size();
+    }
+    size_t csr_bytes = graph.memory_bytes();
+
+    // scan every edge, reading both the neighbor and the weight
+    double map_sum = 0;
+    size_t map_scanned = 0;
+    Stopwatch timer;
+    do
+    {
+        for (auto it = product_graph.begin(); it != product_graph.end(); ++it)
+        {
+            for (auto& edge : it->second)
+            {
+                map_sum += edge.second + edge.first.size();
+            }
+        }
+        map_scanned += map_edges;
+    } while (timer.elapsed_seconds() < MIN_SCAN_SECONDS && map_edges > 0);
+    double map_seconds = timer.elapsed_seconds();
+
+    double csr_sum = 0;
+    size_t csr_scanned = 0;
+    timer.reset();
+    do
+    {
+        for (uint32_t node = 0; node < graph.num_nodes(); node++)
+        {
+            for (uint64_t e = graph.begin(node); e < graph.end(node); e++)
+            {
+                csr_sum += graph.weights[e] + graph.neighbors[e];
+            }
+        }
+        csr_scanned += graph.num_edges();
+    } while (timer.elapsed_seconds() < MIN_SCAN_SECONDS && graph.num_edges() > 0);
+    double csr_seconds = timer.elapsed_seconds();
+
+    CsrGraph converted;
+    product_graph_to_csr(ids, product_graph, converted);
+    bool same = converted.offsets == graph.offsets && converted.neighbors == graph.neighbors && converted.weights == graph.weights;
+
+    cout << "product graph layout (" << graph.num_edges() << " edges, " << graph.num_nodes() << " products, "
+         << (same ? "same edges" : "EDGES DIFFER") << ")" << endl;
+    cout << "  map of sets: " << map_bytes << " bytes, " << double(map_bytes) / max<size_t>(1, map_edges) << " bytes/edge, "
+         << map_scanned / max(map_seconds, 1e-9) / 1e6 << "M edges/s" << endl;
+    cout << "  csr:         " << csr_bytes << " bytes, " << double(csr_bytes) / max<size_t>(1, graph.num_edges()) << " bytes/edge, "
+         << csr_scanned / max(csr_seconds, 1e-9) / 1e6 << "M edges/s" << endl;
+
+    // keeps the scans from being optimized away
+    if (map_sum < 0 || csr_sum < 0) cout << "";
+}
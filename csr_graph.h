@@ -0,0 +1,108 @@
+#ifndef CSR_GRAPH_H
+#define CSR_GRAPH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "id_index.h"
+#include "parse_data.h"
+
+
+/* Weighted directed graph in compressed sparse row form. The edges of node
+ * n are [offsets[n], offsets[n + 1]) in neighbors/weights, sorted by
+ * neighbor id. */
+struct CsrGraph
+{
+    std::vector<uint64_t> offsets;    // num_nodes + 1
+    std::vector<uint32_t> neighbors;
+    std::vector<double> weights;
+
+    size_t num_nodes() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t num_edges() const { return neighbors.size(); }
+    uint64_t begin(uint32_t node) const { return offsets[node]; }
+    uint64_t end(uint32_t node) const { return offsets[node + 1]; }
+
+    void clear();
+
+    /* Appends the edges of the next node, sorted by neighbor and with repeated
+     * edges dropped, the way the set<pair<string, double>> rows of the map
+     * graph store them. Sorts `row` in place. */
+    void append_row(std::vector< std::pair<uint32_t, double> >& row);
+
+    size_t memory_bytes() const
+    {
+        return offsets.capacity() * sizeof(uint64_t) + neighbors.capacity() * sizeof(uint32_t) + weights.capacity() * sizeof(double);
+    }
+};
+
+
+/* Same graph as make_product_graph, built straight into CSR form over
+ * product ids. */
+void make_product_graph_csr(std::map<std::string, Product*>& asin_to_product, std::map< std::string, std::set< std::string > >& users_to_products, const IdIndex& ids, CsrGraph& graph);
+
+/* Converts a graph built by make_product_graph. */
+void product_graph_to_csr(const IdIndex& ids, const std::map<std::string, std::set< std::pair<std::string, double>> >& product_graph, CsrGraph& graph);
+
+/* The end points of the k heaviest edges leaving the user's purchased
+ * products, heaviest first, each product listed once (so there can be
+ * fewer than k). Ties go to the lower product id. */
+void rank_baseline_prediction_csr(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, std::vector<uint32_t>& out);
+
+/* rank_baseline_prediction_csr with the edges leaving each purchased
+ * product multiplied by item_weight(item), where item points into the
+ * user's row of user_items. Products weighted 0 or less contribute no
+ * candidates. */
+template <typename ItemWeight>
+void rank_scaled_baseline_prediction(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, ItemWeight item_weight, std::vector<uint32_t>& out)
+{
+    std::vector< std::pair<double, uint32_t> > recommendation_candidates;
+
+    // iterate over the edges of every item in the user's purchased set
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        double weight = item_weight(item);
+        if (weight <= 0) continue;
+        for (uint64_t e = graph.begin(*item); e < graph.end(*item); e++)
+        {
+            recommendation_candidates.emplace_back(graph.weights[e] * weight, graph.neighbors[e]);
+        }
+    }
+
+    // only the first few entries of the sorted list are used
+    auto by_weight = [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b)
+    {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    };
+    size_t count = std::min(k, recommendation_candidates.size());
+    std::partial_sort(recommendation_candidates.begin(), recommendation_candidates.begin() + count, recommendation_candidates.end(), by_weight);
+
+    out.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t product = recommendation_candidates[i].second;
+        if (std::find(out.begin(), out.end(), product) == out.end()) out.push_back(product);
+    }
+}
+
+/* makeBaselinePrediction over ids: the NUMBER_IN_RECOMMENTATION_SET
+ * heaviest edges leaving the user's purchased products. */
+std::set<uint32_t> make_baseline_prediction_csr(uint32_t user, const UserItems& user_items, const CsrGraph& graph);
+
+/* checkBaselinePredictions over ids. */
+void check_baseline_predictions_csr(const std::set< std::pair<std::string, std::string> >& test_set, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph);
+
+/* Heap bytes used by one node of a std::map / std::set holding `value_size`
+ * bytes: the red-black tree links plus the value, rounded up the way glibc
+ * malloc sizes its chunks. */
+size_t tree_node_bytes(size_t value_size);
+
+/* Prints bytes per edge and edge scan throughput of the map-of-sets product
+ * graph next to its CSR form, and checks that both hold the same edges. */
+void report_product_graph_layout(const IdIndex& ids, const std::map<std::string, std::set< std::pair<std::string, double>> >& product_graph, const CsrGraph& graph);
+
+#endif
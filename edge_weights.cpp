@@ -0,0 +1,280 @@
+#include "edge_weights.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "instrument.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+
+namespace {
+
+// both lists need at least this many entries before the SIMD kernel is used
+const size_t SIMD_MIN_LIST = 16;
+
+
+void fill_inverse_degree(const IdIndex& ids, const UserItems& user_items, ReviewerIndex& index)
+{
+    index.inverse_degree.resize(ids.num_users());
+    for (uint32_t user = 0; user < ids.num_users(); user++)
+    {
+        size_t degree = user < user_items.num_users() ? user_items.degree(user) : 0;
+        index.inverse_degree[user] = 1.0 / double(degree);
+    }
+}
+
+}
+
+
+void build_similar_lists(const map<string, Product*>& asin_to_product, const IdIndex& ids, SimilarLists& similar, unsigned threads)
+{
+    INSTRUMENT_SCOPE("build_similar_lists");
+    vector<const Product*> products;
+    products.reserve(asin_to_product.size());
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it)
+    {
+        products.push_back(it->second);
+    }
+
+    parallel_csr(products.size(), threads, [&](size_t product, unsigned, vector<uint32_t>& out)
+    {
+        for (const string& asin : *products[product]->similar)
+        {
+            uint32_t id = ids.product_id(asin);
+            if (id != NO_ID)
+            {
+                out.push_back(id);
+            }
+        }
+    }, similar.offsets, similar.products);
+}
+
+
+void build_reviewer_index(const IdIndex& ids, const UserItems& user_items, ReviewerIndex& index)
+{
+    INSTRUMENT_SCOPE("build_reviewer_index");
+    /* transpose user -> products into product -> users with a counting sort.
+     * walking the users in id order leaves every reviewer list sorted. */
+    index.offsets.assign(ids.num_products() + 1, 0);
+    for (uint32_t item : user_items.items)
+    {
+        index.offsets[item + 1]++;
+    }
+    for (size_t product = 0; product < ids.num_products(); product++)
+    {
+        index.offsets[product + 1] += index.offsets[product];
+    }
+
+    index.reviewers.resize(user_items.items.size());
+    vector<uint64_t> fill(index.offsets.begin(), index.offsets.end() - 1);
+    for (uint32_t user = 0; user < user_items.num_users(); user++)
+    {
+        for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+        {
+            index.reviewers[fill[*item]++] = user;
+        }
+    }
+
+    fill_inverse_degree(ids, user_items, index);
+}
+
+
+void build_reviewer_index(const IdIndex& ids, const UserItems& user_items, const map<string, Product*>& asin_to_product, ReviewerIndex& index)
+{
+    INSTRUMENT_SCOPE("build_reviewer_index");
+    index.offsets.assign(1, 0);
+    index.offsets.reserve(ids.num_products() + 1);
+    index.reviewers.clear();
+    index.reviewers.reserve(user_items.items.size());
+
+    auto product_it = asin_to_product.begin();
+    for (uint32_t product = 0; product < ids.num_products(); product++)
+    {
+        while (product_it != asin_to_product.end() && product_it->first < ids.asins[product]) ++product_it;
+        if (product_it != asin_to_product.end() && product_it->first == ids.asins[product])
+        {
+            // review maps are in user id order, which is the order of the ids
+            for (auto review = product_it->second->reviews->begin(); review != product_it->second->reviews->end(); ++review)
+            {
+                uint32_t user = ids.user_id(review->first);
+                if (user != NO_ID)
+                {
+                    index.reviewers.push_back(user);
+                }
+            }
+        }
+        index.offsets.push_back(index.reviewers.size());
+    }
+
+    fill_inverse_degree(ids, user_items, index);
+}
+
+
+double intersect_inverse_degree_sum(const uint32_t* a, size_t a_size, const uint32_t* b, size_t b_size, const double* inverse_degree)
+{
+    double sum = 0;
+    size_t i = 0, j = 0;
+
+#ifdef __SSE2__
+    /* compare blocks of 4 against blocks of 4 (all rotations of b), then
+     * advance whichever block ends lower. every matching pair is seen in
+     * exactly one block comparison and matches come out in ascending order,
+     * so the sum is added up in the same order as the scalar merge. */
+    if (a_size >= SIMD_MIN_LIST && b_size >= SIMD_MIN_LIST)
+    {
+        while (i + 4 <= a_size && j + 4 <= b_size)
+        {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+            __m128i hits = _mm_cmpeq_epi32(va, vb);
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(hits));
+            while (mask != 0)
+            {
+                int lane = __builtin_ctz(mask);
+                sum += inverse_degree[a[i + lane]];
+                mask &= mask - 1;
+            }
+
+            uint32_t a_last = a[i + 3];
+            uint32_t b_last = b[j + 3];
+            if (a_last <= b_last) i += 4;
+            if (b_last <= a_last) j += 4;
+        }
+    }
+#endif
+
+    while (i < a_size && j < b_size)
+    {
+        if (a[i] < b[j])
+        {
+            i++;
+        }
+        else if (b[j] < a[i])
+        {
+            j++;
+        }
+        else
+        {
+            sum += inverse_degree[a[i]];
+            i++;
+            j++;
+        }
+    }
+    return sum;
+}
+
+
+double indexed_edge_weight(const ReviewerIndex& index, uint32_t product1, uint32_t product2)
+{
+    // number of users that bought object j
+    size_t o_j = index.count(product2);
+    if (o_j == 0)
+    {
+        return 0;
+    }
+
+    double score = intersect_inverse_degree_sum(index.begin(product1), index.count(product1),
+        index.begin(product2), o_j, index.inverse_degree.data());
+    return (1.0 / double(o_j)) * score;
+}
+
+
+void make_product_graph_indexed(const SimilarLists& similar, const ReviewerIndex& index, CsrGraph& graph)
+{
+    graph.clear();
+    graph.offsets.reserve(similar.num_products() + 1);
+
+    vector< pair<uint32_t, double> > row;
+    for (uint32_t product = 0; product < similar.num_products(); product++)
+    {
+        row.clear();
+        for (uint64_t s = similar.offsets[product]; s < similar.offsets[product + 1]; s++)
+        {
+            uint32_t neighbor = similar.products[s];
+            row.emplace_back(neighbor, indexed_edge_weight(index, product, neighbor));
+        }
+        graph.append_row(row);
+    }
+    graph.neighbors.shrink_to_fit();
+    graph.weights.shrink_to_fit();
+}
+
+
+void make_product_graph_parallel(const SimilarLists& similar, const ReviewerIndex& index, unsigned threads, CsrGraph& graph)
+{
+    INSTRUMENT_SCOPE("make_product_graph_parallel");
+    typedef pair<uint32_t, double> Edge;
+    vector< vector<Edge> > rows(max(1u, threads));
+    vector<Edge> edges;
+
+    parallel_csr(similar.num_products(), threads, [&](size_t product, unsigned thread_id, vector<Edge>& out)
+    {
+        vector<Edge>& row = rows[thread_id];
+        row.clear();
+        for (uint64_t s = similar.offsets[product]; s < similar.offsets[product + 1]; s++)
+        {
+            uint32_t neighbor = similar.products[s];
+            row.emplace_back(neighbor, indexed_edge_weight(index, product, neighbor));
+        }
+
+        // same row order and de-duplication as CsrGraph::append_row
+        sort(row.begin(), row.end());
+        row.erase(unique(row.begin(), row.end()), row.end());
+        out.insert(out.end(), row.begin(), row.end());
+    }, graph.offsets, edges);
+
+    // split the stitched edges into the neighbor and weight arrays
+    const size_t EDGES_PER_BLOCK = 1 << 16;
+    graph.neighbors.resize(edges.size());
+    graph.weights.resize(edges.size());
+    parallel_for((edges.size() + EDGES_PER_BLOCK - 1) / EDGES_PER_BLOCK, threads, [&](size_t block, unsigned)
+    {
+        size_t last = min(edges.size(), (block + 1) * EDGES_PER_BLOCK);
+        for (size_t e = block * EDGES_PER_BLOCK; e < last; e++)
+        {
+            graph.neighbors[e] = edges[e].first;
+            graph.weights[e] = edges[e].second;
+        }
+    });
+    INSTRUMENT_COUNT("graph edges", edges.size());
+}
+
+
+void report_graph_build_scaling(const SimilarLists& similar, const ReviewerIndex& index, unsigned max_threads)
+{
+    CsrGraph serial;
+    Stopwatch timer;
+    make_product_graph_indexed(similar, index, serial);
+    double serial_seconds = timer.elapsed_seconds();
+
+    vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    cout << "graph build: serial " << serial_seconds << "s" << endl;
+    cout << "threads\tseconds\tspeedup\tidentical" << endl;
+    for (unsigned threads : thread_counts)
+    {
+        CsrGraph graph;
+        timer.reset();
+        make_product_graph_parallel(similar, index, threads, graph);
+        double seconds = timer.elapsed_seconds();
+
+        bool same = graph.offsets == serial.offsets && graph.neighbors == serial.neighbors && graph.weights == serial.weights;
+        cout << threads << "\t" << seconds << "\t" << serial_seconds / seconds << "\t" << (same ? "yes" : "NO") << endl;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef EDGE_WEIGHTS_H
+#define EDGE_WEIGHTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "csr_graph.h"
+#include "id_index.h"
+#include "parse_data.h"
+
+
+/* Inverted index used to weight product graph edges without touching the
+ * string keyed maps: product id -> sorted reviewer ids, and user id ->
+ * 1 / number of purchased products. */
+struct ReviewerIndex
+{
+    std::vector<uint64_t> offsets;          // num_products + 1
+    std::vector<uint32_t> reviewers;        // sorted user ids of each product
+    std::vector<double> inverse_degree;     // 1.0 / users_to_products[user].size()
+
+    const uint32_t* begin(uint32_t product) const { return reviewers.data() + offsets[product]; }
+    size_t count(uint32_t product) const { return offsets[product + 1] - offsets[product]; }
+};
+
+
+/* The similar: lists of all products resolved to product ids, in compressed
+ * sparse row form. Asins that are not in the data set are dropped. */
+struct SimilarLists
+{
+    std::vector<uint64_t> offsets;    // num_products + 1
+    std::vector<uint32_t> products;   // in the order of the similar: line
+
+    size_t num_products() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+
+void build_similar_lists(const std::map<std::string, Product*>& asin_to_product, const IdIndex& ids, SimilarLists& similar, unsigned threads = 1);
+
+/* Builds the index by transposing user_items: the reviewers of a product
+ * are the users whose purchased set holds it. */
+void build_reviewer_index(const IdIndex& ids, const UserItems& user_items, ReviewerIndex& index);
+
+/* Builds the reviewer lists from the review maps of asin_to_product and the
+ * degrees from user_items, the inputs scoreUsersWhoPurchasedBothProducts
+ * reads. The two differ when an asin is repeated: the purchased sets keep
+ * the purchases of the replaced records, the kept review map does not. */
+void build_reviewer_index(const IdIndex& ids, const UserItems& user_items, const std::map<std::string, Product*>& asin_to_product, ReviewerIndex& index);
+
+/* Sum of inverse_degree[u] over the users in both sorted lists, added up in
+ * ascending user id order. Long lists go through an SSE2 block compare,
+ * short ones through a plain merge; both give bit-identical sums. */
+double intersect_inverse_degree_sum(const uint32_t* a, size_t a_size, const uint32_t* b, size_t b_size, const double* inverse_degree);
+
+/* Weight of the edge product1 -> product2:
+ * 1/o_j * sum over users who reviewed both of 1/deg(user), the same value
+ * make_product_graph computes. */
+double indexed_edge_weight(const ReviewerIndex& index, uint32_t product1, uint32_t product2);
+
+/* make_product_graph_csr with the weights taken from the reviewer index.
+ * Produces exactly the same graph. */
+void make_product_graph_indexed(const SimilarLists& similar, const ReviewerIndex& index, CsrGraph& graph);
+
+/* make_product_graph_indexed spread over `threads` threads. Ranges of
+ * products are handed to whichever thread is free, every thread collects
+ * its edges in its own buffer and the buffers are stitched into the CSR
+ * arrays without locks. The graph is bit-identical to the serial build. */
+void make_product_graph_parallel(const SimilarLists& similar, const ReviewerIndex& index, unsigned threads, CsrGraph& graph);
+
+/* Times make_product_graph_parallel with 1, 2, 4, ... up to max_threads
+ * threads against make_product_graph_indexed and checks each result is
+ * bit-identical. */
+void report_graph_build_scaling(const SimilarLists& similar, const ReviewerIndex& index, unsigned max_threads);
+
+#endif
@@ -0,0 +1,353 @@
+#include "embeddings.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "instrument.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// purchases sampled per work item of an epoch
+const size_t SAMPLES_PER_BATCH = 4096;
+
+const size_t KMEANS_ITERATIONS = 8;
+
+
+/* Inner product of two dim long vectors, dim a multiple of 8. Eight
+ * running sums keep the loop free of a serial dependency, which lets the
+ * compiler vectorize it without -ffast-math. */
+inline float dot(const float* a, const float* b, size_t dim)
+{
+    float sum[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (size_t d = 0; d < dim; d += 8)
+    {
+        for (size_t l = 0; l < 8; l++)
+        {
+            sum[l] += a[d + l] * b[d + l];
+        }
+    }
+    return ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+}
+
+
+inline float squared_distance(const float* a, const float* b, size_t dim)
+{
+    float sum = 0;
+    for (size_t d = 0; d < dim; d++)
+    {
+        float diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+// true if a ranks ahead of b: higher score, ties to the lower product id
+inline bool better(const pair<float, uint32_t>& a, const pair<float, uint32_t>& b)
+{
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+}
+
+
+/* Keeps the k best entries in a heap with the worst kept entry on top. */
+inline void offer(vector< pair<float, uint32_t> >& heap, size_t k, pair<float, uint32_t> entry)
+{
+    if (heap.size() < k)
+    {
+        heap.push_back(entry);
+        push_heap(heap.begin(), heap.end(), better);
+    }
+    else if (better(entry, heap.front()))
+    {
+        pop_heap(heap.begin(), heap.end(), better);
+        heap.back() = entry;
+        push_heap(heap.begin(), heap.end(), better);
+    }
+}
+
+
+void finish(vector< pair<float, uint32_t> >& heap, vector<uint32_t>& out)
+{
+    sort_heap(heap.begin(), heap.end(), better);
+    for (auto& entry : heap)
+    {
+        out.push_back(entry.second);
+    }
+}
+
+
+inline bool bought(const UserItems& user_items, uint32_t user, uint32_t product)
+{
+    return binary_search(user_items.begin(user), user_items.end(user), product);
+}
+
+}
+
+
+void train_bpr(const UserItems& user_items, size_t num_products, const EmbeddingOptions& options, unsigned threads, Embeddings& embeddings, TrainingStats& stats)
+{
+    INSTRUMENT_SCOPE("train_bpr");
+    Stopwatch timer;
+    threads = max(1u, threads);
+    size_t dim = (max<size_t>(options.dim, 1) + 7) / 8 * 8;
+    size_t num_users = user_items.num_users();
+    stats = TrainingStats();
+
+    embeddings.dim = dim;
+    embeddings.users.resize(num_users * dim);
+    embeddings.products.resize(num_products * dim);
+    mt19937 random(options.seed);
+    normal_distribution<float> start(0, 0.1f);
+    for (float& x : embeddings.users) x = start(random);
+    for (float& x : embeddings.products) x = start(random);
+
+    vector<char> is_active(num_products, 0);
+    for (uint32_t item : user_items.items) is_active[item] = 1;
+    embeddings.active.clear();
+    for (uint32_t product = 0; product < num_products; product++)
+    {
+        if (is_active[product]) embeddings.active.push_back(product);
+    }
+
+    // owner of every purchase, so samples are uniform over purchases
+    vector<uint32_t> owner(user_items.items.size());
+    for (uint32_t user = 0; user < num_users; user++)
+    {
+        fill(owner.begin() + user_items.offsets[user], owner.begin() + user_items.offsets[user + 1], user);
+    }
+    size_t purchases = owner.size();
+    if (purchases == 0 || embeddings.active.size() < 2)
+    {
+        return;
+    }
+
+    float* users = embeddings.users.data();
+    float* products = embeddings.products.data();
+    const float rate = options.learning_rate, reg = options.regularization;
+    size_t batches = (purchases + SAMPLES_PER_BATCH - 1) / SAMPLES_PER_BATCH;
+    vector<double> batch_loss(batches);
+
+    for (size_t epoch = 0; epoch < options.epochs; epoch++)
+    {
+        parallel_for(batches, threads, [&](size_t batch, unsigned)
+        {
+            // a generator per batch: on one thread the run is fixed by the seed
+            mt19937 sampler(options.seed ^ (epoch * 0x9E3779B9u) ^ (batch * 0x85EBCA6Bu));
+            uniform_int_distribution<size_t> pick_purchase(0, purchases - 1);
+            uniform_int_distribution<size_t> pick_product(0, embeddings.active.size() - 1);
+            vector<float> step(dim);
+            double loss = 0;
+
+            size_t count = min(SAMPLES_PER_BATCH, purchases - batch * SAMPLES_PER_BATCH);
+            for (size_t s = 0; s < count; s++)
+            {
+                size_t purchase = pick_purchase(sampler);
+                uint32_t user = owner[purchase];
+                uint32_t i = user_items.items[purchase];
+                uint32_t j = embeddings.active[pick_product(sampler)];
+                if (j == i || bought(user_items, user, j)) continue;
+
+                float* u = users + size_t(user) * dim;
+                float* vi = products + size_t(i) * dim;
+                float* vj = products + size_t(j) * dim;
+                float x = dot(u, vi, dim) - dot(u, vj, dim);
+                float g = 1.0f / (1.0f + exp(x));          // sigmoid(-x)
+                loss += log1p(exp(-x));
+
+                for (size_t d = 0; d < dim; d++)
+                {
+                    step[d] = u[d];
+                    u[d] += rate * (g * (vi[d] - vj[d]) - reg * u[d]);
+                }
+                for (size_t d = 0; d < dim; d++)
+                {
+                    vi[d] += rate * (g * step[d] - reg * vi[d]);
+                    vj[d] += rate * (-g * step[d] - reg * vj[d]);
+                }
+            }
+            batch_loss[batch] = loss;
+        });
+        stats.samples += purchases;
+    }
+
+    double loss = 0;
+    for (double l : batch_loss) loss += l;
+    stats.loss = loss / purchases;
+    stats.seconds = timer.elapsed_seconds();
+}
+
+
+void build_ivf_index(const Embeddings& embeddings, const EmbeddingOptions& options, unsigned threads, IvfIndex& index)
+{
+    INSTRUMENT_SCOPE("build_ivf_index");
+    size_t dim = embeddings.dim;
+    const vector<uint32_t>& active = embeddings.active;
+    size_t lists = options.lists != 0 ? options.lists : size_t(sqrt(double(active.size())));
+    lists = max<size_t>(1, min(lists, active.size()));
+    index = IvfIndex();
+    index.dim = dim;
+    if (active.empty())
+    {
+        index.offsets.assign(1, 0);
+        return;
+    }
+
+    // k-means from a seeded sample of the vectors
+    vector<uint32_t> sample(active);
+    mt19937 random(options.seed);
+    shuffle(sample.begin(), sample.end(), random);
+    index.centroids.resize(lists * dim);
+    for (size_t c = 0; c < lists; c++)
+    {
+        copy(embeddings.product(sample[c]), embeddings.product(sample[c]) + dim, index.centroids.begin() + c * dim);
+    }
+
+    vector<uint32_t> cell(active.size());
+    for (size_t iteration = 0; iteration <= KMEANS_ITERATIONS; iteration++)
+    {
+        parallel_for(active.size(), threads, [&](size_t a, unsigned)
+        {
+            const float* v = embeddings.product(active[a]);
+            float best = numeric_limits<float>::infinity();
+            for (size_t c = 0; c < lists; c++)
+            {
+                float distance = squared_distance(v, index.centroids.data() + c * dim, dim);
+                if (distance < best)
+                {
+                    best = distance;
+                    cell[a] = c;
+                }
+            }
+        });
+        if (iteration == KMEANS_ITERATIONS) break;
+
+        // new centroids; an empty cell keeps its old one
+        vector<double> sums(lists * dim, 0);
+        vector<size_t> sizes(lists, 0);
+        for (size_t a = 0; a < active.size(); a++)
+        {
+            const float* v = embeddings.product(active[a]);
+            for (size_t d = 0; d < dim; d++) sums[cell[a] * dim + d] += v[d];
+            sizes[cell[a]]++;
+        }
+        for (size_t c = 0; c < lists; c++)
+        {
+            if (sizes[c] == 0) continue;
+            for (size_t d = 0; d < dim; d++) index.centroids[c * dim + d] = sums[c * dim + d] / sizes[c];
+        }
+    }
+
+    // counting sort of the vectors by cell
+    index.offsets.assign(lists + 1, 0);
+    for (uint32_t c : cell) index.offsets[c + 1]++;
+    for (size_t c = 0; c < lists; c++) index.offsets[c + 1] += index.offsets[c];
+    index.ids.resize(active.size());
+    index.vectors.resize(active.size() * dim);
+    vector<uint64_t> next(index.offsets.begin(), index.offsets.end() - 1);
+    for (size_t a = 0; a < active.size(); a++)
+    {
+        uint64_t at = next[cell[a]]++;
+        index.ids[at] = active[a];
+        copy(embeddings.product(active[a]), embeddings.product(active[a]) + dim, index.vectors.begin() + at * dim);
+    }
+}
+
+
+void recommend_embedding_exact(uint32_t user, size_t k, const UserItems& user_items, const Embeddings& embeddings, EmbeddingScratch& scratch, vector<uint32_t>& out)
+{
+    out.clear();
+    scratch.heap.clear();
+    if (k == 0) return;
+    const float* u = embeddings.user(user);
+    for (uint32_t product : embeddings.active)
+    {
+        float score = dot(u, embeddings.product(product), embeddings.dim);
+        if (scratch.heap.size() == k && !better(make_pair(score, product), scratch.heap.front())) continue;
+        if (bought(user_items, user, product)) continue;
+        offer(scratch.heap, k, make_pair(score, product));
+    }
+    finish(scratch.heap, out);
+}
+
+
+void recommend_embedding_ivf(uint32_t user, size_t k, size_t probe, const UserItems& user_items, const Embeddings& embeddings, const IvfIndex& index, EmbeddingScratch& scratch, vector<uint32_t>& out)
+{
+    out.clear();
+    scratch.heap.clear();
+    if (k == 0) return;
+    size_t dim = index.dim;
+    const float* u = embeddings.user(user);
+
+    scratch.lists.clear();
+    probe = min(max<size_t>(probe, 1), index.num_lists());
+    for (size_t c = 0; c < index.num_lists(); c++)
+    {
+        offer(scratch.lists, probe, make_pair(dot(u, index.centroids.data() + c * dim, dim), uint32_t(c)));
+    }
+
+    for (auto& list : scratch.lists)
+    {
+        for (uint64_t v = index.offsets[list.second]; v < index.offsets[list.second + 1]; v++)
+        {
+            pair<float, uint32_t> entry(dot(u, index.vectors.data() + v * dim, dim), index.ids[v]);
+            if (scratch.heap.size() == k && !better(entry, scratch.heap.front())) continue;
+            if (bought(user_items, user, entry.second)) continue;
+            offer(scratch.heap, k, entry);
+        }
+    }
+    finish(scratch.heap, out);
+}
+
+
+void report_embedding_search(const UserItems& user_items, const Embeddings& embeddings, const IvfIndex& index, size_t k, uint32_t seed)
+{
+    const size_t SAMPLE_USERS = 2000;
+    vector<uint32_t> users(user_items.num_users());
+    for (uint32_t user = 0; user < users.size(); user++) users[user] = user;
+    mt19937 random(seed);
+    shuffle(users.begin(), users.end(), random);
+    users.resize(min(users.size(), SAMPLE_USERS));
+    if (users.empty()) return;
+
+    EmbeddingScratch scratch;
+    vector< vector<uint32_t> > exact(users.size());
+    Stopwatch timer;
+    for (size_t q = 0; q < users.size(); q++)
+    {
+        recommend_embedding_exact(users[q], k, user_items, embeddings, scratch, exact[q]);
+    }
+    double exact_seconds = timer.elapsed_seconds();
+    cout << "embedding search over " << embeddings.active.size() << " products, " << index.num_lists() << " ivf lists, "
+         << users.size() << " users:" << endl;
+    cout << "  exact:      " << exact_seconds / users.size() * 1e6 << " us/query" << endl;
+
+    vector<uint32_t> approximate;
+    for (size_t probe = 1; ; probe = min(probe * 2, index.num_lists()))
+    {
+        size_t found = 0, wanted = 0;
+        timer.reset();
+        double seconds = 0;
+        for (size_t q = 0; q < users.size(); q++)
+        {
+            timer.reset();
+            recommend_embedding_ivf(users[q], k, probe, user_items, embeddings, index, scratch, approximate);
+            seconds += timer.elapsed_seconds();
+            for (uint32_t product : exact[q])
+            {
+                found += find(approximate.begin(), approximate.end(), product) != approximate.end();
+            }
+            wanted += exact[q].size();
+        }
+        cout << "  probe " << probe << ": " << seconds / users.size() * 1e6 << " us/query, recall@" << k << " "
+             << double(found) / max<size_t>(1, wanted) << endl;
+        if (probe >= index.num_lists()) break;
+    }
+}
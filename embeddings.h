@@ -0,0 +1,95 @@
+#ifndef EMBEDDINGS_H
+#define EMBEDDINGS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "id_index.h"
+
+
+struct EmbeddingOptions
+{
+    size_t dim = 32;                  // rounded up to a multiple of 8
+    size_t epochs = 20;               // passes of one sample per purchase each
+    float learning_rate = 0.05f;
+    float regularization = 0.002f;
+    uint32_t seed = 224;
+    size_t lists = 0;                 // ivf lists, 0: about sqrt(products)
+    size_t probe = 8;                 // lists scanned per query
+};
+
+struct TrainingStats
+{
+    size_t samples = 0;               // (user, bought, not bought) triples
+    double seconds = 0;
+    double loss = 0;                  // mean -log sigmoid(x_ui - x_uj) of the last epoch
+};
+
+
+/* User and product vectors of an implicit feedback factorization, one
+ * contiguous row major float array each. Only products somebody bought
+ * are trained and served; the rest keep their random start. */
+struct Embeddings
+{
+    size_t dim = 0;
+    std::vector<float> users;         // num_users * dim
+    std::vector<float> products;      // num_products * dim
+    std::vector<uint32_t> active;     // products with at least one purchase, ascending
+
+    const float* user(uint32_t u) const { return users.data() + size_t(u) * dim; }
+    const float* product(uint32_t p) const { return products.data() + size_t(p) * dim; }
+    size_t num_users() const { return dim == 0 ? 0 : users.size() / dim; }
+    size_t num_products() const { return dim == 0 ? 0 : products.size() / dim; }
+};
+
+
+/* Trains the embeddings with BPR: for a random purchase (u, i) and a random
+ * product j the user did not buy, one SGD step raises x_ui - x_uj, where
+ * x is the inner product. Threads run Hogwild style, updating the shared
+ * arrays without locks; purchases are sparse, so two threads rarely touch
+ * the same rows at the same time and a lost update only drops one step.
+ * The result depends on the thread count; on one thread it is fixed by
+ * the seed. */
+void train_bpr(const UserItems& user_items, size_t num_products, const EmbeddingOptions& options, unsigned threads, Embeddings& embeddings, TrainingStats& stats);
+
+
+/* Inverted file index over the active product vectors: k-means cells with
+ * the vectors of each cell copied next to each other. A query scores the
+ * centroids by inner product with the user vector and scans the best
+ * `probe` cells. */
+struct IvfIndex
+{
+    size_t dim = 0;
+    std::vector<float> centroids;     // lists * dim
+    std::vector<uint64_t> offsets;    // lists + 1
+    std::vector<uint32_t> ids;        // product id of each listed vector
+    std::vector<float> vectors;       // ids.size() * dim, in list order
+
+    size_t num_lists() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+void build_ivf_index(const Embeddings& embeddings, const EmbeddingOptions& options, unsigned threads, IvfIndex& index);
+
+
+struct EmbeddingScratch
+{
+    std::vector< std::pair<float, uint32_t> > heap;
+    std::vector< std::pair<float, uint32_t> > lists;
+};
+
+/* Exact top k active products by inner product with the user's vector,
+ * skipping products the user bought. Best first, ties to the lower id. */
+void recommend_embedding_exact(uint32_t user, size_t k, const UserItems& user_items, const Embeddings& embeddings, EmbeddingScratch& scratch, std::vector<uint32_t>& out);
+
+/* The same search over the `probe` best lists of the index only. */
+void recommend_embedding_ivf(uint32_t user, size_t k, size_t probe, const UserItems& user_items, const Embeddings& embeddings, const IvfIndex& index, EmbeddingScratch& scratch, std::vector<uint32_t>& out);
+
+/* Prints recall@k of the ivf search against the exact search and the time
+ * per query of both, over a seeded sample of users, for 1, 2, 4, ...
+ * probed lists up to all of them. */
+void report_embedding_search(const UserItems& user_items, const Embeddings& embeddings, const IvfIndex& index, size_t k, uint32_t seed);
+
+#endif
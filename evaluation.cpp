@@ -0,0 +1,182 @@
+#include "evaluation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <sstream>
+
+#include "instrument.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// per user outcome, reduced in user order so the sums do not depend on the
+// thread count
+struct UserMetrics
+{
+    double hit;
+    double precision;
+    double recall;
+    double reciprocal_rank;
+};
+
+}
+
+
+void split_holdout(const UserItems& user_items, double fraction, uint32_t seed, vector<TestPurchase>& tests)
+{
+    INSTRUMENT_SCOPE("split_holdout");
+    tests.clear();
+    vector<uint32_t> eligible;
+    for (uint32_t user = 0; user < user_items.num_users(); user++)
+    {
+        if (user_items.degree(user) >= 2) eligible.push_back(user);
+    }
+
+    size_t wanted = llround(max(0.0, fraction) * user_items.items.size());
+    size_t count = min(wanted, eligible.size());
+
+    // partial Fisher-Yates: the first `count` entries become a uniform sample
+    mt19937_64 random(seed);
+    for (size_t i = 0; i < count; i++)
+    {
+        swap(eligible[i], eligible[uniform_int_distribution<size_t>(i, eligible.size() - 1)(random)]);
+    }
+    sort(eligible.begin(), eligible.begin() + count);
+
+    tests.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t user = eligible[i];
+        size_t pick = uniform_int_distribution<size_t>(0, user_items.degree(user) - 1)(random);
+        tests.push_back(TestPurchase{user, user_items.begin(user)[pick]});
+    }
+}
+
+
+void remove_test_purchases(const vector<TestPurchase>& tests, const IdIndex& ids, map< string, set< string > >& users_to_products, map<string, Product*>& asin_to_product, set< pair<string, string> >& test_set)
+{
+    for (const TestPurchase& test : tests)
+    {
+        const string& user = ids.users[test.user];
+        const string& asin = ids.asins[test.product];
+
+        test_set.insert(pair<string, string>(user, asin));
+        auto purchased = users_to_products.find(user);
+        if (purchased != users_to_products.end()) purchased->second.erase(asin);
+        auto product = asin_to_product.find(asin);
+        if (product != asin_to_product.end())
+        {
+            auto review = product->second->reviews->find(user);
+            if (review != product->second->reviews->end())
+            {
+                delete review->second;
+                product->second->reviews->erase(review);
+            }
+        }
+    }
+}
+
+
+void test_purchases_from_set(const set< pair<string, string> >& test_set, const IdIndex& ids, vector<TestPurchase>& tests)
+{
+    tests.clear();
+    for (auto test_it = test_set.begin(); test_it != test_set.end(); ++test_it)
+    {
+        uint32_t user = ids.user_id(test_it->first);
+        uint32_t product = ids.product_id(test_it->second);
+        if (user != NO_ID && product != NO_ID)
+        {
+            tests.push_back(TestPurchase{user, product});
+        }
+    }
+}
+
+
+void evaluate_recommender(const vector<TestPurchase>& tests, size_t k, unsigned threads, const RecommendFunction& recommend, EvaluationResult& result)
+{
+    INSTRUMENT_SCOPE("evaluate_recommender");
+    Stopwatch timer;
+    threads = max(1u, threads);
+
+    // group the held out purchases by user
+    vector<TestPurchase> sorted(tests);
+    sort(sorted.begin(), sorted.end(), [](const TestPurchase& a, const TestPurchase& b)
+    {
+        return a.user != b.user ? a.user < b.user : a.product < b.product;
+    });
+    vector<size_t> group_start;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        if (i == 0 || sorted[i].user != sorted[i - 1].user) group_start.push_back(i);
+    }
+    group_start.push_back(sorted.size());
+    size_t num_users = group_start.size() - 1;
+
+    vector<UserMetrics> metrics(num_users);
+    vector<double> latency(num_users);
+    vector< vector<uint32_t> > picked(threads);
+    parallel_for(num_users, threads, [&](size_t g, unsigned thread_id)
+    {
+        const TestPurchase* first = sorted.data() + group_start[g];
+        const TestPurchase* last = sorted.data() + group_start[g + 1];
+        vector<uint32_t>& out = picked[thread_id];
+        Stopwatch query_timer;
+        recommend(first->user, k, thread_id, out);
+        latency[g] = query_timer.elapsed_seconds() * 1e6;
+
+        size_t hits = 0, first_hit = 0;
+        for (size_t rank = 0; rank < min(k, out.size()); rank++)
+        {
+            bool relevant = binary_search(first, last, TestPurchase{first->user, out[rank]}, [](const TestPurchase& a, const TestPurchase& b) { return a.product < b.product; });
+            if (!relevant) continue;
+            if (hits++ == 0) first_hit = rank + 1;
+        }
+
+        UserMetrics& m = metrics[g];
+        m.hit = hits > 0;
+        m.precision = k == 0 ? 0 : double(hits) / k;
+        m.recall = double(hits) / (last - first);
+        m.reciprocal_rank = first_hit == 0 ? 0 : 1.0 / first_hit;
+    });
+
+    UserMetrics sum = UserMetrics();
+    for (const UserMetrics& m : metrics)
+    {
+        sum.hit += m.hit;
+        sum.precision += m.precision;
+        sum.recall += m.recall;
+        sum.reciprocal_rank += m.reciprocal_rank;
+    }
+
+    double users = max<size_t>(1, num_users);
+    result.k = k;
+    result.users = num_users;
+    result.tests = sorted.size();
+    result.hit_rate = sum.hit / users;
+    result.precision = sum.precision / users;
+    result.recall = sum.recall / users;
+    result.mrr = sum.reciprocal_rank / users;
+    result.threads = threads;
+    result.latency_p50 = percentile(latency, 50);
+    result.latency_p99 = percentile(latency, 99);
+    result.seconds = timer.elapsed_seconds();
+}
+
+
+string evaluation_json(const EvaluationResult& result)
+{
+    ostringstream json;
+    json.precision(6);
+    json << "{\"predictor\": \"" << result.predictor << "\", \"k\": " << result.k
+         << ", \"users\": " << result.users << ", \"tests\": " << result.tests
+         << ", \"hit_rate\": " << result.hit_rate << ", \"precision\": " << result.precision
+         << ", \"recall\": " << result.recall << ", \"mrr\": " << result.mrr
+         << ", \"latency_p50_us\": " << result.latency_p50 << ", \"latency_p99_us\": " << result.latency_p99
+         << ", \"threads\": " << result.threads << ", \"seconds\": " << result.seconds << "}";
+    return json.str();
+}
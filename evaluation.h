@@ -0,0 +1,69 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "id_index.h"
+#include "parse_data.h"
+
+
+// a purchase hidden from the recommender
+struct TestPurchase
+{
+    uint32_t user;
+    uint32_t product;
+};
+
+
+/* Seeded replacement for extractTestSet. Holds out one purchase of randomly
+ * chosen users with at least two purchases, until `fraction` of all
+ * purchases are held out or every such user has given one up. The same
+ * seed always picks the same purchases. Runs in time linear in the number
+ * of users plus held out purchases. tests comes out sorted by user. */
+void split_holdout(const UserItems& user_items, double fraction, uint32_t seed, std::vector<TestPurchase>& tests);
+
+/* Removes the held out purchases from the purchased sets and the product
+ * review maps, as extractTestSet does, so nothing built afterwards sees
+ * them. Fills test_set in the extractTestSet format. */
+void remove_test_purchases(const std::vector<TestPurchase>& tests, const IdIndex& ids, std::map< std::string, std::set< std::string > >& users_to_products, std::map<std::string, Product*>& asin_to_product, std::set< std::pair<std::string, std::string> >& test_set);
+
+/* Converts an extractTestSet test set to ids, dropping unknown entries. */
+void test_purchases_from_set(const std::set< std::pair<std::string, std::string> >& test_set, const IdIndex& ids, std::vector<TestPurchase>& tests);
+
+
+/* recommend(user, k, thread_id, out): fills out with up to k product ids,
+ * best first. Called concurrently, thread_id picks per-thread scratch. */
+typedef std::function<void(uint32_t, size_t, unsigned, std::vector<uint32_t>&)> RecommendFunction;
+
+struct EvaluationResult
+{
+    std::string predictor;
+    size_t k = 0;
+    size_t users = 0;            // users with at least one held out purchase
+    size_t tests = 0;            // held out purchases
+    double hit_rate = 0;         // share of users with a held out purchase in their top k
+    double precision = 0;        // mean of hits / k
+    double recall = 0;           // mean of hits / held out purchases
+    double mrr = 0;              // mean of 1 / rank of the first hit (0 without one)
+    double latency_p50 = 0;      // median time of one recommendation, microseconds
+    double latency_p99 = 0;      // 99th percentile time of one recommendation, microseconds
+    double seconds = 0;          // wall time of the evaluation
+    unsigned threads = 1;
+};
+
+/* Asks the recommender for the top k of every test user on `threads`
+ * threads and averages the metrics over the users. Every call is timed for
+ * the latency percentiles. */
+void evaluate_recommender(const std::vector<TestPurchase>& tests, size_t k, unsigned threads, const RecommendFunction& recommend, EvaluationResult& result);
+
+/* The result as a one line JSON object. */
+std::string evaluation_json(const EvaluationResult& result);
+
+#endif
@@ -0,0 +1,301 @@
+#include "fast_parser.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "instrument.h"
+#include "line_tokens.h"
+#include "mapped_file.h"
+#include "parallel.h"
+
+using namespace std;
+
+
+namespace {
+
+// chunks per thread, so a slow chunk does not hold up the whole parse
+const size_t CHUNKS_PER_THREAD = 4;
+
+}
+
+
+const char* next_record_boundary(const char* from, const char* begin, const char* end)
+{
+    // move to the start of a line
+    const char* pos = from;
+    if (pos > begin && pos[-1] != '\n')
+    {
+        pos = line_end(pos, end);
+        if (pos < end) ++pos;
+    }
+
+    while (pos < end)
+    {
+        const char* eol = line_end(pos, end);
+        const char* next = eol < end ? eol + 1 : end;
+        if (eol - pos <= 1)
+        {
+            return next;
+        }
+        pos = next;
+    }
+    return end;
+}
+
+
+vector<const char*> record_chunks(const char* begin, const char* end, unsigned threads)
+{
+    // cut the text into roughly equal pieces ending on record boundaries
+    size_t size = end - begin;
+    size_t pieces = threads <= 1 ? 1 : size_t(threads) * CHUNKS_PER_THREAD;
+    vector<const char*> bounds(1, begin);
+    for (size_t i = 1; i < pieces; i++)
+    {
+        const char* target = begin + size / pieces * i;
+        if (target <= bounds.back()) continue;
+        const char* boundary = next_record_boundary(target, begin, end);
+        if (boundary >= end) break;
+        bounds.push_back(boundary);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+
+void parse_chunk(const char* pos, const char* end, bool last_chunk, ParsedChunk& chunk)
+{
+    INSTRUMENT_SCOPE("parse_chunk");
+    Product* current_product = create_product();
+    LineTokens tokens;
+    string user;
+    unordered_map<string_view, uint32_t> local_users;
+
+    while (pos < end)
+    {
+        const char* line = pos;
+        const char* eol = line_end(pos, end);
+        pos = eol < end ? eol + 1 : end;
+
+        // blank lines terminate a product record
+        if (eol - line <= 1)
+        {
+            chunk.products.push_back(current_product);
+            current_product = create_product();
+            continue;
+        }
+
+        tokenize(line, eol, tokens);
+        if (tokens.count == 0) continue;
+
+        string_view first = tokens.token[0];
+        if (first == ID && tokens.count > 1)
+        {
+            current_product->id = to_int(tokens.token[1]);
+        }
+        else if (first == ASIN && tokens.count > 1)
+        {
+            current_product->asin.assign(tokens.token[1]);
+        }
+        else if (first == TITLE)
+        {
+            // titles are re-joined with single spaces, like boost::join did
+            join_words(first.data() + first.size(), eol, current_product->title);
+        }
+        else if (first == GROUP && tokens.count > 1)
+        {
+            // groups such as "Video Games" hold spaces too
+            join_words(tokens.token[1].data(), eol, current_product->group);
+        }
+        else if (first == SALESRANK && tokens.count > 1)
+        {
+            current_product->salesrank = to_int(tokens.token[1]);
+        }
+        else if (first == SIMILAR && tokens.count > 1)
+        {
+            if (to_int(tokens.token[1]) > 0)
+            {
+                const char* similar_pos = tokens.token[1].data() + tokens.token[1].size();
+                for (string_view asin = next_token(similar_pos, eol); !asin.empty(); asin = next_token(similar_pos, eol))
+                {
+                    current_product->similar->emplace_back(asin);
+                }
+            }
+        }
+        else if (starts_with(first, '|'))
+        {
+            // the whole path, category names such as "Classic Rock" hold spaces
+            current_product->categories->emplace_back();
+            join_words(first.data(), eol, current_product->categories->back());
+        }
+        else if (first == REVIEW && tokens.count > 4)
+        {
+            current_product->total_reviews = to_int(tokens.token[2]);
+            current_product->downloaded_reviews = to_int(tokens.token[4]);
+            current_product->avg_rating = to_double(tokens.last);
+
+            chunk.num_purchases += current_product->total_reviews;
+        }
+        else if ((starts_with(first, '1') || starts_with(first, '2')) && tokens.count > 6)
+        {
+            // date  cutomer: <user>  rating: <n>  votes: <n>  helpful: <n>
+            string_view user_view = tokens.token[2];
+            user.assign(user_view);
+
+            Review* review = new Review();
+            review->date.assign(first);
+            review->rating = to_int(tokens.token[4]);
+            review->votes = to_int(tokens.token[6]);
+            review->helpful = to_int(tokens.last);
+            review->product_id = current_product->asin;
+            if (!current_product->reviews->emplace(user, review).second)
+            {
+                // the first review by a user wins, same as map::insert in parse_file
+                delete review;
+            }
+
+            auto inserted = local_users.emplace(user_view, chunk.users.size());
+            if (inserted.second)
+            {
+                chunk.users.push_back(user_view);
+            }
+            chunk.review_user.push_back(inserted.first->second);
+            chunk.review_product.push_back(chunk.products.size());
+        }
+    }
+
+    if (last_chunk)
+    {
+        chunk.products.push_back(current_product);
+    }
+    else
+    {
+        cleanProduct(current_product);
+    }
+}
+
+
+void merge_chunks(vector<ParsedChunk>& chunks, unsigned threads, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > >& users_to_products, int& num_purchases, vector<string>& user_vector)
+{
+    INSTRUMENT_SCOPE("merge_chunks");
+    /* products: a later record with the same asin replaces the earlier one,
+     * as the repeated asin_to_product[asin] assignments in parse_file do.
+     * The replaced records are freed at the end: the reviews binned below
+     * still point at their asin. */
+    vector<Product*> products;
+    vector<Product*> replaced;
+    for (ParsedChunk& chunk : chunks)
+    {
+        products.insert(products.end(), chunk.products.begin(), chunk.products.end());
+        num_purchases += chunk.num_purchases;
+    }
+    stable_sort(products.begin(), products.end(), [](const Product* a, const Product* b) { return a->asin < b->asin; });
+    for (size_t i = 0; i < products.size(); i++)
+    {
+        if (i + 1 < products.size() && products[i + 1]->asin == products[i]->asin)
+        {
+            replaced.push_back(products[i]);
+            continue;
+        }
+        asin_to_product.emplace_hint(asin_to_product.end(), products[i]->asin, products[i]);
+    }
+
+    /* node ids in order of first appearance in the file. the chunks already
+     * dropped their repeats, so only the distinct users of each chunk are
+     * looked up here. */
+    unordered_map<string_view, int> global_ids;
+    vector<string_view> names;
+    vector< vector<int> > chunk_user_ids(chunks.size());
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        chunk_user_ids[c].reserve(chunks[c].users.size());
+        for (string_view user : chunks[c].users)
+        {
+            auto inserted = global_ids.emplace(user, names.size());
+            if (inserted.second)
+            {
+                names.push_back(user);
+            }
+            chunk_user_ids[c].push_back(inserted.first->second);
+        }
+    }
+
+    user_vector.reserve(names.size());
+    for (size_t id = 0; id < names.size(); id++)
+    {
+        user_vector.emplace_back(names[id]);
+        nodeid_to_user.emplace_hint(nodeid_to_user.end(), id, user_vector.back());
+    }
+
+    // rank of each user in string order, so the maps can be filled in order
+    vector<int> by_name(names.size());
+    for (size_t id = 0; id < names.size(); id++) by_name[id] = id;
+    sort(by_name.begin(), by_name.end(), [&](int a, int b) { return names[a] < names[b]; });
+    vector<int> rank(names.size());
+    for (size_t r = 0; r < by_name.size(); r++) rank[by_name[r]] = r;
+
+    for (int id : by_name)
+    {
+        user_to_nodeid.emplace_hint(user_to_nodeid.end(), user_vector[id], id);
+    }
+
+    /* purchased sets are filled in parallel. every bucket owns a contiguous
+     * range of ranks, so no two threads ever touch the same set. */
+    size_t buckets = max<size_t>(1, min<size_t>(names.size(), size_t(threads) * CHUNKS_PER_THREAD));
+    size_t per_bucket = (names.size() + buckets - 1) / max<size_t>(1, buckets);
+    vector< vector< vector< pair<int, const string*> > > > binned(chunks.size(), vector< vector< pair<int, const string*> > >(buckets));
+    parallel_for(chunks.size(), threads, [&](size_t c, unsigned)
+    {
+        ParsedChunk& chunk = chunks[c];
+        for (size_t i = 0; i < chunk.review_user.size(); i++)
+        {
+            int user_rank = rank[chunk_user_ids[c][chunk.review_user[i]]];
+            binned[c][user_rank / per_bucket].emplace_back(user_rank, &chunk.products[chunk.review_product[i]]->asin);
+        }
+    });
+
+    vector< set<string> > purchased(names.size());
+    parallel_for(buckets, threads, [&](size_t b, unsigned)
+    {
+        for (size_t c = 0; c < chunks.size(); c++)
+        {
+            for (auto& entry : binned[c][b])
+            {
+                purchased[entry.first].insert(*entry.second);
+            }
+        }
+    });
+
+    for (size_t r = 0; r < by_name.size(); r++)
+    {
+        users_to_products.emplace_hint(users_to_products.end(), user_vector[by_name[r]], move(purchased[r]));
+    }
+
+    binned.clear();
+    for (Product* product : replaced)
+    {
+        cleanProduct(product);
+    }
+}
+
+
+bool parse_file_mapped(const string& filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > >& users_to_products, int& num_purchases, vector<string>& user_vector, unsigned threads)
+{
+    INSTRUMENT_SCOPE("parse_file_mapped");
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        return false;
+    }
+
+    vector<const char*> bounds = record_chunks(file.data(), file.data() + file.size(), threads);
+    vector<ParsedChunk> chunks(bounds.size() - 1);
+    parallel_for(chunks.size(), threads, [&](size_t i, unsigned)
+    {
+        parse_chunk(bounds[i], bounds[i + 1], i + 1 == chunks.size(), chunks[i]);
+    });
+
+    merge_chunks(chunks, threads, asin_to_product, user_to_nodeid, nodeid_to_user, users_to_products, num_purchases, user_vector);
+    INSTRUMENT_COUNT("parse_file_mapped products", asin_to_product.size());
+    INSTRUMENT_COUNT("parse_file_mapped purchases", num_purchases);
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef FAST_PARSER_H
+#define FAST_PARSER_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "parse_data.h"
+
+
+/* Drop-in replacement for parse_file. The data file is memory mapped and
+ * tokenized in place, so apart from the strings that end up stored in the
+ * Product and Review structs no per-line allocation happens. Fills exactly
+ * the same structures as parse_file (which are expected to start out
+ * empty). With threads > 1 the file is cut into chunks at record
+ * boundaries and the chunks are parsed concurrently; node ids are still
+ * handed out in file order, so the output does not depend on the thread
+ * count. Returns false if the file could not be mapped. */
+bool parse_file_mapped(const std::string& filename, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map<int, std::string>& nodeid_to_user, std::map< std::string, std::set< std::string > >& users_to_products, int& num_purchases, std::vector<std::string>& user_vector, unsigned threads = 1);
+
+
+/* Products and reviews parsed from one piece of the data file. The string
+ * views point into the parsed text, which has to outlive the chunk. */
+struct ParsedChunk
+{
+    std::vector<Product*> products;          // one per record terminator, in file order
+    std::vector<std::string_view> users;     // distinct reviewers in order of first appearance
+    std::vector<uint32_t> review_user;       // index into users for every review line
+    std::vector<uint32_t> review_product;    // index into products for every review line
+    int num_purchases = 0;                   // sum of the reviews: total: counts
+};
+
+
+/* Returns the first position at or after `from` that starts a record, i.e.
+ * the position right after the next blank line. Returns `end` if there is
+ * none. */
+const char* next_record_boundary(const char* from, const char* begin, const char* end);
+
+/* Splits [begin, end) into pieces for `threads` threads, cut at record
+ * boundaries. Returns the piece bounds, begin first and end last. */
+std::vector<const char*> record_chunks(const char* begin, const char* end, unsigned threads);
+
+/* Parses [begin, end). Both ends have to be record boundaries. The product
+ * that is still open at `end` is only kept for the last chunk of a file,
+ * matching parse_file which stores it after the read loop. */
+void parse_chunk(const char* begin, const char* end, bool last_chunk, ParsedChunk& chunk);
+
+/* Merges parsed chunks (in file order) into the parse_file structures. */
+void merge_chunks(std::vector<ParsedChunk>& chunks, unsigned threads, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map<int, std::string>& nodeid_to_user, std::map< std::string, std::set< std::string > >& users_to_products, int& num_purchases, std::vector<std::string>& user_vector);
+
+#endif
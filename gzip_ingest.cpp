@@ -0,0 +1,364 @@
+#include "gzip_ingest.h"
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <zlib.h>
+
+#include "fast_parser.h"
+#include "instrument.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// zlib's own input buffer
+const unsigned GZ_BUFFER = 256 << 10;
+
+
+/* A filled buffer on its way to a parser thread. */
+struct FilledBuffer
+{
+    size_t slot = 0;
+    size_t size = 0;
+    size_t sequence = 0;    // position of the chunk in the file
+    bool last = false;
+};
+
+
+/* Fixed set of buffers passed between the decompressor and the parsers.
+ * The decompressor blocks in acquire when every buffer is full or being
+ * parsed, the parsers block in take until a buffer is filled. */
+class BufferRing
+{
+public:
+    BufferRing(size_t buffers, size_t buffer_size) : slots_(buffers, vector<char>(buffer_size))
+    {
+        for (size_t slot = 0; slot < buffers; slot++) free_.push_back(slot);
+    }
+
+    vector<char>& slot(size_t slot) { return slots_[slot]; }
+
+    size_t acquire()
+    {
+        unique_lock<mutex> guard(lock_);
+        changed_.wait(guard, [this] { return !free_.empty(); });
+        size_t slot = free_.back();
+        free_.pop_back();
+        return slot;
+    }
+
+    void publish(const FilledBuffer& buffer)
+    {
+        lock_guard<mutex> guard(lock_);
+        filled_.push_back(buffer);
+        changed_.notify_all();
+    }
+
+    // false once the decompressor is finished and every buffer was taken
+    bool take(FilledBuffer& buffer)
+    {
+        unique_lock<mutex> guard(lock_);
+        changed_.wait(guard, [this] { return !filled_.empty() || finished_; });
+        if (filled_.empty()) return false;
+        buffer = filled_.front();
+        filled_.pop_front();
+        return true;
+    }
+
+    void release(size_t slot)
+    {
+        lock_guard<mutex> guard(lock_);
+        free_.push_back(slot);
+        changed_.notify_all();
+    }
+
+    void finish()
+    {
+        lock_guard<mutex> guard(lock_);
+        finished_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    vector< vector<char> > slots_;
+    vector<size_t> free_;
+    deque<FilledBuffer> filled_;
+    bool finished_ = false;
+    mutex lock_;
+    condition_variable changed_;
+};
+
+
+/* Length of the prefix of text that ends right after its last blank line,
+ * 0 if it has none. text starts at a record boundary. */
+size_t last_record_boundary(const char* text, size_t size)
+{
+    for (size_t i = size; i-- > 0; )
+    {
+        if (text[i] != '\n') continue;
+        // the line ending here is blank if it is empty or a lone \r
+        size_t start = i;
+        if (start > 0 && text[start - 1] == '\r') start--;
+        if (start == 0 || text[start - 1] == '\n') return i + 1;
+    }
+    return 0;
+}
+
+
+/* Copies the reviewer names a chunk points to out of the buffer it was
+ * parsed from, so the buffer can be refilled before the chunks are merged. */
+void own_chunk_users(ParsedChunk& chunk, vector<char>& names)
+{
+    size_t total = 0;
+    for (string_view user : chunk.users) total += user.size();
+    names.resize(total);
+    char* pos = names.data();
+    for (string_view& user : chunk.users)
+    {
+        memcpy(pos, user.data(), user.size());
+        user = string_view(pos, user.size());
+        pos += user.size();
+    }
+}
+
+
+uint64_t file_size(const string& filename)
+{
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0 ? uint64_t(info.st_size) : 0;
+}
+
+
+/* Reads the whole decompressed file into text. */
+bool decompress_file(const string& filename, string& text)
+{
+    gzFile file = gzopen(filename.c_str(), "rb");
+    if (file == nullptr) return false;
+    gzbuffer(file, GZ_BUFFER);
+
+    text.clear();
+    size_t used = 0;
+    while (true)
+    {
+        if (text.size() - used < (size_t(1) << 20)) text.resize(max<size_t>(size_t(4) << 20, text.size() * 2));
+        int read = gzread(file, &text[used], unsigned(min<size_t>(text.size() - used, INT_MAX)));
+        if (read < 0)
+        {
+            gzclose(file);
+            return false;
+        }
+        if (read == 0) break;
+        used += read;
+    }
+    text.resize(used);
+    return gzclose(file) == Z_OK;
+}
+
+}
+
+
+bool is_gzip_file(const string& filename)
+{
+    return filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".gz") == 0;
+}
+
+
+bool parse_file_gzip(const string& filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > >& users_to_products, int& num_purchases, vector<string>& user_vector, unsigned threads, const GzipIngestOptions& options, GzipIngestStats* stats)
+{
+    INSTRUMENT_SCOPE("parse_file_gzip");
+    Stopwatch timer;
+    gzFile file = gzopen(filename.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    gzbuffer(file, GZ_BUFFER);
+
+    threads = max(1u, threads);
+    size_t buffers = options.buffers > 0 ? max<size_t>(2, options.buffers) : threads + 2;
+    BufferRing ring(buffers, max<size_t>(4096, options.buffer_size));
+
+    // the decompressor, cutting the text into chunks at record boundaries
+    bool read_error = false;
+    double decompress_seconds = 0;
+    uint64_t text_bytes = 0;
+    thread decompressor([&]
+    {
+        size_t slot = ring.acquire();
+        size_t used = 0;
+        size_t sequence = 0;
+        while (true)
+        {
+            vector<char>& buffer = ring.slot(slot);
+            if (used == buffer.size())
+            {
+                // a record longer than the buffer
+                buffer.resize(buffer.size() * 2);
+            }
+
+            Stopwatch read_timer;
+            int read = gzread(file, buffer.data() + used, unsigned(min<size_t>(buffer.size() - used, INT_MAX)));
+            decompress_seconds += read_timer.elapsed_seconds();
+            if (read < 0)
+            {
+                read_error = true;
+                break;
+            }
+            used += read;
+            text_bytes += read;
+
+            if (read == 0)
+            {
+                FilledBuffer last;
+                last.slot = slot;
+                last.size = used;
+                last.sequence = sequence;
+                last.last = true;
+                ring.publish(last);
+                break;
+            }
+            if (used < buffer.size()) continue;
+
+            size_t cut = last_record_boundary(buffer.data(), used);
+            if (cut == 0) continue;
+
+            // the unfinished record moves to the start of the next buffer
+            size_t next = ring.acquire();
+            vector<char>& next_buffer = ring.slot(next);
+            if (next_buffer.size() < used - cut + 1) next_buffer.resize(max(next_buffer.size(), used - cut) * 2);
+            memcpy(next_buffer.data(), buffer.data() + cut, used - cut);
+
+            FilledBuffer filled;
+            filled.slot = slot;
+            filled.size = cut;
+            filled.sequence = sequence++;
+            ring.publish(filled);
+            slot = next;
+            used -= cut;
+        }
+        ring.finish();
+    });
+
+    // the parsers, the calling thread among them
+    mutex chunks_lock;
+    vector<ParsedChunk> chunks;
+    vector< vector<char> > chunk_names;
+    vector<double> parse_seconds(threads, 0);
+    auto parser = [&](unsigned thread_id)
+    {
+        FilledBuffer filled;
+        while (ring.take(filled))
+        {
+            Stopwatch parse_timer;
+            ParsedChunk chunk;
+            vector<char> names;
+            const char* text = ring.slot(filled.slot).data();
+            parse_chunk(text, text + filled.size, filled.last, chunk);
+            own_chunk_users(chunk, names);
+            ring.release(filled.slot);
+            parse_seconds[thread_id] += parse_timer.elapsed_seconds();
+
+            lock_guard<mutex> guard(chunks_lock);
+            if (chunks.size() <= filled.sequence)
+            {
+                chunks.resize(filled.sequence + 1);
+                chunk_names.resize(filled.sequence + 1);
+            }
+            chunks[filled.sequence] = move(chunk);
+            chunk_names[filled.sequence] = move(names);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+    {
+        pool.emplace_back(parser, t);
+    }
+    parser(0);
+    for (thread& worker : pool)
+    {
+        worker.join();
+    }
+    decompressor.join();
+
+    int close_status = gzclose(file);
+    if (read_error || close_status != Z_OK)
+    {
+        for (ParsedChunk& chunk : chunks)
+        {
+            for (Product* product : chunk.products) cleanProduct(product);
+        }
+        return false;
+    }
+
+    Stopwatch merge_timer;
+    merge_chunks(chunks, threads, asin_to_product, user_to_nodeid, nodeid_to_user, users_to_products, num_purchases, user_vector);
+    INSTRUMENT_COUNT("parse_file_gzip products", asin_to_product.size());
+    INSTRUMENT_COUNT("parse_file_gzip purchases", num_purchases);
+
+    if (stats != nullptr)
+    {
+        stats->compressed_bytes = file_size(filename);
+        stats->text_bytes = text_bytes;
+        stats->chunks = chunks.size();
+        stats->decompress_seconds = decompress_seconds;
+        stats->parse_seconds = 0;
+        for (double seconds : parse_seconds) stats->parse_seconds += seconds;
+        stats->merge_seconds = merge_timer.elapsed_seconds();
+        stats->seconds = timer.elapsed_seconds();
+    }
+    return true;
+}
+
+
+void report_gzip_ingest(const string& filename, unsigned threads, const GzipIngestOptions& options)
+{
+    // one after the other: decompress everything, then parse the text
+    Stopwatch timer;
+    string text;
+    if (!decompress_file(filename, text))
+    {
+        cerr << "could not decompress " << filename << endl;
+        return;
+    }
+    double decompress_seconds = timer.elapsed_seconds();
+
+    timer.reset();
+    ParsedData sequential;
+    vector<const char*> bounds = record_chunks(text.data(), text.data() + text.size(), threads);
+    vector<ParsedChunk> chunks(bounds.size() - 1);
+    parallel_for(chunks.size(), threads, [&](size_t i, unsigned)
+    {
+        parse_chunk(bounds[i], bounds[i + 1], i + 1 == chunks.size(), chunks[i]);
+    });
+    merge_chunks(chunks, threads, sequential.asin_to_product, sequential.user_to_nodeid, sequential.nodeid_to_user, sequential.users_to_products, sequential.num_purchases, sequential.user_vector);
+    double parse_seconds = timer.elapsed_seconds();
+    chunks.clear();
+    string().swap(text);
+
+    ParsedData pipelined;
+    GzipIngestStats stats;
+    if (!parse_file_gzip(filename, pipelined.asin_to_product, pipelined.user_to_nodeid, pipelined.nodeid_to_user, pipelined.users_to_products, pipelined.num_purchases, pipelined.user_vector, threads, options, &stats))
+    {
+        cerr << "could not decompress " << filename << endl;
+        return;
+    }
+
+    bool same = same_parse_output(sequential, pipelined);
+    cout << "gzip ingest of " << filename << " (" << stats.compressed_bytes << " bytes, " << stats.text_bytes << " bytes of text, "
+         << threads << " parser threads, " << (same ? "same output" : "OUTPUT DIFFERS") << ")" << endl;
+    cout << "  decompress to memory:   " << decompress_seconds << "s" << endl;
+    cout << "  parse from memory:      " << parse_seconds << "s" << endl;
+    cout << "  sum / max:              " << decompress_seconds + parse_seconds << "s / " << max(decompress_seconds, parse_seconds) << "s" << endl;
+    cout << "  pipelined:              " << stats.seconds << "s (" << stats.chunks << " chunks; gzread " << stats.decompress_seconds
+         << "s, parse_chunk " << stats.parse_seconds << "s, merge " << stats.merge_seconds << "s)" << endl;
+}
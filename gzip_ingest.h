@@ -0,0 +1,50 @@
+#ifndef GZIP_INGEST_H
+#define GZIP_INGEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "parse_data.h"
+
+
+struct GzipIngestOptions
+{
+    size_t buffer_size = size_t(4) << 20;   // decompressed bytes per ring buffer, grown for longer records
+    size_t buffers = 0;                     // ring buffers, 0: two more than the parser threads
+};
+
+
+struct GzipIngestStats
+{
+    uint64_t compressed_bytes = 0;
+    uint64_t text_bytes = 0;
+    size_t chunks = 0;
+    double decompress_seconds = 0;      // inside gzread
+    double parse_seconds = 0;           // inside parse_chunk, summed over the parser threads
+    double merge_seconds = 0;
+    double seconds = 0;                 // end to end
+};
+
+
+/* parse_file_mapped for a gzip compressed data file (plain files are read
+ * as is). One thread decompresses into a bounded ring of buffers, cutting
+ * each buffer after its last blank line and carrying the rest over to the
+ * next; `threads` parser threads run parse_chunk on the filled buffers and
+ * hand them back, so decompression and parsing overlap and memory stays at
+ * a few buffers. The chunks are merged as in parse_file_mapped, which makes
+ * the output identical. Returns false if the file cannot be opened or is
+ * not valid gzip. */
+bool parse_file_gzip(const std::string& filename, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map<int, std::string>& nodeid_to_user, std::map< std::string, std::set< std::string > >& users_to_products, int& num_purchases, std::vector<std::string>& user_vector, unsigned threads = 1, const GzipIngestOptions& options = GzipIngestOptions(), GzipIngestStats* stats = nullptr);
+
+/* Returns true for file names ending in ".gz". */
+bool is_gzip_file(const std::string& filename);
+
+/* Times decompressing the whole file to memory, parsing that text, and the
+ * pipelined parse_file_gzip, and checks the two loads agree. */
+void report_gzip_ingest(const std::string& filename, unsigned threads, const GzipIngestOptions& options);
+
+#endif
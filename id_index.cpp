@@ -0,0 +1,70 @@
+#include "id_index.h"
+
+#include "instrument.h"
+
+using namespace std;
+
+
+uint32_t IdIndex::product_id(const string& asin) const
+{
+    auto found = product_ids.find(asin);
+    return found == product_ids.end() ? NO_ID : found->second;
+}
+
+
+uint32_t IdIndex::user_id(const string& user) const
+{
+    auto found = user_ids.find(user);
+    return found == user_ids.end() ? NO_ID : found->second;
+}
+
+
+void build_id_index(const map<string, Product*>& asin_to_product, const map< string, set< string > >& users_to_products, IdIndex& ids)
+{
+    INSTRUMENT_SCOPE("build_id_index");
+    ids.asins.reserve(asin_to_product.size());
+    ids.product_ids.reserve(asin_to_product.size());
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it)
+    {
+        ids.product_ids.emplace(it->first, ids.asins.size());
+        ids.asins.push_back(it->first);
+    }
+
+    ids.users.reserve(users_to_products.size());
+    ids.user_ids.reserve(users_to_products.size());
+    for (auto it = users_to_products.begin(); it != users_to_products.end(); ++it)
+    {
+        ids.user_ids.emplace(it->first, ids.users.size());
+        ids.users.push_back(it->first);
+    }
+}
+
+
+void build_user_items(const IdIndex& ids, const map< string, set< string > >& users_to_products, UserItems& user_items)
+{
+    INSTRUMENT_SCOPE("build_user_items");
+    user_items.offsets.assign(1, 0);
+    user_items.items.clear();
+    user_items.offsets.reserve(ids.num_users() + 1);
+
+    auto user_it = users_to_products.begin();
+    for (uint32_t user = 0; user < ids.num_users(); user++)
+    {
+        // users_to_products may have gained or lost users since interning
+        while (user_it != users_to_products.end() && user_it->first < ids.users[user]) ++user_it;
+        if (user_it != users_to_products.end() && user_it->first == ids.users[user])
+        {
+            // purchased sets are in asin order, which is product id order
+            for (const string& asin : user_it->second)
+            {
+                uint32_t product = ids.product_id(asin);
+                if (product != NO_ID)
+                {
+                    user_items.items.push_back(product);
+                }
+            }
+        }
+        user_items.offsets.push_back(user_items.items.size());
+    }
+    user_items.items.shrink_to_fit();
+}
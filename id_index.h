@@ -0,0 +1,59 @@
+#ifndef ID_INDEX_H
+#define ID_INDEX_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parse_data.h"
+
+
+const uint32_t NO_ID = UINT32_MAX;
+
+
+/* Dense uint32_t ids for products and users. Ids are handed out in string
+ * order (the iteration order of asin_to_product and users_to_products), so
+ * ordering by id is the same as ordering by asin / amazon user id. The
+ * edge weights rely on this to sum over co-reviewers in the same order as
+ * scoreUsersWhoPurchasedBothProducts. */
+struct IdIndex
+{
+    std::vector<std::string> asins;                          // product id -> asin
+    std::vector<std::string> users;                          // user id -> amazon user id
+    std::unordered_map<std::string, uint32_t> product_ids;   // asin -> product id
+    std::unordered_map<std::string, uint32_t> user_ids;      // amazon user id -> user id
+
+    size_t num_products() const { return asins.size(); }
+    size_t num_users() const { return users.size(); }
+
+    // NO_ID if the asin / user is not known
+    uint32_t product_id(const std::string& asin) const;
+    uint32_t user_id(const std::string& user) const;
+};
+
+
+/* user id -> purchased product ids (sorted), in compressed sparse row form */
+struct UserItems
+{
+    std::vector<uint64_t> offsets;   // num_users + 1
+    std::vector<uint32_t> items;
+
+    size_t num_users() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    const uint32_t* begin(uint32_t user) const { return items.data() + offsets[user]; }
+    const uint32_t* end(uint32_t user) const { return items.data() + offsets[user + 1]; }
+    size_t degree(uint32_t user) const { return offsets[user + 1] - offsets[user]; }
+};
+
+
+/* Interns the products of asin_to_product and the users of
+ * users_to_products. Called right after loading the data file. */
+void build_id_index(const std::map<std::string, Product*>& asin_to_product, const std::map< std::string, std::set< std::string > >& users_to_products, IdIndex& ids);
+
+/* Converts users_to_products to ids. Purchases of unknown users or products
+ * are skipped. */
+void build_user_items(const IdIndex& ids, const std::map< std::string, std::set< std::string > >& users_to_products, UserItems& user_items);
+
+#endif
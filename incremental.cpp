@@ -0,0 +1,376 @@
+#include "incremental.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+
+#include "fast_parser.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+/* Inserts value into a sorted vector. Returns false if it was there. */
+bool insert_sorted(vector<uint32_t>& values, uint32_t value)
+{
+    auto pos = lower_bound(values.begin(), values.end(), value);
+    if (pos != values.end() && *pos == value)
+    {
+        return false;
+    }
+    values.insert(pos, value);
+    return true;
+}
+
+}
+
+
+uint32_t IncrementalGraph::intern_product(const string& asin)
+{
+    auto inserted = product_ids_.emplace(asin, asins_.size());
+    if (inserted.second)
+    {
+        asins_.push_back(asin);
+        present_.push_back(0);
+        reviewers_.emplace_back();
+        similar_.emplace_back();
+        named_by_.emplace_back();
+        rows_.emplace_back();
+        dirty_.push_back(0);
+    }
+    return inserted.first->second;
+}
+
+
+uint32_t IncrementalGraph::intern_user(const string& user)
+{
+    auto inserted = user_ids_.emplace(user, users_.size());
+    if (inserted.second)
+    {
+        users_.push_back(user);
+        items_.emplace_back();
+        inverse_degree_.push_back(numeric_limits<double>::infinity());
+    }
+    return inserted.first->second;
+}
+
+
+void IncrementalGraph::mark(uint32_t product)
+{
+    if (!dirty_[product])
+    {
+        dirty_[product] = 1;
+        dirty_list_.push_back(product);
+    }
+}
+
+
+void IncrementalGraph::load(const map<string, Product*>& asin_to_product, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph)
+{
+    *this = IncrementalGraph();
+
+    // keep the batch ids, so the loaded rows can be taken over as they are
+    for (const string& asin : ids.asins)
+    {
+        present_[intern_product(asin)] = 1;
+    }
+    for (const string& user : ids.users)
+    {
+        intern_user(user);
+    }
+
+    for (uint32_t user = 0; user < user_items.num_users(); user++)
+    {
+        items_[user].assign(user_items.begin(user), user_items.end(user));
+        inverse_degree_[user] = 1.0 / double(items_[user].size());
+    }
+
+    // the reviewers of the kept review maps, which the loaded rows were weighted with
+    ReviewerIndex index;
+    build_reviewer_index(ids, user_items, asin_to_product, index);
+    for (uint32_t product = 0; product < ids.num_products(); product++)
+    {
+        reviewers_[product].assign(index.begin(product), index.begin(product) + index.count(product));
+    }
+
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it)
+    {
+        uint32_t product = product_ids_[it->first];
+        for (const string& asin : *it->second->similar)
+        {
+            uint32_t target = intern_product(asin);
+            similar_[product].push_back(target);
+            named_by_[target].push_back(product);
+        }
+    }
+
+    for (uint32_t product = 0; product < graph.num_nodes(); product++)
+    {
+        for (uint64_t e = graph.begin(product); e < graph.end(product); e++)
+        {
+            rows_[product].emplace_back(graph.neighbors[e], graph.weights[e]);
+        }
+    }
+}
+
+
+void IncrementalGraph::add_product(const string& asin, const vector<string>& similar)
+{
+    uint32_t product = intern_product(asin);
+    if (present_[product])
+    {
+        return;
+    }
+    present_[product] = 1;
+
+    for (const string& name : similar)
+    {
+        uint32_t target = intern_product(name);
+        similar_[product].push_back(target);
+        named_by_[target].push_back(product);
+    }
+
+    // the product's own row, and edges into it that were waiting for it
+    mark(product);
+    for (uint32_t source : named_by_[product])
+    {
+        mark(source);
+    }
+}
+
+
+bool IncrementalGraph::add_review(const string& user_name, const string& asin)
+{
+    uint32_t product = intern_product(asin);
+    uint32_t user = intern_user(user_name);
+    if (!present_[product])
+    {
+        present_[product] = 1;
+        for (uint32_t source : named_by_[product])
+        {
+            mark(source);
+        }
+    }
+
+    /* a purchase of a replaced record is in items_ but not in reviewers_,
+     * so a new review of it only adds the reviewer */
+    bool purchase = insert_sorted(items_[user], product);
+    bool reviewer = insert_sorted(reviewers_[product], user);
+    if (!purchase && !reviewer)
+    {
+        return false;
+    }
+
+    // o_j of the product changed
+    mark(product);
+    for (uint32_t source : named_by_[product])
+    {
+        mark(source);
+    }
+    if (purchase)
+    {
+        // 1/deg of the user changed for every pair of the user's products
+        inverse_degree_[user] = 1.0 / double(items_[user].size());
+        for (uint32_t other : items_[user])
+        {
+            mark(other);
+        }
+    }
+    return true;
+}
+
+
+void IncrementalGraph::commit(IngestStats& stats)
+{
+    for (uint32_t product : dirty_list_)
+    {
+        dirty_[product] = 0;
+        vector< pair<uint32_t, double> >& row = rows_[product];
+        row.clear();
+        for (uint32_t neighbor : similar_[product])
+        {
+            if (!present_[neighbor]) continue;
+
+            // indexed_edge_weight over the mutable lists
+            size_t o_j = reviewers_[neighbor].size();
+            double weight = 0;
+            if (o_j > 0)
+            {
+                double score = intersect_inverse_degree_sum(reviewers_[product].data(), reviewers_[product].size(),
+                    reviewers_[neighbor].data(), o_j, inverse_degree_.data());
+                weight = (1.0 / double(o_j)) * score;
+            }
+            row.emplace_back(neighbor, weight);
+        }
+        sort(row.begin(), row.end());
+        row.erase(unique(row.begin(), row.end()), row.end());
+
+        stats.rows++;
+        stats.edges += row.size();
+    }
+    dirty_list_.clear();
+}
+
+
+IngestStats IncrementalGraph::ingest(const char* begin, const char* end)
+{
+    IngestStats stats;
+    ParsedChunk chunk;
+    parse_chunk(begin, end, true, chunk);
+
+    for (Product* product : chunk.products)
+    {
+        if (!product->asin.empty())
+        {
+            auto found = product_ids_.find(product->asin);
+            stats.products += found == product_ids_.end() || !present_[found->second];
+            add_product(product->asin, *product->similar);
+
+            for (auto review = product->reviews->begin(); review != product->reviews->end(); ++review)
+            {
+                stats.reviews += add_review(review->first, product->asin);
+            }
+        }
+        cleanProduct(product);
+    }
+
+    commit(stats);
+    return stats;
+}
+
+
+void IncrementalGraph::to_csr(CsrGraph& graph) const
+{
+    graph.clear();
+    for (const auto& row : rows_)
+    {
+        for (auto& edge : row)
+        {
+            graph.neighbors.push_back(edge.first);
+            graph.weights.push_back(edge.second);
+        }
+        graph.offsets.push_back(graph.neighbors.size());
+    }
+}
+
+
+void IncrementalGraph::to_tables(IdIndex& ids, UserItems& user_items, SimilarLists& similar, ReviewerIndex& index) const
+{
+    ids = IdIndex();
+    ids.asins = asins_;
+    ids.users = users_;
+
+    user_items.offsets.assign(1, 0);
+    user_items.items.clear();
+    for (const auto& items : items_)
+    {
+        user_items.items.insert(user_items.items.end(), items.begin(), items.end());
+        user_items.offsets.push_back(user_items.items.size());
+    }
+
+    similar.offsets.assign(1, 0);
+    similar.products.clear();
+    for (uint32_t product = 0; product < asins_.size(); product++)
+    {
+        if (present_[product])
+        {
+            for (uint32_t target : similar_[product])
+            {
+                if (present_[target]) similar.products.push_back(target);
+            }
+        }
+        similar.offsets.push_back(similar.products.size());
+    }
+
+    // the degrees are counted again from the purchases, not copied
+    index.offsets.assign(1, 0);
+    index.reviewers.clear();
+    for (const auto& reviewers : reviewers_)
+    {
+        index.reviewers.insert(index.reviewers.end(), reviewers.begin(), reviewers.end());
+        index.offsets.push_back(index.reviewers.size());
+    }
+    index.inverse_degree.resize(items_.size());
+    for (uint32_t user = 0; user < items_.size(); user++)
+    {
+        index.inverse_degree[user] = 1.0 / double(items_[user].size());
+    }
+}
+
+
+void run_incremental_benchmark(const map<string, Product*>& asin_to_product, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph, uint32_t seed)
+{
+    if (ids.num_products() == 0 || ids.num_users() == 0)
+    {
+        return;
+    }
+
+    Stopwatch timer;
+    IncrementalGraph incremental;
+    incremental.load(asin_to_product, ids, user_items, graph);
+    cout << "incremental graph loaded in " << timer.elapsed_seconds() << "s" << endl;
+
+    mt19937 random(seed);
+    uniform_int_distribution<uint32_t> pick_product(0, ids.num_products() - 1);
+    uniform_int_distribution<uint32_t> pick_user(0, ids.num_users() - 1);
+    size_t new_products = 0, new_users = 0;
+
+    for (size_t batch : {1, 10, 100, 1000})
+    {
+        // one record per review; every tenth names a brand new product
+        ostringstream text;
+        for (size_t r = 0; r < batch; r++)
+        {
+            string user = random() % 10 == 0 ? "NEWUSER" + to_string(new_users++) : ids.users[pick_user(random)];
+            if (r % 10 == 9)
+            {
+                text << "Id:   0\nASIN: NEW" << new_products++ << "\n  similar: 3";
+                for (int s = 0; s < 3; s++) text << "  " << ids.asins[pick_product(random)];
+                text << "\n";
+            }
+            else
+            {
+                text << "Id:   0\nASIN: " << ids.asins[pick_product(random)] << "\n";
+            }
+            text << "  reviews: total: 1  downloaded: 1  avg rating: 5\n"
+                 << "    2006-1-1  cutomer: " << user << "  rating: 5  votes:   0  helpful:   0\n\n";
+        }
+        string records = text.str();
+
+        timer.reset();
+        IngestStats stats = incremental.ingest(records.data(), records.data() + records.size());
+        double seconds = timer.elapsed_seconds();
+        cout << "  ingest " << batch << " record" << (batch == 1 ? "" : "s") << ": " << seconds * 1e3 << "ms ("
+             << stats.reviews << " reviews, " << stats.products << " new products, " << stats.rows << " rows / "
+             << stats.edges << " edges recomputed)" << endl;
+    }
+
+    // full rebuild of the updated data for comparison
+    IdIndex rebuilt_ids;
+    UserItems rebuilt_items;
+    SimilarLists similar;
+    ReviewerIndex index;
+    incremental.to_tables(rebuilt_ids, rebuilt_items, similar, index);
+    timer.reset();
+    CsrGraph rebuilt;
+    make_product_graph_indexed(similar, index, rebuilt);
+    double rebuild_seconds = timer.elapsed_seconds();
+    cout << "  full graph rebuild: " << rebuild_seconds * 1e3 << "ms (parsing the dump again comes on top)" << endl;
+
+    CsrGraph updated;
+    incremental.to_csr(updated);
+    bool same_edges = updated.offsets == rebuilt.offsets && updated.neighbors == rebuilt.neighbors;
+    double max_error = 0;
+    for (size_t e = 0; same_edges && e < updated.weights.size(); e++)
+    {
+        double scale = max(1.0, fabs(rebuilt.weights[e]));
+        max_error = max(max_error, fabs(updated.weights[e] - rebuilt.weights[e]) / scale);
+    }
+    cout << "  incremental graph " << (same_edges && max_error < 1e-12 ? "matches" : "DIFFERS FROM")
+         << " the rebuild (largest relative weight difference " << max_error << ")" << endl;
+}
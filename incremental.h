@@ -0,0 +1,106 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "id_index.h"
+#include "parse_data.h"
+
+
+struct IngestStats
+{
+    size_t products = 0;          // new products added
+    size_t reviews = 0;           // new (user, product) purchases
+    size_t rows = 0;              // product graph rows whose weights were recomputed
+    size_t edges = 0;             // edge weights recomputed
+};
+
+
+/* Mutable copy of the product graph that absorbs new product and review
+ * records without a full rebuild. Every change marks the graph rows whose
+ * weights depend on it:
+ *
+ *   new review (u, p):  row p, every row with an edge into p (o_j of p
+ *                       changed) and the rows of u's products (1/deg(u)
+ *                       changed for every pair u reviewed)
+ *   new product p:      row p and every row whose similar: list names p
+ *
+ * and commit() recomputes just those rows, the same way
+ * make_product_graph_indexed computes them. Ids are only ever appended:
+ * products and users first seen in an update get the next free id, so
+ * the string order of the batch ids no longer holds for them. */
+class IncrementalGraph
+{
+public:
+    /* Starts from a batch build. asin_to_product provides the raw similar:
+     * lists, including asins that are not (yet) products, and the reviewer
+     * lists, which leave out the purchases of replaced records. */
+    void load(const std::map<std::string, Product*>& asin_to_product, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph);
+
+    /* Adds a product. A product that is already known keeps its similar:
+     * list; only its new reviews count. */
+    void add_product(const std::string& asin, const std::vector<std::string>& similar);
+
+    /* Adds a purchase. Returns false if the user already bought and
+     * reviewed the product. Unknown products are created with no similar: list. */
+    bool add_review(const std::string& user, const std::string& asin);
+
+    /* Recomputes the rows touched since the last commit. */
+    void commit(IngestStats& stats);
+
+    /* Parses appended records in the data file format (product records with
+     * their review lines, separated by blank lines), adds them and commits.
+     * Returns the work done. */
+    IngestStats ingest(const char* begin, const char* end);
+
+    size_t num_products() const { return asins_.size(); }
+    size_t num_users() const { return users_.size(); }
+    const std::string& asin(uint32_t product) const { return asins_[product]; }
+    const std::string& user(uint32_t user) const { return users_[user]; }
+    bool is_product(uint32_t product) const { return present_[product]; }
+
+    void to_csr(CsrGraph& graph) const;
+
+    /* The current purchases, similar: lists and reviewer index in the batch
+     * builder's input form, for a full rebuild over the same ids. */
+    void to_tables(IdIndex& ids, UserItems& user_items, SimilarLists& similar, ReviewerIndex& index) const;
+
+private:
+    uint32_t intern_product(const std::string& asin);
+    uint32_t intern_user(const std::string& user);
+    void mark(uint32_t product);
+
+    std::vector<std::string> asins_;
+    std::unordered_map<std::string, uint32_t> product_ids_;
+    std::vector<char> present_;                                  // seen as a record, not just named in a similar: list
+    std::vector<std::string> users_;
+    std::unordered_map<std::string, uint32_t> user_ids_;
+
+    std::vector< std::vector<uint32_t> > items_;                 // user -> sorted product ids
+    std::vector< std::vector<uint32_t> > reviewers_;             // product -> sorted user ids
+    std::vector<double> inverse_degree_;                         // user -> 1 / purchases
+    std::vector< std::vector<uint32_t> > similar_;               // product -> similar: list, in file order
+    std::vector< std::vector<uint32_t> > named_by_;              // product -> products whose similar: list names it
+    std::vector< std::vector< std::pair<uint32_t, double> > > rows_;  // product -> weighted edges, sorted
+
+    std::vector<char> dirty_;
+    std::vector<uint32_t> dirty_list_;
+};
+
+
+/* Feeds batches of 1, 10, 100 and 1000 synthetic review records (a tenth of
+ * them with a new product) into an IncrementalGraph loaded from the batch
+ * build, prints the latency of every batch next to the time a full graph
+ * rebuild takes, and checks the incremental graph against that rebuild.
+ * graph has to carry the baseline weights, not a scored or similarity graph. */
+void run_incremental_benchmark(const std::map<std::string, Product*>& asin_to_product, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph, uint32_t seed);
+
+#endif
@@ -0,0 +1,152 @@
+#include "instrument.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include <sys/resource.h>
+
+using namespace std;
+
+
+namespace {
+
+atomic<InstrumentSite*> site_list(nullptr);
+
+// the counters of the calling thread, most recently created first
+thread_local InstrumentCounter* thread_counters = nullptr;
+
+
+// JSON string literal; names and paths only need quotes and backslashes escaped
+string quoted(const string& text)
+{
+    string out = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+}
+
+
+InstrumentSite::InstrumentSite(const char* name)
+    : name_(name), nanoseconds_(0), calls_(0), count_(0), next_(site_list.load())
+{
+    while (!site_list.compare_exchange_weak(next_, this))
+    {
+    }
+}
+
+
+const InstrumentSite* InstrumentSite::first()
+{
+    return site_list.load();
+}
+
+
+InstrumentCounter::InstrumentCounter(InstrumentSite& site)
+    : site_(site), pending_(0), adds_(0), next_(thread_counters)
+{
+    thread_counters = this;
+}
+
+
+InstrumentCounter::~InstrumentCounter()
+{
+    flush();
+    InstrumentCounter** link = &thread_counters;
+    while (*link != nullptr && *link != this) link = &(*link)->next_;
+    if (*link == this) *link = next_;
+}
+
+
+void InstrumentCounter::flush()
+{
+    if (pending_ != 0) site_.add_count(pending_);
+    pending_ = 0;
+    adds_ = 0;
+}
+
+
+uint64_t peak_rss_bytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+    return uint64_t(usage.ru_maxrss) * 1024;    // kilobytes on Linux
+}
+
+
+string instrument_json()
+{
+    // sites sharing a name are added up, e.g. one counter bumped from two places
+    struct Total
+    {
+        string name;
+        double seconds;
+        uint64_t calls;
+        uint64_t count;
+    };
+    for (InstrumentCounter* counter = thread_counters; counter != nullptr; counter = counter->next())
+    {
+        counter->flush();
+    }
+
+    vector<const InstrumentSite*> sites;
+    for (const InstrumentSite* site = InstrumentSite::first(); site != nullptr; site = site->next())
+    {
+        sites.push_back(site);
+    }
+    reverse(sites.begin(), sites.end());
+
+    vector<Total> totals;
+    for (const InstrumentSite* site : sites)
+    {
+        auto found = find_if(totals.begin(), totals.end(), [&](const Total& t) { return t.name == site->name(); });
+        if (found == totals.end())
+        {
+            totals.push_back(Total{site->name(), 0, 0, 0});
+            found = totals.end() - 1;
+        }
+        found->seconds += site->seconds();
+        found->calls += site->calls();
+        found->count += site->count();
+    }
+
+    ostringstream json;
+    json.precision(6);
+    json << "{";
+    for (size_t i = 0; i < totals.size(); i++)
+    {
+        json << (i == 0 ? "" : ", ") << quoted(totals[i].name) << ": {\"seconds\": " << totals[i].seconds
+             << ", \"calls\": " << totals[i].calls << ", \"count\": " << totals[i].count << "}";
+    }
+    json << "}";
+    return json.str();
+}
+
+
+string BenchReport::json() const
+{
+    ostringstream json;
+    json.precision(6);
+    json << "{\"data_file\": " << quoted(data_file) << ", \"threads\": " << threads
+         << ", \"instrumented\": " << (PARSE_DATA_INSTRUMENT ? "true" : "false") << ", \"stages\": {";
+    double total = 0;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        json << (i == 0 ? "" : ", ") << quoted(stages[i].first) << ": " << stages[i].second;
+        total += stages[i].second;
+    }
+    json << "}, \"total_seconds\": " << total << ", \"peak_rss_bytes\": " << peak_rss_bytes() << ", \"sizes\": {";
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        json << (i == 0 ? "" : ", ") << quoted(sizes[i].first) << ": " << sizes[i].second;
+    }
+    json << "}, \"sites\": " << instrument_json() << "}";
+    return json.str();
+}
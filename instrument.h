@@ -0,0 +1,147 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Scoped timers and counters for the hot paths. Every INSTRUMENT_SCOPE or
+ * INSTRUMENT_COUNT site owns a static InstrumentSite with relaxed atomic
+ * totals, so sites can sit inside parallel_for bodies without locks.
+ * Counts are added up per thread first, so a counter bumped once per query
+ * does not bounce the site's cache line between threads. The sites link
+ * themselves into one list the first time they run, and instrument_json()
+ * reports them. Build with -DPARSE_DATA_INSTRUMENT=0
+ * (make INSTRUMENT=0) and the macros compile to nothing. */
+#ifndef PARSE_DATA_INSTRUMENT
+#define PARSE_DATA_INSTRUMENT 1
+#endif
+
+
+class InstrumentSite
+{
+public:
+    explicit InstrumentSite(const char* name);
+
+    void add_time(uint64_t nanoseconds)
+    {
+        nanoseconds_.fetch_add(nanoseconds, std::memory_order_relaxed);
+        calls_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void add_count(uint64_t n) { count_.fetch_add(n, std::memory_order_relaxed); }
+
+    const char* name() const { return name_; }
+    double seconds() const { return nanoseconds_.load(std::memory_order_relaxed) * 1e-9; }
+    uint64_t calls() const { return calls_.load(std::memory_order_relaxed); }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    const InstrumentSite* next() const { return next_; }
+
+    static const InstrumentSite* first();
+
+private:
+    const char* name_;
+    std::atomic<uint64_t> nanoseconds_;
+    std::atomic<uint64_t> calls_;
+    std::atomic<uint64_t> count_;
+    InstrumentSite* next_;
+};
+
+
+/* One thread's pending count of a site. It is added to the site every
+ * FLUSH_ADDS adds, when the thread exits and when the thread calls
+ * instrument_json(). */
+class InstrumentCounter
+{
+public:
+    explicit InstrumentCounter(InstrumentSite& site);
+    ~InstrumentCounter();
+
+    InstrumentCounter(const InstrumentCounter&) = delete;
+    InstrumentCounter& operator=(const InstrumentCounter&) = delete;
+
+    void add(uint64_t n)
+    {
+        pending_ += n;
+        if (++adds_ == FLUSH_ADDS) flush();
+    }
+    void flush();
+
+    InstrumentCounter* next() const { return next_; }
+
+private:
+    static const uint32_t FLUSH_ADDS = 1024;
+
+    InstrumentSite& site_;
+    uint64_t pending_;
+    uint32_t adds_;
+    InstrumentCounter* next_;   // the thread's other counters
+};
+
+
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(InstrumentSite& site) : site_(site), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer()
+    {
+        site_.add_time(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    InstrumentSite& site_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+#define INSTRUMENT_JOIN2(a, b) a##b
+#define INSTRUMENT_JOIN(a, b) INSTRUMENT_JOIN2(a, b)
+
+#if PARSE_DATA_INSTRUMENT
+#define INSTRUMENT_SCOPE(name) \
+    static InstrumentSite INSTRUMENT_JOIN(instrument_site_, __LINE__)(name); \
+    ScopedTimer INSTRUMENT_JOIN(instrument_timer_, __LINE__)(INSTRUMENT_JOIN(instrument_site_, __LINE__))
+#define INSTRUMENT_COUNT(name, n) \
+    do { \
+        static InstrumentSite instrument_site(name); \
+        static thread_local InstrumentCounter instrument_counter(instrument_site); \
+        instrument_counter.add(n); \
+    } while (0)
+#else
+#define INSTRUMENT_SCOPE(name) do { } while (0)
+#define INSTRUMENT_COUNT(name, n) do { } while (0)
+#endif
+
+
+/* Stage times and structure sizes of one benchmark run, reported with the
+ * instrumented sites as one JSON object. Stages are timed by the caller,
+ * so they are there even when the sites are compiled out. */
+struct BenchReport
+{
+    std::string data_file;
+    unsigned threads = 1;
+    std::vector< std::pair<std::string, double> > stages;     // name, seconds
+    std::vector< std::pair<std::string, uint64_t> > sizes;    // name, entries or bytes
+
+    void stage(const std::string& name, double seconds) { stages.emplace_back(name, seconds); }
+    void size(const std::string& name, uint64_t value) { sizes.emplace_back(name, value); }
+
+    std::string json() const;
+};
+
+
+/* Peak resident set size of this process in bytes (getrusage). */
+uint64_t peak_rss_bytes();
+
+/* {"name": {"seconds": s, "calls": n, "count": n}, ...} over every site
+ * that has run, in the order they first ran. Counts still pending on other
+ * running threads are not included. */
+std::string instrument_json();
+
+#endif
@@ -0,0 +1,316 @@
+#include "item_similarity.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "parallel.h"
+#include "stopwatch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ITEM_SIMILARITY_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+namespace {
+
+/* Like roaring bitmaps, a product's reviewers are only treated as a bitset
+ * when its blocks hold at least this many reviewers on average; sparser
+ * sets are cheaper to intersect as sorted lists. */
+const size_t DENSE_REVIEWERS_PER_BLOCK = 4;
+
+typedef size_t (*IntersectFunction)(const ReviewerIndex& index, const ReviewerBitsets& bitsets, uint32_t a, uint32_t b);
+
+
+// reference kernel: plain merge of the two sorted reviewer lists
+size_t intersect_lists(const ReviewerIndex& index, const ReviewerBitsets&, uint32_t a, uint32_t b)
+{
+    const uint32_t* x = index.begin(a);
+    const uint32_t* x_end = x + index.count(a);
+    const uint32_t* y = index.begin(b);
+    const uint32_t* y_end = y + index.count(b);
+    size_t common = 0;
+    while (x != x_end && y != y_end)
+    {
+        if (*x < *y) ++x;
+        else if (*y < *x) ++y;
+        else
+        {
+            common++;
+            ++x;
+            ++y;
+        }
+    }
+    return common;
+}
+
+
+inline bool dense(const ReviewerIndex& index, const ReviewerBitsets& bitsets, uint32_t product)
+{
+    return index.count(product) > 0 && index.count(product) >= DENSE_REVIEWERS_PER_BLOCK * (bitsets.offsets[product + 1] - bitsets.offsets[product]);
+}
+
+
+size_t intersect_bitsets_scalar(const ReviewerIndex& index, const ReviewerBitsets& bitsets, uint32_t a, uint32_t b)
+{
+    if (!dense(index, bitsets, a) || !dense(index, bitsets, b)) return intersect_lists(index, bitsets, a, b);
+
+    uint64_t i = bitsets.offsets[a], i_end = bitsets.offsets[a + 1];
+    uint64_t j = bitsets.offsets[b], j_end = bitsets.offsets[b + 1];
+    size_t common = 0;
+    while (i < i_end && j < j_end)
+    {
+        uint32_t key_a = bitsets.keys[i], key_b = bitsets.keys[j];
+        if (key_a < key_b) i++;
+        else if (key_b < key_a) j++;
+        else
+        {
+            const uint64_t* x = bitsets.blocks[i++].words;
+            const uint64_t* y = bitsets.blocks[j++].words;
+            common += __builtin_popcountll(x[0] & y[0]) + __builtin_popcountll(x[1] & y[1])
+                    + __builtin_popcountll(x[2] & y[2]) + __builtin_popcountll(x[3] & y[3]);
+        }
+    }
+    return common;
+}
+
+
+#ifdef ITEM_SIMILARITY_X86
+/* Counts the bits of a common block with a 4 bit lookup table (vpshufb)
+ * and sums the byte counts into four 64 bit lanes (vpsadbw). Compiled for
+ * AVX2 on its own, so the rest of the program still runs on any x86. */
+__attribute__((target("avx2")))
+size_t intersect_bitsets_avx2(const ReviewerIndex& index, const ReviewerBitsets& bitsets, uint32_t a, uint32_t b)
+{
+    if (!dense(index, bitsets, a) || !dense(index, bitsets, b)) return intersect_lists(index, bitsets, a, b);
+
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+
+    uint64_t i = bitsets.offsets[a], i_end = bitsets.offsets[a + 1];
+    uint64_t j = bitsets.offsets[b], j_end = bitsets.offsets[b + 1];
+    while (i < i_end && j < j_end)
+    {
+        uint32_t key_a = bitsets.keys[i], key_b = bitsets.keys[j];
+        if (key_a < key_b) i++;
+        else if (key_b < key_a) j++;
+        else
+        {
+            __m256i both = _mm256_and_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(bitsets.blocks[i++].words)),
+                                            _mm256_load_si256(reinterpret_cast<const __m256i*>(bitsets.blocks[j++].words)));
+            __m256i low = _mm256_and_si256(both, low_nibbles);
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(both, 4), low_nibbles);
+            __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+        }
+    }
+    return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+         + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+}
+#endif
+
+
+/* Resolves a kernel name. "auto" becomes "avx2" or "scalar". Returns
+ * nullptr for unknown names and for "avx2" on CPUs without it. */
+IntersectFunction find_kernel(string& name)
+{
+    if (name == "auto") name = avx2_supported() ? "avx2" : "scalar";
+    if (name == "merge") return intersect_lists;
+    if (name == "scalar") return intersect_bitsets_scalar;
+#ifdef ITEM_SIMILARITY_X86
+    if (name == "avx2" && avx2_supported()) return intersect_bitsets_avx2;
+#endif
+    return nullptr;
+}
+
+
+// candidate collection of one thread
+struct RowScratch
+{
+    vector<uint32_t> stamp;
+    vector<uint32_t> candidates;
+    vector< pair<uint32_t, double> > row;
+    uint32_t generation = 0;
+    size_t pairs = 0;
+};
+
+
+bool same_graph(const CsrGraph& a, const CsrGraph& b)
+{
+    return a.offsets == b.offsets && a.neighbors == b.neighbors && a.weights == b.weights;
+}
+
+}
+
+
+void build_reviewer_bitsets(const ReviewerIndex& index, unsigned threads, ReviewerBitsets& bitsets)
+{
+    struct KeyedBlock
+    {
+        uint32_t key;
+        ReviewerBitsets::Block bits;
+    };
+
+    size_t num_products = index.offsets.empty() ? 0 : index.offsets.size() - 1;
+    vector<KeyedBlock> keyed;
+    parallel_csr(num_products, threads, [&](size_t product, unsigned, vector<KeyedBlock>& out)
+    {
+        size_t first = out.size();
+        const uint32_t* reviewers = index.begin(product);
+        for (size_t r = 0; r < index.count(product); r++)
+        {
+            uint32_t key = reviewers[r] / ReviewerBitsets::BLOCK_BITS;
+            uint32_t bit = reviewers[r] % ReviewerBitsets::BLOCK_BITS;
+            if (out.size() == first || out.back().key != key)
+            {
+                out.push_back(KeyedBlock{key, ReviewerBitsets::Block{{0, 0, 0, 0}}});
+            }
+            out.back().bits.words[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }, bitsets.offsets, keyed);
+
+    bitsets.keys.resize(keyed.size());
+    bitsets.blocks.resize(keyed.size());
+    for (size_t i = 0; i < keyed.size(); i++)
+    {
+        bitsets.keys[i] = keyed[i].key;
+        bitsets.blocks[i] = keyed[i].bits;
+    }
+}
+
+
+bool avx2_supported()
+{
+#ifdef ITEM_SIMILARITY_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+
+bool build_item_similarity(const ReviewerIndex& index, const UserItems& user_items, const ReviewerBitsets& bitsets, const ItemSimilarityOptions& options, unsigned threads, CsrGraph& graph, ItemSimilarityStats& stats)
+{
+    stats = ItemSimilarityStats();
+    stats.kernel = options.kernel;
+    IntersectFunction intersect = find_kernel(stats.kernel);
+    bool cosine = options.measure == "cosine";
+    if (intersect == nullptr || (!cosine && options.measure != "jaccard"))
+    {
+        return false;
+    }
+
+    Stopwatch timer;
+    threads = max(1u, threads);
+    size_t num_products = bitsets.num_products();
+    vector<RowScratch> scratch(threads);
+    vector< pair<uint32_t, double> > edges;
+    graph.clear();
+
+    parallel_csr(num_products, threads, [&](size_t a, unsigned thread_id, vector< pair<uint32_t, double> >& out)
+    {
+        RowScratch& s = scratch[thread_id];
+        if (s.stamp.empty()) s.stamp.assign(num_products, 0);
+        if (++s.generation == 0)
+        {
+            fill(s.stamp.begin(), s.stamp.end(), 0);
+            s.generation = 1;
+        }
+
+        // every product a reviewer of a also bought
+        s.candidates.clear();
+        const uint32_t* reviewers = index.begin(a);
+        for (size_t r = 0; r < index.count(a); r++)
+        {
+            uint32_t user = reviewers[r];
+            if (options.user_cap != 0 && user_items.degree(user) > options.user_cap) continue;
+            for (const uint32_t* b = user_items.begin(user); b != user_items.end(user); ++b)
+            {
+                if (*b != a && s.stamp[*b] != s.generation)
+                {
+                    s.stamp[*b] = s.generation;
+                    s.candidates.push_back(*b);
+                }
+            }
+        }
+
+        s.row.clear();
+        double size_a = index.count(a);
+        for (uint32_t b : s.candidates)
+        {
+            double common = intersect(index, bitsets, a, b);
+            double size_b = index.count(b);
+            double similarity = cosine ? common / sqrt(size_a * size_b) : common / (size_a + size_b - common);
+            s.row.emplace_back(b, similarity);
+        }
+        s.pairs += s.candidates.size();
+
+        size_t keep = min(options.top_n, s.row.size());
+        partial_sort(s.row.begin(), s.row.begin() + keep, s.row.end(), [](const pair<uint32_t, double>& x, const pair<uint32_t, double>& y)
+        {
+            return x.second != y.second ? x.second > y.second : x.first < y.first;
+        });
+        sort(s.row.begin(), s.row.begin() + keep);
+        out.insert(out.end(), s.row.begin(), s.row.begin() + keep);
+    }, graph.offsets, edges);
+
+    graph.neighbors.resize(edges.size());
+    graph.weights.resize(edges.size());
+    for (size_t e = 0; e < edges.size(); e++)
+    {
+        graph.neighbors[e] = edges[e].first;
+        graph.weights[e] = edges[e].second;
+    }
+
+    for (const RowScratch& s : scratch)
+    {
+        stats.pairs += s.pairs;
+    }
+    stats.seconds = timer.elapsed_seconds();
+    return true;
+}
+
+
+void report_item_similarity(const ReviewerIndex& index, const UserItems& user_items, const ReviewerBitsets& bitsets, const ItemSimilarityOptions& options, unsigned max_threads)
+{
+    max_threads = max(1u, max_threads);
+    size_t dense_products = 0;
+    for (uint32_t product = 0; product < bitsets.num_products(); product++)
+    {
+        dense_products += dense(index, bitsets, product);
+    }
+    cout << "reviewer bitsets: " << bitsets.keys.size() << " blocks for " << index.reviewers.size() << " reviews, "
+         << bitsets.memory_bytes() / (1024.0 * 1024.0) << " MB, " << dense_products << " of " << bitsets.num_products()
+         << " products dense enough for bitsets; avx2 " << (avx2_supported() ? "available" : "not available") << endl;
+
+    ItemSimilarityOptions run = options;
+    CsrGraph reference;
+    ItemSimilarityStats stats;
+    vector<string> kernels = {"merge", "scalar"};
+    if (avx2_supported()) kernels.push_back("avx2");
+    for (const string& kernel : kernels)
+    {
+        run.kernel = kernel;
+        CsrGraph graph;
+        build_item_similarity(index, user_items, bitsets, run, max_threads, graph, stats);
+        if (kernel == "merge") reference = graph;
+        cout << "  " << kernel << " on " << max_threads << " threads: " << stats.pairs << " pairs in " << stats.seconds << "s, "
+             << stats.pairs / max(stats.seconds, 1e-12) / 1e6 << "M pairs/s, " << (same_graph(graph, reference) ? "same graph" : "DIFFERENT GRAPH") << endl;
+    }
+
+    run.kernel = "auto";
+    for (unsigned threads = 1; ; threads = min(threads * 2, max_threads))
+    {
+        CsrGraph graph;
+        build_item_similarity(index, user_items, bitsets, run, threads, graph, stats);
+        cout << "  " << stats.kernel << " on " << threads << " thread" << (threads == 1 ? "" : "s") << ": "
+             << stats.pairs / max(stats.seconds, 1e-12) / 1e6 << "M pairs/s, " << (same_graph(graph, reference) ? "same graph" : "DIFFERENT GRAPH") << endl;
+        if (threads == max_threads) break;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef ITEM_SIMILARITY_H
+#define ITEM_SIMILARITY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "id_index.h"
+
+
+/* Reviewer sets as blocked bitsets: the user id space is cut into blocks
+ * of 256 users and every product keeps only its non-empty blocks, as a
+ * sorted list of block numbers with one 256 bit word each. Two products
+ * intersect by merging their block lists and counting the bits of the
+ * AND of every common block. Sparse products (few reviewers per block)
+ * are intersected as sorted reviewer lists instead. */
+struct ReviewerBitsets
+{
+    static const uint32_t BLOCK_BITS = 256;
+
+    struct alignas(32) Block
+    {
+        uint64_t words[4];
+    };
+
+    std::vector<uint64_t> offsets;    // num_products + 1
+    std::vector<uint32_t> keys;       // block number (user / BLOCK_BITS), sorted per product
+    std::vector<Block> blocks;        // the bits of each key
+
+    size_t num_products() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t memory_bytes() const
+    {
+        return offsets.size() * sizeof(uint64_t) + keys.size() * sizeof(uint32_t) + blocks.size() * sizeof(Block);
+    }
+};
+
+
+struct ItemSimilarityOptions
+{
+    std::string measure = "cosine";   // "cosine" or "jaccard"
+    std::string kernel = "auto";      // "auto", "avx2", "scalar" (bitsets) or "merge" (sorted lists)
+    size_t top_n = 20;                // neighbors kept per product
+    size_t user_cap = 1000;           // users with more purchases propose no candidates (0: no cap)
+};
+
+struct ItemSimilarityStats
+{
+    std::string kernel;               // kernel that actually ran
+    size_t pairs = 0;                 // candidate pairs scored, each unordered pair once per end
+    double seconds = 0;
+};
+
+
+void build_reviewer_bitsets(const ReviewerIndex& index, unsigned threads, ReviewerBitsets& bitsets);
+
+/* True if this CPU runs the AVX2 kernel. "auto" picks it when it does and
+ * falls back to the portable scalar kernel otherwise. */
+bool avx2_supported();
+
+/* Scores every pair of products that share at least one reviewer, not just
+ * the pairs named in similar: lists, and keeps each product's top_n
+ * neighbors by similarity (ties to the lower id). The result is a product
+ * graph with rows sorted by neighbor, so every csr predictor runs on it.
+ * All kernels produce the same graph. The candidates of a product come
+ * from its reviewers' purchases; a handful of heavy reviewers would make
+ * that close to all pairs, so users above user_cap are skipped there (their
+ * reviews still count in every intersection). Returns false for unknown
+ * options. */
+bool build_item_similarity(const ReviewerIndex& index, const UserItems& user_items, const ReviewerBitsets& bitsets, const ItemSimilarityOptions& options, unsigned threads, CsrGraph& graph, ItemSimilarityStats& stats);
+
+/* Times every available kernel in pairs per second on `max_threads`
+ * threads, then the default kernel from 1, 2, 4, ... threads, and checks
+ * each graph against the sorted list merge. */
+void report_item_similarity(const ReviewerIndex& index, const UserItems& user_items, const ReviewerBitsets& bitsets, const ItemSimilarityOptions& options, unsigned max_threads);
+
+#endif
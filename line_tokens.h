@@ -0,0 +1,95 @@
+#ifndef LINE_TOKENS_H
+#define LINE_TOKENS_H
+
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+
+/* Zero copy tokenizing helpers shared by the in-place loaders. */
+
+// the most tokens any of the fixed format lines needs by position
+const size_t MAX_POSITIONAL_TOKENS = 8;
+
+/* Space separated tokens of one line, views into the mapped file. Only the
+ * first few tokens are kept by position (plus the last one), which is all
+ * the fixed format lines need; titles and similar lists are walked with
+ * next_token instead. Splitting matches split(line, ' '): only spaces
+ * separate tokens and empty tokens are dropped. */
+struct LineTokens
+{
+    std::string_view token[MAX_POSITIONAL_TOKENS];
+    std::string_view last;
+    size_t count;
+};
+
+
+inline std::string_view next_token(const char*& pos, const char* end)
+{
+    while (pos < end && *pos == ' ') ++pos;
+    const char* start = pos;
+    while (pos < end && *pos != ' ') ++pos;
+    return std::string_view(start, pos - start);
+}
+
+
+inline void tokenize(const char* pos, const char* end, LineTokens& tokens)
+{
+    tokens.count = 0;
+    while (true)
+    {
+        std::string_view token = next_token(pos, end);
+        if (token.empty()) break;
+        if (tokens.count < MAX_POSITIONAL_TOKENS)
+        {
+            tokens.token[tokens.count] = token;
+        }
+        tokens.last = token;
+        tokens.count++;
+    }
+}
+
+
+inline int to_int(std::string_view token)
+{
+    int value = 0;
+    std::from_chars(token.data(), token.data() + token.size(), value);
+    return value;
+}
+
+
+inline double to_double(std::string_view token)
+{
+    double value = 0;
+    std::from_chars(token.data(), token.data() + token.size(), value);
+    return value;
+}
+
+
+inline bool starts_with(std::string_view token, char c)
+{
+    return !token.empty() && token[0] == c;
+}
+
+
+/* Stores the words from pos to end in out, joined by single spaces, the
+ * way parse_file rebuilds titles and other fields that may hold spaces. */
+inline void join_words(const char* pos, const char* end, std::string& out)
+{
+    out.clear();
+    for (std::string_view word = next_token(pos, end); !word.empty(); word = next_token(pos, end))
+    {
+        if (!out.empty()) out.push_back(' ');
+        out.append(word);
+    }
+}
+
+
+inline const char* line_end(const char* pos, const char* end)
+{
+    const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+    return newline ? newline : end;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+
+/* Read-only memory mapping of a whole file. The mapping is released when the
+ * object goes out of scope. */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // maps the file, returns false (and leaves the object empty) on failure
+    bool open(const std::string& filename);
+    void close();
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool is_open() const { return data_ != nullptr || opened_empty_; }
+
+private:
+    const char* data_;
+    size_t size_;
+    bool opened_empty_;
+};
+
+#endif
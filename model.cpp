@@ -0,0 +1,164 @@
+#include "model.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+const uint32_t LOAD_TEST_SEED = 224;
+
+}
+
+
+RecommenderModel::RecommenderModel(IdIndex&& ids, UserItems&& user_items, CsrGraph&& graph, unsigned threads, size_t shards)
+    : ids_(move(ids)), user_items_(move(user_items)), graph_(move(graph)), shards_(max<size_t>(1, shards))
+{
+    // the sharded tables replace the single user table
+    ids_.user_ids = unordered_map<string, uint32_t>();
+
+    // bucket the users by shard so each shard can be filled by one thread
+    size_t num_users = ids_.num_users();
+    vector<uint32_t> shard_of_user(num_users);
+    parallel_for(num_users, threads, [&](size_t user, unsigned)
+    {
+        shard_of_user[user] = shard_of(ids_.users[user]);
+    });
+
+    vector<size_t> shard_start(shards_.size() + 1, 0);
+    for (uint32_t shard : shard_of_user)
+    {
+        shard_start[shard + 1]++;
+    }
+    for (size_t shard = 0; shard < shards_.size(); shard++)
+    {
+        shard_start[shard + 1] += shard_start[shard];
+    }
+
+    vector<uint32_t> users_by_shard(num_users);
+    vector<size_t> next(shard_start.begin(), shard_start.end() - 1);
+    for (uint32_t user = 0; user < num_users; user++)
+    {
+        users_by_shard[next[shard_of_user[user]]++] = user;
+    }
+
+    parallel_for(shards_.size(), threads, [&](size_t shard, unsigned)
+    {
+        Shard& table = shards_[shard];
+        table.reserve(shard_start[shard + 1] - shard_start[shard]);
+        for (size_t i = shard_start[shard]; i < shard_start[shard + 1]; i++)
+        {
+            uint32_t user = users_by_shard[i];
+            table.emplace(ids_.users[user], user);
+        }
+    });
+}
+
+
+uint32_t RecommenderModel::user_id(string_view user) const
+{
+    const Shard& table = shards_[shard_of(user)];
+    auto found = table.find(user);
+    return found == table.end() ? NO_ID : found->second;
+}
+
+
+bool RecommenderModel::recommend(string_view user, size_t k, TopKScratch& scratch, vector<uint32_t>& out) const
+{
+    return recommend(user_id(user), k, scratch, out);
+}
+
+
+bool RecommenderModel::recommend(uint32_t user, size_t k, TopKScratch& scratch, vector<uint32_t>& out) const
+{
+    if (user == NO_ID || user >= user_items_.num_users())
+    {
+        out.clear();
+        return false;
+    }
+    recommend_top_k(user, k, user_items_, graph_, scratch, out);
+    return true;
+}
+
+
+void run_load_test(const RecommenderModel& model, size_t queries, size_t k, unsigned max_threads)
+{
+    if (model.num_users() == 0 || queries == 0)
+    {
+        return;
+    }
+
+    vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max(1u, max_threads));
+
+    cout << "load test: " << queries << " queries per thread, top " << k << endl;
+    for (unsigned threads : thread_counts)
+    {
+        vector< vector<double> > latencies(threads, vector<double>(queries));
+        atomic<unsigned> ready(0);
+        atomic<bool> go(false);
+
+        auto client = [&](unsigned thread_id)
+        {
+            mt19937 random(LOAD_TEST_SEED + thread_id);
+            uniform_int_distribution<uint32_t> pick(0, model.num_users() - 1);
+            TopKScratch scratch;
+            scratch.reset(model.num_products());
+            vector<uint32_t> picked;
+
+            ready++;
+            while (!go.load(memory_order_acquire))
+            {
+                this_thread::yield();
+            }
+
+            for (size_t q = 0; q < queries; q++)
+            {
+                const string& user = model.user(pick(random));
+                auto start = chrono::steady_clock::now();
+                model.recommend(user, k, scratch, picked);
+                latencies[thread_id][q] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            }
+        };
+
+        vector<thread> pool;
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pool.emplace_back(client, t);
+        }
+        while (ready.load() < threads)
+        {
+            this_thread::yield();
+        }
+        Stopwatch timer;
+        go.store(true, memory_order_release);
+        for (thread& worker : pool)
+        {
+            worker.join();
+        }
+        double seconds = timer.elapsed_seconds();
+
+        vector<double> all;
+        all.reserve(threads * queries);
+        for (auto& samples : latencies)
+        {
+            all.insert(all.end(), samples.begin(), samples.end());
+        }
+        cout << "  " << threads << " thread" << (threads == 1 ? "" : "s") << ": "
+             << all.size() / max(seconds, 1e-9) << " qps, p50 " << percentile(all, 50)
+             << "us, p99 " << percentile(all, 99) << "us" << endl;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "csr_graph.h"
+#include "id_index.h"
+#include "topk.h"
+
+
+/* Read-only recommender built from the interned ids, the purchases and the
+ * product graph. Nothing changes after construction and every query is a
+ * const member taking the caller's scratch space, so any number of threads
+ * can query one model at the same time without locks. */
+class RecommenderModel
+{
+public:
+    /* Takes ownership of the tables. The user lookup is rebuilt as
+     * `shards` hash tables on `threads` threads. */
+    RecommenderModel(IdIndex&& ids, UserItems&& user_items, CsrGraph&& graph, unsigned threads, size_t shards = 64);
+
+    // the shard tables point into ids_.users
+    RecommenderModel(const RecommenderModel&) = delete;
+    RecommenderModel& operator=(const RecommenderModel&) = delete;
+
+    size_t num_users() const { return ids_.num_users(); }
+    size_t num_products() const { return ids_.num_products(); }
+    const std::string& user(uint32_t user) const { return ids_.users[user]; }
+    const std::string& asin(uint32_t product) const { return ids_.asins[product]; }
+
+    // NO_ID if the user is not known
+    uint32_t user_id(std::string_view user) const;
+
+    /* Top k product ids for a user, best first. Returns false (with out
+     * empty) for an unknown user. */
+    bool recommend(std::string_view user, size_t k, TopKScratch& scratch, std::vector<uint32_t>& out) const;
+
+    /* The same by user id, for callers that looked the user up already. */
+    bool recommend(uint32_t user, size_t k, TopKScratch& scratch, std::vector<uint32_t>& out) const;
+
+private:
+    typedef std::unordered_map<std::string_view, uint32_t> Shard;
+
+    size_t shard_of(std::string_view user) const { return std::hash<std::string_view>()(user) % shards_.size(); }
+
+    IdIndex ids_;
+    UserItems user_items_;
+    CsrGraph graph_;
+    std::vector<Shard> shards_;
+};
+
+
+/* Replays `queries` random user lookups per thread against the model with
+ * 1, 2, 4, ... up to max_threads threads querying at once, and prints the
+ * throughput and the p50/p99 query latency of every run. The users are
+ * drawn from a fixed seed, so runs are repeatable. */
+void run_load_test(const RecommenderModel& model, size_t queries, size_t k, unsigned max_threads);
+
+#endif
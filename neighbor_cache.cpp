@@ -0,0 +1,285 @@
+#include "neighbor_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'P', 'R', 'N', 'B', 'R', 'T', 'O', 'P'};
+const uint32_t ENDIAN_CHECK = 0x01020304;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    uint64_t num_products;
+    uint64_t top_n;
+    uint64_t num_entries;
+    uint64_t graph_edges;    // edges of the graph the cache was built from
+};
+
+static_assert(sizeof(CacheHeader) == 48, "CacheHeader layout is part of the file format");
+
+
+inline size_t aligned(size_t bytes)
+{
+    return (bytes + 7) / 8 * 8;
+}
+
+
+// heaviest first, ties to the lower neighbor id
+inline bool heavier(double weight_a, uint32_t neighbor_a, double weight_b, uint32_t neighbor_b)
+{
+    return weight_a != weight_b ? weight_a > weight_b : neighbor_a < neighbor_b;
+}
+
+}
+
+
+NeighborCache::NeighborCache()
+    : offsets_(nullptr), neighbors_(nullptr), weights_(nullptr), num_products_(0), top_n_(0), graph_edges_(0)
+{
+}
+
+
+void NeighborCache::point_at_vectors()
+{
+    offsets_ = offset_storage_.data();
+    neighbors_ = neighbor_storage_.data();
+    weights_ = weight_storage_.data();
+}
+
+
+void NeighborCache::build(const CsrGraph& graph, size_t top_n, unsigned threads)
+{
+    file_.close();
+    num_products_ = graph.num_nodes();
+    top_n_ = top_n;
+    graph_edges_ = graph.num_edges();
+
+    vector< vector< pair<uint32_t, double> > > rows(max(1u, threads));
+    vector< pair<uint32_t, double> > entries;
+    parallel_csr(num_products_, threads, [&](size_t product, unsigned thread_id, vector< pair<uint32_t, double> >& out)
+    {
+        vector< pair<uint32_t, double> >& row = rows[thread_id];
+        row.clear();
+        for (uint64_t e = graph.begin(product); e < graph.end(product); e++)
+        {
+            row.emplace_back(graph.neighbors[e], graph.weights[e]);
+        }
+        size_t keep = min(top_n, row.size());
+        partial_sort(row.begin(), row.begin() + keep, row.end(), [](const pair<uint32_t, double>& a, const pair<uint32_t, double>& b)
+        {
+            return heavier(a.second, a.first, b.second, b.first);
+        });
+        out.insert(out.end(), row.begin(), row.begin() + keep);
+    }, offset_storage_, entries);
+
+    neighbor_storage_.resize(entries.size());
+    weight_storage_.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        neighbor_storage_[i] = entries[i].first;
+        weight_storage_[i] = entries[i].second;
+    }
+    point_at_vectors();
+}
+
+
+bool NeighborCache::write(const string& filename) const
+{
+    ofstream out(filename.c_str(), ios::binary);
+    if (!out)
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = NEIGHBOR_CACHE_VERSION;
+    header.endian_check = ENDIAN_CHECK;
+    header.num_products = num_products_;
+    header.top_n = top_n_;
+    header.num_entries = num_products_ == 0 ? 0 : offsets_[num_products_];
+    header.graph_edges = graph_edges_;
+
+    static const char padding[8] = {0};
+    size_t neighbor_bytes = header.num_entries * sizeof(uint32_t);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(offsets_), (num_products_ + 1) * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(neighbors_), neighbor_bytes);
+    out.write(padding, aligned(neighbor_bytes) - neighbor_bytes);
+    out.write(reinterpret_cast<const char*>(weights_), header.num_entries * sizeof(double));
+    return out.good();
+}
+
+
+bool NeighborCache::open(const string& filename)
+{
+    offset_storage_.clear();
+    neighbor_storage_.clear();
+    weight_storage_.clear();
+    if (!file_.open(filename))
+    {
+        cerr << "neighbor cache: could not open " << filename << endl;
+        return false;
+    }
+
+    CacheHeader header;
+    if (file_.size() < sizeof(header))
+    {
+        cerr << "neighbor cache: " << filename << " is truncated" << endl;
+        file_.close();
+        return false;
+    }
+    memcpy(&header, file_.data(), sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.endian_check != ENDIAN_CHECK)
+    {
+        cerr << "neighbor cache: " << filename << " is not a neighbor cache" << endl;
+        file_.close();
+        return false;
+    }
+    if (header.version != NEIGHBOR_CACHE_VERSION)
+    {
+        cerr << "neighbor cache: " << filename << " has version " << header.version << ", expected " << NEIGHBOR_CACHE_VERSION << endl;
+        file_.close();
+        return false;
+    }
+
+    // bounds the sizes below, so they cannot overflow
+    if (header.num_products >= file_.size() / sizeof(uint64_t) || header.num_entries > file_.size() / sizeof(uint32_t))
+    {
+        cerr << "neighbor cache: " << filename << " is truncated" << endl;
+        file_.close();
+        return false;
+    }
+
+    size_t offsets_at = sizeof(header);
+    size_t neighbors_at = offsets_at + (header.num_products + 1) * sizeof(uint64_t);
+    size_t weights_at = neighbors_at + aligned(header.num_entries * sizeof(uint32_t));
+    size_t end = weights_at + header.num_entries * sizeof(double);
+    if (file_.size() != end)
+    {
+        cerr << "neighbor cache: " << filename << " is truncated" << endl;
+        file_.close();
+        return false;
+    }
+
+    offsets_ = reinterpret_cast<const uint64_t*>(file_.data() + offsets_at);
+    neighbors_ = reinterpret_cast<const uint32_t*>(file_.data() + neighbors_at);
+
+    // offsets start at 0, never decrease and end at the entry count; neighbors are product ids
+    bool valid = offsets_[0] == 0 && offsets_[header.num_products] == header.num_entries;
+    for (uint64_t product = 0; valid && product < header.num_products; product++)
+    {
+        valid = offsets_[product] <= offsets_[product + 1];
+    }
+    for (uint64_t e = 0; valid && e < header.num_entries; e++)
+    {
+        valid = neighbors_[e] < header.num_products;
+    }
+    if (!valid)
+    {
+        cerr << "neighbor cache: " << filename << " is corrupt" << endl;
+        file_.close();
+        return false;
+    }
+
+    weights_ = reinterpret_cast<const double*>(file_.data() + weights_at);
+    num_products_ = header.num_products;
+    top_n_ = header.top_n;
+    graph_edges_ = header.graph_edges;
+    return true;
+}
+
+
+size_t NeighborCache::memory_bytes() const
+{
+    size_t entries = num_products_ == 0 ? 0 : offsets_[num_products_];
+    return sizeof(CacheHeader) + (num_products_ + 1) * sizeof(uint64_t) + aligned(entries * sizeof(uint32_t)) + entries * sizeof(double);
+}
+
+
+void rank_cached_prediction(uint32_t user, size_t k, const UserItems& user_items, const NeighborCache& cache, NeighborMergeScratch& scratch, vector<uint32_t>& out)
+{
+    typedef NeighborMergeScratch::Cursor Cursor;
+    auto lighter = [](const Cursor& a, const Cursor& b) { return heavier(b.weight, b.neighbor, a.weight, a.neighbor); };
+
+    out.clear();
+    vector<Cursor>& heap = scratch.heap;
+    heap.clear();
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        if (cache.count(*item) > 0)
+        {
+            heap.push_back(Cursor{cache.weights(*item)[0], cache.neighbors(*item)[0], *item, 0});
+        }
+    }
+    make_heap(heap.begin(), heap.end(), lighter);
+
+    // the k heaviest edges, each product listed once
+    for (size_t taken = 0; taken < k && !heap.empty(); taken++)
+    {
+        pop_heap(heap.begin(), heap.end(), lighter);
+        Cursor& top = heap.back();
+        if (find(out.begin(), out.end(), top.neighbor) == out.end()) out.push_back(top.neighbor);
+
+        if (++top.position < cache.count(top.product))
+        {
+            top.weight = cache.weights(top.product)[top.position];
+            top.neighbor = cache.neighbors(top.product)[top.position];
+            push_heap(heap.begin(), heap.end(), lighter);
+        }
+        else
+        {
+            heap.pop_back();
+        }
+    }
+}
+
+
+void report_neighbor_cache(const NeighborCache& cache, const UserItems& user_items, const CsrGraph& graph, size_t k)
+{
+    size_t num_users = user_items.num_users();
+    cout << "neighbor cache: top " << cache.top_n() << " of " << cache.num_products() << " products, "
+         << cache.memory_bytes() / (1024.0 * 1024.0) << " MB (product graph: " << graph.memory_bytes() / (1024.0 * 1024.0) << " MB)" << endl;
+    if (k > cache.top_n())
+    {
+        cout << "  k = " << k << " is larger than the cached top " << cache.top_n() << ", results may differ" << endl;
+    }
+
+    vector< vector<uint32_t> > uncached(num_users);
+    Stopwatch timer;
+    for (uint32_t user = 0; user < num_users; user++)
+    {
+        rank_baseline_prediction_csr(user, k, user_items, graph, uncached[user]);
+    }
+    double uncached_seconds = timer.elapsed_seconds();
+
+    NeighborMergeScratch scratch;
+    vector<uint32_t> cached;
+    size_t same = 0;
+    double cached_seconds = 0;
+    for (uint32_t user = 0; user < num_users; user++)
+    {
+        timer.reset();
+        rank_cached_prediction(user, k, user_items, cache, scratch, cached);
+        cached_seconds += timer.elapsed_seconds();
+        same += cached == uncached[user];
+    }
+
+    double users = max<size_t>(1, num_users);
+    cout << "  uncached baseline: " << uncached_seconds / users * 1e9 << " ns/query" << endl;
+    cout << "  cached baseline:   " << cached_seconds / users * 1e9 << " ns/query (" << uncached_seconds / max(cached_seconds, 1e-12) << "x)" << endl;
+    cout << "  " << same << " of " << num_users << " users get the same recommendations" << endl;
+}
@@ -0,0 +1,94 @@
+#ifndef NEIGHBOR_CACHE_H
+#define NEIGHBOR_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "csr_graph.h"
+#include "id_index.h"
+#include "mapped_file.h"
+
+
+const unsigned NEIGHBOR_CACHE_VERSION = 1;
+
+
+/* Each product's top N outgoing edges by weight (ties to the lower
+ * neighbor id), heaviest first, in compressed sparse row form. Built
+ * offline from the product graph, written to a file and memory mapped at
+ * serve time. The baseline predictor only ever reads the heaviest edges,
+ * so for k <= N a k-way merge over the user's purchased products gives
+ * exactly what rank_baseline_prediction_csr returns. */
+class NeighborCache
+{
+public:
+    NeighborCache();
+
+    NeighborCache(const NeighborCache&) = delete;
+    NeighborCache& operator=(const NeighborCache&) = delete;
+
+    void build(const CsrGraph& graph, size_t top_n, unsigned threads);
+
+    /* Writes the table: a fixed header followed by the offsets, neighbor
+     * and weight arrays, each 8 byte aligned. Returns false on I/O
+     * errors. */
+    bool write(const std::string& filename) const;
+
+    /* Memory maps a written table. Returns false (with the reason on
+     * stderr) for missing, foreign or truncated files and for offsets or
+     * neighbor ids that are out of range. */
+    bool open(const std::string& filename);
+
+    size_t num_products() const { return num_products_; }
+    size_t top_n() const { return top_n_; }
+    uint64_t graph_edges() const { return graph_edges_; }
+    size_t memory_bytes() const;
+
+    const uint32_t* neighbors(uint32_t product) const { return neighbors_ + offsets_[product]; }
+    const double* weights(uint32_t product) const { return weights_ + offsets_[product]; }
+    size_t count(uint32_t product) const { return offsets_[product + 1] - offsets_[product]; }
+
+private:
+    void point_at_vectors();
+
+    // built in memory
+    std::vector<uint64_t> offset_storage_;
+    std::vector<uint32_t> neighbor_storage_;
+    std::vector<double> weight_storage_;
+    // or mapped
+    MappedFile file_;
+
+    const uint64_t* offsets_;
+    const uint32_t* neighbors_;
+    const double* weights_;
+    size_t num_products_;
+    size_t top_n_;
+    uint64_t graph_edges_;
+};
+
+
+// heap of the k-way merge, kept per thread
+struct NeighborMergeScratch
+{
+    struct Cursor
+    {
+        double weight;
+        uint32_t neighbor;
+        uint32_t product;
+        uint32_t position;
+    };
+    std::vector<Cursor> heap;
+};
+
+/* rank_baseline_prediction_csr answered from the cache: merges the sorted
+ * rows of the user's purchased products and keeps the first k edges. */
+void rank_cached_prediction(uint32_t user, size_t k, const UserItems& user_items, const NeighborCache& cache, NeighborMergeScratch& scratch, std::vector<uint32_t>& out);
+
+/* Prints the size of the cache next to the graph, and the time per query
+ * of the cached and the uncached baseline over every user, checking that
+ * both return the same recommendations. */
+void report_neighbor_cache(const NeighborCache& cache, const UserItems& user_items, const CsrGraph& graph, size_t k);
+
+#endif
@@ -0,0 +1,820 @@
+#include "out_of_core.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <queue>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+#include "instrument.h"
+#include "line_tokens.h"
+#include "mapped_file.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// rough bytes of memory per byte of data file while its shards are processed
+const size_t MEMORY_PER_FILE_BYTE = 4;
+
+// the split hands read pages of the data file back to the kernel in steps of this many bytes
+const size_t RELEASE_BYTES = size_t(16) << 20;
+
+// read and write buffer of every shard file
+const size_t IO_BUFFER = 1 << 16;
+
+// every kind of shard file, for the clean up
+const char* const SHARD_KINDS[] = {"products", "reviews", "user_keys", "user_ids", "asin_keys", "asin_ids",
+                                   "asin_records", "rated", "lists", "requests", "responses", "rows"};
+
+
+// FNV-1a, so the partition does not depend on the standard library
+inline uint64_t hash_key(string_view key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key)
+    {
+        hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+
+struct ShardFiles
+{
+    string directory;
+    size_t shards;
+
+    size_t shard_of(string_view key) const { return hash_key(key) % shards; }
+    string path(const char* kind, size_t shard) const { return directory + "/" + kind + "." + to_string(shard); }
+
+    void remove_all() const
+    {
+        for (const char* kind : SHARD_KINDS)
+        {
+            for (size_t shard = 0; shard < shards; shard++)
+            {
+                remove(path(kind, shard).c_str());
+            }
+        }
+    }
+};
+
+
+/* Buffered binary writer of one shard file. */
+class ShardWriter
+{
+public:
+    ShardWriter() : file_(nullptr), ok_(true), bytes_(0) {}
+    ~ShardWriter() { if (file_ != nullptr) fclose(file_); }
+
+    ShardWriter(const ShardWriter&) = delete;
+    ShardWriter& operator=(const ShardWriter&) = delete;
+
+    bool open(const string& path)
+    {
+        file_ = fopen(path.c_str(), "wb");
+        if (file_ == nullptr)
+        {
+            cerr << "could not write " << path << endl;
+            return false;
+        }
+        setvbuf(file_, nullptr, _IOFBF, IO_BUFFER);
+        path_ = path;
+        return true;
+    }
+
+    void put(const void* data, size_t size)
+    {
+        // an empty string_view may have no data pointer at all
+        if (size == 0) return;
+        ok_ = ok_ && fwrite(data, 1, size, file_) == size;
+        bytes_ += size;
+    }
+    void put_u32(uint32_t value) { put(&value, sizeof(value)); }
+    void put_f64(double value) { put(&value, sizeof(value)); }
+    void put_string(string_view text)
+    {
+        put_u32(text.size());
+        put(text.data(), text.size());
+    }
+
+    bool close()
+    {
+        bool ok = ok_ && file_ != nullptr && fclose(file_) == 0;
+        file_ = nullptr;
+        if (!ok) cerr << "could not write " << path_ << endl;
+        return ok;
+    }
+
+    uint64_t bytes() const { return bytes_; }
+
+private:
+    FILE* file_;
+    string path_;
+    bool ok_;
+    uint64_t bytes_;
+};
+
+
+/* Buffered sequential reader of one shard file. The get functions return
+ * false at the end of the file. */
+class ShardReader
+{
+public:
+    ShardReader() : file_(nullptr), buffer_(IO_BUFFER), pos_(0), size_(0) {}
+    ~ShardReader() { if (file_ != nullptr) fclose(file_); }
+
+    ShardReader(const ShardReader&) = delete;
+    ShardReader& operator=(const ShardReader&) = delete;
+
+    bool open(const string& path)
+    {
+        file_ = fopen(path.c_str(), "rb");
+        if (file_ == nullptr)
+        {
+            cerr << "could not read " << path << endl;
+            return false;
+        }
+        path_ = path;
+        return true;
+    }
+
+    bool get(void* data, size_t size)
+    {
+        char* out = static_cast<char*>(data);
+        while (size > 0)
+        {
+            if (pos_ == size_)
+            {
+                size_ = fread(buffer_.data(), 1, buffer_.size(), file_);
+                pos_ = 0;
+                if (size_ == 0) return false;
+            }
+            size_t take = min(size, size_ - pos_);
+            copy(buffer_.data() + pos_, buffer_.data() + pos_ + take, out);
+            pos_ += take;
+            out += take;
+            size -= take;
+        }
+        return true;
+    }
+    bool get_u32(uint32_t& value) { return get(&value, sizeof(value)); }
+    bool get_f64(double& value) { return get(&value, sizeof(value)); }
+    bool get_string(string& text)
+    {
+        uint32_t size;
+        if (!get_u32(size)) return false;
+        text.resize(size);
+        return get(&text[0], size);
+    }
+
+    /* True unless a read failed, reported on stderr. */
+    bool close()
+    {
+        bool ok = file_ != nullptr && ferror(file_) == 0;
+        if (file_ != nullptr) fclose(file_);
+        file_ = nullptr;
+        if (!ok) cerr << "could not read " << path_ << endl;
+        return ok;
+    }
+
+private:
+    FILE* file_;
+    string path_;
+    vector<char> buffer_;
+    size_t pos_;
+    size_t size_;
+};
+
+
+bool open_writers(const ShardFiles& files, const char* kind, vector<ShardWriter>& writers)
+{
+    for (size_t shard = 0; shard < writers.size(); shard++)
+    {
+        if (!writers[shard].open(files.path(kind, shard))) return false;
+    }
+    return true;
+}
+
+
+bool close_writers(vector<ShardWriter>& writers, OutOfCoreStats& stats)
+{
+    bool ok = true;
+    for (ShardWriter& writer : writers)
+    {
+        ok = writer.close() && ok;
+        stats.bytes_written += writer.bytes();
+    }
+    return ok;
+}
+
+
+/* Reads a whole keys file (sorted strings) with its ids file. */
+bool load_keys(const ShardFiles& files, const char* keys_kind, const char* ids_kind, size_t shard, vector<string>& keys, vector<uint32_t>& ids)
+{
+    keys.clear();
+    ids.clear();
+    ShardReader key_reader, id_reader;
+    if (!key_reader.open(files.path(keys_kind, shard)) || !id_reader.open(files.path(ids_kind, shard))) return false;
+    string key;
+    uint32_t id;
+    while (key_reader.get_string(key) && id_reader.get_u32(id))
+    {
+        keys.push_back(key);
+        ids.push_back(id);
+    }
+    return key_reader.close() && id_reader.close();
+}
+
+
+// index of key in the sorted keys, or NO_ID
+inline uint32_t find_key(const vector<string>& keys, const string& key)
+{
+    auto found = lower_bound(keys.begin(), keys.end(), key);
+    return found != keys.end() && *found == key ? found - keys.begin() : NO_ID;
+}
+
+
+/* Reviewer lists of the products of one shard, in key (= id) order: user
+ * ids ascending and 1/degree of each user. */
+struct ReviewerLists
+{
+    vector<uint32_t> ids;
+    vector<uint64_t> offsets;
+    vector<uint32_t> users;
+    vector<double> inverse_degree;
+};
+
+
+bool load_lists(const ShardFiles& files, size_t shard, ReviewerLists& lists)
+{
+    lists.ids.clear();
+    lists.offsets.assign(1, 0);
+    lists.users.clear();
+    lists.inverse_degree.clear();
+
+    ShardReader reader;
+    if (!reader.open(files.path("lists", shard))) return false;
+    uint32_t id, count;
+    while (reader.get_u32(id) && reader.get_u32(count))
+    {
+        lists.ids.push_back(id);
+        lists.users.resize(lists.users.size() + count);
+        lists.inverse_degree.resize(lists.inverse_degree.size() + count);
+        reader.get(lists.users.data() + lists.offsets.back(), count * sizeof(uint32_t));
+        reader.get(lists.inverse_degree.data() + lists.offsets.back(), count * sizeof(double));
+        lists.offsets.push_back(lists.users.size());
+    }
+    return reader.close();
+}
+
+
+/* Reads the data file once, the way parse_chunk walks it, and writes every
+ * product record (asin, record number and similar: asins) to the shard of
+ * its asin and every review as (user, asin, record number) to the shard of
+ * the user. */
+bool split_data_file(const MappedFile& file, const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("split_data_file");
+    vector<ShardWriter> products(files.shards), reviews(files.shards);
+    if (!open_writers(files, "products", products) || !open_writers(files, "reviews", reviews))
+    {
+        return false;
+    }
+
+    string_view asin;
+    vector<string_view> similar, users;
+    auto flush = [&]()
+    {
+        ShardWriter& product = products[files.shard_of(asin)];
+        product.put_string(asin);
+        product.put_u32(stats.records);
+        product.put_u32(similar.size());
+        for (string_view entry : similar) product.put_string(entry);
+        for (string_view user : users)
+        {
+            ShardWriter& review = reviews[files.shard_of(user)];
+            review.put_string(user);
+            review.put_string(asin);
+            review.put_u32(stats.records);
+        }
+        stats.records++;
+        asin = string_view();
+        similar.clear();
+        users.clear();
+    };
+
+    LineTokens tokens;
+    const char* pos = file.data();
+    const char* end = pos + file.size();
+    const char* released = pos;
+    size_t page = sysconf(_SC_PAGESIZE);
+    while (pos < end)
+    {
+        const char* line = pos;
+        const char* eol = line_end(pos, end);
+        pos = eol < end ? eol + 1 : end;
+
+        // blank lines terminate a product record
+        if (eol - line <= 1)
+        {
+            flush();
+
+            /* nothing before pos is referenced any more. the pages are clean,
+             * so dropping them only keeps them from counting as resident. */
+            if (size_t(pos - released) >= RELEASE_BYTES)
+            {
+                const char* until = file.data() + size_t(pos - file.data()) / page * page;
+                madvise(const_cast<char*>(released), until - released, MADV_DONTNEED);
+                released = until;
+            }
+            continue;
+        }
+
+        tokenize(line, eol, tokens);
+        if (tokens.count == 0) continue;
+
+        string_view first = tokens.token[0];
+        if (first == ASIN && tokens.count > 1)
+        {
+            asin = tokens.token[1];
+        }
+        else if (first == SIMILAR && tokens.count > 1 && to_int(tokens.token[1]) > 0)
+        {
+            const char* similar_pos = tokens.token[1].data() + tokens.token[1].size();
+            for (string_view entry = next_token(similar_pos, eol); !entry.empty(); entry = next_token(similar_pos, eol))
+            {
+                similar.push_back(entry);
+            }
+        }
+        else if ((starts_with(first, '1') || starts_with(first, '2')) && tokens.count > 6)
+        {
+            users.push_back(tokens.token[2]);
+        }
+    }
+    // the record still open at the end of the file is kept, as in parse_chunk
+    flush();
+
+    return close_writers(products, stats) && close_writers(reviews, stats);
+}
+
+
+/* Sorts the (user, asin) pairs of every user shard, drops repeats (a user
+ * buys a product once however many reviews they wrote, the pair keeps the
+ * last record it came from), writes them back and writes the distinct
+ * users as the shard's keys. */
+bool sort_reviews(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("sort_reviews");
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        vector< tuple<string, string, uint32_t> > pairs;
+        ShardReader reader;
+        if (!reader.open(files.path("reviews", shard))) return false;
+        string user, asin;
+        uint32_t record;
+        while (reader.get_string(user) && reader.get_string(asin) && reader.get_u32(record))
+        {
+            pairs.emplace_back(user, asin, record);
+        }
+        if (!reader.close()) return false;
+
+        sort(pairs.begin(), pairs.end());
+        auto same_pair = [](const tuple<string, string, uint32_t>& a, const tuple<string, string, uint32_t>& b)
+        {
+            return get<0>(a) == get<0>(b) && get<1>(a) == get<1>(b);
+        };
+        size_t kept = 0;
+        for (size_t i = 0; i < pairs.size(); i++)
+        {
+            if (i + 1 < pairs.size() && same_pair(pairs[i], pairs[i + 1])) continue;
+            swap(pairs[kept++], pairs[i]);
+        }
+        pairs.resize(kept);
+
+        vector<ShardWriter> out(2);
+        if (!out[0].open(files.path("reviews", shard)) || !out[1].open(files.path("user_keys", shard))) return false;
+        for (size_t i = 0; i < pairs.size(); i++)
+        {
+            out[0].put_string(get<0>(pairs[i]));
+            out[0].put_string(get<1>(pairs[i]));
+            out[0].put_u32(get<2>(pairs[i]));
+            if (i == 0 || get<0>(pairs[i]) != get<0>(pairs[i - 1])) out[1].put_string(get<0>(pairs[i]));
+        }
+        if (!close_writers(out, stats)) return false;
+        stats.purchases += pairs.size();
+    }
+    return true;
+}
+
+
+/* Hands out ids in string order over the sorted keys of all shards, with a
+ * k-way merge that holds one key per shard. A key lives in exactly one
+ * shard. The id of every key is written to ids_kind, in key order. */
+bool assign_ids(const ShardFiles& files, const char* keys_kind, const char* ids_kind, size_t& count, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("assign_ids");
+    vector<ShardReader> readers(files.shards);
+    vector<ShardWriter> writers(files.shards);
+    if (!open_writers(files, ids_kind, writers)) return false;
+
+    typedef pair<string, size_t> Head;   // (key, shard)
+    priority_queue< Head, vector<Head>, greater<Head> > heads;
+    string key;
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        if (!readers[shard].open(files.path(keys_kind, shard))) return false;
+        if (readers[shard].get_string(key)) heads.emplace(key, shard);
+    }
+
+    count = 0;
+    while (!heads.empty())
+    {
+        size_t shard = heads.top().second;
+        heads.pop();
+        writers[shard].put_u32(count++);
+        if (readers[shard].get_string(key)) heads.emplace(key, shard);
+    }
+
+    bool ok = close_writers(writers, stats);
+    for (ShardReader& reader : readers)
+    {
+        ok = reader.close() && ok;
+    }
+    return ok;
+}
+
+
+/* Walks the sorted pairs of every user shard next to the user ids and sends
+ * (asin, user id, 1/degree, record number) to the shard of the asin. */
+bool send_degrees(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("send_degrees");
+    vector<ShardWriter> rated(files.shards);
+    if (!open_writers(files, "rated", rated)) return false;
+
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        ShardReader pairs, ids;
+        if (!pairs.open(files.path("reviews", shard)) || !ids.open(files.path("user_ids", shard))) return false;
+
+        string user, asin, current;
+        uint32_t record;
+        vector< pair<string, uint32_t> > bought;
+        auto send = [&]()
+        {
+            uint32_t id = 0;
+            ids.get_u32(id);
+            double inverse_degree = 1.0 / double(bought.size());
+            for (const pair<string, uint32_t>& product : bought)
+            {
+                ShardWriter& out = rated[files.shard_of(product.first)];
+                out.put_string(product.first);
+                out.put_u32(id);
+                out.put_f64(inverse_degree);
+                out.put_u32(product.second);
+            }
+            bought.clear();
+        };
+
+        while (pairs.get_string(user) && pairs.get_string(asin) && pairs.get_u32(record))
+        {
+            if (user != current && !bought.empty()) send();
+            current = user;
+            bought.emplace_back(asin, record);
+        }
+        if (!bought.empty()) send();
+        if (!pairs.close() || !ids.close()) return false;
+    }
+    return close_writers(rated, stats);
+}
+
+
+/* Keeps the last record of every asin in each product shard (a repeated
+ * asin replaces the earlier record, as in merge_chunks), writes the kept
+ * records back in asin order, the asins as the shard's keys and the record
+ * number of every key. */
+bool sort_products(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("sort_products");
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        // (asin, record number, similar: asins)
+        vector< tuple<string, uint32_t, vector<string> > > records;
+        ShardReader reader;
+        if (!reader.open(files.path("products", shard))) return false;
+        string asin;
+        uint32_t record, count;
+        while (reader.get_string(asin) && reader.get_u32(record) && reader.get_u32(count))
+        {
+            records.emplace_back(asin, record, vector<string>(count));
+            for (string& entry : get<2>(records.back())) reader.get_string(entry);
+        }
+        if (!reader.close()) return false;
+
+        stable_sort(records.begin(), records.end(), [](const tuple<string, uint32_t, vector<string> >& a, const tuple<string, uint32_t, vector<string> >& b)
+        {
+            return get<0>(a) < get<0>(b);
+        });
+
+        vector<ShardWriter> out(3);
+        if (!out[0].open(files.path("products", shard)) || !out[1].open(files.path("asin_keys", shard))
+            || !out[2].open(files.path("asin_records", shard))) return false;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            if (i + 1 < records.size() && get<0>(records[i + 1]) == get<0>(records[i])) continue;
+            out[0].put_string(get<0>(records[i]));
+            out[0].put_u32(get<2>(records[i]).size());
+            for (const string& entry : get<2>(records[i])) out[0].put_string(entry);
+            out[1].put_string(get<0>(records[i]));
+            out[2].put_u32(get<1>(records[i]));
+        }
+        if (!close_writers(out, stats)) return false;
+    }
+    return true;
+}
+
+
+/* Collects the reviewer list of every product of a shard from the rated
+ * pairs of its kept record (the reviews of a replaced record count towards
+ * the degrees only, as in the review maps), and sends each similar: entry
+ * of its products to the shard of the similar asin as (asin, product id,
+ * asking shard). */
+bool build_reviewer_lists(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("build_reviewer_lists");
+    vector<ShardWriter> requests(files.shards);
+    if (!open_writers(files, "requests", requests)) return false;
+
+    vector<string> keys;
+    vector<uint32_t> ids;
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        if (!load_keys(files, "asin_keys", "asin_ids", shard, keys, ids)) return false;
+        ShardReader kept;
+        if (!kept.open(files.path("asin_records", shard))) return false;
+        vector<uint32_t> kept_record(keys.size());
+        for (uint32_t& record : kept_record) kept.get_u32(record);
+        if (!kept.close()) return false;
+
+        // (local product, user id, 1/degree)
+        vector< tuple<uint32_t, uint32_t, double> > reviewers;
+        ShardReader rated;
+        if (!rated.open(files.path("rated", shard))) return false;
+        string asin;
+        uint32_t user, record;
+        double inverse_degree;
+        while (rated.get_string(asin) && rated.get_u32(user) && rated.get_f64(inverse_degree) && rated.get_u32(record))
+        {
+            uint32_t local = find_key(keys, asin);
+            if (local != NO_ID && record == kept_record[local]) reviewers.emplace_back(local, user, inverse_degree);
+        }
+        if (!rated.close()) return false;
+        sort(reviewers.begin(), reviewers.end());
+
+        vector<ShardWriter> lists(1);
+        if (!lists[0].open(files.path("lists", shard))) return false;
+        size_t r = 0;
+        for (uint32_t local = 0; local < keys.size(); local++)
+        {
+            size_t first = r;
+            while (r < reviewers.size() && get<0>(reviewers[r]) == local) r++;
+            lists[0].put_u32(ids[local]);
+            lists[0].put_u32(r - first);
+            for (size_t i = first; i < r; i++) lists[0].put_u32(get<1>(reviewers[i]));
+            for (size_t i = first; i < r; i++) lists[0].put_f64(get<2>(reviewers[i]));
+        }
+        if (!close_writers(lists, stats)) return false;
+
+        ShardReader products;
+        if (!products.open(files.path("products", shard))) return false;
+        uint32_t count;
+        string entry;
+        for (uint32_t local = 0; products.get_string(asin) && products.get_u32(count); local++)
+        {
+            for (uint32_t s = 0; s < count && products.get_string(entry); s++)
+            {
+                ShardWriter& out = requests[files.shard_of(entry)];
+                out.put_string(entry);
+                out.put_u32(ids[local]);
+                out.put_u32(shard);
+            }
+        }
+        if (!products.close()) return false;
+    }
+    return close_writers(requests, stats);
+}
+
+
+/* Answers the requests sent to each shard: a similar asin that is a known
+ * product goes back to the asking shard as (product id, neighbor id,
+ * neighbor's reviewer list); unknown asins are dropped, as in
+ * build_similar_lists. */
+bool answer_requests(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("answer_requests");
+    vector<ShardWriter> responses(files.shards);
+    if (!open_writers(files, "responses", responses)) return false;
+
+    vector<string> keys;
+    vector<uint32_t> ids;
+    ReviewerLists lists;
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        if (!load_keys(files, "asin_keys", "asin_ids", shard, keys, ids) || !load_lists(files, shard, lists)) return false;
+
+        ShardReader requests;
+        if (!requests.open(files.path("requests", shard))) return false;
+        string asin;
+        uint32_t product, asking;
+        while (requests.get_string(asin) && requests.get_u32(product) && requests.get_u32(asking))
+        {
+            uint32_t local = find_key(keys, asin);
+            if (local == NO_ID || asking >= files.shards) continue;
+
+            uint64_t first = lists.offsets[local];
+            uint32_t count = lists.offsets[local + 1] - first;
+            ShardWriter& out = responses[asking];
+            out.put_u32(product);
+            out.put_u32(lists.ids[local]);
+            out.put_u32(count);
+            out.put(lists.users.data() + first, count * sizeof(uint32_t));
+            out.put(lists.inverse_degree.data() + first, count * sizeof(double));
+        }
+        if (!requests.close()) return false;
+    }
+    return close_writers(responses, stats);
+}
+
+
+/* Weighs the edges of every shard's products from the answered requests,
+ * as indexed_edge_weight does, and writes them as sorted (product,
+ * neighbor, weight) rows with repeats dropped (CsrGraph::append_row). */
+bool weigh_edges(const ShardFiles& files, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("weigh_edges");
+    ReviewerLists lists;
+    vector<uint32_t> users;
+    vector<double> inverse_degree;
+    for (size_t shard = 0; shard < files.shards; shard++)
+    {
+        if (!load_lists(files, shard, lists)) return false;
+
+        vector< tuple<uint32_t, uint32_t, double> > edges;
+        ShardReader responses;
+        if (!responses.open(files.path("responses", shard))) return false;
+        uint32_t product, neighbor, o_j;
+        while (responses.get_u32(product) && responses.get_u32(neighbor) && responses.get_u32(o_j))
+        {
+            users.resize(o_j);
+            inverse_degree.resize(o_j);
+            responses.get(users.data(), o_j * sizeof(uint32_t));
+            responses.get(inverse_degree.data(), o_j * sizeof(double));
+
+            auto found = lower_bound(lists.ids.begin(), lists.ids.end(), product);
+            if (found == lists.ids.end() || *found != product) continue;
+            size_t local = found - lists.ids.begin();
+
+            // sum of 1/degree over the common reviewers, in ascending user order
+            double weight = 0;
+            if (o_j != 0)
+            {
+                double score = 0;
+                uint64_t i = lists.offsets[local], i_end = lists.offsets[local + 1];
+                size_t j = 0;
+                while (i < i_end && j < o_j)
+                {
+                    if (lists.users[i] < users[j])
+                    {
+                        i++;
+                    }
+                    else if (users[j] < lists.users[i])
+                    {
+                        j++;
+                    }
+                    else
+                    {
+                        score += lists.inverse_degree[i];
+                        i++;
+                        j++;
+                    }
+                }
+                weight = (1.0 / double(o_j)) * score;
+            }
+            edges.emplace_back(product, neighbor, weight);
+        }
+        if (!responses.close()) return false;
+
+        sort(edges.begin(), edges.end());
+        edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+        vector<ShardWriter> rows(1);
+        if (!rows[0].open(files.path("rows", shard))) return false;
+        for (auto& edge : edges)
+        {
+            rows[0].put_u32(get<0>(edge));
+            rows[0].put_u32(get<1>(edge));
+            rows[0].put_f64(get<2>(edge));
+        }
+        if (!close_writers(rows, stats)) return false;
+    }
+    return true;
+}
+
+
+/* Reads the rows of all shards into the graph, counting the degrees in a
+ * first pass. Every product's row is in one shard, sorted by neighbor. */
+bool assemble_graph(const ShardFiles& files, size_t num_products, CsrGraph& graph)
+{
+    INSTRUMENT_SCOPE("assemble_graph");
+    graph.offsets.assign(num_products + 1, 0);
+    vector<uint64_t> cursor;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            for (size_t product = 0; product < num_products; product++)
+            {
+                graph.offsets[product + 1] += graph.offsets[product];
+            }
+            graph.neighbors.resize(graph.offsets[num_products]);
+            graph.weights.resize(graph.offsets[num_products]);
+            cursor.assign(graph.offsets.begin(), graph.offsets.end() - 1);
+        }
+
+        for (size_t shard = 0; shard < files.shards; shard++)
+        {
+            ShardReader rows;
+            if (!rows.open(files.path("rows", shard))) return false;
+            uint32_t product, neighbor;
+            double weight;
+            while (rows.get_u32(product) && rows.get_u32(neighbor) && rows.get_f64(weight))
+            {
+                if (product >= num_products) continue;
+                if (pass == 0)
+                {
+                    graph.offsets[product + 1]++;
+                }
+                else
+                {
+                    graph.neighbors[cursor[product]] = neighbor;
+                    graph.weights[cursor[product]++] = weight;
+                }
+            }
+            if (!rows.close()) return false;
+        }
+    }
+    return true;
+}
+
+}
+
+
+bool build_product_graph_out_of_core(const string& data_file, const OutOfCoreOptions& options, CsrGraph& graph, OutOfCoreStats& stats)
+{
+    INSTRUMENT_SCOPE("build_product_graph_out_of_core");
+    Stopwatch timer;
+    stats = OutOfCoreStats();
+
+    MappedFile file;
+    if (!file.open(data_file))
+    {
+        cerr << "could not open " << data_file << endl;
+        return false;
+    }
+    if (mkdir(options.directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cerr << "could not create " << options.directory << endl;
+        return false;
+    }
+
+    size_t budget = max<size_t>(1, options.memory_budget);
+    stats.shards = options.shards > 0 ? options.shards : max<size_t>(1, (file.size() * MEMORY_PER_FILE_BYTE + budget - 1) / budget);
+    ShardFiles files{options.directory, stats.shards};
+
+    bool ok = split_data_file(file, files, stats);
+    file.close();
+
+    ok = ok && sort_reviews(files, stats)
+            && assign_ids(files, "user_keys", "user_ids", stats.users, stats)
+            && send_degrees(files, stats)
+            && sort_products(files, stats)
+            && assign_ids(files, "asin_keys", "asin_ids", stats.products, stats)
+            && build_reviewer_lists(files, stats)
+            && answer_requests(files, stats)
+            && weigh_edges(files, stats)
+            && assemble_graph(files, stats.products, graph);
+
+    files.remove_all();
+    stats.edges = graph.num_edges();
+    stats.seconds = timer.elapsed_seconds();
+    return ok;
+}
@@ -0,0 +1,56 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "csr_graph.h"
+
+
+struct OutOfCoreOptions
+{
+    std::string directory;                      // where the shard files go, created if missing
+    size_t memory_budget = size_t(256) << 20;   // bytes one shard may take up while it is processed
+    size_t shards = 0;                          // 0: enough for the budget, estimated from the file size
+};
+
+
+struct OutOfCoreStats
+{
+    size_t shards = 0;
+    size_t records = 0;              // product records in the file, repeated asins included
+    size_t products = 0;
+    size_t users = 0;
+    uint64_t purchases = 0;          // distinct (user, product) pairs
+    uint64_t edges = 0;
+    uint64_t bytes_written = 0;      // shard and exchange files, all passes
+    double seconds = 0;
+};
+
+
+/* Builds the product graph of the data file without loading it: the same
+ * graph (ids in asin order, bit-identical weights) as parse_file_mapped,
+ * build_id_index and make_product_graph_parallel, with no test purchases
+ * removed. The file is read once and split into shards by a hash of the
+ * asin (product records) and of the user id (review lines). Each later
+ * pass holds one shard at a time:
+ *
+ *   users     sort a shard's (user, asin) pairs, which gives the degrees
+ *   ids       k-way merge of the sorted shard keys hands out user and
+ *             product ids in string order, as build_id_index does
+ *   reviews   (asin, user id, 1/degree) go to the shard of the asin, which
+ *             builds the sorted reviewer list of each of its products from
+ *             the reviews of the record it kept
+ *   requests  every similar: entry goes to the shard of the similar asin
+ *   responses that shard resolves the asin and sends the product's id and
+ *             reviewer list back to the shard of the asking product
+ *   rows      which weighs the edge like scoreUsersWhoPurchasedBothProducts
+ *
+ * Only the finished graph has to fit in memory. Intermediate files are
+ * removed before returning. Returns false (naming the culprit on stderr)
+ * if the data file cannot be read or a shard file cannot be written or
+ * read back. */
+bool build_product_graph_out_of_core(const std::string& data_file, const OutOfCoreOptions& options, CsrGraph& graph, OutOfCoreStats& stats);
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+
+/* Number of hardware threads, at least 1. */
+inline unsigned hardware_threads()
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+
+/* Calls body(index, thread_id) for every index in [0, count) using up to
+ * `threads` threads. Indices are handed out one at a time from a shared
+ * counter, so uneven work items balance themselves. thread_id is in
+ * [0, threads) and can be used to pick per-thread scratch space. The
+ * calling thread takes part as thread 0. */
+template <typename Body>
+void parallel_for(size_t count, unsigned threads, Body body)
+{
+    threads = std::max(1u, std::min<unsigned>(threads, count));
+    if (threads == 1)
+    {
+        for (size_t i = 0; i < count; i++) body(i, 0u);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](unsigned thread_id)
+    {
+        for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+        {
+            body(i, thread_id);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+    {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+}
+
+
+/* Builds a compressed sparse row array in parallel. row(r, thread_id, out)
+ * appends the entries of row r to out. Rows are handed out in fixed size
+ * blocks to whichever thread is free; each thread appends to its own
+ * buffer, so no locking is needed. Afterwards the row lengths are prefix
+ * summed into offsets and every block is copied from its thread's buffer to
+ * its final position. The result is the same as running the rows in order
+ * on one thread. */
+template <typename T, typename Row>
+void parallel_csr(size_t num_rows, unsigned threads, Row row, std::vector<uint64_t>& offsets, std::vector<T>& values)
+{
+    const size_t ROWS_PER_BLOCK = 256;
+    size_t num_blocks = (num_rows + ROWS_PER_BLOCK - 1) / ROWS_PER_BLOCK;
+    threads = std::max(1u, std::min<unsigned>(threads, num_blocks));
+
+    std::vector< std::vector<T> > buffers(threads);
+    std::vector<unsigned> block_thread(num_blocks);
+    std::vector<size_t> block_start(num_blocks);
+    offsets.assign(num_rows + 1, 0);
+
+    parallel_for(num_blocks, threads, [&](size_t block, unsigned thread_id)
+    {
+        std::vector<T>& out = buffers[thread_id];
+        block_thread[block] = thread_id;
+        block_start[block] = out.size();
+
+        size_t last = std::min(num_rows, (block + 1) * ROWS_PER_BLOCK);
+        for (size_t r = block * ROWS_PER_BLOCK; r < last; r++)
+        {
+            size_t before = out.size();
+            row(r, thread_id, out);
+            offsets[r + 1] = out.size() - before;
+        }
+    });
+
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        offsets[r + 1] += offsets[r];
+    }
+
+    values.resize(offsets[num_rows]);
+    parallel_for(num_blocks, threads, [&](size_t block, unsigned)
+    {
+        size_t first = block * ROWS_PER_BLOCK;
+        size_t last = std::min(num_rows, first + ROWS_PER_BLOCK);
+        const T* source = buffers[block_thread[block]].data() + block_start[block];
+        std::copy(source, source + (offsets[last] - offsets[first]), values.begin() + offsets[first]);
+    });
+}
+
+#endif
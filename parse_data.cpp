@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <iostream>
@@ -11,194 +13,1456 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 
+#include "arena_dataset.h"
+#include "category_index.h"
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "embeddings.h"
+#include "evaluation.h"
+#include "fast_parser.h"
+#include "gzip_ingest.h"
+#include "id_index.h"
+#include "incremental.h"
+#include "instrument.h"
+#include "item_similarity.h"
+#include "model.h"
+#include "neighbor_cache.h"
+#include "out_of_core.h"
+#include "parallel.h"
+#include "parse_data.h"
+#include "ppr.h"
+#include "reorder.h"
+#include "review_columns.h"
+#include "scoring_policies.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stopwatch.h"
+#include "topk.h"
+#include "user_graph.h"
+
 
 using namespace std;
 
-const string ASIN = "ASIN:";
-const string GROUP = "group:";
-const string ID = "Id:";
-const string REVIEW = "reviews:";
-const string SALESRANK = "salesrank:";
-const string SIMILAR = "similar:";
-const string TITLE = "title:";
 
+// command line options
+struct Options
+{
+    string data_file = "amazon-large.txt";  // SNAP amazon-meta formatted input
+    string parser = "mmap";                 // "mmap" (parse_file_mapped) or "legacy" (parse_file)
+    bool compare_parsers = false;           // time both parsers on data_file and exit
+    bool parse_scaling = false;             // time the mmap parser from 1 to `threads` threads and exit
+    bool arena_report = false;              // compare the Product* and arena layouts and exit
+    bool gzip_report = false;               // time sequential against pipelined gzip ingest and exit
+    GzipIngestOptions gzip_options;         // ring buffers of the gzip loader, used for .gz data files
+    unsigned threads = hardware_threads();  // worker threads for the parallel stages
+    string snapshot;                        // load this binary snapshot instead of parsing data_file
+    string write_snapshot;                  // write a snapshot of the parsed data here
+    string compare_snapshot;                // check this snapshot against data_file and exit
+    string graph = "csr";                   // product graph layout: "csr" or "map" (map of sets)
+    bool graph_report = false;              // compare memory and scan speed of both layouts
+    string weights = "indexed";             // csr edge weights: "indexed" (reviewer index) or "legacy"
+    bool compare_weights = false;           // build the csr graph both ways and compare
+    bool graph_scaling = false;             // time the parallel graph build from 1 to `threads` threads
+    string predictor = "baseline";          // csr predictor: "baseline", "topk", "ppr" or "embedding"
+    size_t k = NUMBER_IN_RECOMMENTATION_SET;  // recommendations per user, for every predictor and the evaluation
+    string recommend_all;                   // write top k recommendations for every user here
+    size_t load_test = 0;                   // queries per thread for the concurrent load test
+    ServerOptions server_options;           // --serve: port (0: no server) and batching of the query server
+    LoadClientOptions client_options;       // --load-client: port (0: not a client) and load of the test client
+    bool user_graph = false;                // build the user co-review graph
+    bool compare_user_graph = false;        // check it against group_user_co_reviews (small files only)
+    UserGraphOptions user_graph_options;    // memory budget and reviewer cap of the user graph
+    double holdout = 0;                     // percent of purchases held out by split_holdout (0: extractTestSet)
+    uint32_t seed = 224;                    // seed of the holdout split
+    bool evaluate = false;                  // print hit rate, precision, recall and MRR as JSON
+    string eval_json;                       // also write the evaluation JSON here
+    PprOptions ppr_options;                 // settings of the ppr predictor
+    bool incremental_bench = false;         // time incremental graph updates against a rebuild
+    string write_neighbor_cache;            // write each product's top neighbors here
+    string neighbor_cache;                  // serve the baseline predictor from this neighbor cache
+    size_t neighbor_top = 32;               // neighbors kept per product in a written cache
+    bool item_similarity = false;           // replace the product graph by reviewer set similarity
+    bool similarity_report = false;         // benchmark the item similarity kernels
+    string scoring;                         // rebuild the edge weights and topk ranking with this scoring pipeline
+    bool scoring_report = false;            // time every scoring pipeline against a virtual dispatch version
+    string reorder;                         // baseline and topk: run on product and user ids relabelled by "degree" or "rcm"
+    bool reorder_report = false;            // cache misses and throughput with and without reordering
+    ItemSimilarityOptions similarity_options;  // measure, kernel and neighbors of the similarity graph
+    vector<string> filter_groups;           // topk: only recommend products of these groups
+    vector<string> filter_categories;       // topk: only recommend products in these categories
+    vector<string> boost_categories;        // topk: multiply the score of products in these categories
+    double category_boost = 2;              // by this factor
+    bool category_report = false;           // time filtered against unfiltered topk queries
+    EmbeddingOptions embedding_options;     // bpr training and ivf search of the embedding predictor
+    bool embedding_report = false;          // ivf recall and latency against exact search
+    ReviewWeighting review_weighting;       // baseline: weigh purchases by the recency and rating of their reviews
+    bool review_report = false;             // compare memory and scan speed of review maps and columns
+    string out_of_core;                     // build the product graph out of core, shards in this directory, and exit
+    OutOfCoreOptions out_of_core_options;   // memory budget and shard count of the out of core build
+    bool compare_out_of_core = false;       // check the out of core graph against the in memory build
+    bool bench = false;                     // print stage times, peak memory and sizes as JSON
+    string bench_json;                      // also write the benchmark JSON here
+};
+
+bool parse_options(int argc, char* argv[], Options& options);
+int compare_parsers(const Options& options);
+int parse_scaling(const Options& options);
+int compare_snapshot(const Options& options);
+int out_of_core(const Options& options);
+bool load_data(const Options& options, ParsedData& data);
+bool compare_user_graph(const UserGraph& graph, const IdIndex& ids, ParsedData& data);
+bool finish_bench(const Options& options, const BenchReport& bench);
+
+
+int main(int argc, char* argv[])
+{   
+    // make sure the random numbers are really random
+    // srand(time(NULL));
+
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        return 1;
+    }
+
+    if (options.compare_parsers)
+    {
+        return compare_parsers(options);
+    }
+    if (options.parse_scaling)
+    {
+        return parse_scaling(options);
+    }
+    if (!options.compare_snapshot.empty())
+    {
+        return compare_snapshot(options);
+    }
+    if (options.arena_report)
+    {
+        report_arena_layout(options.data_file, options.threads);
+        return 0;
+    }
+    if (options.gzip_report)
+    {
+        report_gzip_ingest(options.data_file, options.threads, options.gzip_options);
+        return 0;
+    }
+    if (!options.out_of_core.empty())
+    {
+        return out_of_core(options);
+    }
+    if (options.client_options.port != 0)
+    {
+        options.client_options.k = options.k;
+        return run_load_client(options.client_options) ? 0 : 1;
+    }
+
+    /* parse the data file (makes the product-product graphs), the next two 
+     * functions make the user-user graph. using the amazon-small.txt file for 
+     * now since the other one is huge. feel free to use the regular datafile. */
+    BenchReport bench;
+    bench.data_file = options.snapshot.empty() ? options.data_file : options.snapshot;
+    bench.threads = options.threads;
+    Stopwatch stage_timer;
+
+    ParsedData data;
+    if (!load_data(options, data))
+    {
+        return 1;
+    }
+    bench.stage("parse", stage_timer.elapsed_seconds());
 
-// review information
-typedef struct {
-    string date;        // date that the review was created
-    int helpful;        // number of people who found the review helpful
-    int rating;         // number of stars given to product by this rating (1-5)
-    int votes;          // number of people who voted on if the review was helpful
-    string product_id;  // product ID
-} Review;
+    /* asin_to_product
+        key = (string) amazon product id
+        value = (Product*) product object */
+    map<string, Product*>& asin_to_product = data.asin_to_product;
 
+    /* user_co_reviews
+        key = pair (userid1, userid2)
+        value = (set) product objects that both users have reviewed */
+    map<pair<int, int>, set<Product*> > user_co_reviews = map<pair<int, int>, set<Product*> >();
 
-// product information
-typedef struct {
-    string asin;                    // amazon product ID
-    double avg_rating;              // average star rating from all of the reviews
-    vector<string>* categories;     // categorization of the product
-    int downloaded_reviews;         // number of reviews of the product that are captured in the dataset
-    string group;                   // major category (books, music, etc.)
-    int id;                         // index in the database (probably not useful)
-    map<string, Review*>* reviews;  // map of amazon user id -> review struct
-    int salesrank;                  // amazon salesrank score
-    vector<string>* similar;        // co-purchased product asins
-    string title;                   // name of the item
-    int total_reviews;              // number of total product reviews, usually equal to downloaded_reviews
-} Product;
+    /* user_graph
+        key = (int) user node
+        value = pair (userid2, edge weight) */
+    map<int, set< pair<int, int>> > user_graph = map<int, set< pair<int, int>> >();
+
+    /* product_graph
+        key = product asin
+        value = pair (product asin2, edge weight) */
+    map<string, set< pair<string, double>> > product_graph = map<string, set< pair<string, double>> >();
+
+    /* users_to_products
+        key = username
+        value = set of products user has purchased */
+    map< string, set< string > >& users_to_products = data.users_to_products;
+
+    
+    int& num_purchases = data.num_purchases;
+    vector<string>& user_vector = data.user_vector;
+
+    /* ids
+        dense product and user ids, in asin / user id order */
+    IdIndex ids;
+    stage_timer.reset();
+    build_id_index(asin_to_product, users_to_products, ids);
+    bench.stage("ids", stage_timer.elapsed_seconds());
+
+    // int count = 0;
+    // for (auto it = users_to_products.begin(); it != users_to_products.end(); ++it)
+    // {
+    //     if (count++ == 5000) break;
+    //     cout << it->first << ":" << endl;
+    //     if (it->second.size() > 1)
+    //     {
+    //         for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2)
+    //         {
+    //             cout << '\t' << *it2 << endl;
+    //         }
+    //     }
+    // }
+    cout << "A12N9YU5K516JF: " << users_to_products["A12N9YU5K516JF"].size() << endl;
+
+    /* These graphs aren't used to make the baseline predictions so we aren't
+     * creating them right now. --user-graph builds the co-review graph with
+     * build_user_graph, which scales to the large file. */
+    // group_user_co_reviews(user_co_reviews, asin_to_product, data.user_to_nodeid);
+    // make_user_graph(data.user_to_nodeid, user_co_reviews, user_graph);
+
+    cout << "asin_to_product: " << asin_to_product.size() << endl;
+
+    // // these two should be the same size
+    // cout << "user_to_nodeid: " << data.user_to_nodeid.size() << endl;
+    // cout << "nodeid_to_user: " << data.nodeid_to_user.size() << endl;
+
+    /* we're not using these one right now */
+    // cout << "user_co_reviews: " << user_co_reviews.size() << endl;
+    // cout << "user_graph: " << user_graph.size() << endl;
+
+    /* roughly 1/10 purchases will be in the test set. this will allow us to 
+     * evaluate the performance of the baseline predictor as well as the one
+     * we are creating. the test set items are (string) user id, (string) asin.*/
+    cout << "making test set" << endl;
+    stage_timer.reset();
+    set< pair<string, string> > test_set = set< pair<string, string> >();
+    vector<TestPurchase> tests;
+    if (options.holdout > 0)
+    {
+        Stopwatch timer;
+        UserItems all_items;
+        build_user_items(ids, users_to_products, all_items);
+        split_holdout(all_items, options.holdout / 100.0, options.seed, tests);
+        remove_test_purchases(tests, ids, users_to_products, asin_to_product, test_set);
+        cout << "held out " << tests.size() << " purchases (seed " << options.seed << ") in " << timer.elapsed_seconds() << "s" << endl;
+    }
+    else
+    {
+        extractTestSet(num_purchases, user_vector, users_to_products, test_set, asin_to_product);
+        test_purchases_from_set(test_set, ids, tests);
+    }
+    bench.stage("test_set", stage_timer.elapsed_seconds());
+    cout << "test set size: " << test_set.size() << endl;
+    // for (auto it = test_set.begin(); it != test_set.end(); ++it)
+    // {
+    //     cout << (*it).first << ": " << (*it).second << endl;
+    // }
+
+    cout << "making product graph" << endl;
+    stage_timer.reset();
+    if (options.graph == "csr")
+    {
+        UserItems user_items;
+        build_user_items(ids, users_to_products, user_items);
+
+        CsrGraph graph;
+        Stopwatch graph_timer;
+        if (options.weights == "legacy" || options.compare_weights)
+        {
+            make_product_graph_csr(asin_to_product, users_to_products, ids, graph);
+        }
+        double legacy_seconds = graph_timer.elapsed_seconds();
+
+        if (options.weights == "indexed" || options.compare_weights)
+        {
+            graph_timer.reset();
+            SimilarLists similar;
+            build_similar_lists(asin_to_product, ids, similar, options.threads);
+            ReviewerIndex index;
+            build_reviewer_index(ids, user_items, asin_to_product, index);
+            CsrGraph indexed_graph;
+            make_product_graph_parallel(similar, index, options.threads, indexed_graph);
+            double indexed_seconds = graph_timer.elapsed_seconds();
+
+            if (options.graph_scaling)
+            {
+                report_graph_build_scaling(similar, index, options.threads);
+            }
+
+            if (options.compare_weights)
+            {
+                bool same = indexed_graph.offsets == graph.offsets && indexed_graph.neighbors == graph.neighbors && indexed_graph.weights == graph.weights;
+                cout << "scoreUsersWhoPurchasedBothProducts weights: " << legacy_seconds << "s" << endl;
+                cout << "reviewer index weights: " << indexed_seconds << "s (" << legacy_seconds / indexed_seconds << "x), "
+                     << (same ? "identical" : "DIFFERENT") << endl;
+            }
+            swap(graph, indexed_graph);
+        }
+        bench.stage("product_graph", stage_timer.elapsed_seconds());
+        bench.size("products", ids.num_products());
+        bench.size("users", ids.num_users());
+        bench.size("purchases", user_items.items.size());
+        bench.size("graph_edges", graph.num_edges());
+        bench.size("graph_bytes", graph.memory_bytes());
+        bench.size("user_items_bytes", user_items.offsets.size() * sizeof(uint64_t) + user_items.items.size() * sizeof(uint32_t));
+
+        if (options.graph_report)
+        {
+            make_product_graph(asin_to_product, product_graph, users_to_products);
+            report_product_graph_layout(ids, product_graph, graph);
+        }
+
+        const ScoringPipeline* scoring = nullptr;
+        if (!options.scoring.empty() || options.scoring_report)
+        {
+            SimilarLists similar;
+            build_similar_lists(asin_to_product, ids, similar, options.threads);
+            ReviewerIndex index;
+            build_reviewer_index(ids, user_items, asin_to_product, index);
+            ReviewColumns review_columns;
+            build_review_columns(asin_to_product, ids, review_columns);
+            vector<float> ratings;
+            build_reviewer_ratings(index, review_columns, ratings);
+            ScoringContext context;
+            context.index = &index;
+            context.ratings = ratings.data();
+
+            if (options.scoring_report)
+            {
+                report_scoring_policies(similar, context, user_items, options.k, options.threads);
+            }
+            if (!options.scoring.empty())
+            {
+                scoring = find_scoring_pipeline(options.scoring);
+                Stopwatch timer;
+                CsrGraph scored_graph;
+                scoring->build_graph(similar, context, options.threads, scored_graph);
+                cout << scoring->name << " scoring: " << scored_graph.num_edges() << " edges in " << timer.elapsed_seconds() << "s replace the product graph" << endl;
+                swap(graph, scored_graph);
+            }
+        }
+
+        if (options.item_similarity || options.similarity_report)
+        {
+            ReviewerIndex index;
+            build_reviewer_index(ids, user_items, asin_to_product, index);
+            ReviewerBitsets bitsets;
+            build_reviewer_bitsets(index, options.threads, bitsets);
+            if (options.similarity_report)
+            {
+                report_item_similarity(index, user_items, bitsets, options.similarity_options, options.threads);
+            }
+            if (options.item_similarity)
+            {
+                CsrGraph similarity_graph;
+                ItemSimilarityStats stats;
+                if (!build_item_similarity(index, user_items, bitsets, options.similarity_options, options.threads, similarity_graph, stats))
+                {
+                    cerr << "unknown similarity kernel " << options.similarity_options.kernel << endl;
+                    return 1;
+                }
+                cout << options.similarity_options.measure << " item similarity (" << stats.kernel << "): " << stats.pairs << " pairs in "
+                     << stats.seconds << "s, " << similarity_graph.num_edges() << " edges replace the product graph" << endl;
+                swap(graph, similarity_graph);
+            }
+        }
+
+        GraphReordering reordering;
+        CsrGraph reordered_graph;
+        UserItems reordered_items;
+        if (!options.reorder.empty() || options.reorder_report)
+        {
+            if (options.reorder_report)
+            {
+                SimilarLists similar;
+                build_similar_lists(asin_to_product, ids, similar, options.threads);
+                ReviewerIndex index;
+                build_reviewer_index(ids, user_items, asin_to_product, index);
+                report_reordering(similar, index, user_items, graph, options.k, options.threads);
+            }
+            if (!options.reorder.empty())
+            {
+                Stopwatch timer;
+                compute_reordering(options.reorder, graph, user_items, reordering);
+                reorder_graph(graph, reordering.products, reordered_graph);
+                reorder_user_items(user_items, reordering, reordered_items);
+                cout << options.reorder << " reordering of " << reordered_graph.num_nodes() << " products and " << reordered_items.num_users()
+                     << " users in " << timer.elapsed_seconds() << "s" << endl;
+            }
+        }
+
+        if (options.user_graph || options.compare_user_graph)
+        {
+            cout << "making user graph" << endl;
+            Stopwatch timer;
+            ReviewerIndex index;
+            build_reviewer_index(ids, user_items, asin_to_product, index);
+            UserGraph user_graph;
+            UserGraphStats stats;
+            if (!build_user_graph(index, ids.num_users(), options.user_graph_options, user_graph, stats))
+            {
+                cerr << "could not spill the user graph runs" << endl;
+                return 1;
+            }
+            cout << "user graph: " << user_graph.num_users() << " users, " << user_graph.num_edges() << " edges from "
+                 << stats.pairs << " reviewer pairs, " << stats.capped_products << " capped products, "
+                 << stats.runs << " runs spilled, " << timer.elapsed_seconds() << "s" << endl;
+
+            if (options.compare_user_graph)
+            {
+                cout << "group_user_co_reviews " << (compare_user_graph(user_graph, ids, data) ? "agrees" : "DIFFERS") << endl;
+            }
+        }
+
+        if (options.incremental_bench)
+        {
+            cout << "benchmarking incremental updates" << endl;
+            run_incremental_benchmark(asin_to_product, ids, user_items, graph, options.seed);
+        }
+
+        if (!options.write_neighbor_cache.empty())
+        {
+            Stopwatch timer;
+            NeighborCache cache;
+            cache.build(graph, options.neighbor_top, options.threads);
+            if (!cache.write(options.write_neighbor_cache))
+            {
+                cerr << "could not write " << options.write_neighbor_cache << endl;
+                return 1;
+            }
+            cout << "neighbor cache of " << cache.memory_bytes() << " bytes written in " << timer.elapsed_seconds() << "s" << endl;
+        }
+
+        NeighborCache neighbor_cache;
+        if (!options.neighbor_cache.empty())
+        {
+            if (!neighbor_cache.open(options.neighbor_cache))
+            {
+                return 1;
+            }
+            if (neighbor_cache.num_products() != graph.num_nodes() || neighbor_cache.graph_edges() != graph.num_edges())
+            {
+                cerr << "neighbor cache " << options.neighbor_cache << " was built from a different product graph" << endl;
+                return 1;
+            }
+            report_neighbor_cache(neighbor_cache, user_items, graph, options.k);
+        }
+
+        CategoryIndex categories;
+        CategoryFilter category_filter;
+        if (!options.filter_groups.empty() || !options.filter_categories.empty() || !options.boost_categories.empty() || options.category_report)
+        {
+            build_category_index(asin_to_product, ids, categories);
+            if (!compile_category_filter(categories, options.filter_groups, options.filter_categories, options.boost_categories, options.category_boost, category_filter))
+            {
+                return 1;
+            }
+            if (options.category_report)
+            {
+                report_category_filter(user_items, graph, categories, category_filter, options.k);
+            }
+        }
+
+        Embeddings embeddings;
+        IvfIndex ivf;
+        if (options.predictor == "embedding" || options.embedding_report)
+        {
+            TrainingStats stats;
+            train_bpr(user_items, ids.num_products(), options.embedding_options, options.threads, embeddings, stats);
+            cout << "bpr: " << options.embedding_options.epochs << " epochs, " << stats.samples << " samples in " << stats.seconds << "s ("
+                 << stats.samples / max(stats.seconds, 1e-9) / 1e6 << "M samples/s on " << options.threads << " threads), loss " << stats.loss << endl;
+            Stopwatch timer;
+            build_ivf_index(embeddings, options.embedding_options, options.threads, ivf);
+            cout << "ivf index: " << ivf.num_lists() << " lists over " << embeddings.active.size() << " products in " << timer.elapsed_seconds() << "s" << endl;
+            if (options.embedding_report)
+            {
+                report_embedding_search(user_items, embeddings, ivf, options.k, options.seed);
+            }
+        }
+
+        ReviewColumns reviews;
+        if (options.review_weighting.active() || options.review_report)
+        {
+            build_review_columns(asin_to_product, ids, reviews);
+            bench.size("review_columns_bytes", reviews.memory_bytes());
+            if (options.review_report)
+            {
+                report_review_columns(asin_to_product, reviews);
+            }
+        }
+
+        PprGraph ppr_graph;
+        if (options.predictor == "ppr")
+        {
+            build_ppr_graph(ids, user_items, graph, ppr_graph);
+        }
+
+        // the csr predictors behind one interface, for the evaluation loop
+        vector<TopKScratch> scratch(options.threads);
+        vector<PprScratch> ppr_scratch(options.threads);
+        vector<NeighborMergeScratch> merge_scratch(options.threads);
+        vector<EmbeddingScratch> embedding_scratch(options.threads);
+        RecommendFunction recommend = [&](uint32_t user, size_t k, unsigned thread_id, vector<uint32_t>& out)
+        {
+            if (user >= user_items.num_users())
+            {
+                out.clear();
+            }
+            else if (options.predictor == "topk" && category_filter.active())
+            {
+                recommend_top_k_filtered(user, k, user_items, graph, categories, category_filter, scratch[thread_id], out);
+            }
+            else if (options.predictor == "topk" && scoring != nullptr)
+            {
+                scoring->ranker(k)(user, k, user_items, graph, scratch[thread_id], out);
+            }
+            else if (options.predictor == "topk" && !options.reorder.empty())
+            {
+                recommend_top_k(reordering.users.new_id[user], k, reordered_items, reordered_graph, scratch[thread_id], out);
+                restore_product_ids(reordering, out);
+            }
+            else if (options.predictor == "topk")
+            {
+                recommend_top_k(user, k, user_items, graph, scratch[thread_id], out);
+            }
+            else if (options.predictor == "embedding")
+            {
+                recommend_embedding_ivf(user, k, options.embedding_options.probe, user_items, embeddings, ivf, embedding_scratch[thread_id], out);
+            }
+            else if (options.predictor == "ppr")
+            {
+                recommend_ppr(user, k, ppr_graph, options.ppr_options, ppr_scratch[thread_id], out);
+            }
+            else if (options.review_weighting.active())
+            {
+                rank_weighted_baseline_prediction(user, k, user_items, graph, reviews, options.review_weighting, out);
+            }
+            else if (!options.neighbor_cache.empty())
+            {
+                rank_cached_prediction(user, k, user_items, neighbor_cache, merge_scratch[thread_id], out);
+            }
+            else if (!options.reorder.empty())
+            {
+                rank_baseline_prediction_csr(reordering.users.new_id[user], k, reordered_items, reordered_graph, out);
+                restore_product_ids(reordering, out);
+            }
+            else
+            {
+                rank_baseline_prediction_csr(user, k, user_items, graph, out);
+            }
+        };
+
+        stage_timer.reset();
+        EvaluationResult result;
+        result.predictor = options.predictor;
+        // predictors that only the recommend function can run, so their correct predictions are taken from the evaluation result
+        bool evaluated_predictor = options.predictor == "ppr" || options.predictor == "embedding" || options.review_weighting.active() || !options.reorder.empty()
+                                   || (options.predictor == "topk" && (category_filter.active() || scoring != nullptr));
+        if (options.evaluate || !options.eval_json.empty() || evaluated_predictor)
+        {
+            evaluate_recommender(tests, options.k, options.threads, recommend, result);
+        }
+        if (options.evaluate || !options.eval_json.empty())
+        {
+            string json = evaluation_json(result);
+            cout << json << endl;
+            if (!options.eval_json.empty())
+            {
+                ofstream out(options.eval_json.c_str());
+                out << json << endl;
+                if (!out)
+                {
+                    cerr << "could not write " << options.eval_json << endl;
+                    return 1;
+                }
+            }
+        }
+
+        cout << "making predictions" << endl;
+        if (evaluated_predictor)
+        {
+            // one held out purchase per user, so users with a hit are correct predictions
+            int numCorrect = llround(result.hit_rate * result.users);
+            cout << "Number of Correct Predictions: " << numCorrect << endl;
+            cout << "Percentage Correct: " << 100.0 * (numCorrect / double(test_set.size())) << "%" << endl;
+        }
+        else if (options.predictor == "topk")
+        {
+            check_top_k_predictions(test_set, ids, user_items, graph, options.k, options.threads);
+        }
+        else
+        {
+            check_baseline_predictions_csr(test_set, ids, user_items, graph);
+        }
+        bench.stage("prediction", stage_timer.elapsed_seconds());
+
+        if (!options.recommend_all.empty())
+        {
+            Stopwatch timer;
+            vector<uint32_t> recommendations;
+            recommend_all_users(options.k, user_items, graph, options.threads, recommendations);
+            double seconds = timer.elapsed_seconds();
+            cout << "top " << options.k << " for " << user_items.num_users() << " users in " << seconds << "s ("
+                 << user_items.num_users() / max(seconds, 1e-9) << " users/s)" << endl;
+
+            if (!write_recommendations(options.recommend_all, ids, options.k, recommendations))
+            {
+                cerr << "could not write " << options.recommend_all << endl;
+                return 1;
+            }
+        }
+
+        if (options.load_test > 0 || options.server_options.port != 0)
+        {
+            Stopwatch timer;
+            RecommenderModel model(move(ids), move(user_items), move(graph), options.threads);
+            cout << "built read only model in " << timer.elapsed_seconds() << "s" << endl;
+            if (options.load_test > 0)
+            {
+                run_load_test(model, options.load_test, options.k, options.threads);
+            }
+            if (options.server_options.port != 0)
+            {
+                options.server_options.threads = options.threads;
+                options.server_options.k = options.k;
+                if (!run_server(model, options.server_options))
+                {
+                    return 1;
+                }
+            }
+        }
+
+        cout << "done" << endl;
+        return finish_bench(options, bench) ? 0 : 1;
+    }
+
+    make_product_graph(asin_to_product, product_graph, users_to_products);
+    bench.stage("product_graph", stage_timer.elapsed_seconds());
+    bench.size("products", asin_to_product.size());
+    bench.size("users", users_to_products.size());
+    bench.size("graph_rows", product_graph.size());
+    // int counter = 0;
+    // for (auto it = product_graph.begin(); it != product_graph.end(); ++it)
+    // {
+    //     cout << it->first << endl;
+    //     for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2)
+    //     {
+    //         cout << "  " << (*it2).first << endl;
+    //     }
+    // }
+
+    cout << "making predictions" << endl;
+    stage_timer.reset();
+    checkBaselinePredictions(test_set, users_to_products, product_graph);
+    bench.stage("prediction", stage_timer.elapsed_seconds());
+
+    cout << "done" << endl;
+
+    return finish_bench(options, bench) ? 0 : 1;
+}
+
+
+/* Prints the --bench JSON line and writes it to --bench-json. Returns false
+ * if the file could not be written. */
+bool finish_bench(const Options& options, const BenchReport& bench)
+{
+    if (!options.bench && options.bench_json.empty())
+    {
+        return true;
+    }
+    string json = bench.json();
+    cout << json << endl;
+    if (!options.bench_json.empty())
+    {
+        ofstream out(options.bench_json.c_str());
+        out << json << endl;
+        if (!out)
+        {
+            cerr << "could not write " << options.bench_json << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Fills data from the snapshot if one was given, otherwise parses the data
+ * file with the selected parser. Writes a snapshot afterwards if asked to. */
+bool load_data(const Options& options, ParsedData& data)
+{
+    Stopwatch timer;
+    if (!options.snapshot.empty())
+    {
+        if (!load_snapshot(options.snapshot, data.asin_to_product, data.user_to_nodeid, data.nodeid_to_user, data.users_to_products, data.num_purchases, data.user_vector))
+        {
+            return false;
+        }
+        cout << "loaded snapshot " << options.snapshot << " in " << timer.elapsed_seconds() << "s" << endl;
+    }
+    else
+    {
+        if (is_gzip_file(options.data_file))
+        {
+            if (!parse_file_gzip(options.data_file, data.asin_to_product, data.user_to_nodeid, data.nodeid_to_user, data.users_to_products, data.num_purchases, data.user_vector, options.threads, options.gzip_options))
+            {
+                cerr << "could not read " << options.data_file << endl;
+                return false;
+            }
+        }
+        else if (options.parser == "legacy")
+        {
+            parse_file(options.data_file, data.asin_to_product, data.user_to_nodeid, data.nodeid_to_user, data.users_to_products, data.num_purchases, data.user_vector);
+        }
+        else if (!parse_file_mapped(options.data_file, data.asin_to_product, data.user_to_nodeid, data.nodeid_to_user, data.users_to_products, data.num_purchases, data.user_vector, options.threads))
+        {
+            cerr << "could not open " << options.data_file << endl;
+            return false;
+        }
+        cout << "parsed " << options.data_file << " in " << timer.elapsed_seconds() << "s" << endl;
+    }
+
+    if (!options.write_snapshot.empty())
+    {
+        timer.reset();
+        if (!write_snapshot(options.write_snapshot, data.asin_to_product, data.user_to_nodeid, data.users_to_products, data.num_purchases))
+        {
+            return false;
+        }
+        cout << "wrote snapshot " << options.write_snapshot << " in " << timer.elapsed_seconds() << "s" << endl;
+    }
+    return true;
+}
+
+
+void printUsage(const char* program)
+{
+    cerr << "usage: " << program << " [options] [data file]" << endl;
+    cerr << "  --parser mmap|legacy   loader used for the data file (default mmap)" << endl;
+    cerr << "  --compare-parsers      time both loaders, check they agree and exit" << endl;
+    cerr << "  --threads N            worker threads for the parallel stages (default: all cores)" << endl;
+    cerr << "  --parse-scaling        time the mmap loader with 1..N threads and exit" << endl;
+    cerr << "  --arena-report         compare load time and peak RSS of the Product* and arena layouts and exit" << endl;
+    cerr << "  --gzip-buffer MB       decompressed MB per ring buffer of the .gz loader (default 4)" << endl;
+    cerr << "  --gzip-report          time decompress-then-parse against the pipelined .gz loader and exit" << endl;
+    cerr << "  --snapshot FILE        load a binary snapshot instead of parsing the data file" << endl;
+    cerr << "  --write-snapshot FILE  write a binary snapshot of the loaded data" << endl;
+    cerr << "  --compare-snapshot FILE  time loading FILE against parsing, check they agree and exit" << endl;
+    cerr << "  --graph csr|map        product graph layout (default csr)" << endl;
+    cerr << "  --graph-report         print bytes per edge and scan speed of both layouts" << endl;
+    cerr << "  --weights indexed|legacy  how csr edge weights are computed (default indexed)" << endl;
+    cerr << "  --compare-weights      compute the csr edge weights both ways and compare" << endl;
+    cerr << "  --graph-scaling        time the parallel product graph build with 1..N threads" << endl;
+    cerr << "  --predictor baseline|topk|ppr|embedding  csr predictor (default baseline)" << endl;
+    cerr << "  --k N                  recommendations per user for every predictor and the evaluation (default " << NUMBER_IN_RECOMMENTATION_SET << ")" << endl;
+    cerr << "  --recommend-all FILE   write top k recommendations for every user to FILE" << endl;
+    cerr << "  --load-test N          query the read only model from 1..N threads, N queries each" << endl;
+    cerr << "  --user-graph           build the user co-review graph" << endl;
+    cerr << "  --user-graph-budget MB  memory for reviewer pairs before runs spill to disk (default 256)" << endl;
+    cerr << "  --reviewer-cap N       sample N reviewers of more popular products, 0 for no cap (default 1000)" << endl;
+    cerr << "  --compare-user-graph   check the user graph against group_user_co_reviews" << endl;
+    cerr << "  --holdout PCT          hold out PCT% of purchases with the seeded splitter instead of extractTestSet" << endl;
+    cerr << "  --seed N               seed of the holdout split (default 224)" << endl;
+    cerr << "  --evaluate             print hit rate, precision, recall and MRR at k of the csr predictor as JSON" << endl;
+    cerr << "  --eval-json FILE       also write the evaluation JSON to FILE" << endl;
+    cerr << "  --incremental-bench    time incremental review/product ingest against a full graph rebuild" << endl;
+    cerr << "  --filter-group NAME    topk: only recommend products of group NAME (repeatable)" << endl;
+    cerr << "  --filter-category NAME topk: only recommend products in category NAME, e.g. Rock or 40 (repeatable)" << endl;
+    cerr << "  --boost-category NAME  topk: multiply the score of products in category NAME (repeatable)" << endl;
+    cerr << "  --category-boost F     factor of --boost-category (default 2)" << endl;
+    cerr << "  --category-report      time filtered against unfiltered topk queries" << endl;
+    cerr << "  --embedding-dim N      embedding: vector size, rounded up to a multiple of 8 (default 32)" << endl;
+    cerr << "  --embedding-epochs N   embedding: bpr passes over the purchases (default 20)" << endl;
+    cerr << "  --embedding-rate F     embedding: sgd learning rate (default 0.05)" << endl;
+    cerr << "  --ivf-lists N          embedding: k-means lists of the ivf index (default sqrt(products))" << endl;
+    cerr << "  --ivf-probe N          embedding: lists scanned per query (default 8)" << endl;
+    cerr << "  --embedding-report     ivf recall and latency against exact inner product search" << endl;
+    cerr << "  --recency-half-life D  baseline: weigh each purchase by 2^(-age / D), age in days of the user's review" << endl;
+    cerr << "  --rating-weight        baseline: weigh each purchase by the rating of the user's review / 5" << endl;
+    cerr << "  --review-window D      baseline: ignore purchases reviewed more than D days before the newest review" << endl;
+    cerr << "  --review-report        compare memory and filter scan speed of the review maps and review columns" << endl;
+    cerr << "  --out-of-core DIR      build the product graph from shards in DIR without loading the data file and exit" << endl;
+    cerr << "  --shard-memory MB      out of core: memory one shard may use (default 256)" << endl;
+    cerr << "  --shards N             out of core: number of shards (default: from the file size and --shard-memory)" << endl;
+    cerr << "  --compare-out-of-core  out of core: also build the graph in memory and check they are identical" << endl;
+    cerr << "  --serve PORT           after the csr graph, answer top k queries on 127.0.0.1:PORT until SHUTDOWN" << endl;
+    cerr << "  --batch-size N         serve: queries answered together (default 32)" << endl;
+    cerr << "  --batch-window-us N    serve: how long a worker waits for a batch to fill (default 0)" << endl;
+    cerr << "  --load-client PORT     load test the server on 127.0.0.1:PORT and exit" << endl;
+    cerr << "  --client-connections N load client: concurrent connections (default 8)" << endl;
+    cerr << "  --client-queries N     load client: queries per connection (default 10000)" << endl;
+    cerr << "  --client-pipeline N    load client: requests in flight per connection (default 4)" << endl;
+    cerr << "  --shutdown-server      load client: stop the server when done" << endl;
+    cerr << "  --bench                print stage times, peak memory, structure sizes and hot path counters as JSON" << endl;
+    cerr << "  --bench-json FILE      also write that JSON to FILE" << endl;
+    cerr << "  --scoring baseline|degree|jaccard|rating  rebuild the edge weights (and the topk ranking) with this scoring pipeline" << endl;
+    cerr << "  --scoring-report       time every scoring pipeline against the same pipeline through virtual calls" << endl;
+    cerr << "  --reorder degree|rcm   baseline and topk: query a copy of the graph with product and user ids relabelled for locality" << endl;
+    cerr << "  --reorder-report       cache misses, graph build and query throughput with and without reordering" << endl;
+    cerr << "  --item-similarity cosine|jaccard  use reviewer set similarity of all co-reviewed products as the product graph" << endl;
+    cerr << "  --similarity-kernel auto|avx2|scalar|merge  intersection kernel (default auto: avx2 if the cpu has it)" << endl;
+    cerr << "  --similarity-top N     neighbors kept per product (default 20)" << endl;
+    cerr << "  --similarity-user-cap N  users with more purchases propose no candidate pairs (default 1000, 0: no cap)" << endl;
+    cerr << "  --similarity-report    time every similarity kernel in pairs per second" << endl;
+    cerr << "  --write-neighbor-cache FILE  write every product's top neighbors to FILE" << endl;
+    cerr << "  --neighbor-cache FILE  memory map FILE and serve the baseline predictor from it" << endl;
+    cerr << "  --neighbor-top N       neighbors kept per product in a written cache (default 32)" << endl;
+    cerr << "  --ppr-method push|walks  personalized PageRank by residual pushing or random walks (default push)" << endl;
+    cerr << "  --ppr-alpha A          restart probability (default 0.15)" << endl;
+    cerr << "  --ppr-epsilon E        push: residual threshold per unit of degree (default 1e-4)" << endl;
+    cerr << "  --ppr-walks N          walks: random walks per query (default 2000)" << endl;
+    cerr << "  --ppr-similar-share S  share of a product's mass sent along product graph edges (default 0.5)" << endl;
+}
+
+
+/* Reads the command line into options. Returns false (after printing the
+ * usage) if an argument is not understood. */
+bool parse_options(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--parser" && has_value)
+        {
+            options.parser = argv[++i];
+            if (options.parser != "mmap" && options.parser != "legacy")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--compare-parsers")
+        {
+            options.compare_parsers = true;
+        }
+        else if (arg == "--threads" && has_value)
+        {
+            options.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--parse-scaling")
+        {
+            options.parse_scaling = true;
+        }
+        else if (arg == "--arena-report")
+        {
+            options.arena_report = true;
+        }
+        else if (arg == "--gzip-buffer" && has_value)
+        {
+            options.gzip_options.buffer_size = size_t(max(1, atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--gzip-report")
+        {
+            options.gzip_report = true;
+        }
+        else if (arg == "--snapshot" && has_value)
+        {
+            options.snapshot = argv[++i];
+        }
+        else if (arg == "--write-snapshot" && has_value)
+        {
+            options.write_snapshot = argv[++i];
+        }
+        else if (arg == "--compare-snapshot" && has_value)
+        {
+            options.compare_snapshot = argv[++i];
+        }
+        else if (arg == "--graph" && has_value)
+        {
+            options.graph = argv[++i];
+            if (options.graph != "csr" && options.graph != "map")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--graph-report")
+        {
+            options.graph_report = true;
+        }
+        else if (arg == "--weights" && has_value)
+        {
+            options.weights = argv[++i];
+            if (options.weights != "indexed" && options.weights != "legacy")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--compare-weights")
+        {
+            options.compare_weights = true;
+        }
+        else if (arg == "--graph-scaling")
+        {
+            options.graph_scaling = true;
+        }
+        else if (arg == "--predictor" && has_value)
+        {
+            options.predictor = argv[++i];
+            if (options.predictor != "baseline" && options.predictor != "topk" && options.predictor != "ppr" && options.predictor != "embedding")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--k" && has_value)
+        {
+            options.k = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--recommend-all" && has_value)
+        {
+            options.recommend_all = argv[++i];
+        }
+        else if (arg == "--load-test" && has_value)
+        {
+            options.load_test = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--user-graph")
+        {
+            options.user_graph = true;
+        }
+        else if (arg == "--user-graph-budget" && has_value)
+        {
+            options.user_graph_options.memory_budget = size_t(max(1, atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--reviewer-cap" && has_value)
+        {
+            options.user_graph_options.reviewer_cap = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--compare-user-graph")
+        {
+            options.compare_user_graph = true;
+        }
+        else if (arg == "--holdout" && has_value)
+        {
+            options.holdout = max(0.0, atof(argv[++i]));
+        }
+        else if (arg == "--seed" && has_value)
+        {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--evaluate")
+        {
+            options.evaluate = true;
+        }
+        else if (arg == "--eval-json" && has_value)
+        {
+            options.eval_json = argv[++i];
+        }
+        else if (arg == "--incremental-bench")
+        {
+            options.incremental_bench = true;
+        }
+        else if (arg == "--filter-group" && has_value)
+        {
+            options.filter_groups.push_back(argv[++i]);
+        }
+        else if (arg == "--filter-category" && has_value)
+        {
+            options.filter_categories.push_back(argv[++i]);
+        }
+        else if (arg == "--boost-category" && has_value)
+        {
+            options.boost_categories.push_back(argv[++i]);
+        }
+        else if (arg == "--category-boost" && has_value)
+        {
+            options.category_boost = max(0.0, atof(argv[++i]));
+        }
+        else if (arg == "--category-report")
+        {
+            options.category_report = true;
+        }
+        else if (arg == "--embedding-dim" && has_value)
+        {
+            options.embedding_options.dim = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--embedding-epochs" && has_value)
+        {
+            options.embedding_options.epochs = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--embedding-rate" && has_value)
+        {
+            options.embedding_options.learning_rate = max(0.0, atof(argv[++i]));
+        }
+        else if (arg == "--ivf-lists" && has_value)
+        {
+            options.embedding_options.lists = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--ivf-probe" && has_value)
+        {
+            options.embedding_options.probe = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--embedding-report")
+        {
+            options.embedding_report = true;
+        }
+        else if (arg == "--recency-half-life" && has_value)
+        {
+            options.review_weighting.half_life_days = max(0.0, atof(argv[++i]));
+        }
+        else if (arg == "--rating-weight")
+        {
+            options.review_weighting.rating = true;
+        }
+        else if (arg == "--review-window" && has_value)
+        {
+            options.review_weighting.window_days = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--review-report")
+        {
+            options.review_report = true;
+        }
+        else if (arg == "--out-of-core" && has_value)
+        {
+            options.out_of_core = argv[++i];
+            options.out_of_core_options.directory = options.out_of_core;
+        }
+        else if (arg == "--shard-memory" && has_value)
+        {
+            options.out_of_core_options.memory_budget = size_t(max(1, atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--shards" && has_value)
+        {
+            options.out_of_core_options.shards = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--compare-out-of-core")
+        {
+            options.compare_out_of_core = true;
+        }
+        else if (arg == "--serve" && has_value)
+        {
+            options.server_options.port = atoi(argv[++i]);
+        }
+        else if (arg == "--batch-size" && has_value)
+        {
+            options.server_options.max_batch = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--batch-window-us" && has_value)
+        {
+            options.server_options.batch_window_us = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--load-client" && has_value)
+        {
+            options.client_options.port = atoi(argv[++i]);
+        }
+        else if (arg == "--client-connections" && has_value)
+        {
+            options.client_options.connections = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--client-queries" && has_value)
+        {
+            options.client_options.queries = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--client-pipeline" && has_value)
+        {
+            options.client_options.pipeline = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--shutdown-server")
+        {
+            options.client_options.shutdown = true;
+        }
+        else if (arg == "--bench")
+        {
+            options.bench = true;
+        }
+        else if (arg == "--bench-json" && has_value)
+        {
+            options.bench_json = argv[++i];
+        }
+        else if (arg == "--scoring" && has_value)
+        {
+            options.scoring = argv[++i];
+            if (find_scoring_pipeline(options.scoring) == nullptr)
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--scoring-report")
+        {
+            options.scoring_report = true;
+        }
+        else if (arg == "--reorder" && has_value)
+        {
+            options.reorder = argv[++i];
+            if (options.reorder != "degree" && options.reorder != "rcm")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--reorder-report")
+        {
+            options.reorder_report = true;
+        }
+        else if (arg == "--item-similarity" && has_value)
+        {
+            options.item_similarity = true;
+            options.similarity_options.measure = argv[++i];
+            if (options.similarity_options.measure != "cosine" && options.similarity_options.measure != "jaccard")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--similarity-kernel" && has_value)
+        {
+            options.similarity_options.kernel = argv[++i];
+        }
+        else if (arg == "--similarity-top" && has_value)
+        {
+            options.similarity_options.top_n = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--similarity-user-cap" && has_value)
+        {
+            options.similarity_options.user_cap = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--similarity-report")
+        {
+            options.similarity_report = true;
+        }
+        else if (arg == "--write-neighbor-cache" && has_value)
+        {
+            options.write_neighbor_cache = argv[++i];
+        }
+        else if (arg == "--neighbor-cache" && has_value)
+        {
+            options.neighbor_cache = argv[++i];
+        }
+        else if (arg == "--neighbor-top" && has_value)
+        {
+            options.neighbor_top = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--ppr-method" && has_value)
+        {
+            options.ppr_options.method = argv[++i];
+            if (options.ppr_options.method != "push" && options.ppr_options.method != "walks")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--ppr-alpha" && has_value)
+        {
+            options.ppr_options.alpha = min(1.0, max(1e-3, atof(argv[++i])));
+        }
+        else if (arg == "--ppr-epsilon" && has_value)
+        {
+            options.ppr_options.epsilon = max(1e-12, atof(argv[++i]));
+        }
+        else if (arg == "--ppr-walks" && has_value)
+        {
+            options.ppr_options.walks = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--ppr-similar-share" && has_value)
+        {
+            options.ppr_options.similar_share = min(1.0, max(0.0, atof(argv[++i])));
+        }
+        else if (boost::starts_with(arg, "-"))
+        {
+            printUsage(argv[0]);
+            return false;
+        }
+        else
+        {
+            options.data_file = arg;
+        }
+    }
 
+    bool filtered = !options.filter_groups.empty() || !options.filter_categories.empty() || !options.boost_categories.empty();
+    if (filtered && options.predictor != "topk")
+    {
+        cerr << "group and category filters need --predictor topk" << endl;
+        return false;
+    }
+    // the topk predictor runs one of filtered, scored and reordered queries
+    if (filtered && (!options.scoring.empty() || !options.reorder.empty()))
+    {
+        cerr << "group and category filters cannot be combined with --scoring or --reorder" << endl;
+        return false;
+    }
+    if (options.predictor == "topk" && !options.scoring.empty() && !options.reorder.empty())
+    {
+        cerr << "--scoring cannot be combined with --reorder for the topk predictor" << endl;
+        return false;
+    }
+    // the incremental graph starts from the product graph and keeps its weighting
+    if (options.incremental_bench && (!options.scoring.empty() || options.item_similarity))
+    {
+        cerr << "--incremental-bench needs the baseline product graph, not --scoring or --item-similarity" << endl;
+        return false;
+    }
+    // the scoring ranker would run over the similarity graph
+    if (!options.scoring.empty() && options.item_similarity)
+    {
+        cerr << "--scoring cannot be combined with --item-similarity" << endl;
+        return false;
+    }
+    return true;
+}
 
-// function prototypes
-void checkBaselinePredictions(set< pair<string, string> >&test_set, map< string, set< string > >&users_to_products, map<string, set< pair<string, double>> >&product_graph);
 
-Product* create_product();
-Review* create_review();
+/* Parses the data file with parse_file and parse_file_mapped, reports how
+ * long each one took and checks that both produced the same structures. */
+int compare_parsers(const Options& options)
+{
+    ParsedData legacy, mapped;
 
-void extractTestSet(int num_purchases, vector<string> &user_vector, map< string, set< string > >&users_to_products, set< pair<string, string> >&test_set, map<string, Product*>& asin_to_product);
+    Stopwatch timer;
+    parse_file(options.data_file, legacy.asin_to_product, legacy.user_to_nodeid, legacy.nodeid_to_user, legacy.users_to_products, legacy.num_purchases, legacy.user_vector);
+    double legacy_seconds = timer.elapsed_seconds();
 
-int getUserEdgeWeight(int user1, int user2);
+    timer.reset();
+    if (!parse_file_mapped(options.data_file, mapped.asin_to_product, mapped.user_to_nodeid, mapped.nodeid_to_user, mapped.users_to_products, mapped.num_purchases, mapped.user_vector, options.threads))
+    {
+        cerr << "could not open " << options.data_file << endl;
+        return 1;
+    }
+    double mapped_seconds = timer.elapsed_seconds();
+
+    bool same = same_parse_output(legacy, mapped);
+    cout << "products: " << mapped.asin_to_product.size() << ", users: " << mapped.user_to_nodeid.size() << endl;
+    cout << "parse_file:        " << legacy_seconds << "s" << endl;
+    cout << "parse_file_mapped: " << mapped_seconds << "s" << endl;
+    cout << "speedup: " << legacy_seconds / mapped_seconds << "x" << endl;
+    cout << "outputs " << (same ? "match" : "DIFFER") << endl;
+    return same ? 0 : 1;
+}
 
-void group_user_co_reviews(map< pair<int, int>, set<Product*> >& co_reviews, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid);
 
-set<string> makeBaselinePrediction(string user, map< string, set< string > >&users_to_products, map<string, set< pair<string, double>> >&product_graph);
+/* Times parse_file_mapped with 1, 2, 4, ... up to options.threads threads and
+ * checks every run against the single threaded one. */
+int parse_scaling(const Options& options)
+{
+    vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < options.threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(options.threads);
 
-void make_product_graph(map<string, Product*> &asin_to_product, map<string, set< pair<string, double>> > &product_graph, map< string, set< string > >&users_to_products);
+    ParsedData base;
+    double base_seconds = 0;
+    bool all_same = true;
 
-void make_user_graph(map< string, int>& user_to_nodeid, map<pair<int, int>, set<Product*> >& co_reviews, map< int, set< pair<int, int>> >& user_graph);
+    cout << "threads\tseconds\tspeedup\tmatches" << endl;
+    for (unsigned threads : thread_counts)
+    {
+        ParsedData run;
+        ParsedData& target = threads == 1 ? base : run;
 
-void parse_file(string filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > > &users_to_products, int &num_purchases, vector<string>&user_vector);
+        Stopwatch timer;
+        if (!parse_file_mapped(options.data_file, target.asin_to_product, target.user_to_nodeid, target.nodeid_to_user, target.users_to_products, target.num_purchases, target.user_vector, threads))
+        {
+            cerr << "could not open " << options.data_file << endl;
+            return 1;
+        }
+        double seconds = timer.elapsed_seconds();
+        if (threads == 1) base_seconds = seconds;
 
-double scoreUsersWhoPurchasedBothProducts(string product1, string product2, map< string, set< string > >&users_to_products, map<string, Product*>& asin_to_product);
+        bool same = threads == 1 || same_parse_output(base, run);
+        all_same = all_same && same;
+        cout << threads << "\t" << seconds << "\t" << base_seconds / seconds << "\t" << (same ? "yes" : "NO") << endl;
+    }
 
-vector<string> split(string str, char delimiter);
-void cleanHeap(map<string, Product*>&asin_to_product);
+    return all_same ? 0 : 1;
+}
 
-int main(int argc, char* argv[])
-{   
-    // make sure the random numbers are really random
-    // srand(time(NULL));
 
-    /* asin_to_product
-        key = (string) amazon product id
-        value = (Product*) product object */
-    map<string, Product*> asin_to_product = map<string, Product*>();
+/* Parses the data file, loads the snapshot given with --compare-snapshot and
+ * checks that both produced the same structures. */
+int compare_snapshot(const Options& options)
+{
+    ParsedData parsed, loaded;
 
-    /* user_to_nodeid
-        key = (string) amazon user id
-        value = (int) node id - not sure if this is necessary */
-    map<string, int> user_to_nodeid = map<string, int>();
+    Stopwatch timer;
+    if (!parse_file_mapped(options.data_file, parsed.asin_to_product, parsed.user_to_nodeid, parsed.nodeid_to_user, parsed.users_to_products, parsed.num_purchases, parsed.user_vector, options.threads))
+    {
+        cerr << "could not open " << options.data_file << endl;
+        return 1;
+    }
+    double parse_seconds = timer.elapsed_seconds();
 
-    /* nodeid_to_user
-        key = (int) node id
-        value = (string) amazon user id */
-    map<int, string> nodeid_to_user = map<int, string>();
+    timer.reset();
+    if (!load_snapshot(options.compare_snapshot, loaded.asin_to_product, loaded.user_to_nodeid, loaded.nodeid_to_user, loaded.users_to_products, loaded.num_purchases, loaded.user_vector))
+    {
+        return 1;
+    }
+    double load_seconds = timer.elapsed_seconds();
 
-    /* user_co_reviews
-        key = pair (userid1, userid2)
-        value = (set) product objects that both users have reviewed */
-    map<pair<int, int>, set<Product*> > user_co_reviews = map<pair<int, int>, set<Product*> >();
+    bool same = same_parse_output(parsed, loaded);
+    cout << "parse_file_mapped: " << parse_seconds << "s" << endl;
+    cout << "load_snapshot:     " << load_seconds << "s" << endl;
+    cout << "outputs " << (same ? "match" : "DIFFER") << endl;
+    return same ? 0 : 1;
+}
 
-    /* user_graph
-        key = (int) user node
-        value = pair (userid2, edge weight) */
-    map<int, set< pair<int, int>> > user_graph = map<int, set< pair<int, int>> >();
 
-    /* product_graph
-        key = product asin
-        value = pair (product asin2, edge weight) */
-    map<string, set< pair<string, double>> > product_graph = map<string, set< pair<string, double>> >();
+/* Builds the product graph with the sharded pipeline, optionally writes its
+ * neighbor cache, and with --compare-out-of-core checks it against the in
+ * memory build over the whole data file. */
+int out_of_core(const Options& options)
+{
+    CsrGraph graph;
+    OutOfCoreStats stats;
+    if (!build_product_graph_out_of_core(options.data_file, options.out_of_core_options, graph, stats))
+    {
+        return 1;
+    }
+    cout << "out of core product graph: " << stats.products << " products (" << stats.records << " records), " << stats.users << " users, "
+         << stats.purchases << " purchases, " << stats.edges << " edges; " << stats.shards << " shards, "
+         << stats.bytes_written / (1024.0 * 1024.0) << " MB written, " << stats.seconds << "s, peak RSS "
+         << peak_rss_bytes() / (1024.0 * 1024.0) << " MB" << endl;
 
-    /* users_to_products
-        key = username
-        value = set of products user has purchased */
-    map< string, set< string > >users_to_products = map< string, set< string > >();
+    if (!options.write_neighbor_cache.empty())
+    {
+        NeighborCache cache;
+        cache.build(graph, options.neighbor_top, options.threads);
+        if (!cache.write(options.write_neighbor_cache))
+        {
+            cerr << "could not write " << options.write_neighbor_cache << endl;
+            return 1;
+        }
+        cout << "neighbor cache of " << cache.memory_bytes() << " bytes written" << endl;
+    }
 
-    
-    int num_purchases = 0;
-    vector<string> user_vector = vector<string>();
+    if (!options.compare_out_of_core)
+    {
+        return 0;
+    }
 
-    /* parse the data file (makes the product-product graphs), the next two 
-     * functions make the user-user graph. using the amazon-small.txt file for 
-     * now since the other one is huge. feel free to use the regular datafile. */
-    parse_file("amazon-large.txt", asin_to_product, user_to_nodeid, nodeid_to_user, users_to_products, num_purchases, user_vector);
-    // int count = 0;
-    // for (auto it = users_to_products.begin(); it != users_to_products.end(); ++it)
-    // {
-    //     if (count++ == 5000) break;
-    //     cout << it->first << ":" << endl;
-    //     if (it->second.size() > 1)
-    //     {
-    //         for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2)
-    //         {
-    //             cout << '\t' << *it2 << endl;
-    //         }
-    //     }
-    // }
-    cout << "A12N9YU5K516JF: " << users_to_products["A12N9YU5K516JF"].size() << endl;
+    Stopwatch timer;
+    ParsedData data;
+    if (!load_data(options, data))
+    {
+        return 1;
+    }
+    IdIndex ids;
+    build_id_index(data.asin_to_product, data.users_to_products, ids);
+    UserItems user_items;
+    build_user_items(ids, data.users_to_products, user_items);
+    SimilarLists similar;
+    build_similar_lists(data.asin_to_product, ids, similar, options.threads);
+    ReviewerIndex index;
+    build_reviewer_index(ids, user_items, data.asin_to_product, index);
+    CsrGraph in_memory;
+    make_product_graph_parallel(similar, index, options.threads, in_memory);
+
+    bool same = ids.num_products() == stats.products && ids.num_users() == stats.users && user_items.items.size() == stats.purchases
+             && in_memory.offsets == graph.offsets && in_memory.neighbors == graph.neighbors && in_memory.weights == graph.weights;
+    cout << "in memory product graph: " << in_memory.num_edges() << " edges in " << timer.elapsed_seconds() << "s, "
+         << (same ? "identical" : "DIFFERENT") << endl;
+    return same ? 0 : 1;
+}
 
-    /* These graphs aren't used to make the baseline predictions so we aren't
-     * creating them right now. */
-    // group_user_co_reviews(user_co_reviews, asin_to_product, user_to_nodeid);
-    // make_user_graph(user_to_nodeid, user_co_reviews, user_graph);
 
-    cout << "asin_to_product: " << asin_to_product.size() << endl;
+bool same_reviews(map<string, Review*>& a, map<string, Review*>& b)
+{
+    if (a.size() != b.size()) return false;
+    for (auto a_it = a.begin(), b_it = b.begin(); a_it != a.end(); ++a_it, ++b_it)
+    {
+        Review* x = a_it->second;
+        Review* y = b_it->second;
+        if (a_it->first != b_it->first || x->date != y->date || x->helpful != y->helpful
+            || x->rating != y->rating || x->votes != y->votes || x->product_id != y->product_id)
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // // these two should be the same size
-    // cout << "user_to_nodeid: " << user_to_nodeid.size() << endl;
-    // cout << "nodeid_to_user: " << nodeid_to_user.size() << endl;
 
-    /* we're not using these one right now */
-    // cout << "user_co_reviews: " << user_co_reviews.size() << endl;
-    // cout << "user_graph: " << user_graph.size() << endl;
+bool same_parse_output(ParsedData& a, ParsedData& b)
+{
+    if (a.asin_to_product.size() != b.asin_to_product.size()
+        || a.user_to_nodeid != b.user_to_nodeid
+        || a.nodeid_to_user != b.nodeid_to_user
+        || a.users_to_products != b.users_to_products
+        || a.user_vector != b.user_vector
+        || a.num_purchases != b.num_purchases)
+    {
+        return false;
+    }
 
-    /* roughly 1/10 purchases will be in the test set. this will allow us to 
-     * evaluate the performance of the baseline predictor as well as the one
-     * we are creating. the test set items are (string) user id, (string) asin.*/
-    cout << "making test set" << endl;
-    set< pair<string, string> > test_set = set< pair<string, string> >();
-    extractTestSet(num_purchases, user_vector, users_to_products, test_set, asin_to_product);
-    cout << "test set size: " << test_set.size() << endl;
-    // for (auto it = test_set.begin(); it != test_set.end(); ++it)
-    // {
-    //     cout << (*it).first << ": " << (*it).second << endl;
-    // }
+    for (auto a_it = a.asin_to_product.begin(), b_it = b.asin_to_product.begin(); a_it != a.asin_to_product.end(); ++a_it, ++b_it)
+    {
+        Product* x = a_it->second;
+        Product* y = b_it->second;
+        if (a_it->first != b_it->first || x->asin != y->asin || x->avg_rating != y->avg_rating
+            || *x->categories != *y->categories || x->downloaded_reviews != y->downloaded_reviews
+            || x->group != y->group || x->id != y->id || x->salesrank != y->salesrank
+            || *x->similar != *y->similar || x->title != y->title || x->total_reviews != y->total_reviews
+            || !same_reviews(*x->reviews, *y->reviews))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    cout << "making product graph" << endl;
-    make_product_graph(asin_to_product, product_graph, users_to_products);
-    // int counter = 0;
-    // for (auto it = product_graph.begin(); it != product_graph.end(); ++it)
-    // {
-    //     cout << it->first << endl;
-    //     for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2)
-    //     {
-    //         cout << "  " << (*it2).first << endl;
-    //     }
-    // }
 
-    cout << "making predictions" << endl;
-    checkBaselinePredictions(test_set, users_to_products, product_graph);
+/* Runs the original group_user_co_reviews and checks that every user pair
+ * it finds has the same co-review count in the user graph, and that the
+ * graph has no other edges. Only practical on small files, and only
+ * meaningful without a reviewer cap. */
+bool compare_user_graph(const UserGraph& graph, const IdIndex& ids, ParsedData& data)
+{
+    map<pair<int, int>, set<Product*> > co_reviews;
+    group_user_co_reviews(co_reviews, data.asin_to_product, data.user_to_nodeid);
 
-    cout << "done" << endl;
+    size_t matched = 0;
+    for (auto it = co_reviews.begin(); it != co_reviews.end(); ++it)
+    {
+        uint32_t user1 = ids.user_id(data.nodeid_to_user[it->first.first]);
+        uint32_t user2 = ids.user_id(data.nodeid_to_user[it->first.second]);
+        if (user1 == NO_ID || user2 == NO_ID || user1 >= graph.num_users())
+        {
+            return false;
+        }
 
-    cleanHeap(asin_to_product);
-    return 0;
+        const uint32_t* row = graph.neighbors.data() + graph.begin(user1);
+        const uint32_t* row_end = graph.neighbors.data() + graph.end(user1);
+        const uint32_t* found = lower_bound(row, row_end, user2);
+        if (found == row_end || *found != user2 || graph.co_reviews[found - graph.neighbors.data()] != it->second.size())
+        {
+            return false;
+        }
+        matched++;
+    }
+    return matched == graph.neighbors.size();
 }
 
+
 void cleanHeap(map<string, Product*>&asin_to_product){
     for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it){
-        Product *product = it->second;
+        cleanProduct(it->second);
+    }
+}
 
-        delete product->categories;
-        delete product->similar;
 
-        for (auto review = product->reviews->begin(); review != product->reviews->end(); ++review){
-            delete review->second;
-        }
+void cleanProduct(Product* product){
+    delete product->categories;
+    delete product->similar;
 
-        delete product->reviews;
-        delete product;
+    for (auto review = product->reviews->begin(); review != product->reviews->end(); ++review){
+        delete review->second;
     }
+
+    delete product->reviews;
+    delete product;
 }
 
 
@@ -290,10 +1554,24 @@ int getUserEdgeWeight(int user1, int user2)
 }
 
 
+/* Stores a parsed record under its asin. A repeated asin replaces the
+ * earlier record, which is freed. */
+void store_product(map<string, Product*>& asin_to_product, Product* product)
+{
+    Product*& stored = asin_to_product[product->asin];
+    if (stored != nullptr && stored != product)
+    {
+        cleanProduct(stored);
+    }
+    stored = product;
+}
+
+
 /* Creates the main product-product graph (asin -> product objects; node id ->
  * product object). Also creates the amazon user ID -> node ID graph */
 void parse_file(string filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > >&users_to_products, int &num_purchases, vector<string>&user_vector)
 {
+    INSTRUMENT_SCOPE("parse_file");
     ifstream infile(filename.c_str());
     cout << "opened" << endl;
     string line;
@@ -307,7 +1585,7 @@ void parse_file(string filename, map<string, Product*>& asin_to_product, map<str
     {
         if (line.size() <= 1)
         {
-            asin_to_product[current_product->asin] = current_product;
+            store_product(asin_to_product, current_product);
             current_product = create_product();
             count++;
             if (count % 1000 == 0)
@@ -334,7 +1612,8 @@ void parse_file(string filename, map<string, Product*>& asin_to_product, map<str
         }
         else if (tokens[0].compare(GROUP) == 0)
         {
-            current_product->group = tokens[1];
+            tokens.erase(tokens.begin());
+            current_product->group = boost::join(tokens, " ");
         }
         else if (tokens[0].compare(SALESRANK) == 0)
         {
@@ -350,7 +1629,7 @@ void parse_file(string filename, map<string, Product*>& asin_to_product, map<str
         }
         else if (boost::starts_with(tokens[0], "|"))
         {
-            current_product->categories->push_back(tokens[0]);
+            current_product->categories->push_back(boost::join(tokens, " "));
         }
         else if (tokens[0].compare(REVIEW) == 0)
         {
@@ -362,8 +1641,9 @@ void parse_file(string filename, map<string, Product*>& asin_to_product, map<str
         }
         else if (boost::starts_with(tokens[0], "1") || boost::starts_with(tokens[0], "2"))
         {
+            // date  cutomer: <user>  rating: <n>  votes: <n>  helpful: <n>
             current_product->reviews->insert(pair<string, Review*>(tokens[2],create_review(tokens[0],
-                tokens[4], tokens[6], tokens[tokens.size() - 1], 
+                tokens[tokens.size() - 1], tokens[4], tokens[6],
                 current_product->asin)));
             if (user_to_nodeid.find(tokens[2]) == user_to_nodeid.end())
             {
@@ -379,11 +1659,13 @@ void parse_file(string filename, map<string, Product*>& asin_to_product, map<str
         }
     } 
 
-    asin_to_product[current_product->asin] = current_product;
+    store_product(asin_to_product, current_product);
     // current_product = create_product();
     // count++;
 
     infile.close();
+    INSTRUMENT_COUNT("parse_file products", asin_to_product.size());
+    INSTRUMENT_COUNT("parse_file purchases", num_purchases);
 }
 
 
@@ -411,6 +1693,7 @@ vector<string> split(string str, char delimiter)
     Weight of edges will be added for baseline */
 void make_product_graph(map<string, Product*> &asin_to_product, map<string, set< pair<string, double>> > &product_graph, map< string, set< string > >&users_to_products)
 {
+    INSTRUMENT_SCOPE("make_product_graph");
     for (auto product_it = asin_to_product.begin(); product_it != asin_to_product.end(); ++product_it)
     {
         string first_product_string = product_it->first;
@@ -488,6 +1771,7 @@ double scoreUsersWhoPurchasedBothProducts(string product1, string product2, map<
 #define PERCENTAGE_TEST_PURCHASES 5
 void extractTestSet(int num_purchases, vector<string>& user_vector, map< string, set< string > >& users_to_products, set< pair<string, string> >& test_set, map<string, Product*>& asin_to_product) 
 {   
+    INSTRUMENT_SCOPE("extractTestSet");
     // int numInTest = int(num_purchases * (PERCENTAGE_TEST_PURCHASES / 100.0));
     int numInTest = 100;
     for (int i = 0; i < numInTest; i++)
@@ -531,13 +1815,17 @@ void extractTestSet(int num_purchases, vector<string>& user_vector, map< string,
         test_set.insert( pair<string, string>(chosen_user, chosen_product) );
         users_to_products[chosen_user].erase(chosen_product);
         user_vector.erase(remove(user_vector.begin(), user_vector.end(), chosen_user), user_vector.end());
-        asin_to_product[chosen_product]->reviews->erase(chosen_user);
+        map<string, Review*>* reviews = asin_to_product[chosen_product]->reviews;
+        auto review = reviews->find(chosen_user);
+        if (review != reviews->end())
+        {
+            delete review->second;
+            reviews->erase(review);
+        }
     }
 }
 
 
-#define NUMBER_IN_RECOMMENTATION_SET 5
-
 void printRecommendations(vector< pair<string, double> >&productRecommendations)
 {
     for (int i = 0; i < NUMBER_IN_RECOMMENTATION_SET; i++)
@@ -552,22 +1840,33 @@ void printRecommendations(vector< pair<string, double> >&productRecommendations)
 
 bool sortRecommendationsCmp(const pair<string, double>& edge1, const pair<string, double>& edge2)
 {
-    return (edge1.second >= edge2.second);
+    return (edge1.second > edge2.second);
 }
 
 
-set<string> makeBaselinePrediction(string user, map< string, set< string > >& users_to_products, map<string, set< pair<string, double>> >& product_graph)
+set<string> makeBaselinePrediction(const string& user, const map< string, set< string > >& users_to_products, const map<string, set< pair<string, double>> >& product_graph)
 {
     vector< pair<string, double> >recommendation_candidates = vector<pair<string, double>>();
+
+    /* look keys up with find rather than operator[], which would insert
+     * missing users and products into the shared maps */
+    auto purchased = users_to_products.find(user);
+    if (purchased == users_to_products.end())
+    {
+        return set<string>();
+    }
     
     // iterate over items in user's purchased set
-    for (auto items_it = users_to_products[user].begin(); items_it != users_to_products[user].end(); ++items_it)
+    for (auto items_it = purchased->second.begin(); items_it != purchased->second.end(); ++items_it)
     {
-        string item_asin = *items_it;
+        const string& item_asin = *items_it;
         // cout << item_asin << endl;
 
+        auto edges = product_graph.find(item_asin);
+        if (edges == product_graph.end()) continue;
+
         // iterate over edges for a purchased item
-        for (auto edges_it = product_graph[item_asin].begin(); edges_it != product_graph[item_asin].end(); ++edges_it)
+        for (auto edges_it = edges->second.begin(); edges_it != edges->second.end(); ++edges_it)
         {
             pair<string, double>edge = *edges_it;
             // cout << "  " << edge.first << endl;
@@ -596,6 +1895,7 @@ set<string> makeBaselinePrediction(string user, map< string, set< string > >& us
 
 void checkBaselinePredictions(set< pair<string, string> >&test_set, map< string, set< string > >&users_to_products, map<string, set< pair<string, double>> >&product_graph)
 {
+    INSTRUMENT_SCOPE("checkBaselinePredictions");
     int numCorrect = 0;
     for (auto test_it = test_set.begin(); test_it != test_set.end(); ++test_it)
     {
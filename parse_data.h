@@ -0,0 +1,98 @@
+#ifndef PARSE_DATA_H
+#define PARSE_DATA_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+const std::string ASIN = "ASIN:";
+const std::string GROUP = "group:";
+const std::string ID = "Id:";
+const std::string REVIEW = "reviews:";
+const std::string SALESRANK = "salesrank:";
+const std::string SIMILAR = "similar:";
+const std::string TITLE = "title:";
+
+#define NUMBER_IN_RECOMMENTATION_SET 5
+
+
+// review information
+typedef struct {
+    std::string date;        // date that the review was created
+    int helpful;             // number of people who found the review helpful
+    int rating;              // number of stars given to product by this rating (1-5)
+    int votes;               // number of people who voted on if the review was helpful
+    std::string product_id;  // product ID
+} Review;
+
+
+// product information
+typedef struct {
+    std::string asin;                              // amazon product ID
+    double avg_rating;                             // average star rating from all of the reviews
+    std::vector<std::string>* categories;          // categorization of the product
+    int downloaded_reviews;                        // number of reviews of the product that are captured in the dataset
+    std::string group;                             // major category (books, music, etc.)
+    int id;                                        // index in the database (probably not useful)
+    std::map<std::string, Review*>* reviews;       // map of amazon user id -> review struct
+    int salesrank;                                 // amazon salesrank score
+    std::vector<std::string>* similar;             // co-purchased product asins
+    std::string title;                             // name of the item
+    int total_reviews;                             // number of total product reviews, usually equal to downloaded_reviews
+} Product;
+
+
+// function prototypes
+void checkBaselinePredictions(std::set< std::pair<std::string, std::string> >&test_set, std::map< std::string, std::set< std::string > >&users_to_products, std::map<std::string, std::set< std::pair<std::string, double>> >&product_graph);
+
+Product* create_product();
+Review* create_review(std::string date, std::string helpful, std::string rating, std::string votes, std::string product_id);
+
+void extractTestSet(int num_purchases, std::vector<std::string> &user_vector, std::map< std::string, std::set< std::string > >&users_to_products, std::set< std::pair<std::string, std::string> >&test_set, std::map<std::string, Product*>& asin_to_product);
+
+int getUserEdgeWeight(int user1, int user2);
+
+void group_user_co_reviews(std::map< std::pair<int, int>, std::set<Product*> >& co_reviews, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid);
+
+std::set<std::string> makeBaselinePrediction(const std::string& user, const std::map< std::string, std::set< std::string > >&users_to_products, const std::map<std::string, std::set< std::pair<std::string, double>> >&product_graph);
+
+void make_product_graph(std::map<std::string, Product*> &asin_to_product, std::map<std::string, std::set< std::pair<std::string, double>> > &product_graph, std::map< std::string, std::set< std::string > >&users_to_products);
+
+void make_user_graph(std::map< std::string, int>& user_to_nodeid, std::map<std::pair<int, int>, std::set<Product*> >& co_reviews, std::map< int, std::set< std::pair<int, int>> >& user_graph);
+
+void parse_file(std::string filename, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map<int, std::string>& nodeid_to_user, std::map< std::string, std::set< std::string > > &users_to_products, int &num_purchases, std::vector<std::string>&user_vector);
+
+void store_product(std::map<std::string, Product*>& asin_to_product, Product* product);
+
+double scoreUsersWhoPurchasedBothProducts(std::string product1, std::string product2, std::map< std::string, std::set< std::string > >&users_to_products, std::map<std::string, Product*>& asin_to_product);
+
+std::vector<std::string> split(std::string str, char delimiter);
+void cleanHeap(std::map<std::string, Product*>&asin_to_product);
+void cleanProduct(Product* product);
+
+/* Everything parse_file fills, bundled together for the loaders and the
+ * modes that compare them. The products are freed on destruction. */
+struct ParsedData
+{
+    std::map<std::string, Product*> asin_to_product;
+    std::map<std::string, int> user_to_nodeid;
+    std::map<int, std::string> nodeid_to_user;
+    std::map< std::string, std::set< std::string > > users_to_products;
+    int num_purchases = 0;
+    std::vector<std::string> user_vector;
+
+    ParsedData() {}
+    ~ParsedData() { cleanHeap(asin_to_product); }
+    ParsedData(const ParsedData&) = delete;
+    ParsedData& operator=(const ParsedData&) = delete;
+};
+
+/* Returns true if two loads of the data file produced the same products,
+ * reviews and user tables. Used to check alternative loaders against
+ * parse_file. */
+bool same_parse_output(ParsedData& a, ParsedData& b);
+
+#endif
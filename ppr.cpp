@@ -0,0 +1,254 @@
+#include "ppr.h"
+
+#include <algorithm>
+
+using namespace std;
+
+
+namespace {
+
+inline size_t node_degree(const PprGraph& graph, uint32_t node)
+{
+    size_t num_users = graph.num_users();
+    if (node < num_users)
+    {
+        return graph.user_items->degree(node);
+    }
+    uint32_t product = node - num_users;
+    return graph.reviewers.count(product) + (graph.products->end(product) - graph.products->begin(product));
+}
+
+
+/* How a product splits its outgoing mass between product graph edges and
+ * buyers. Falls back to whichever side exists. */
+inline double similar_share(const PprGraph& graph, const PprOptions& options, uint32_t product)
+{
+    bool has_similar = graph.products->end(product) > graph.products->begin(product);
+    bool has_buyers = graph.reviewers.count(product) > 0;
+    if (!has_similar) return 0;
+    return has_buyers ? options.similar_share : 1;
+}
+
+
+/* Weight of product graph edge e as a share of the product's edges; even
+ * split if all weights are zero. */
+inline double edge_share(const PprGraph& graph, uint32_t product, uint64_t e)
+{
+    double total = graph.similar_total[product];
+    if (total > 0) return graph.products->weights[e] / total;
+    return 1.0 / (graph.products->end(product) - graph.products->begin(product));
+}
+
+
+class Pusher
+{
+public:
+    Pusher(const PprGraph& graph, const PprOptions& options, PprScratch& scratch)
+        : graph_(graph), options_(options), s_(scratch), num_users_(graph.num_users()) {}
+
+    void add(uint32_t node, double mass)
+    {
+        if (s_.stamp[node] != s_.generation)
+        {
+            s_.stamp[node] = s_.generation;
+            s_.estimate[node] = 0;
+            s_.residual[node] = 0;
+            s_.queued[node] = 0;
+            s_.touched.push_back(node);
+        }
+        s_.residual[node] += mass;
+        if (!s_.queued[node] && s_.residual[node] > options_.epsilon * max<size_t>(1, node_degree(graph_, node)))
+        {
+            s_.queued[node] = 1;
+            s_.queue.push_back(node);
+        }
+    }
+
+    void run(uint32_t source)
+    {
+        add(source, 1.0);
+        for (size_t head = 0; head < s_.queue.size() && s_.pushes < options_.max_pushes; head++)
+        {
+            uint32_t node = s_.queue[head];
+            s_.queued[node] = 0;
+            double mass = s_.residual[node];
+            s_.residual[node] = 0;
+            s_.estimate[node] += options_.alpha * mass;
+            spread(source, node, (1 - options_.alpha) * mass);
+            s_.pushes++;
+        }
+    }
+
+private:
+    void spread(uint32_t source, uint32_t node, double mass)
+    {
+        if (node < num_users_)
+        {
+            size_t degree = graph_.user_items->degree(node);
+            if (degree == 0)
+            {
+                add(source, mass);
+                return;
+            }
+            for (const uint32_t* item = graph_.user_items->begin(node); item != graph_.user_items->end(node); ++item)
+            {
+                add(num_users_ + *item, mass / degree);
+            }
+            return;
+        }
+
+        uint32_t product = node - num_users_;
+        size_t buyers = graph_.reviewers.count(product);
+        double to_similar = similar_share(graph_, options_, product);
+        if (to_similar == 0 && buyers == 0)
+        {
+            add(source, mass);
+            return;
+        }
+        for (uint64_t e = graph_.products->begin(product); e < graph_.products->end(product) && to_similar > 0; e++)
+        {
+            add(num_users_ + graph_.products->neighbors[e], mass * to_similar * edge_share(graph_, product, e));
+        }
+        const uint32_t* buyer = graph_.reviewers.begin(product);
+        for (size_t i = 0; i < buyers; i++)
+        {
+            add(buyer[i], mass * (1 - to_similar) / buyers);
+        }
+    }
+
+    const PprGraph& graph_;
+    const PprOptions& options_;
+    PprScratch& s_;
+    size_t num_users_;
+};
+
+
+/* One step of the walk from node, or the source again at dead ends. */
+uint32_t walk_step(const PprGraph& graph, const PprOptions& options, uint32_t source, uint32_t node, mt19937_64& random)
+{
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    size_t num_users = graph.num_users();
+    if (node < num_users)
+    {
+        size_t degree = graph.user_items->degree(node);
+        if (degree == 0) return source;
+        return num_users + graph.user_items->begin(node)[uniform_int_distribution<size_t>(0, degree - 1)(random)];
+    }
+
+    uint32_t product = node - num_users;
+    size_t buyers = graph.reviewers.count(product);
+    double to_similar = similar_share(graph, options, product);
+    if (to_similar == 0 && buyers == 0) return source;
+
+    if (unit(random) < to_similar)
+    {
+        double pick = unit(random);
+        uint64_t last = graph.products->end(product) - 1;
+        for (uint64_t e = graph.products->begin(product); e < last; e++)
+        {
+            pick -= edge_share(graph, product, e);
+            if (pick < 0) return num_users + graph.products->neighbors[e];
+        }
+        return num_users + graph.products->neighbors[last];
+    }
+    return graph.reviewers.begin(product)[uniform_int_distribution<size_t>(0, buyers - 1)(random)];
+}
+
+}
+
+
+void PprScratch::reset(size_t num_nodes)
+{
+    if (estimate.size() != num_nodes)
+    {
+        estimate.assign(num_nodes, 0);
+        residual.assign(num_nodes, 0);
+        stamp.assign(num_nodes, 0);
+        queued.assign(num_nodes, 0);
+        generation = 0;
+    }
+}
+
+
+void build_ppr_graph(const IdIndex& ids, const UserItems& user_items, const CsrGraph& products, PprGraph& graph)
+{
+    graph.user_items = &user_items;
+    graph.products = &products;
+    build_reviewer_index(ids, user_items, graph.reviewers);
+
+    graph.similar_total.assign(products.num_nodes(), 0);
+    for (uint32_t product = 0; product < products.num_nodes(); product++)
+    {
+        for (uint64_t e = products.begin(product); e < products.end(product); e++)
+        {
+            graph.similar_total[product] += products.weights[e];
+        }
+    }
+}
+
+
+void recommend_ppr(uint32_t user, size_t k, const PprGraph& graph, const PprOptions& options, PprScratch& scratch, vector<uint32_t>& out)
+{
+    out.clear();
+    scratch.reset(graph.num_nodes());
+    scratch.touched.clear();
+    scratch.queue.clear();
+    scratch.pushes = 0;
+    if (++scratch.generation == 0)
+    {
+        fill(scratch.stamp.begin(), scratch.stamp.end(), 0);
+        scratch.generation = 1;
+    }
+
+    if (options.method == "walks")
+    {
+        // the end points of walks with geometric length estimate the PageRank
+        scratch.random.seed(options.seed ^ (uint64_t(user) * 0x9E3779B97F4A7C15ULL));
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        double share = 1.0 / max<size_t>(1, options.walks);
+        for (size_t w = 0; w < options.walks; w++)
+        {
+            uint32_t node = user;
+            while (unit(scratch.random) >= options.alpha)
+            {
+                node = walk_step(graph, options, user, node, scratch.random);
+                scratch.pushes++;
+            }
+            if (scratch.stamp[node] != scratch.generation)
+            {
+                scratch.stamp[node] = scratch.generation;
+                scratch.estimate[node] = 0;
+                scratch.touched.push_back(node);
+            }
+            scratch.estimate[node] += share;
+        }
+    }
+    else
+    {
+        Pusher(graph, options, scratch).run(user);
+    }
+
+    // rank the products the user has not bought yet
+    size_t num_users = graph.num_users();
+    const uint32_t* purchased = graph.user_items->begin(user);
+    const uint32_t* purchased_end = graph.user_items->end(user);
+    scratch.candidates.clear();
+    for (uint32_t node : scratch.touched)
+    {
+        if (node < num_users || scratch.estimate[node] <= 0) continue;
+        uint32_t product = node - num_users;
+        if (binary_search(purchased, purchased_end, product)) continue;
+        scratch.candidates.emplace_back(scratch.estimate[node], product);
+    }
+
+    auto better = [](const pair<double, uint32_t>& a, const pair<double, uint32_t>& b)
+    {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    };
+    size_t count = min(k, scratch.candidates.size());
+    partial_sort(scratch.candidates.begin(), scratch.candidates.begin() + count, scratch.candidates.end(), better);
+    for (size_t i = 0; i < count; i++)
+    {
+        out.push_back(scratch.candidates[i].second);
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef PPR_H
+#define PPR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "id_index.h"
+
+
+/* Graph walked by the personalized PageRank recommender: users and
+ * products as one node set (users first, then products), with every
+ * purchase as an edge both ways and the weighted product graph edges on
+ * top. Holds pointers to the purchases and the product graph, which have
+ * to outlive it. */
+struct PprGraph
+{
+    const UserItems* user_items = nullptr;   // user -> purchased products
+    const CsrGraph* products = nullptr;      // product -> similar products, weighted
+    ReviewerIndex reviewers;                 // product -> users who bought it
+    std::vector<double> similar_total;       // sum of the product graph weights of every product
+
+    size_t num_users() const { return user_items->num_users(); }
+    size_t num_products() const { return products->num_nodes(); }
+    size_t num_nodes() const { return num_users() + num_products(); }
+};
+
+
+struct PprOptions
+{
+    std::string method = "push";   // "push" (residual pushing) or "walks" (Monte Carlo)
+    double alpha = 0.15;           // restart probability
+    double epsilon = 1e-4;         // push: stop once every residual is below epsilon * degree
+    double similar_share = 0.5;    // share of a product's outgoing mass sent along product graph edges
+    size_t walks = 2000;           // walks: number of random walks per query
+    size_t max_pushes = 200000;    // push: hard limit on pushes per query
+    uint32_t seed = 224;           // walks: combined with the user id, so results are repeatable
+};
+
+
+/* Per-thread working memory, reused across queries like TopKScratch. */
+struct PprScratch
+{
+    std::vector<double> estimate;          // PageRank estimate per node
+    std::vector<double> residual;          // mass not yet pushed per node
+    std::vector<uint32_t> stamp;           // query generation that last touched the node
+    std::vector<uint32_t> touched;         // nodes touched by the current query
+    std::vector<uint32_t> queue;           // nodes waiting to be pushed
+    std::vector<char> queued;
+    std::vector< std::pair<double, uint32_t> > candidates;
+    std::mt19937_64 random;
+    uint32_t generation = 0;
+    size_t pushes = 0;                     // work done by the last query
+
+    void reset(size_t num_nodes);
+};
+
+
+/* Builds the reverse purchase index and the per-product weight totals. */
+void build_ppr_graph(const IdIndex& ids, const UserItems& user_items, const CsrGraph& products, PprGraph& graph);
+
+/* Recommends the k products with the highest personalized PageRank for the
+ * user (restarting at the user), leaving out products the user already
+ * bought. From a user, mass goes evenly to the purchased products; from a
+ * product, similar_share of it follows the product graph in proportion to
+ * the edge weights and the rest goes evenly to the product's buyers. With
+ * method "push" the work per query is bounded by 1 / (alpha * epsilon)
+ * edge updates and by max_pushes; with "walks" by the number of walks. out
+ * is filled best first, ties to the lower product id. */
+void recommend_ppr(uint32_t user, size_t k, const PprGraph& graph, const PprOptions& options, PprScratch& scratch, std::vector<uint32_t>& out);
+
+#endif
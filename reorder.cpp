@@ -0,0 +1,527 @@
+#include "reorder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <random>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stopwatch.h"
+#include "topk.h"
+
+using namespace std;
+
+
+namespace {
+
+// neighbors this close share a cache line or the next one of a double array
+const uint32_t NEAR_GAP = 8;
+
+// seed of the shuffled query order
+const uint32_t QUERY_SEED = 224;
+
+// seed of the random layout, not the query order's or its users would be
+// queried in storage order
+const uint32_t RANDOM_LAYOUT_SEED = 7;
+
+// timed runs of every measurement, the fastest is reported
+const int MEASURE_RUNS = 3;
+
+
+/* Counts hardware cache misses of this thread in user space through
+ * perf_event_open. Virtual machines and locked down kernels often refuse
+ * the counter, then available() is false and the counts are 0. */
+class CacheMissCounter
+{
+public:
+    explicit CacheMissCounter(uint64_t config) : fd_(-1)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = config == PERF_COUNT_HW_CACHE_MISSES ? PERF_TYPE_HARDWARE : PERF_TYPE_HW_CACHE;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~CacheMissCounter()
+    {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+    bool available() const { return fd_ >= 0; }
+
+    void start()
+    {
+        if (fd_ < 0) return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t stop()
+    {
+        if (fd_ < 0) return 0;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) return 0;
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+const uint64_t L1D_READ_MISSES = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+
+/* Seconds and cache misses of one measured run. */
+struct Measurement
+{
+    double seconds = 0;
+    uint64_t llc_misses = 0;
+    uint64_t l1_misses = 0;
+};
+
+/* The fastest of MEASURE_RUNS runs of body. */
+template <typename Body>
+Measurement measure(CacheMissCounter& llc, CacheMissCounter& l1, Body body)
+{
+    Measurement best;
+    for (int run = 0; run < MEASURE_RUNS; run++)
+    {
+        Measurement result;
+        llc.start();
+        l1.start();
+        Stopwatch timer;
+        body();
+        result.seconds = timer.elapsed_seconds();
+        result.l1_misses = l1.stop();
+        result.llc_misses = llc.stop();
+        if (run == 0 || result.seconds < best.seconds) best = result;
+    }
+    return best;
+}
+
+
+void invert(IdPermutation& permutation)
+{
+    permutation.new_id.assign(permutation.old_id.size(), 0);
+    for (uint32_t n = 0; n < permutation.old_id.size(); n++)
+    {
+        permutation.new_id[permutation.old_id[n]] = n;
+    }
+}
+
+void identity(size_t size, IdPermutation& permutation)
+{
+    permutation.old_id.resize(size);
+    for (uint32_t n = 0; n < size; n++) permutation.old_id[n] = n;
+    invert(permutation);
+}
+
+
+/* Both directions of every edge, in CSR form. */
+void undirected_adjacency(const CsrGraph& graph, vector<uint64_t>& offsets, vector<uint32_t>& neighbors)
+{
+    size_t nodes = graph.num_nodes();
+    offsets.assign(nodes + 1, 0);
+    for (uint32_t node = 0; node < nodes; node++)
+    {
+        for (uint64_t e = graph.begin(node); e < graph.end(node); e++)
+        {
+            offsets[node + 1]++;
+            offsets[graph.neighbors[e] + 1]++;
+        }
+    }
+    for (size_t node = 0; node < nodes; node++) offsets[node + 1] += offsets[node];
+
+    neighbors.resize(offsets[nodes]);
+    vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+    for (uint32_t node = 0; node < nodes; node++)
+    {
+        for (uint64_t e = graph.begin(node); e < graph.end(node); e++)
+        {
+            neighbors[fill[node]++] = graph.neighbors[e];
+            neighbors[fill[graph.neighbors[e]]++] = node;
+        }
+    }
+}
+
+
+void degree_order(const vector<uint64_t>& offsets, vector<uint32_t>& order)
+{
+    size_t nodes = offsets.size() - 1;
+    order.resize(nodes);
+    for (uint32_t node = 0; node < nodes; node++) order[node] = node;
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        return offsets[a + 1] - offsets[a] > offsets[b + 1] - offsets[b];
+    });
+}
+
+
+void rcm_order(const vector<uint64_t>& offsets, const vector<uint32_t>& neighbors, vector<uint32_t>& order)
+{
+    size_t nodes = offsets.size() - 1;
+    auto degree = [&](uint32_t node) { return offsets[node + 1] - offsets[node]; };
+
+    // components start from their lowest degree product
+    vector<uint32_t> starts(nodes);
+    for (uint32_t node = 0; node < nodes; node++) starts[node] = node;
+    stable_sort(starts.begin(), starts.end(), [&](uint32_t a, uint32_t b) { return degree(a) < degree(b); });
+
+    order.clear();
+    order.reserve(nodes);
+    vector<bool> visited(nodes, false);
+    vector<uint32_t> next;
+    for (uint32_t start : starts)
+    {
+        if (visited[start]) continue;
+        visited[start] = true;
+        // order doubles as the breadth first queue
+        size_t head = order.size();
+        order.push_back(start);
+        for (; head < order.size(); head++)
+        {
+            uint32_t node = order[head];
+            next.clear();
+            for (uint64_t e = offsets[node]; e < offsets[node + 1]; e++)
+            {
+                uint32_t neighbor = neighbors[e];
+                if (!visited[neighbor])
+                {
+                    visited[neighbor] = true;
+                    next.push_back(neighbor);
+                }
+            }
+            stable_sort(next.begin(), next.end(), [&](uint32_t a, uint32_t b) { return degree(a) < degree(b); });
+            order.insert(order.end(), next.begin(), next.end());
+        }
+    }
+    reverse(order.begin(), order.end());
+}
+
+
+void order_users(const UserItems& user_items, const IdPermutation& products, IdPermutation& users)
+{
+    size_t num_users = user_items.num_users();
+    vector<uint32_t> first(num_users, UINT32_MAX);
+    for (uint32_t user = 0; user < num_users; user++)
+    {
+        for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+        {
+            first[user] = min(first[user], products.new_id[*item]);
+        }
+    }
+    users.old_id.resize(num_users);
+    for (uint32_t user = 0; user < num_users; user++) users.old_id[user] = user;
+    stable_sort(users.old_id.begin(), users.old_id.end(), [&](uint32_t a, uint32_t b) { return first[a] < first[b]; });
+    invert(users);
+}
+
+
+void reorder_similar_lists(const SimilarLists& similar, const IdPermutation& products, SimilarLists& out)
+{
+    out.offsets.assign(1, 0);
+    out.offsets.reserve(similar.num_products() + 1);
+    out.products.clear();
+    out.products.reserve(similar.products.size());
+    for (uint32_t product = 0; product < similar.num_products(); product++)
+    {
+        uint32_t old = products.old_id[product];
+        for (uint64_t s = similar.offsets[old]; s < similar.offsets[old + 1]; s++)
+        {
+            out.products.push_back(products.new_id[similar.products[s]]);
+        }
+        out.offsets.push_back(out.products.size());
+    }
+}
+
+
+/* Mean distance between the ids of an edge's end points, and the share of
+ * edges that are at most NEAR_GAP apart. */
+void neighbor_gaps(const CsrGraph& graph, double& mean_gap, double& near_share)
+{
+    double total = 0;
+    size_t near = 0;
+    for (uint32_t node = 0; node < graph.num_nodes(); node++)
+    {
+        for (uint64_t e = graph.begin(node); e < graph.end(node); e++)
+        {
+            uint32_t gap = node > graph.neighbors[e] ? node - graph.neighbors[e] : graph.neighbors[e] - node;
+            total += gap;
+            if (gap <= NEAR_GAP) near++;
+        }
+    }
+    double edges = max<double>(1, graph.num_edges());
+    mean_gap = total / edges;
+    near_share = near / edges;
+}
+
+
+/* recommend_top_k's score of a candidate: the summed weights of the edges
+ * reaching it from the user's purchases. */
+double candidate_score(uint32_t user, uint32_t candidate, const UserItems& user_items, const CsrGraph& graph)
+{
+    double score = 0;
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        const uint32_t* row = graph.neighbors.data() + graph.begin(*item);
+        const uint32_t* row_end = graph.neighbors.data() + graph.end(*item);
+        const uint32_t* edge = lower_bound(row, row_end, candidate);
+        if (edge != row_end && *edge == candidate) score += graph.weights[edge - graph.neighbors.data()];
+    }
+    return score;
+}
+
+
+/* True if two top k lists of a user score the same rank by rank (in the
+ * original ids), so they differ at most in how ties were broken. */
+bool same_scores(uint32_t user, const uint32_t* a, const uint32_t* b, size_t k, const UserItems& user_items, const CsrGraph& graph)
+{
+    for (size_t i = 0; i < k; i++)
+    {
+        if ((a[i] == NO_ID) != (b[i] == NO_ID)) return false;
+        if (a[i] == NO_ID || a[i] == b[i]) continue;
+        double score_a = candidate_score(user, a[i], user_items, graph);
+        double score_b = candidate_score(user, b[i], user_items, graph);
+        if (fabs(score_a - score_b) > 1e-12 * max(1.0, fabs(score_a))) return false;
+    }
+    return true;
+}
+
+
+/* True if b is a, up to the rounding of weights summed in another order. */
+bool same_up_to_rounding(const CsrGraph& a, const CsrGraph& b)
+{
+    if (a.offsets != b.offsets || a.neighbors != b.neighbors) return false;
+    for (size_t e = 0; e < a.num_edges(); e++)
+    {
+        if (fabs(a.weights[e] - b.weights[e]) > 1e-12 * max(1.0, fabs(a.weights[e]))) return false;
+    }
+    return true;
+}
+
+
+string misses(const CacheMissCounter& counter, uint64_t count, size_t per)
+{
+    if (!counter.available()) return "n/a";
+    ostringstream text;
+    text << double(count) / max<size_t>(1, per);
+    return text.str();
+}
+
+}
+
+
+bool compute_reordering(const string& method, const CsrGraph& graph, const UserItems& user_items, GraphReordering& reordering)
+{
+    if (method != "degree" && method != "rcm")
+    {
+        return false;
+    }
+
+    vector<uint64_t> offsets;
+    vector<uint32_t> neighbors;
+    undirected_adjacency(graph, offsets, neighbors);
+    if (method == "degree")
+    {
+        degree_order(offsets, reordering.products.old_id);
+    }
+    else
+    {
+        rcm_order(offsets, neighbors, reordering.products.old_id);
+    }
+    invert(reordering.products);
+    order_users(user_items, reordering.products, reordering.users);
+    return true;
+}
+
+
+void reorder_graph(const CsrGraph& graph, const IdPermutation& products, CsrGraph& out)
+{
+    out.clear();
+    out.offsets.reserve(graph.num_nodes() + 1);
+    out.neighbors.reserve(graph.num_edges());
+    out.weights.reserve(graph.num_edges());
+
+    vector< pair<uint32_t, double> > row;
+    for (uint32_t node = 0; node < graph.num_nodes(); node++)
+    {
+        uint32_t old = products.old_id[node];
+        row.clear();
+        for (uint64_t e = graph.begin(old); e < graph.end(old); e++)
+        {
+            row.emplace_back(products.new_id[graph.neighbors[e]], graph.weights[e]);
+        }
+        out.append_row(row);
+    }
+}
+
+
+void reorder_user_items(const UserItems& user_items, const GraphReordering& reordering, UserItems& out)
+{
+    out.offsets.assign(1, 0);
+    out.offsets.reserve(user_items.num_users() + 1);
+    out.items.clear();
+    out.items.reserve(user_items.items.size());
+    for (uint32_t user = 0; user < user_items.num_users(); user++)
+    {
+        uint32_t old = reordering.users.old_id[user];
+        size_t row = out.items.size();
+        for (const uint32_t* item = user_items.begin(old); item != user_items.end(old); ++item)
+        {
+            out.items.push_back(reordering.products.new_id[*item]);
+        }
+        sort(out.items.begin() + row, out.items.end());
+        out.offsets.push_back(out.items.size());
+    }
+}
+
+
+void reorder_reviewer_index(const ReviewerIndex& index, const GraphReordering& reordering, ReviewerIndex& out)
+{
+    size_t num_products = index.offsets.size() - 1;
+    out.offsets.assign(1, 0);
+    out.offsets.reserve(num_products + 1);
+    out.reviewers.clear();
+    out.reviewers.reserve(index.reviewers.size());
+    for (uint32_t product = 0; product < num_products; product++)
+    {
+        uint32_t old = reordering.products.old_id[product];
+        size_t row = out.reviewers.size();
+        for (const uint32_t* user = index.begin(old); user != index.begin(old) + index.count(old); ++user)
+        {
+            out.reviewers.push_back(*user < reordering.users.size() ? reordering.users.new_id[*user] : *user);
+        }
+        sort(out.reviewers.begin() + row, out.reviewers.end());
+        out.offsets.push_back(out.reviewers.size());
+    }
+
+    // users missing from user_items keep their place at the end
+    out.inverse_degree.resize(index.inverse_degree.size());
+    for (uint32_t user = 0; user < index.inverse_degree.size(); user++)
+    {
+        uint32_t old = user < reordering.users.size() ? reordering.users.old_id[user] : user;
+        out.inverse_degree[user] = index.inverse_degree[old];
+    }
+}
+
+
+void restore_product_ids(const GraphReordering& reordering, vector<uint32_t>& products)
+{
+    for (uint32_t& product : products)
+    {
+        product = reordering.products.old_id[product];
+    }
+}
+
+
+void report_reordering(const SimilarLists& similar, const ReviewerIndex& index, const UserItems& user_items, const CsrGraph& graph, size_t k, unsigned threads)
+{
+    CacheMissCounter llc(PERF_COUNT_HW_CACHE_MISSES);
+    CacheMissCounter l1(L1D_READ_MISSES);
+
+    // the same users for every layout, in an order no layout favours
+    vector<uint32_t> queries(user_items.num_users());
+    for (uint32_t user = 0; user < queries.size(); user++) queries[user] = user;
+    shuffle(queries.begin(), queries.end(), mt19937(QUERY_SEED));
+
+    vector<uint32_t> original_top_k;
+    cout << "graph reordering (" << graph.num_nodes() << " products, " << user_items.num_users() << " users, " << graph.num_edges()
+         << " edges, k = " << k << ", cache misses " << (llc.available() ? "from perf_event_open" : "not available on this machine") << ")" << endl;
+    cout << "order\treorder s\tmean gap\tgap<=" << NEAR_GAP << "\tbuild s\tbuild llc/edge\ttopk us\ttopk llc/q\ttopk l1/q\tbaseline us\tbaseline llc/q\tsame topk scores" << endl;
+
+    // random ids stand in for an asin order with no locality at all
+    const char* methods[] = { "original", "random", "degree", "rcm" };
+    for (const char* method : methods)
+    {
+        GraphReordering reordering;
+        CsrGraph reordered;
+        UserItems items;
+        Stopwatch timer;
+        if (strcmp(method, "original") == 0)
+        {
+            identity(graph.num_nodes(), reordering.products);
+            identity(user_items.num_users(), reordering.users);
+        }
+        else if (strcmp(method, "random") == 0)
+        {
+            identity(graph.num_nodes(), reordering.products);
+            shuffle(reordering.products.old_id.begin(), reordering.products.old_id.end(), mt19937(RANDOM_LAYOUT_SEED));
+            invert(reordering.products);
+            identity(user_items.num_users(), reordering.users);
+            shuffle(reordering.users.old_id.begin(), reordering.users.old_id.end(), mt19937(RANDOM_LAYOUT_SEED));
+            invert(reordering.users);
+        }
+        else
+        {
+            compute_reordering(method, graph, user_items, reordering);
+        }
+        reorder_graph(graph, reordering.products, reordered);
+        reorder_user_items(user_items, reordering, items);
+        double reorder_seconds = timer.elapsed_seconds();
+
+        double mean_gap, near_share;
+        neighbor_gaps(reordered, mean_gap, near_share);
+
+        // the graph build over the relabelled inputs gives the same graph
+        SimilarLists reordered_similar;
+        reorder_similar_lists(similar, reordering.products, reordered_similar);
+        CsrGraph built;
+        Measurement build = measure(llc, l1, [&]
+        {
+            ReviewerIndex reordered_index;
+            reorder_reviewer_index(index, reordering, reordered_index);
+            make_product_graph_parallel(reordered_similar, reordered_index, threads, built);
+        });
+        bool build_same = same_up_to_rounding(reordered, built);
+
+        TopKScratch scratch;
+        scratch.reset(reordered.num_nodes());
+        vector<uint32_t> out;
+        vector<uint32_t> top_k(queries.size() * k, NO_ID);
+        Measurement top_k_run = measure(llc, l1, [&]
+        {
+            for (size_t q = 0; q < queries.size(); q++)
+            {
+                recommend_top_k(reordering.users.new_id[queries[q]], k, items, reordered, scratch, out);
+                restore_product_ids(reordering, out);
+                copy(out.begin(), out.end(), top_k.begin() + q * k);
+            }
+        });
+        Measurement baseline_run = measure(llc, l1, [&]
+        {
+            for (size_t q = 0; q < queries.size(); q++)
+            {
+                rank_baseline_prediction_csr(reordering.users.new_id[queries[q]], k, items, reordered, out);
+            }
+        });
+
+        // ties go to the lower id, so relabelling may swap equally scored products
+        if (original_top_k.empty()) original_top_k = top_k;
+        size_t same_users = 0;
+        for (size_t q = 0; q < queries.size(); q++)
+        {
+            if (same_scores(queries[q], &top_k[q * k], &original_top_k[q * k], k, user_items, graph)) same_users++;
+        }
+
+        double num_queries = max<double>(1, queries.size());
+        cout << method << "\t" << reorder_seconds << "\t" << mean_gap << "\t" << 100 * near_share << "%\t"
+             << build.seconds << (build_same ? "" : " (GRAPH DIFFERS)") << "\t" << misses(llc, build.llc_misses, graph.num_edges()) << "\t"
+             << top_k_run.seconds * 1e6 / num_queries << "\t" << misses(llc, top_k_run.llc_misses, queries.size()) << "\t" << misses(l1, top_k_run.l1_misses, queries.size()) << "\t"
+             << baseline_run.seconds * 1e6 / num_queries << "\t" << misses(llc, baseline_run.llc_misses, queries.size()) << "\t"
+             << 100.0 * same_users / num_queries << "%" << endl;
+    }
+}
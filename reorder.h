@@ -0,0 +1,64 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "id_index.h"
+
+
+/* A relabelling of ids: new_id[old id] and its inverse old_id[new id]. */
+struct IdPermutation
+{
+    std::vector<uint32_t> new_id;
+    std::vector<uint32_t> old_id;
+
+    size_t size() const { return new_id.size(); }
+};
+
+
+/* New product and user ids that put products which are used together next
+ * to each other. The product order comes from the product graph:
+ *
+ *   degree  most edges (in and out) first, ties by old id
+ *   rcm     reverse Cuthill-McKee over the undirected graph: breadth first
+ *           from a lowest degree product of every component, neighbors in
+ *           increasing degree, the whole order reversed
+ *
+ * Users follow their products: ordered by the lowest new id among their
+ * purchases, users without purchases last. */
+struct GraphReordering
+{
+    IdPermutation products;
+    IdPermutation users;
+};
+
+
+/* Returns false for an unknown method. */
+bool compute_reordering(const std::string& method, const CsrGraph& graph, const UserItems& user_items, GraphReordering& reordering);
+
+/* The graph with nodes and neighbors relabelled, rows sorted by the new
+ * neighbor ids. Weights are copied, not recomputed. */
+void reorder_graph(const CsrGraph& graph, const IdPermutation& products, CsrGraph& out);
+
+/* user_items with users and products relabelled, rows sorted. */
+void reorder_user_items(const UserItems& user_items, const GraphReordering& reordering, UserItems& out);
+
+/* The reviewer index with products and users relabelled, lists sorted. */
+void reorder_reviewer_index(const ReviewerIndex& index, const GraphReordering& reordering, ReviewerIndex& out);
+
+/* Maps product ids of a relabelled graph back to the original ids. */
+void restore_product_ids(const GraphReordering& reordering, std::vector<uint32_t>& products);
+
+/* For the original ids and every method: the time to compute and apply the
+ * reordering, how far apart neighbor ids are, the graph build from the
+ * similar: lists and the reviewer index, and a top-k and a baseline query
+ * for every user in a shuffled order, each with cache misses where the CPU
+ * exposes hardware counters to perf_event_open. */
+void report_reordering(const SimilarLists& similar, const ReviewerIndex& index, const UserItems& user_items, const CsrGraph& graph, size_t k, unsigned threads);
+
+#endif
@@ -0,0 +1,280 @@
+#include "review_columns.h"
+
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include <iostream>
+
+#include "instrument.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// minimum time each scan in the review report runs for
+const double MIN_SCAN_SECONDS = 0.5;
+
+// days from 1970-01-01 to the given civil date (proleptic Gregorian)
+long days_from_civil(long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = unsigned(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + long(doe) - 719468;
+}
+
+bool parse_number(string_view& text, long& value)
+{
+    size_t digits = 0;
+    value = 0;
+    while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9')
+    {
+        value = value * 10 + (text[digits] - '0');
+        digits++;
+    }
+    text.remove_prefix(digits);
+    return digits > 0 && digits <= 4;
+}
+
+/* Calls take(i) for every review with day >= min_day and rating >=
+ * min_rating, in index order. The vector loop compares 16 days (two
+ * registers of 8) and 16 ratings at a time: max(0, min - x) is zero exactly
+ * when x >= min, which gives unsigned compares in SSE2. */
+template <typename Take>
+void scan_reviews(const ReviewColumns& columns, uint16_t min_day, uint8_t min_rating, Take take)
+{
+    const uint16_t* day = columns.day.data();
+    const uint8_t* rating = columns.rating.data();
+    size_t n = columns.num_reviews();
+    size_t i = 0;
+
+    const __m128i day_min = _mm_set1_epi16(short(min_day));
+    const __m128i rating_min = _mm_set1_epi8(char(min_rating));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(day + i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(day + i + 8));
+        __m128i low_ok = _mm_cmpeq_epi16(_mm_subs_epu16(day_min, low), zero);
+        __m128i high_ok = _mm_cmpeq_epi16(_mm_subs_epu16(day_min, high), zero);
+        // 0 / -1 words saturate to 0 / -1 bytes
+        __m128i day_ok = _mm_packs_epi16(low_ok, high_ok);
+
+        __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rating + i));
+        __m128i rating_ok = _mm_cmpeq_epi8(_mm_subs_epu8(rating_min, r), zero);
+
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(day_ok, rating_ok)));
+        while (mask != 0)
+        {
+            take(uint32_t(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++)
+    {
+        if (day[i] >= min_day && rating[i] >= min_rating) take(uint32_t(i));
+    }
+}
+
+}
+
+
+uint16_t parse_day(string_view date)
+{
+    long year, month, day;
+    if (!parse_number(date, year) || date.empty() || date[0] != '-') return 0;
+    date.remove_prefix(1);
+    if (!parse_number(date, month) || date.empty() || date[0] != '-') return 0;
+    date.remove_prefix(1);
+    if (!parse_number(date, day) || !date.empty()) return 0;
+    if (month < 1 || month > 12 || day < 1 || day > 31) return 0;
+
+    long days = days_from_civil(year, unsigned(month), unsigned(day));
+    if (days < 0 || days > UINT16_MAX) return 0;
+    return uint16_t(days);
+}
+
+
+size_t ReviewColumns::memory_bytes() const
+{
+    return user.size() * sizeof(uint32_t) + product.size() * sizeof(uint32_t) + day.size() * sizeof(uint16_t)
+         + rating.size() * sizeof(uint8_t) + helpful.size() * sizeof(uint32_t) + votes.size() * sizeof(uint32_t)
+         + product_offsets.size() * sizeof(uint64_t) + user_offsets.size() * sizeof(uint64_t) + by_user.size() * sizeof(uint32_t);
+}
+
+
+void build_review_columns(const map<string, Product*>& asin_to_product, const IdIndex& ids, ReviewColumns& columns)
+{
+    INSTRUMENT_SCOPE("review columns");
+    columns = ReviewColumns();
+
+    size_t total = 0;
+    for (auto& entry : asin_to_product) total += entry.second->reviews->size();
+    columns.user.reserve(total);
+    columns.product.reserve(total);
+    columns.day.reserve(total);
+    columns.rating.reserve(total);
+    columns.helpful.reserve(total);
+    columns.votes.reserve(total);
+
+    // product ids are handed out in asin order, the order of asin_to_product
+    columns.product_offsets.reserve(asin_to_product.size() + 1);
+    columns.product_offsets.push_back(0);
+    uint32_t product = 0;
+    for (auto& entry : asin_to_product)
+    {
+        for (auto& review : *entry.second->reviews)
+        {
+            uint32_t user = ids.user_id(review.first);
+            if (user == NO_ID) continue;
+            uint16_t day = parse_day(review.second->date);
+            columns.user.push_back(user);
+            columns.product.push_back(product);
+            columns.day.push_back(day);
+            columns.rating.push_back(uint8_t(min(max(review.second->rating, 0), 255)));
+            columns.helpful.push_back(uint32_t(max(review.second->helpful, 0)));
+            columns.votes.push_back(uint32_t(max(review.second->votes, 0)));
+            columns.newest_day = max(columns.newest_day, day);
+        }
+        columns.product_offsets.push_back(columns.user.size());
+        product++;
+    }
+
+    // counting sort by user; a stable pass keeps product order within a user
+    columns.user_offsets.assign(ids.num_users() + 1, 0);
+    for (uint32_t user : columns.user) columns.user_offsets[user + 1]++;
+    for (size_t u = 0; u < ids.num_users(); u++) columns.user_offsets[u + 1] += columns.user_offsets[u];
+    vector<uint64_t> next(columns.user_offsets.begin(), columns.user_offsets.end() - 1);
+    columns.by_user.resize(columns.num_reviews());
+    for (size_t i = 0; i < columns.num_reviews(); i++)
+    {
+        columns.by_user[next[columns.user[i]]++] = uint32_t(i);
+    }
+}
+
+
+size_t count_reviews(const ReviewColumns& columns, uint16_t min_day, uint8_t min_rating)
+{
+    size_t count = 0;
+    scan_reviews(columns, min_day, min_rating, [&count](uint32_t) { count++; });
+    return count;
+}
+
+
+void select_reviews(const ReviewColumns& columns, uint16_t min_day, uint8_t min_rating, vector<uint32_t>& out)
+{
+    out.clear();
+    scan_reviews(columns, min_day, min_rating, [&out](uint32_t review) { out.push_back(review); });
+}
+
+
+double ReviewWeighting::weight(const ReviewColumns& columns, uint32_t review) const
+{
+    double age = double(columns.newest_day) - double(columns.day[review]);
+    if (window_days > 0 && age > double(window_days)) return 0;
+
+    double result = 1;
+    if (half_life_days > 0) result *= exp2(-age / half_life_days);
+    if (rating) result *= columns.rating[review] / 5.0;
+    return result;
+}
+
+
+void rank_weighted_baseline_prediction(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, const ReviewColumns& columns, const ReviewWeighting& weighting, vector<uint32_t>& out)
+{
+    INSTRUMENT_COUNT("weighted baseline queries", 1);
+
+    // the user's reviews and purchases are both in product order, so one
+    // forward walk finds the review of each purchase
+    const uint32_t* review = nullptr;
+    const uint32_t* reviews_end = nullptr;
+    if (user < columns.num_users())
+    {
+        review = columns.by_user.data() + columns.user_offsets[user];
+        reviews_end = columns.by_user.data() + columns.user_offsets[user + 1];
+    }
+
+    rank_scaled_baseline_prediction(user, k, user_items, graph, [&](const uint32_t* item) {
+        while (review != reviews_end && columns.product[*review] < *item) ++review;
+        // purchases without a review of their own are not weighted
+        if (review == reviews_end || columns.product[*review] != *item) return 1.0;
+        return weighting.weight(columns, *review);
+    }, out);
+}
+
+
+void report_review_columns(const map<string, Product*>& asin_to_product, const ReviewColumns& columns)
+{
+    // one tree node per review, the Review it points to and the strings of both
+    size_t map_reviews = 0;
+    size_t map_bytes = 0;
+    const size_t review_bytes = (sizeof(Review) + 8 + 15) / 16 * 16;
+    for (auto& entry : asin_to_product)
+    {
+        for (auto& review : *entry.second->reviews)
+        {
+            map_bytes += tree_node_bytes(sizeof(pair<const string, Review*>)) + review_bytes;
+            if (review.first.capacity() > 15) map_bytes += review.first.capacity() + 1;
+            if (review.second->date.capacity() > 15) map_bytes += review.second->date.capacity() + 1;
+            if (review.second->product_id.capacity() > 15) map_bytes += review.second->product_id.capacity() + 1;
+        }
+        map_reviews += entry.second->reviews->size();
+    }
+    size_t column_bytes = columns.memory_bytes();
+
+    cout << "review layout (" << columns.num_reviews() << " reviews, newest day " << columns.newest_day << ")" << endl;
+    cout << "  map<string, Review*>: " << map_bytes << " bytes, " << double(map_bytes) / max<size_t>(1, map_reviews) << " bytes/review" << endl;
+    cout << "  columns:              " << column_bytes << " bytes, " << double(column_bytes) / max<size_t>(1, columns.num_reviews()) << " bytes/review" << endl;
+
+    struct Filter
+    {
+        const char* name;
+        uint16_t min_day;
+        uint8_t min_rating;
+    };
+    uint16_t last_year = columns.newest_day > 365 ? uint16_t(columns.newest_day - 365) : 0;
+    const Filter filters[] = {
+        { "last 365 days", last_year, 0 },
+        { "rating >= 4", 0, 4 },
+        { "both", last_year, 4 },
+    };
+
+    for (const Filter& filter : filters)
+    {
+        // the map has to parse every date it looks at
+        size_t map_count = 0;
+        size_t map_scanned = 0;
+        Stopwatch timer;
+        do
+        {
+            map_count = 0;
+            for (auto& entry : asin_to_product)
+            {
+                for (auto& review : *entry.second->reviews)
+                {
+                    if (review.second->rating >= filter.min_rating && parse_day(review.second->date) >= filter.min_day) map_count++;
+                }
+            }
+            map_scanned += map_reviews;
+        } while (timer.elapsed_seconds() < MIN_SCAN_SECONDS && map_reviews > 0);
+        double map_seconds = timer.elapsed_seconds();
+
+        size_t column_count = 0;
+        size_t column_scanned = 0;
+        timer.reset();
+        do
+        {
+            column_count = count_reviews(columns, filter.min_day, filter.min_rating);
+            column_scanned += columns.num_reviews();
+        } while (timer.elapsed_seconds() < MIN_SCAN_SECONDS && columns.num_reviews() > 0);
+        double column_seconds = timer.elapsed_seconds();
+
+        cout << "  " << filter.name << ": " << column_count << " reviews" << (map_count == column_count ? "" : " (COUNTS DIFFER)")
+             << ", map " << map_scanned / max(map_seconds, 1e-9) / 1e6 << "M reviews/s"
+             << ", columns " << column_scanned / max(column_seconds, 1e-9) / 1e6 << "M reviews/s" << endl;
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef REVIEW_COLUMNS_H
+#define REVIEW_COLUMNS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "csr_graph.h"
+#include "id_index.h"
+#include "parse_data.h"
+
+
+/* Days since 1970-01-01 of a review date as written in the data file
+ * ("2001-12-14", month and day without leading zeros allowed). Dates that
+ * do not parse, or fall outside 1970..2149, give 0. */
+uint16_t parse_day(std::string_view date);
+
+
+/* Every review as struct-of-arrays columns instead of a map<string,
+ * Review*> per product: 15 bytes per review for the columns plus 12 for the
+ * two offset/index entries, against one tree node, one Review and up to
+ * three heap strings. Reviews are sorted by product and, within a product,
+ * by user (the order of the review maps). by_user lists the same reviews
+ * grouped by user, in product order within a user, which is the order of
+ * that user's row in UserItems. */
+struct ReviewColumns
+{
+    // one entry per review
+    std::vector<uint32_t> user;
+    std::vector<uint32_t> product;
+    std::vector<uint16_t> day;              // parse_day of the date
+    std::vector<uint8_t> rating;
+    std::vector<uint32_t> helpful;
+    std::vector<uint32_t> votes;
+
+    std::vector<uint64_t> product_offsets;  // num_products + 1, into the columns
+    std::vector<uint64_t> user_offsets;     // num_users + 1, into by_user
+    std::vector<uint32_t> by_user;          // review indices
+
+    uint16_t newest_day = 0;                // the most recent review, "now" for recency
+
+    size_t num_reviews() const { return user.size(); }
+    size_t num_users() const { return user_offsets.empty() ? 0 : user_offsets.size() - 1; }
+    size_t memory_bytes() const;
+};
+
+
+void build_review_columns(const std::map<std::string, Product*>& asin_to_product, const IdIndex& ids, ReviewColumns& columns);
+
+/* Number of reviews with day >= min_day and rating >= min_rating, and the
+ * indices of those reviews. Both run an SSE2 filter over 16 reviews per
+ * step (saturating subtracts as unsigned compares) and a scalar tail. */
+size_t count_reviews(const ReviewColumns& columns, uint16_t min_day, uint8_t min_rating);
+void select_reviews(const ReviewColumns& columns, uint16_t min_day, uint8_t min_rating, std::vector<uint32_t>& out);
+
+
+/* How the baseline predictor weighs the user's own purchases: by how
+ * recent the user's review of the product is (halving every half life),
+ * by its rating (rating / 5), and within a window of days before
+ * newest_day (purchases outside it are ignored). */
+struct ReviewWeighting
+{
+    double half_life_days = 0;     // 0: no recency weighting
+    bool rating = false;
+    size_t window_days = 0;        // 0: no window
+
+    bool active() const { return half_life_days > 0 || rating || window_days > 0; }
+
+    /* Weight of a purchase by its review, 0 outside the window. */
+    double weight(const ReviewColumns& columns, uint32_t review) const;
+};
+
+/* rank_baseline_prediction_csr with the edges leaving every purchased
+ * product scaled by the weight of the user's review of it. */
+void rank_weighted_baseline_prediction(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, const ReviewColumns& columns, const ReviewWeighting& weighting, std::vector<uint32_t>& out);
+
+/* Prints the memory of the columns next to the review maps, and the scan
+ * speed of three filters (last year, rating >= 4, both) over both layouts,
+ * checking that they count the same reviews. */
+void report_review_columns(const std::map<std::string, Product*>& asin_to_product, const ReviewColumns& columns);
+
+#endif
@@ -0,0 +1,286 @@
+#include "scoring_policies.h"
+
+#include <iostream>
+
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+template <typename Weight, typename Normalization, typename Aggregation>
+ScoringPipeline make_pipeline(const char* name, bool needs_ratings)
+{
+    ScoringPipeline pipeline;
+    pipeline.name = name;
+    pipeline.needs_ratings = needs_ratings;
+    pipeline.build_graph = &build_policy_graph<Weight, Normalization>;
+    pipeline.rank_k5 = &rank_policy_top_k<5, Aggregation>;
+    pipeline.rank_k10 = &rank_policy_top_k<10, Aggregation>;
+    pipeline.rank_k20 = &rank_policy_top_k<20, Aggregation>;
+    pipeline.rank_any = &rank_policy_top_k<0, Aggregation>;
+    return pipeline;
+}
+
+const ScoringPipeline PIPELINES[] = {
+    make_pipeline<InverseDegreeWeight, TargetNormalization, SumAggregation>("baseline", false),
+    make_pipeline<InverseDegreeWeight, CosineNormalization, SumAggregation>("degree", false),
+    make_pipeline<UnitWeight, JaccardNormalization, MaxAggregation>("jaccard", false),
+    make_pipeline<RatingWeight, TargetNormalization, SumAggregation>("rating", true),
+};
+
+
+/* The same pipelines behind an interface, one virtual call per co-reviewer,
+ * per edge and per aggregated candidate edge, for the benchmark. */
+class VirtualScoring
+{
+public:
+    virtual ~VirtualScoring() {}
+    virtual double weight(const ScoringContext& context, uint32_t user, uint64_t position) const = 0;
+    virtual double normalize(double sum, size_t degree1, size_t degree2) const = 0;
+    virtual double combine(double score, double weight) const = 0;
+};
+
+template <typename Weight, typename Normalization, typename Aggregation>
+class VirtualPolicies : public VirtualScoring
+{
+public:
+    double weight(const ScoringContext& context, uint32_t user, uint64_t position) const override { return Weight::weight(context, user, position); }
+    double normalize(double sum, size_t degree1, size_t degree2) const override { return Normalization::normalize(sum, degree1, degree2); }
+    double combine(double score, double weight) const override { return Aggregation::combine(score, weight); }
+};
+
+const VirtualPolicies<InverseDegreeWeight, TargetNormalization, SumAggregation> VIRTUAL_BASELINE;
+const VirtualPolicies<InverseDegreeWeight, CosineNormalization, SumAggregation> VIRTUAL_DEGREE;
+const VirtualPolicies<UnitWeight, JaccardNormalization, MaxAggregation> VIRTUAL_JACCARD;
+const VirtualPolicies<RatingWeight, TargetNormalization, SumAggregation> VIRTUAL_RATING;
+
+// in the order of PIPELINES
+const VirtualScoring* const VIRTUAL_PIPELINES[] = { &VIRTUAL_BASELINE, &VIRTUAL_DEGREE, &VIRTUAL_JACCARD, &VIRTUAL_RATING };
+
+
+double virtual_edge_weight(const VirtualScoring& scoring, const ScoringContext& context, uint32_t product1, uint32_t product2)
+{
+    const ReviewerIndex& index = *context.index;
+    const uint32_t* a = index.begin(product1);
+    const uint32_t* b = index.begin(product2);
+    size_t a_size = index.count(product1);
+    size_t b_size = index.count(product2);
+    uint64_t b_offset = index.offsets[product2];
+
+    double sum = 0;
+    size_t i = 0, j = 0;
+    while (i < a_size && j < b_size)
+    {
+        if (a[i] < b[j])
+        {
+            i++;
+        }
+        else if (b[j] < a[i])
+        {
+            j++;
+        }
+        else
+        {
+            sum += scoring.weight(context, b[j], b_offset + j);
+            i++;
+            j++;
+        }
+    }
+    return scoring.normalize(sum, a_size, b_size);
+}
+
+
+// true if a ranks ahead of b: higher score, ties to the lower product id
+bool better(const pair<double, uint32_t>& a, const pair<double, uint32_t>& b)
+{
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+}
+
+/* rank_policy_top_k with a runtime k, a virtual combine and a heap ordered
+ * through a comparator, the way recommend_top_k and the baseline rank. */
+void virtual_top_k(const VirtualScoring& scoring, uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, vector<uint32_t>& out)
+{
+    out.clear();
+    scratch.reset(graph.num_nodes());
+    scratch.touched.clear();
+    if (++scratch.generation == 0)
+    {
+        fill(scratch.stamp.begin(), scratch.stamp.end(), 0);
+        scratch.generation = 1;
+    }
+    uint32_t generation = scratch.generation;
+
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        scratch.stamp[*item] = generation;
+        scratch.scores[*item] = -HUGE_VAL;
+    }
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        for (uint64_t e = graph.begin(*item); e < graph.end(*item); e++)
+        {
+            uint32_t candidate = graph.neighbors[e];
+            if (scratch.stamp[candidate] != generation)
+            {
+                scratch.stamp[candidate] = generation;
+                scratch.scores[candidate] = graph.weights[e];
+                scratch.touched.push_back(candidate);
+            }
+            else if (scratch.scores[candidate] != -HUGE_VAL)
+            {
+                scratch.scores[candidate] = scoring.combine(scratch.scores[candidate], graph.weights[e]);
+            }
+        }
+    }
+
+    vector< pair<double, uint32_t> >& heap = scratch.heap;
+    heap.clear();
+    if (k == 0) return;
+    bool (*comparator)(const pair<double, uint32_t>&, const pair<double, uint32_t>&) = better;
+    for (uint32_t candidate : scratch.touched)
+    {
+        pair<double, uint32_t> entry(scratch.scores[candidate], candidate);
+        if (heap.size() < k)
+        {
+            heap.push_back(entry);
+            push_heap(heap.begin(), heap.end(), comparator);
+        }
+        else if (comparator(entry, heap.front()))
+        {
+            pop_heap(heap.begin(), heap.end(), comparator);
+            heap.back() = entry;
+            push_heap(heap.begin(), heap.end(), comparator);
+        }
+    }
+    sort_heap(heap.begin(), heap.end(), comparator);
+    for (auto& entry : heap)
+    {
+        out.push_back(entry.second);
+    }
+}
+
+
+/* Seconds for one top-k query per user through rank, and the
+ * recommendations, k slots per user. */
+template <typename Rank>
+double time_queries(const UserItems& user_items, size_t k, vector<uint32_t>& all, Rank rank)
+{
+    all.assign(user_items.num_users() * k, NO_ID);
+    vector<uint32_t> out;
+    Stopwatch timer;
+    for (uint32_t user = 0; user < user_items.num_users(); user++)
+    {
+        rank(user, out);
+        copy(out.begin(), out.end(), all.begin() + size_t(user) * k);
+    }
+    return timer.elapsed_seconds();
+}
+
+bool same_graph(const CsrGraph& a, const CsrGraph& b)
+{
+    return a.offsets == b.offsets && a.neighbors == b.neighbors && a.weights == b.weights;
+}
+
+}
+
+
+const ScoringPipeline* find_scoring_pipeline(const string& name)
+{
+    for (const ScoringPipeline& pipeline : PIPELINES)
+    {
+        if (name == pipeline.name) return &pipeline;
+    }
+    return nullptr;
+}
+
+
+vector<string> scoring_pipeline_names()
+{
+    vector<string> names;
+    for (const ScoringPipeline& pipeline : PIPELINES)
+    {
+        names.push_back(pipeline.name);
+    }
+    return names;
+}
+
+
+void build_reviewer_ratings(const ReviewerIndex& index, const ReviewColumns& columns, vector<float>& ratings)
+{
+    ratings.assign(index.reviewers.size(), 1.0f);
+    size_t products = min(index.offsets.size(), columns.product_offsets.size());
+    for (uint32_t product = 0; product + 1 < products; product++)
+    {
+        // both lists are sorted by user id
+        uint64_t review = columns.product_offsets[product];
+        uint64_t reviews_end = columns.product_offsets[product + 1];
+        for (uint64_t r = index.offsets[product]; r < index.offsets[product + 1]; r++)
+        {
+            uint32_t user = index.reviewers[r];
+            while (review < reviews_end && columns.user[review] < user) review++;
+            if (review < reviews_end && columns.user[review] == user) ratings[r] = columns.rating[review] / 5.0f;
+        }
+    }
+}
+
+
+void report_scoring_policies(const SimilarLists& similar, const ScoringContext& context, const UserItems& user_items, size_t k, unsigned threads)
+{
+    CsrGraph reference_graph;
+    make_product_graph_parallel(similar, *context.index, threads, reference_graph);
+
+    TopKScratch scratch;
+    vector<uint32_t> reference;
+    time_queries(user_items, k, reference, [&](uint32_t user, vector<uint32_t>& out)
+    {
+        recommend_top_k(user, k, user_items, reference_graph, scratch, out);
+    });
+
+    cout << "scoring policies (" << reference_graph.num_edges() << " edges, " << user_items.num_users() << " queries at k = " << k
+         << ", " << threads << " threads)" << endl;
+    cout << "pipeline\tbuild template\tbuild virtual\tquery template\tquery virtual\tsame" << endl;
+    for (size_t p = 0; p < sizeof(PIPELINES) / sizeof(PIPELINES[0]); p++)
+    {
+        const ScoringPipeline& pipeline = PIPELINES[p];
+        const VirtualScoring& scoring = *VIRTUAL_PIPELINES[p];
+        if (pipeline.needs_ratings && context.ratings == nullptr) continue;
+
+        CsrGraph graph;
+        Stopwatch timer;
+        pipeline.build_graph(similar, context, threads, graph);
+        double build_seconds = timer.elapsed_seconds();
+
+        CsrGraph virtual_graph;
+        timer.reset();
+        build_scored_graph(similar, threads, [&](uint32_t product1, uint32_t product2)
+        {
+            return virtual_edge_weight(scoring, context, product1, product2);
+        }, virtual_graph);
+        double virtual_build_seconds = timer.elapsed_seconds();
+
+        PolicyRanker rank = pipeline.ranker(k);
+        vector<uint32_t> recommendations;
+        double query_seconds = time_queries(user_items, k, recommendations, [&](uint32_t user, vector<uint32_t>& out)
+        {
+            rank(user, k, user_items, graph, scratch, out);
+        });
+        vector<uint32_t> virtual_recommendations;
+        double virtual_query_seconds = time_queries(user_items, k, virtual_recommendations, [&](uint32_t user, vector<uint32_t>& out)
+        {
+            virtual_top_k(scoring, user, k, user_items, graph, scratch, out);
+        });
+
+        bool same = same_graph(graph, virtual_graph) && recommendations == virtual_recommendations;
+        if (p == 0)
+        {
+            same = same && same_graph(graph, reference_graph) && recommendations == reference;
+        }
+
+        double edges = max<double>(1, graph.num_edges());
+        double queries = max<double>(1, user_items.num_users());
+        cout << pipeline.name << "\t" << build_seconds * 1e9 / edges << " ns/edge\t" << virtual_build_seconds * 1e9 / edges << " ns/edge\t"
+             << query_seconds * 1e6 / queries << " us\t" << virtual_query_seconds * 1e6 / queries << " us\t" << (same ? "yes" : "NO") << endl;
+    }
+}
@@ -0,0 +1,288 @@
+#ifndef SCORING_POLICIES_H
+#define SCORING_POLICIES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "csr_graph.h"
+#include "edge_weights.h"
+#include "id_index.h"
+#include "parallel.h"
+#include "review_columns.h"
+#include "topk.h"
+
+
+/* The scoring pipeline split into compile-time policies. An edge
+ * product1 -> product2 is scored by walking the two reviewer lists:
+ *
+ *   Weight         what each user who reviewed both adds to the edge
+ *   Normalization  turns that sum into the edge weight, given both degrees
+ *   Aggregation    combines the edges reaching one candidate at query time
+ *
+ * and K, the number of recommendations, is a template parameter too (0:
+ * taken from the k argument). Every combination instantiates its own
+ * inlined loops; find_scoring_pipeline picks one at run time. */
+
+/* What the policies read: the reviewer index and, for the rating weight,
+ * the rating / 5 of every entry of index.reviewers. */
+struct ScoringContext
+{
+    const ReviewerIndex* index = nullptr;
+    const float* ratings = nullptr;
+};
+
+
+// weight policies; position indexes index.reviewers in product2's list
+
+/* 1 / number of products the user bought, as in make_product_graph. */
+struct InverseDegreeWeight
+{
+    static double weight(const ScoringContext& context, uint32_t user, uint64_t) { return context.index->inverse_degree[user]; }
+};
+
+/* 1 per user, which makes the sum the size of the intersection. */
+struct UnitWeight
+{
+    static double weight(const ScoringContext&, uint32_t, uint64_t) { return 1.0; }
+};
+
+/* 1 / degree, scaled by how the user rated product2. */
+struct RatingWeight
+{
+    static double weight(const ScoringContext& context, uint32_t user, uint64_t position)
+    {
+        return context.index->inverse_degree[user] * context.ratings[position];
+    }
+};
+
+
+// normalization policies; degree1 and degree2 are the reviewer counts
+
+/* sum / o_j, the make_product_graph formula. */
+struct TargetNormalization
+{
+    static double normalize(double sum, size_t, size_t degree2) { return degree2 == 0 ? 0 : (1.0 / double(degree2)) * sum; }
+};
+
+/* sum / sqrt(o_i * o_j). */
+struct CosineNormalization
+{
+    static double normalize(double sum, size_t degree1, size_t degree2)
+    {
+        return degree1 == 0 || degree2 == 0 ? 0 : sum / std::sqrt(double(degree1) * double(degree2));
+    }
+};
+
+/* |A ∩ B| / |A ∪ B|, for a sum of unit weights. */
+struct JaccardNormalization
+{
+    static double normalize(double sum, size_t degree1, size_t degree2)
+    {
+        double union_size = double(degree1) + double(degree2) - sum;
+        return union_size <= 0 ? 0 : sum / union_size;
+    }
+};
+
+
+// aggregation policies
+
+/* A candidate scores the sum of its edges, as in recommend_top_k. */
+struct SumAggregation
+{
+    static double combine(double score, double weight) { return score + weight; }
+};
+
+/* A candidate scores its heaviest edge, as the baseline predictor ranks. */
+struct MaxAggregation
+{
+    static double combine(double score, double weight) { return std::max(score, weight); }
+};
+
+
+/* Weight of the edge product1 -> product2. The merge advances both lists
+ * without a branch on the comparison and adds 0 for non-matching steps, so
+ * matches are summed in ascending user id order and the baseline policies
+ * give bit-identical weights to indexed_edge_weight. */
+template <typename Weight, typename Normalization>
+double policy_edge_weight(const ScoringContext& context, uint32_t product1, uint32_t product2)
+{
+    const ReviewerIndex& index = *context.index;
+    const uint32_t* a = index.begin(product1);
+    const uint32_t* b = index.begin(product2);
+    size_t a_size = index.count(product1);
+    size_t b_size = index.count(product2);
+    uint64_t b_offset = index.offsets[product2];
+
+    double sum = 0;
+    size_t i = 0, j = 0;
+    while (i < a_size && j < b_size)
+    {
+        uint32_t x = a[i];
+        uint32_t y = b[j];
+        double weight = Weight::weight(context, y, b_offset + j);
+        sum += x == y ? weight : 0.0;
+        i += x <= y;
+        j += y <= x;
+    }
+    return Normalization::normalize(sum, a_size, b_size);
+}
+
+
+/* make_product_graph_parallel with the edge weight taken from
+ * edge_weight(product1, product2). */
+template <typename EdgeWeight>
+void build_scored_graph(const SimilarLists& similar, unsigned threads, EdgeWeight edge_weight, CsrGraph& graph)
+{
+    typedef std::pair<uint32_t, double> Edge;
+    std::vector< std::vector<Edge> > rows(std::max(1u, threads));
+    std::vector<Edge> edges;
+
+    graph.clear();
+    parallel_csr(similar.num_products(), threads, [&](size_t product, unsigned thread_id, std::vector<Edge>& out)
+    {
+        std::vector<Edge>& row = rows[thread_id];
+        row.clear();
+        for (uint64_t s = similar.offsets[product]; s < similar.offsets[product + 1]; s++)
+        {
+            uint32_t neighbor = similar.products[s];
+            row.emplace_back(neighbor, edge_weight(uint32_t(product), neighbor));
+        }
+        std::sort(row.begin(), row.end());
+        row.erase(std::unique(row.begin(), row.end()), row.end());
+        out.insert(out.end(), row.begin(), row.end());
+    }, graph.offsets, edges);
+
+    graph.neighbors.resize(edges.size());
+    graph.weights.resize(edges.size());
+    for (size_t e = 0; e < edges.size(); e++)
+    {
+        graph.neighbors[e] = edges[e].first;
+        graph.weights[e] = edges[e].second;
+    }
+}
+
+
+template <typename Weight, typename Normalization>
+void build_policy_graph(const SimilarLists& similar, const ScoringContext& context, unsigned threads, CsrGraph& graph)
+{
+    build_scored_graph(similar, threads, [&context](uint32_t product1, uint32_t product2)
+    {
+        return policy_edge_weight<Weight, Normalization>(context, product1, product2);
+    }, graph);
+}
+
+
+/* recommend_top_k with the candidate scores combined by Aggregation and the
+ * best K kept in a sorted array (on the stack when K is known). Products
+ * the user bought are never recommended; ties go to the lower product id.
+ * With SumAggregation it returns exactly what recommend_top_k returns. */
+template <size_t K, typename Aggregation>
+void rank_policy_top_k(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, std::vector<uint32_t>& out)
+{
+    out.clear();
+    scratch.reset(graph.num_nodes());
+    scratch.touched.clear();
+    if (++scratch.generation == 0)
+    {
+        std::fill(scratch.stamp.begin(), scratch.stamp.end(), 0);
+        scratch.generation = 1;
+    }
+    uint32_t generation = scratch.generation;
+
+    // purchased products are stamped with no score before any edge is read
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        scratch.stamp[*item] = generation;
+        scratch.scores[*item] = -HUGE_VAL;
+    }
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        for (uint64_t e = graph.begin(*item); e < graph.end(*item); e++)
+        {
+            uint32_t candidate = graph.neighbors[e];
+            if (scratch.stamp[candidate] != generation)
+            {
+                scratch.stamp[candidate] = generation;
+                scratch.scores[candidate] = graph.weights[e];
+                scratch.touched.push_back(candidate);
+            }
+            else if (scratch.scores[candidate] != -HUGE_VAL)
+            {
+                scratch.scores[candidate] = Aggregation::combine(scratch.scores[candidate], graph.weights[e]);
+            }
+        }
+    }
+
+    const size_t capacity = K > 0 ? K : k;
+    if (capacity == 0) return;
+    std::pair<double, uint32_t> fixed[K > 0 ? K : 1];
+    if (K == 0) scratch.heap.resize(capacity);
+    std::pair<double, uint32_t>* best = K > 0 ? fixed : scratch.heap.data();
+
+    // best first: higher score, then lower product id
+    size_t size = 0;
+    for (uint32_t candidate : scratch.touched)
+    {
+        std::pair<double, uint32_t> entry(scratch.scores[candidate], candidate);
+        if (size == capacity && !(entry.first > best[size - 1].first || (entry.first == best[size - 1].first && entry.second < best[size - 1].second)))
+        {
+            continue;
+        }
+        size_t pos = size < capacity ? size++ : capacity - 1;
+        while (pos > 0 && (entry.first > best[pos - 1].first || (entry.first == best[pos - 1].first && entry.second < best[pos - 1].second)))
+        {
+            best[pos] = best[pos - 1];
+            pos--;
+        }
+        best[pos] = entry;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        out.push_back(best[i].second);
+    }
+}
+
+
+typedef void (*PolicyGraphBuilder)(const SimilarLists& similar, const ScoringContext& context, unsigned threads, CsrGraph& graph);
+typedef void (*PolicyRanker)(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, std::vector<uint32_t>& out);
+
+/* One instantiated combination of policies. */
+struct ScoringPipeline
+{
+    const char* name;
+    bool needs_ratings;                 // ScoringContext::ratings is read
+    PolicyGraphBuilder build_graph;
+    PolicyRanker rank_k5;               // K = 5, 10 and 20 compiled in
+    PolicyRanker rank_k10;
+    PolicyRanker rank_k20;
+    PolicyRanker rank_any;              // K from the argument
+
+    PolicyRanker ranker(size_t k) const { return k == 5 ? rank_k5 : k == 10 ? rank_k10 : k == 20 ? rank_k20 : rank_any; }
+};
+
+
+/* "baseline" (1/degree, / o_j, sum), "degree" (1/degree, / sqrt(o_i o_j),
+ * sum), "jaccard" (unit, jaccard, max) or "rating" (1/degree * rating / 5,
+ * / o_j, sum). nullptr for other names. The baseline graph is the one
+ * make_product_graph_parallel builds. */
+const ScoringPipeline* find_scoring_pipeline(const std::string& name);
+
+/* The names find_scoring_pipeline knows, in a fixed order. */
+std::vector<std::string> scoring_pipeline_names();
+
+/* rating / 5 of the review behind every entry of index.reviewers, 1 where
+ * the review columns hold no review for it. */
+void build_reviewer_ratings(const ReviewerIndex& index, const ReviewColumns& columns, std::vector<float>& ratings);
+
+/* Times the graph build and a top-k query over every user for each
+ * pipeline against the same pipeline written with virtual calls and a
+ * runtime k, and checks both give the same graph and recommendations (and
+ * the baseline against make_product_graph_parallel and recommend_top_k). */
+void report_scoring_policies(const SimilarLists& similar, const ScoringContext& context, const UserItems& user_items, size_t k, unsigned threads);
+
+#endif
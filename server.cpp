@@ -0,0 +1,643 @@
+#include "server.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+const uint32_t USERS_SEED = 224;
+const uint32_t CLIENT_SEED = 224;
+
+// bytes read from a socket at a time
+const size_t READ_CHUNK = 1 << 16;
+
+// pending connections the kernel queues before accept
+const int LISTEN_BACKLOG = 128;
+
+// most users one USERS request returns
+const size_t MAX_USERS_REPLY = 100000;
+
+
+/* Buffered line reader and writer over a connected socket. */
+class LineSocket
+{
+public:
+    explicit LineSocket(int fd) : fd_(fd), pos_(0), chunk_(READ_CHUNK) {}
+
+    /* The next line without its '\n' (or "\r\n"). Returns false once the
+     * peer has closed the connection. */
+    bool read_line(string& line)
+    {
+        while (true)
+        {
+            size_t newline = buffer_.find('\n', pos_);
+            if (newline != string::npos)
+            {
+                line.assign(buffer_, pos_, newline - pos_);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                pos_ = newline + 1;
+                return true;
+            }
+            buffer_.erase(0, pos_);
+            pos_ = 0;
+            ssize_t got = recv(fd_, chunk_.data(), chunk_.size(), 0);
+            if (got <= 0) return false;
+            buffer_.append(chunk_.data(), got);
+        }
+    }
+
+    // true if a whole line is buffered, so read_line will not block
+    bool has_line() const { return buffer_.find('\n', pos_) != string::npos; }
+
+    bool write_all(const string& text)
+    {
+        for (size_t sent = 0; sent < text.size(); )
+        {
+            ssize_t n = send(fd_, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+private:
+    int fd_;
+    string buffer_;
+    size_t pos_;
+    vector<char> chunk_;
+};
+
+
+void set_no_delay(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+int connect_local(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_no_delay(fd);
+    return fd;
+}
+
+
+// drops the spaces at the start of text
+string_view skip_spaces(string_view text)
+{
+    size_t start = text.find_first_not_of(' ');
+    return start == string_view::npos ? string_view() : text.substr(start);
+}
+
+
+// first word of a line and the rest after the spaces that follow it
+void split_command(string_view line, string_view& word, string_view& rest)
+{
+    line = skip_spaces(line);
+    size_t space = line.find(' ');
+    word = line.substr(0, space);
+    rest = space == string_view::npos ? string_view() : skip_spaces(line.substr(space));
+}
+
+
+/* Parses a request argument that has to be a plain decimal number, with
+ * nothing but spaces after it. strtoul alone would take "-1" as SIZE_MAX
+ * and stop silently at junk. */
+bool parse_count(string_view text, size_t& value)
+{
+    if (text.empty() || text[0] < '0' || text[0] > '9') return false;
+    string number(text);
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = strtoull(number.c_str(), &end, 10);
+    if (errno == ERANGE || !skip_spaces(string_view(end)).empty()) return false;
+    value = size_t(min<unsigned long long>(parsed, SIZE_MAX));
+    return true;
+}
+
+
+/* The queries of one read from a connection. The connection waits until
+ * all of them are answered, then writes the answers in order. */
+struct Group
+{
+    mutex lock;
+    condition_variable done;
+    size_t remaining = 0;
+
+    void finish()
+    {
+        lock_guard<mutex> guard(lock);
+        if (--remaining == 0) done.notify_one();
+    }
+
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&] { return remaining == 0; });
+    }
+};
+
+
+struct Query
+{
+    string_view user;
+    size_t k;
+    string* answer;
+    Group* group;
+};
+
+
+/* The queries of all connections, taken off in batches. */
+class BatchQueue
+{
+public:
+    BatchQueue() : closed_(false), collecting_(false) {}
+
+    void push(const vector<Query>& queries)
+    {
+        {
+            lock_guard<mutex> guard(lock_);
+            queue_.insert(queue_.end(), queries.begin(), queries.end());
+        }
+        changed_.notify_all();
+    }
+
+    void close()
+    {
+        {
+            lock_guard<mutex> guard(lock_);
+            closed_ = true;
+        }
+        changed_.notify_all();
+    }
+
+    /* Waits until no other worker is collecting and a query is queued, then
+     * waits up to `window` for max_batch queries and takes up to that
+     * many. Returns false once the queue is closed and empty. */
+    bool pop_batch(size_t max_batch, chrono::microseconds window, vector<Query>& batch)
+    {
+        unique_lock<mutex> guard(lock_);
+        changed_.wait(guard, [&] { return closed_ || (!collecting_ && !queue_.empty()); });
+        if (queue_.empty())
+        {
+            return false;
+        }
+
+        collecting_ = true;
+        changed_.wait_until(guard, chrono::steady_clock::now() + window, [&] { return closed_ || queue_.size() >= max_batch; });
+        size_t take = min(max_batch, queue_.size());
+        batch.assign(queue_.begin(), queue_.begin() + take);
+        queue_.erase(queue_.begin(), queue_.begin() + take);
+        collecting_ = false;
+        guard.unlock();
+        changed_.notify_all();
+        return true;
+    }
+
+private:
+    mutex lock_;
+    condition_variable changed_;
+    deque<Query> queue_;
+    bool closed_;
+    bool collecting_;
+};
+
+
+struct ServerState
+{
+    const RecommenderModel& model;
+    const ServerOptions& options;
+    int listen_fd = -1;
+    atomic<bool> stopping{false};
+    BatchQueue queue;
+
+    mutex clients_lock;
+    condition_variable clients_closed;   // signalled whenever a connection ends
+    vector<int> clients;                 // open connections, each served by a detached thread
+
+    atomic<uint64_t> queries{0};
+    atomic<uint64_t> batches{0};
+    atomic<uint64_t> distinct{0};
+
+    ServerState(const RecommenderModel& m, const ServerOptions& o) : model(m), options(o) {}
+
+    /* Stops accepting and wakes every connection blocked in a read; the
+     * queries already queued are still answered. */
+    void stop()
+    {
+        if (stopping.exchange(true)) return;
+        shutdown(listen_fd, SHUT_RDWR);
+        lock_guard<mutex> guard(clients_lock);
+        for (int fd : clients)
+        {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+};
+
+
+struct WorkerScratch
+{
+    TopKScratch top_k;
+    vector<uint32_t> picked;
+    vector<uint32_t> ids;
+    vector<size_t> order;
+    string answer;
+};
+
+
+/* Answers a batch. Queries are ordered by (user id, k), so repeats sit
+ * next to each other and are answered once, and the purchase rows are
+ * read in id order. */
+void answer_batch(ServerState& state, vector<Query>& batch, WorkerScratch& scratch)
+{
+    size_t n = batch.size();
+    scratch.ids.resize(n);
+    scratch.order.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        scratch.ids[i] = state.model.user_id(batch[i].user);
+        scratch.order[i] = i;
+    }
+    sort(scratch.order.begin(), scratch.order.end(), [&](size_t a, size_t b)
+    {
+        return scratch.ids[a] != scratch.ids[b] ? scratch.ids[a] < scratch.ids[b] : batch[a].k < batch[b].k;
+    });
+
+    size_t distinct = 0;
+    for (size_t first = 0; first < n; )
+    {
+        size_t query = scratch.order[first];
+        size_t last = first + 1;
+        while (last < n && scratch.ids[scratch.order[last]] == scratch.ids[query] && batch[scratch.order[last]].k == batch[query].k) last++;
+
+        if (!state.model.recommend(scratch.ids[query], batch[query].k, scratch.top_k, scratch.picked))
+        {
+            scratch.answer = "ERR unknown user";
+        }
+        else
+        {
+            scratch.answer = "OK";
+            for (uint32_t product : scratch.picked)
+            {
+                scratch.answer += ' ';
+                scratch.answer += state.model.asin(product);
+            }
+        }
+        for (size_t i = first; i < last; i++)
+        {
+            *batch[scratch.order[i]].answer = scratch.answer;
+        }
+        distinct++;
+        first = last;
+    }
+
+    state.queries += n;
+    state.batches++;
+    state.distinct += distinct;
+    for (Query& q : batch)
+    {
+        q.group->finish();
+    }
+}
+
+
+void work(ServerState& state)
+{
+    WorkerScratch scratch;
+    vector<Query> batch;
+    while (state.queue.pop_batch(max<size_t>(1, state.options.max_batch), chrono::microseconds(state.options.batch_window_us), batch))
+    {
+        answer_batch(state, batch, scratch);
+    }
+}
+
+
+/* Reads requests until the peer goes away. All requests that arrived
+ * together are answered as one group, so pipelined queries of a single
+ * connection can share a batch. */
+void serve_connection(ServerState& state, int fd)
+{
+    LineSocket socket(fd);
+    vector<string> lines, answers;
+    vector<Query> queries;
+    Group group;
+    string line, out;
+    bool open = true;
+    while (open && socket.read_line(line))
+    {
+        lines.assign(1, line);
+        while (socket.has_line() && socket.read_line(line))
+        {
+            lines.push_back(line);
+        }
+        answers.assign(lines.size(), string());
+        queries.clear();
+
+        bool shutdown_requested = false;
+        size_t answered = lines.size();
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            string_view word, rest;
+            split_command(lines[i], word, rest);
+            if (word == "QUIT")
+            {
+                open = false;
+                answered = i;
+                break;
+            }
+            else if (word == "SHUTDOWN")
+            {
+                answers[i] = "OK";
+                shutdown_requested = true;
+            }
+            else if (word == "STATS")
+            {
+                answers[i] = "OK queries " + to_string(state.queries.load()) + " batches " + to_string(state.batches.load())
+                           + " distinct " + to_string(state.distinct.load());
+            }
+            else if (word == "USERS")
+            {
+                size_t count = 0;
+                if (!parse_count(rest, count))
+                {
+                    answers[i] = "ERR bad count";
+                    continue;
+                }
+                count = state.model.num_users() == 0 ? 0 : min(count, MAX_USERS_REPLY);
+                mt19937 random(USERS_SEED);
+                uniform_int_distribution<uint32_t> pick(0, max<size_t>(1, state.model.num_users()) - 1);
+                answers[i] = "OK";
+                for (size_t u = 0; u < count; u++)
+                {
+                    answers[i] += ' ';
+                    answers[i] += state.model.user(pick(random));
+                }
+            }
+            else if (word.empty())
+            {
+                answers[i] = "ERR empty request";
+            }
+            else
+            {
+                size_t k = state.options.k;
+                if (!rest.empty() && (!parse_count(rest, k) || k == 0))
+                {
+                    answers[i] = "ERR bad k";
+                    continue;
+                }
+                queries.push_back(Query{word, min(k, state.model.num_products()), &answers[i], &group});
+            }
+        }
+
+        group.remaining = queries.size();
+        if (!queries.empty())
+        {
+            state.queue.push(queries);
+            group.wait();
+        }
+
+        out.clear();
+        for (size_t i = 0; i < answered; i++)
+        {
+            out += answers[i];
+            out += '\n';
+        }
+        if (!socket.write_all(out))
+        {
+            break;
+        }
+        if (shutdown_requested)
+        {
+            state.stop();
+        }
+    }
+
+    lock_guard<mutex> guard(state.clients_lock);
+    state.clients.erase(find(state.clients.begin(), state.clients.end(), fd));
+    close(fd);
+    state.clients_closed.notify_all();
+}
+
+}
+
+
+bool run_server(const RecommenderModel& model, const ServerOptions& options)
+{
+    ServerState state(model, options);
+    state.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (state.listen_fd < 0
+        || setsockopt(state.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+        || bind(state.listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || listen(state.listen_fd, LISTEN_BACKLOG) != 0)
+    {
+        cerr << "could not listen on 127.0.0.1:" << options.port << endl;
+        if (state.listen_fd >= 0) close(state.listen_fd);
+        return false;
+    }
+
+    unsigned threads = max(1u, options.threads);
+    cout << "serving on 127.0.0.1:" << options.port << " with " << threads << " workers, batches of up to "
+         << options.max_batch << " queries within " << options.batch_window_us << "us" << endl;
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+    {
+        workers.emplace_back(work, ref(state));
+    }
+
+    while (!state.stopping.load())
+    {
+        int fd = accept(state.listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        set_no_delay(fd);
+
+        lock_guard<mutex> guard(state.clients_lock);
+        if (state.stopping.load())
+        {
+            close(fd);
+            break;
+        }
+        state.clients.push_back(fd);
+        // detached, so a closed connection gives its stack back right away
+        thread(serve_connection, ref(state), fd).detach();
+    }
+
+    {
+        unique_lock<mutex> guard(state.clients_lock);
+        state.clients_closed.wait(guard, [&] { return state.clients.empty(); });
+    }
+    state.queue.close();
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    close(state.listen_fd);
+
+    uint64_t batches = max<uint64_t>(1, state.batches.load());
+    cout << "served " << state.queries.load() << " queries in " << state.batches.load() << " batches ("
+         << double(state.queries.load()) / batches << " per batch, " << state.distinct.load() << " distinct)" << endl;
+    return true;
+}
+
+
+bool run_load_client(const LoadClientOptions& options)
+{
+    int fd = connect_local(options.port);
+    if (fd < 0)
+    {
+        cerr << "could not connect to 127.0.0.1:" << options.port << endl;
+        return false;
+    }
+    LineSocket control(fd);
+
+    // the users to query come from the server, so the client loads nothing
+    string line;
+    vector<string> users;
+    if (!control.write_all("USERS " + to_string(options.users) + "\n") || !control.read_line(line) || line.compare(0, 2, "OK") != 0)
+    {
+        cerr << "no users from 127.0.0.1:" << options.port << endl;
+        close(fd);
+        return false;
+    }
+    for (const char* pos = line.data() + 2, *end = line.data() + line.size(); pos < end; )
+    {
+        while (pos < end && *pos == ' ') ++pos;
+        const char* start = pos;
+        while (pos < end && *pos != ' ') ++pos;
+        if (pos > start) users.emplace_back(start, pos - start);
+    }
+    if (users.empty())
+    {
+        cerr << "the server knows no users" << endl;
+        close(fd);
+        return false;
+    }
+
+    unsigned connections = max(1u, options.connections);
+    size_t pipeline = max<size_t>(1, options.pipeline);
+    vector< vector<double> > latencies(connections);
+    atomic<size_t> failed(0);
+    atomic<unsigned> unreachable(0);
+
+    auto client = [&](unsigned c)
+    {
+        int socket_fd = connect_local(options.port);
+        if (socket_fd < 0)
+        {
+            unreachable++;
+            return;
+        }
+        LineSocket socket(socket_fd);
+        mt19937 random(CLIENT_SEED + c);
+        uniform_int_distribution<size_t> pick(0, users.size() - 1);
+        string request, answer;
+        latencies[c].reserve(options.queries);
+
+        for (size_t sent = 0; sent < options.queries; )
+        {
+            size_t n = min(pipeline, options.queries - sent);
+            request.clear();
+            for (size_t i = 0; i < n; i++)
+            {
+                request += users[pick(random)];
+                request += ' ';
+                request += to_string(options.k);
+                request += '\n';
+            }
+
+            auto start = chrono::steady_clock::now();
+            if (!socket.write_all(request))
+            {
+                failed += options.queries - sent;
+                break;
+            }
+            size_t i = 0;
+            for (; i < n && socket.read_line(answer); i++)
+            {
+                latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+                if (answer.compare(0, 2, "OK") != 0) failed++;
+            }
+            if (i < n)
+            {
+                failed += options.queries - sent - i;
+                break;
+            }
+            sent += n;
+        }
+        close(socket_fd);
+    };
+
+    Stopwatch timer;
+    vector<thread> pool;
+    for (unsigned c = 0; c < connections; c++)
+    {
+        pool.emplace_back(client, c);
+    }
+    for (thread& worker : pool)
+    {
+        worker.join();
+    }
+    double seconds = timer.elapsed_seconds();
+
+    vector<double> all;
+    for (auto& samples : latencies)
+    {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    cout << "load client: " << connections << " connections x " << options.queries << " queries, pipeline " << pipeline << ", top " << options.k
+         << ": " << all.size() / max(seconds, 1e-9) << " qps, p50 " << percentile(all, 50) << "us, p99 " << percentile(all, 99)
+         << "us, p99.9 " << percentile(all, 99.9) << "us, " << failed.load() << " failed" << endl;
+
+    if (control.write_all("STATS\n") && control.read_line(line))
+    {
+        cout << "server: " << line << endl;
+    }
+    if (options.shutdown && control.write_all("SHUTDOWN\n"))
+    {
+        control.read_line(line);
+    }
+    close(fd);
+    return failed.load() == 0 && unreachable.load() == 0;
+}
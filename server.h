@@ -0,0 +1,63 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "model.h"
+
+
+/* Line protocol of the recommendation server, one request per line, one
+ * response line each, in request order (requests may be pipelined):
+ *
+ *   <user id> [k]   "OK <asin> <asin> ..." best first, or "ERR unknown user";
+ *                   k has to be a positive number ("ERR bad k")
+ *   USERS <n>       "OK <user> ..." n known users (at most 100000) drawn
+ *                   with a fixed seed, "ERR bad count" if n is not a number
+ *   STATS           "OK queries <n> batches <n> distinct <n>"
+ *   QUIT            closes the connection
+ *   SHUTDOWN        "OK", then the server stops
+ */
+
+struct ServerOptions
+{
+    uint16_t port = 0;
+    unsigned threads = 1;          // worker threads answering batches
+    size_t k = 5;                  // when the request names no k
+    size_t max_batch = 32;         // queries answered together
+    size_t batch_window_us = 0;    // how long a worker waits for a batch to fill
+};
+
+
+/* Serves the model on 127.0.0.1:port until a client sends SHUTDOWN. Every
+ * connection has a thread that reads its requests and writes the answers;
+ * the queries go to one queue. A fixed pool of workers takes them off in
+ * micro-batches: one worker at a time takes up to max_batch waiting queries
+ * (first waiting up to the window for more to arrive) and answers them
+ * while the next worker collects, so batches grow with the backlog.
+ * Repeated (user, k) queries of a batch are answered once and the
+ * distinct ones run in user id order. Returns false if the port cannot be
+ * bound. */
+bool run_server(const RecommenderModel& model, const ServerOptions& options);
+
+
+struct LoadClientOptions
+{
+    uint16_t port = 0;
+    unsigned connections = 8;
+    size_t queries = 10000;        // per connection
+    size_t pipeline = 4;           // requests sent before the answers are read
+    size_t k = 5;
+    size_t users = 10000;          // users fetched with USERS and queried at random
+    bool shutdown = false;         // send SHUTDOWN when done
+};
+
+
+/* Load test against a running server: every connection sends its queries
+ * in pipelined groups and times each group from the first write to the
+ * last answer. Prints the throughput, the p50/p99/p99.9 latency and the
+ * server's batch counters. Returns false if the server cannot be reached
+ * or an answer is not OK. */
+bool run_load_client(const LoadClientOptions& options);
+
+#endif
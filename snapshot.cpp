@@ -0,0 +1,503 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "instrument.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'P', 'R', 'S', 'N', 'A', 'P', 'S', 'H'};
+const uint32_t ENDIAN_CHECK = 0x01020304;
+
+enum Section
+{
+    ASIN_OFFSETS,      // uint64 per asin + 1
+    ASIN_CHARS,        // char
+    USER_OFFSETS,      // uint64 per user + 1, users in node id order
+    USER_CHARS,        // char
+    TEXT_OFFSETS,      // uint64 per string + 1
+    TEXT_CHARS,        // char
+    PRODUCTS,          // ProductRecord, in asin order; product i has asin i
+    CATEGORY_OFFSETS,  // uint64 per product + 1
+    CATEGORY_IDS,      // uint32 text index
+    SIMILAR_OFFSETS,   // uint64 per product + 1
+    SIMILAR_IDS,       // uint32 asin index
+    REVIEW_OFFSETS,    // uint64 per product + 1
+    REVIEWS,           // ReviewRecord, in reviewer id order within a product
+    USER_ORDER,        // uint32 node ids sorted by user id string
+    PURCHASE_OFFSETS,  // uint64 per user + 1, users in node id order
+    PURCHASE_IDS,      // uint32 asin index, sorted
+    NUM_SECTIONS
+};
+
+struct SectionEntry
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    int64_t num_purchases;
+    SectionEntry sections[NUM_SECTIONS];
+};
+
+struct ProductRecord
+{
+    double avg_rating;
+    int32_t id;
+    int32_t salesrank;
+    int32_t total_reviews;
+    int32_t downloaded_reviews;
+    uint32_t title;    // text index
+    uint32_t group;    // text index
+};
+
+struct ReviewRecord
+{
+    uint32_t user;     // node id
+    uint32_t date;     // text index
+    int32_t helpful;
+    int32_t rating;
+    int32_t votes;
+};
+
+static_assert(sizeof(ProductRecord) == 32, "ProductRecord layout is part of the file format");
+static_assert(sizeof(ReviewRecord) == 20, "ReviewRecord layout is part of the file format");
+
+
+/* Interns strings into the offsets + characters layout. */
+class StringTable
+{
+public:
+    StringTable() : offsets_(1, 0) {}
+
+    uint32_t intern(const string& value)
+    {
+        auto found = ids_.find(value);
+        if (found != ids_.end()) return found->second;
+        return add(value);
+    }
+
+    // appends without checking for an existing copy
+    uint32_t add(const string& value)
+    {
+        uint32_t id = offsets_.size() - 1;
+        chars_.append(value);
+        offsets_.push_back(chars_.size());
+        ids_.emplace(value, id);
+        return id;
+    }
+
+    const vector<uint64_t>& offsets() const { return offsets_; }
+    const string& chars() const { return chars_; }
+
+private:
+    vector<uint64_t> offsets_;
+    string chars_;
+    unordered_map<string, uint32_t> ids_;
+};
+
+
+/* Views one of the string tables of a mapped snapshot. */
+struct StringView
+{
+    const uint64_t* offsets;
+    const char* chars;
+
+    string get(uint32_t i) const
+    {
+        return string(chars + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const string& filename) : out_(filename.c_str(), ios::binary), position_(sizeof(SnapshotHeader))
+    {
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header_.version = SNAPSHOT_VERSION;
+        header_.endian_check = ENDIAN_CHECK;
+        out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    }
+
+    template <typename T>
+    void section(Section section, const T* data, size_t count)
+    {
+        // every array starts 8 byte aligned so it can be used in place
+        static const char padding[8] = {0};
+        size_t pad = (8 - position_ % 8) % 8;
+        out_.write(padding, pad);
+        position_ += pad;
+
+        header_.sections[section].offset = position_;
+        header_.sections[section].count = count;
+        out_.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+        position_ += count * sizeof(T);
+    }
+
+    template <typename T>
+    void section(Section section, const vector<T>& data)
+    {
+        this->section(section, data.data(), data.size());
+    }
+
+    bool finish(int64_t num_purchases)
+    {
+        header_.num_purchases = num_purchases;
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+        out_.close();
+        return !out_.fail();
+    }
+
+    bool ok() const { return out_.good(); }
+
+private:
+    ofstream out_;
+    SnapshotHeader header_;
+    uint64_t position_;
+};
+
+
+/* An offsets array has to start at 0, never decrease and end within the
+ * array it indexes. */
+bool valid_offsets(const uint64_t* offsets, size_t count, uint64_t limit)
+{
+    if (count == 0 || offsets[0] != 0)
+    {
+        return false;
+    }
+    for (size_t i = 1; i < count; i++)
+    {
+        if (offsets[i] < offsets[i - 1]) return false;
+    }
+    return offsets[count - 1] <= limit;
+}
+
+
+bool valid_ids(const uint32_t* ids, size_t count, size_t limit)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ids[i] >= limit) return false;
+    }
+    return true;
+}
+
+
+template <typename T>
+const T* section_data(const MappedFile& file, const SnapshotHeader* header, Section section)
+{
+    return reinterpret_cast<const T*>(file.data() + header->sections[section].offset);
+}
+
+}
+
+
+bool write_snapshot(const string& filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map< string, set< string > >& users_to_products, int num_purchases)
+{
+    if (user_to_nodeid.size() != users_to_products.size())
+    {
+        cerr << "snapshot: users_to_products and user_to_nodeid disagree" << endl;
+        return false;
+    }
+
+    // product keys take the first asin indices, in map order
+    StringTable asins;
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it)
+    {
+        asins.add(it->first);
+    }
+
+    StringTable users;
+    vector<uint32_t> user_order;
+    vector<string> names(user_to_nodeid.size());
+    for (auto it = user_to_nodeid.begin(); it != user_to_nodeid.end(); ++it)
+    {
+        if (it->second < 0 || size_t(it->second) >= names.size())
+        {
+            cerr << "snapshot: node ids are not dense" << endl;
+            return false;
+        }
+        names[it->second] = it->first;
+        user_order.push_back(it->second);
+    }
+    for (const string& name : names)
+    {
+        users.add(name);
+    }
+
+    StringTable text;
+    vector<ProductRecord> products;
+    vector<uint64_t> category_offsets(1, 0), similar_offsets(1, 0), review_offsets(1, 0);
+    vector<uint32_t> category_ids, similar_ids;
+    vector<ReviewRecord> reviews;
+    products.reserve(asin_to_product.size());
+
+    for (auto it = asin_to_product.begin(); it != asin_to_product.end(); ++it)
+    {
+        Product* product = it->second;
+
+        ProductRecord record;
+        record.avg_rating = product->avg_rating;
+        record.id = product->id;
+        record.salesrank = product->salesrank;
+        record.total_reviews = product->total_reviews;
+        record.downloaded_reviews = product->downloaded_reviews;
+        record.title = text.intern(product->title);
+        record.group = text.intern(product->group);
+        products.push_back(record);
+
+        for (const string& category : *product->categories)
+        {
+            category_ids.push_back(text.intern(category));
+        }
+        category_offsets.push_back(category_ids.size());
+
+        for (const string& similar : *product->similar)
+        {
+            similar_ids.push_back(asins.intern(similar));
+        }
+        similar_offsets.push_back(similar_ids.size());
+
+        for (auto review_it = product->reviews->begin(); review_it != product->reviews->end(); ++review_it)
+        {
+            auto user = user_to_nodeid.find(review_it->first);
+            if (user == user_to_nodeid.end())
+            {
+                cerr << "snapshot: reviewer " << review_it->first << " has no node id" << endl;
+                return false;
+            }
+
+            Review* review = review_it->second;
+            ReviewRecord review_record;
+            review_record.user = user->second;
+            review_record.date = text.intern(review->date);
+            review_record.helpful = review->helpful;
+            review_record.rating = review->rating;
+            review_record.votes = review->votes;
+            reviews.push_back(review_record);
+        }
+        review_offsets.push_back(reviews.size());
+    }
+
+    vector<uint64_t> purchase_offsets(1, 0);
+    vector<uint32_t> purchase_ids;
+    for (const string& name : names)
+    {
+        auto purchased = users_to_products.find(name);
+        if (purchased == users_to_products.end())
+        {
+            cerr << "snapshot: users_to_products and user_to_nodeid disagree" << endl;
+            return false;
+        }
+        for (const string& asin : purchased->second)
+        {
+            purchase_ids.push_back(asins.intern(asin));
+        }
+        purchase_offsets.push_back(purchase_ids.size());
+    }
+
+    SnapshotWriter writer(filename);
+    if (!writer.ok())
+    {
+        cerr << "snapshot: could not create " << filename << endl;
+        return false;
+    }
+    writer.section(ASIN_OFFSETS, asins.offsets());
+    writer.section(ASIN_CHARS, asins.chars().data(), asins.chars().size());
+    writer.section(USER_OFFSETS, users.offsets());
+    writer.section(USER_CHARS, users.chars().data(), users.chars().size());
+    writer.section(TEXT_OFFSETS, text.offsets());
+    writer.section(TEXT_CHARS, text.chars().data(), text.chars().size());
+    writer.section(PRODUCTS, products);
+    writer.section(CATEGORY_OFFSETS, category_offsets);
+    writer.section(CATEGORY_IDS, category_ids);
+    writer.section(SIMILAR_OFFSETS, similar_offsets);
+    writer.section(SIMILAR_IDS, similar_ids);
+    writer.section(REVIEW_OFFSETS, review_offsets);
+    writer.section(REVIEWS, reviews);
+    writer.section(USER_ORDER, user_order);
+    writer.section(PURCHASE_OFFSETS, purchase_offsets);
+    writer.section(PURCHASE_IDS, purchase_ids);
+    return writer.finish(num_purchases);
+}
+
+
+bool load_snapshot(const string& filename, map<string, Product*>& asin_to_product, map<string, int>& user_to_nodeid, map<int, string>& nodeid_to_user, map< string, set< string > >& users_to_products, int& num_purchases, vector<string>& user_vector)
+{
+    INSTRUMENT_SCOPE("load_snapshot");
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        cerr << "snapshot: could not open " << filename << endl;
+        return false;
+    }
+
+    const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(file.data());
+    if (file.size() < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    {
+        cerr << "snapshot: " << filename << " is not a snapshot" << endl;
+        return false;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->endian_check != ENDIAN_CHECK)
+    {
+        cerr << "snapshot: " << filename << " has version " << header->version
+             << ", expected " << SNAPSHOT_VERSION << " (re-create it with --write-snapshot)" << endl;
+        return false;
+    }
+
+    const size_t element_size[NUM_SECTIONS] = {8, 1, 8, 1, 8, 1, sizeof(ProductRecord), 8, 4, 8, 4, 8, sizeof(ReviewRecord), 4, 8, 4};
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        const SectionEntry& entry = header->sections[s];
+        if (entry.offset % 8 != 0 || entry.offset > file.size() || entry.count > (file.size() - entry.offset) / element_size[s])
+        {
+            cerr << "snapshot: " << filename << " is truncated" << endl;
+            return false;
+        }
+    }
+
+    size_t num_users = header->sections[USER_ORDER].count;
+    size_t num_products = header->sections[PRODUCTS].count;
+    if (header->sections[ASIN_OFFSETS].count < num_products + 1
+        || header->sections[USER_OFFSETS].count != num_users + 1
+        || header->sections[CATEGORY_OFFSETS].count != num_products + 1
+        || header->sections[SIMILAR_OFFSETS].count != num_products + 1
+        || header->sections[REVIEW_OFFSETS].count != num_products + 1
+        || header->sections[PURCHASE_OFFSETS].count != num_users + 1)
+    {
+        cerr << "snapshot: " << filename << " is inconsistent" << endl;
+        return false;
+    }
+
+    StringView asins = {section_data<uint64_t>(file, header, ASIN_OFFSETS), section_data<char>(file, header, ASIN_CHARS)};
+    StringView users = {section_data<uint64_t>(file, header, USER_OFFSETS), section_data<char>(file, header, USER_CHARS)};
+    StringView text = {section_data<uint64_t>(file, header, TEXT_OFFSETS), section_data<char>(file, header, TEXT_CHARS)};
+    const ProductRecord* products = section_data<ProductRecord>(file, header, PRODUCTS);
+    const uint64_t* category_offsets = section_data<uint64_t>(file, header, CATEGORY_OFFSETS);
+    const uint32_t* category_ids = section_data<uint32_t>(file, header, CATEGORY_IDS);
+    const uint64_t* similar_offsets = section_data<uint64_t>(file, header, SIMILAR_OFFSETS);
+    const uint32_t* similar_ids = section_data<uint32_t>(file, header, SIMILAR_IDS);
+    const uint64_t* review_offsets = section_data<uint64_t>(file, header, REVIEW_OFFSETS);
+    const ReviewRecord* reviews = section_data<ReviewRecord>(file, header, REVIEWS);
+    const uint32_t* user_order = section_data<uint32_t>(file, header, USER_ORDER);
+    const uint64_t* purchase_offsets = section_data<uint64_t>(file, header, PURCHASE_OFFSETS);
+    const uint32_t* purchase_ids = section_data<uint32_t>(file, header, PURCHASE_IDS);
+
+    // every offset and index is checked before anything is built from them
+    const SectionEntry* sections = header->sections;
+    size_t num_asins = sections[ASIN_OFFSETS].count - 1;
+    size_t num_text = sections[TEXT_OFFSETS].count == 0 ? 0 : sections[TEXT_OFFSETS].count - 1;
+    bool valid = sections[TEXT_OFFSETS].count > 0
+        && valid_offsets(asins.offsets, sections[ASIN_OFFSETS].count, sections[ASIN_CHARS].count)
+        && valid_offsets(users.offsets, sections[USER_OFFSETS].count, sections[USER_CHARS].count)
+        && valid_offsets(text.offsets, sections[TEXT_OFFSETS].count, sections[TEXT_CHARS].count)
+        && valid_offsets(category_offsets, num_products + 1, sections[CATEGORY_IDS].count)
+        && valid_offsets(similar_offsets, num_products + 1, sections[SIMILAR_IDS].count)
+        && valid_offsets(review_offsets, num_products + 1, sections[REVIEWS].count)
+        && valid_offsets(purchase_offsets, num_users + 1, sections[PURCHASE_IDS].count)
+        && valid_ids(category_ids, sections[CATEGORY_IDS].count, num_text)
+        && valid_ids(similar_ids, sections[SIMILAR_IDS].count, num_asins)
+        && valid_ids(purchase_ids, sections[PURCHASE_IDS].count, num_asins)
+        && valid_ids(user_order, num_users, num_users);
+    for (size_t i = 0; valid && i < num_products; i++)
+    {
+        valid = products[i].title < num_text && products[i].group < num_text;
+    }
+    for (size_t r = 0; valid && r < sections[REVIEWS].count; r++)
+    {
+        valid = reviews[r].user < num_users && reviews[r].date < num_text;
+    }
+    // user_order is a permutation of the node ids
+    vector<bool> ordered(valid ? num_users : 0, false);
+    for (size_t i = 0; valid && i < num_users; i++)
+    {
+        valid = !ordered[user_order[i]];
+        ordered[user_order[i]] = true;
+    }
+    if (!valid)
+    {
+        cerr << "snapshot: " << filename << " is corrupt" << endl;
+        return false;
+    }
+
+    user_vector.reserve(user_vector.size() + num_users);
+    for (size_t id = 0; id < num_users; id++)
+    {
+        user_vector.push_back(users.get(id));
+        nodeid_to_user.emplace_hint(nodeid_to_user.end(), id, user_vector.back());
+    }
+    const string* names = user_vector.data() + user_vector.size() - num_users;
+
+    for (size_t i = 0; i < num_users; i++)
+    {
+        uint32_t id = user_order[i];
+        user_to_nodeid.emplace_hint(user_to_nodeid.end(), names[id], id);
+
+        set<string>& purchased = users_to_products.emplace_hint(users_to_products.end(), names[id], set<string>())->second;
+        for (uint64_t p = purchase_offsets[id]; p < purchase_offsets[id + 1]; p++)
+        {
+            purchased.emplace_hint(purchased.end(), asins.get(purchase_ids[p]));
+        }
+    }
+
+    for (size_t i = 0; i < num_products; i++)
+    {
+        const ProductRecord& record = products[i];
+        Product* product = create_product();
+        product->asin = asins.get(i);
+        product->avg_rating = record.avg_rating;
+        product->id = record.id;
+        product->salesrank = record.salesrank;
+        product->total_reviews = record.total_reviews;
+        product->downloaded_reviews = record.downloaded_reviews;
+        product->title = text.get(record.title);
+        product->group = text.get(record.group);
+
+        product->categories->reserve(category_offsets[i + 1] - category_offsets[i]);
+        for (uint64_t c = category_offsets[i]; c < category_offsets[i + 1]; c++)
+        {
+            product->categories->push_back(text.get(category_ids[c]));
+        }
+
+        product->similar->reserve(similar_offsets[i + 1] - similar_offsets[i]);
+        for (uint64_t s = similar_offsets[i]; s < similar_offsets[i + 1]; s++)
+        {
+            product->similar->push_back(asins.get(similar_ids[s]));
+        }
+
+        for (uint64_t r = review_offsets[i]; r < review_offsets[i + 1]; r++)
+        {
+            const ReviewRecord& review_record = reviews[r];
+            Review* review = new Review();
+            review->date = text.get(review_record.date);
+            review->helpful = review_record.helpful;
+            review->rating = review_record.rating;
+            review->votes = review_record.votes;
+            review->product_id = product->asin;
+            product->reviews->emplace_hint(product->reviews->end(), names[review_record.user], review);
+        }
+
+        asin_to_product.emplace_hint(asin_to_product.end(), product->asin, product);
+    }
+
+    num_purchases += header->num_purchases;
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "parse_data.h"
+
+
+/* Binary snapshot of everything parse_file produces, so later runs can skip
+ * the text parse.
+ *
+ * The file is a fixed header followed by flat, 8 byte aligned arrays. Every
+ * string lives once in one of three interned tables (asins, user ids, other
+ * text such as titles, groups, categories and dates) stored as an offsets
+ * array plus the concatenated characters. Products, reviews, similar lists
+ * and purchased sets refer to strings by table index and to their own
+ * variable length lists by [offsets[i], offsets[i + 1]) ranges. Products are
+ * stored in asin order and users in node id order, so loading rebuilds the
+ * std::maps with in-order inserts. */
+
+// 2: groups and category paths keep their spaces
+const unsigned SNAPSHOT_VERSION = 2;
+
+/* Writes the snapshot. user_to_nodeid and users_to_products have to hold the
+ * same users, as they do straight after parsing. Returns false on I/O
+ * errors. */
+bool write_snapshot(const std::string& filename, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map< std::string, std::set< std::string > >& users_to_products, int num_purchases);
+
+/* Memory maps a snapshot and fills the same structures parse_file fills.
+ * Returns false (with the reason on stderr) if the file is missing, was
+ * written by a different version, is truncated or holds an offset or a
+ * string index that is out of range. */
+bool load_snapshot(const std::string& filename, std::map<std::string, Product*>& asin_to_product, std::map<std::string, int>& user_to_nodeid, std::map<int, std::string>& nodeid_to_user, std::map< std::string, std::set< std::string > >& users_to_products, int& num_purchases, std::vector<std::string>& user_vector);
+
+#endif
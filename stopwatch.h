@@ -0,0 +1,37 @@
+#ifndef STOPWATCH_H
+#define STOPWATCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+
+/* Wall clock timer used for the timing reports. */
+class Stopwatch
+{
+public:
+    Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+    void reset() { start_ = std::chrono::steady_clock::now(); }
+
+    double elapsed_seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+/* The p-th percentile (0-100) of a set of samples, nearest rank. Reorders
+ * the samples. Returns 0 for an empty set. */
+inline double percentile(std::vector<double>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    size_t rank = std::min(samples.size() - 1, size_t(p / 100.0 * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+#endif
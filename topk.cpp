@@ -0,0 +1,251 @@
+#include "topk.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "instrument.h"
+#include "parallel.h"
+#include "stopwatch.h"
+
+using namespace std;
+
+
+namespace {
+
+// users per work item in the all-users pass
+const size_t USERS_PER_BATCH = 1024;
+
+const double EXCLUDED = -numeric_limits<double>::infinity();
+
+
+// true if a ranks ahead of b: higher score, ties to the lower product id
+inline bool better(const pair<double, uint32_t>& a, const pair<double, uint32_t>& b)
+{
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+}
+
+
+/* recommend_top_k with a hook on the final score of every candidate:
+ * score(candidate, sum of edge weights) returns the ranking score, or
+ * EXCLUDED to drop the candidate. Called once per candidate, after all
+ * edges are summed. */
+template <typename Score>
+void top_k(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, vector<uint32_t>& out, Score score)
+{
+    out.clear();
+    scratch.reset(graph.num_nodes());
+    scratch.touched.clear();
+
+    if (++scratch.generation == 0)
+    {
+        // the stamps wrapped around, start over
+        fill(scratch.stamp.begin(), scratch.stamp.end(), 0);
+        scratch.generation = 1;
+    }
+    uint32_t generation = scratch.generation;
+
+    // purchased products are stamped as excluded before any edge is read
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        scratch.stamp[*item] = generation;
+        scratch.scores[*item] = EXCLUDED;
+    }
+
+    for (const uint32_t* item = user_items.begin(user); item != user_items.end(user); ++item)
+    {
+        for (uint64_t e = graph.begin(*item); e < graph.end(*item); e++)
+        {
+            uint32_t candidate = graph.neighbors[e];
+            if (scratch.stamp[candidate] != generation)
+            {
+                scratch.stamp[candidate] = generation;
+                scratch.scores[candidate] = graph.weights[e];
+                scratch.touched.push_back(candidate);
+            }
+            else if (scratch.scores[candidate] != EXCLUDED)
+            {
+                scratch.scores[candidate] += graph.weights[e];
+            }
+        }
+    }
+
+    // bounded heap with the worst kept candidate on top
+    vector< pair<double, uint32_t> >& heap = scratch.heap;
+    heap.clear();
+    if (k == 0) return;
+    for (uint32_t candidate : scratch.touched)
+    {
+        pair<double, uint32_t> entry(score(candidate, scratch.scores[candidate]), candidate);
+        if (entry.first == EXCLUDED) continue;
+        if (heap.size() < k)
+        {
+            heap.push_back(entry);
+            push_heap(heap.begin(), heap.end(), better);
+        }
+        else if (better(entry, heap.front()))
+        {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = entry;
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    sort_heap(heap.begin(), heap.end(), better);
+    for (auto& entry : heap)
+    {
+        out.push_back(entry.second);
+    }
+}
+
+}
+
+
+void TopKScratch::reset(size_t num_products)
+{
+    if (scores.size() != num_products)
+    {
+        scores.assign(num_products, 0);
+        stamp.assign(num_products, 0);
+        generation = 0;
+    }
+}
+
+
+void recommend_top_k(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, vector<uint32_t>& out)
+{
+    INSTRUMENT_COUNT("top_k queries", 1);
+    top_k(user, k, user_items, graph, scratch, out, [](uint32_t, double score) { return score; });
+}
+
+
+void recommend_top_k_filtered(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, const CategoryIndex& categories, const CategoryFilter& filter, TopKScratch& scratch, vector<uint32_t>& out)
+{
+    INSTRUMENT_COUNT("filtered top_k queries", 1);
+    top_k(user, k, user_items, graph, scratch, out, [&](uint32_t candidate, double score)
+    {
+        return filter.admits(categories, candidate) ? filter.score(categories, candidate, score) : EXCLUDED;
+    });
+}
+
+
+void recommend_all_users(size_t k, const UserItems& user_items, const CsrGraph& graph, unsigned threads, vector<uint32_t>& out)
+{
+    INSTRUMENT_SCOPE("recommend_all_users");
+    size_t num_users = user_items.num_users();
+    out.assign(num_users * k, NO_ID);
+
+    threads = max(1u, threads);
+    vector<TopKScratch> scratch(threads);
+    vector< vector<uint32_t> > picked(threads);
+
+    size_t batches = (num_users + USERS_PER_BATCH - 1) / USERS_PER_BATCH;
+    parallel_for(batches, threads, [&](size_t batch, unsigned thread_id)
+    {
+        size_t last = min(num_users, (batch + 1) * USERS_PER_BATCH);
+        for (size_t user = batch * USERS_PER_BATCH; user < last; user++)
+        {
+            recommend_top_k(user, k, user_items, graph, scratch[thread_id], picked[thread_id]);
+            copy(picked[thread_id].begin(), picked[thread_id].end(), out.begin() + user * k);
+        }
+    });
+}
+
+
+void check_top_k_predictions(const set< pair<string, string> >& test_set, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph, size_t k, unsigned threads)
+{
+    vector< pair<uint32_t, uint32_t> > tests;
+    for (auto test_it = test_set.begin(); test_it != test_set.end(); ++test_it)
+    {
+        uint32_t user = ids.user_id(test_it->first);
+        if (user != NO_ID && user < user_items.num_users())
+        {
+            tests.emplace_back(user, ids.product_id(test_it->second));
+        }
+    }
+
+    threads = max(1u, threads);
+    vector<TopKScratch> scratch(threads);
+    vector< vector<uint32_t> > picked(threads);
+    vector<char> correct(tests.size(), 0);
+    parallel_for(tests.size(), threads, [&](size_t i, unsigned thread_id)
+    {
+        recommend_top_k(tests[i].first, k, user_items, graph, scratch[thread_id], picked[thread_id]);
+        correct[i] = find(picked[thread_id].begin(), picked[thread_id].end(), tests[i].second) != picked[thread_id].end();
+    });
+
+    int numCorrect = count(correct.begin(), correct.end(), 1);
+    cout << "Number of Correct Predictions: " << numCorrect << endl;
+    cout << "Percentage Correct: " << 100.0 * (numCorrect / double(test_set.size())) << "%" << endl;
+}
+
+
+bool write_recommendations(const string& filename, const IdIndex& ids, size_t k, const vector<uint32_t>& recommendations)
+{
+    ofstream out(filename.c_str());
+    if (!out)
+    {
+        return false;
+    }
+
+    size_t num_users = k == 0 ? 0 : recommendations.size() / k;
+    for (size_t user = 0; user < num_users; user++)
+    {
+        const uint32_t* picked = recommendations.data() + user * k;
+        if (picked[0] == NO_ID) continue;
+
+        out << ids.users[user] << '\t';
+        for (size_t rank = 0; rank < k && picked[rank] != NO_ID; rank++)
+        {
+            if (rank > 0) out << ' ';
+            out << ids.asins[picked[rank]];
+        }
+        out << '\n';
+    }
+    return out.good();
+}
+
+
+void report_category_filter(const UserItems& user_items, const CsrGraph& graph, const CategoryIndex& categories, const CategoryFilter& filter, size_t k)
+{
+    size_t passing = 0;
+    for (uint32_t product = 0; product < categories.num_products(); product++)
+    {
+        passing += filter.admits(categories, product);
+    }
+    cout << "category index: " << categories.num_nodes() << " categories, " << categories.groups.size() << " groups, "
+         << categories.categories.size() << " product categories, " << categories.memory_bytes() / (1024.0 * 1024.0) << " MB; "
+         << passing << " of " << categories.num_products() << " products pass the filter" << endl;
+
+    TopKScratch scratch;
+    vector<uint32_t> out;
+    size_t num_users = user_items.num_users();
+    size_t unfiltered_results = 0, filtered_results = 0;
+
+    // alternating rounds, best of three, to keep machine noise out
+    double unfiltered_seconds = 1e300, filtered_seconds = 1e300;
+    for (int round = 0; round < 3; round++)
+    {
+        unfiltered_results = filtered_results = 0;
+        Stopwatch timer;
+        for (uint32_t user = 0; user < num_users; user++)
+        {
+            recommend_top_k(user, k, user_items, graph, scratch, out);
+            unfiltered_results += out.size();
+        }
+        unfiltered_seconds = min(unfiltered_seconds, timer.elapsed_seconds());
+
+        timer.reset();
+        for (uint32_t user = 0; user < num_users; user++)
+        {
+            recommend_top_k_filtered(user, k, user_items, graph, categories, filter, scratch, out);
+            filtered_results += out.size();
+        }
+        filtered_seconds = min(filtered_seconds, timer.elapsed_seconds());
+    }
+
+    double users = max<size_t>(1, num_users);
+    cout << "  unfiltered top " << k << ": " << unfiltered_seconds / users * 1e9 << " ns/query, " << unfiltered_results / users << " products per user" << endl;
+    cout << "  filtered top " << k << ":   " << filtered_seconds / users * 1e9 << " ns/query, " << filtered_results / users << " products per user" << endl;
+}
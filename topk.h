@@ -0,0 +1,62 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "category_index.h"
+#include "csr_graph.h"
+#include "id_index.h"
+
+
+/* Per-thread working memory for top-K queries. The dense score array is
+ * sized once for all products and reused by every query; a generation
+ * stamp marks which entries belong to the current query, so nothing has to
+ * be cleared between queries. */
+struct TopKScratch
+{
+    std::vector<double> scores;                      // aggregated candidate score per product
+    std::vector<uint32_t> stamp;                     // query generation that last touched the product
+    std::vector<uint32_t> touched;                   // candidates of the current query
+    std::vector< std::pair<double, uint32_t> > heap; // bounded min-heap used for selection
+    uint32_t generation = 0;
+
+    void reset(size_t num_products);
+};
+
+
+/* Recommends up to k products for a user. A candidate's score is the sum of
+ * the weights of all edges reaching it from the user's purchased products;
+ * products the user already bought are never recommended. out is filled
+ * best first (higher score, then lower product id). */
+void recommend_top_k(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, TopKScratch& scratch, std::vector<uint32_t>& out);
+
+/* recommend_top_k restricted to the candidates the filter admits, with the
+ * boosted ones' scores multiplied by the filter's boost. Filtering happens
+ * once per candidate after its score is summed, so it costs a signature
+ * AND for most candidates. Fewer than k products come back when fewer
+ * candidates pass. */
+void recommend_top_k_filtered(uint32_t user, size_t k, const UserItems& user_items, const CsrGraph& graph, const CategoryIndex& categories, const CategoryFilter& filter, TopKScratch& scratch, std::vector<uint32_t>& out);
+
+/* Runs recommend_top_k for every user on `threads` threads. out holds k
+ * slots per user (user * k + rank), unused slots are NO_ID. */
+void recommend_all_users(size_t k, const UserItems& user_items, const CsrGraph& graph, unsigned threads, std::vector<uint32_t>& out);
+
+/* checkBaselinePredictions for the top-K engine: counts how many held out
+ * purchases show up in the user's top k. */
+void check_top_k_predictions(const std::set< std::pair<std::string, std::string> >& test_set, const IdIndex& ids, const UserItems& user_items, const CsrGraph& graph, size_t k, unsigned threads);
+
+/* Prints the size of the category index and the time per query of
+ * recommend_top_k and recommend_top_k_filtered over every user, with how
+ * many products the filtered queries still return. */
+void report_category_filter(const UserItems& user_items, const CsrGraph& graph, const CategoryIndex& categories, const CategoryFilter& filter, size_t k);
+
+/* Writes "user<TAB>asin asin ..." lines for every user with at least one
+ * recommendation. Returns false on I/O errors. */
+bool write_recommendations(const std::string& filename, const IdIndex& ids, size_t k, const std::vector<uint32_t>& recommendations);
+
+#endif
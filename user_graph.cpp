@@ -0,0 +1,276 @@
+#include "user_graph.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <random>
+
+using namespace std;
+
+
+namespace {
+
+// smallest read buffer per run during the merge, in records
+const size_t MIN_READ_RECORDS = 1024;
+
+// records collected before a write while spilling a run
+const size_t WRITE_RECORDS = 4096;
+
+
+// a user pair (smaller id first) and how many products both reviewed
+struct EdgeRecord
+{
+    uint64_t pair;
+    uint64_t count;
+};
+
+
+inline uint64_t pack(uint32_t a, uint32_t b)
+{
+    return uint64_t(a) << 32 | b;
+}
+
+
+/* Calls visit(pair, count) for every distinct pair of a sorted buffer. */
+template <typename Visit>
+void scan_sorted_pairs(const vector<uint64_t>& pairs, Visit visit)
+{
+    for (size_t i = 0; i < pairs.size(); )
+    {
+        size_t j = i + 1;
+        while (j < pairs.size() && pairs[j] == pairs[i]) j++;
+        visit(pairs[i], j - i);
+        i = j;
+    }
+}
+
+
+/* Sorts the buffer and appends it to a new temporary file as (pair, count)
+ * records. The buffer is emptied. Returns nullptr on I/O errors. */
+FILE* spill_run(vector<uint64_t>& pairs)
+{
+    FILE* file = tmpfile();
+    if (file == nullptr)
+    {
+        return nullptr;
+    }
+
+    sort(pairs.begin(), pairs.end());
+    vector<EdgeRecord> staged;
+    staged.reserve(WRITE_RECORDS);
+    bool ok = true;
+    scan_sorted_pairs(pairs, [&](uint64_t pair, uint64_t count)
+    {
+        staged.push_back(EdgeRecord{pair, count});
+        if (staged.size() == WRITE_RECORDS)
+        {
+            ok = ok && fwrite(staged.data(), sizeof(EdgeRecord), staged.size(), file) == staged.size();
+            staged.clear();
+        }
+    });
+    ok = ok && fwrite(staged.data(), sizeof(EdgeRecord), staged.size(), file) == staged.size();
+    pairs.clear();
+
+    if (!ok || fflush(file) != 0)
+    {
+        fclose(file);
+        return nullptr;
+    }
+    return file;
+}
+
+
+/* Buffered sequential reader over one spilled run. */
+class RunReader
+{
+public:
+    RunReader(FILE* file, size_t records) : file_(file), buffer_(records), pos_(0), size_(0) {}
+
+    void rewind()
+    {
+        std::rewind(file_);
+        pos_ = size_ = 0;
+    }
+
+    bool next(EdgeRecord& record)
+    {
+        if (pos_ == size_)
+        {
+            size_ = fread(buffer_.data(), sizeof(EdgeRecord), buffer_.size(), file_);
+            pos_ = 0;
+            if (size_ == 0) return false;
+        }
+        record = buffer_[pos_++];
+        return true;
+    }
+
+    bool failed() const { return ferror(file_) != 0; }
+
+private:
+    FILE* file_;
+    vector<EdgeRecord> buffer_;
+    size_t pos_;
+    size_t size_;
+};
+
+
+/* k-way merge of the runs: calls visit(pair, count) for every distinct
+ * pair in ascending order, with the counts of all runs added up. */
+template <typename Visit>
+bool merge_runs(vector<RunReader>& readers, Visit visit)
+{
+    typedef pair<uint64_t, size_t> Head;   // (pair, reader)
+    priority_queue< Head, vector<Head>, greater<Head> > heads;
+    vector<EdgeRecord> current(readers.size());
+    for (size_t r = 0; r < readers.size(); r++)
+    {
+        readers[r].rewind();
+        if (readers[r].next(current[r])) heads.emplace(current[r].pair, r);
+    }
+
+    while (!heads.empty())
+    {
+        uint64_t pair = heads.top().first;
+        uint64_t count = 0;
+        while (!heads.empty() && heads.top().first == pair)
+        {
+            size_t r = heads.top().second;
+            heads.pop();
+            count += current[r].count;
+            if (readers[r].next(current[r])) heads.emplace(current[r].pair, r);
+        }
+        visit(pair, count);
+    }
+
+    for (RunReader& reader : readers)
+    {
+        if (reader.failed()) return false;
+    }
+    return true;
+}
+
+
+/* Fills the graph from a pass over the distinct pairs in ascending order.
+ * for_each_pair(visit) is called twice: degrees first, then the edges.
+ * Because the pairs arrive sorted with the smaller id first, every row ends
+ * up sorted without a final sort: row v receives its smaller neighbors
+ * (from the rows before it) before its own larger ones. */
+template <typename ForEachPair>
+bool fill_user_graph(size_t num_users, ForEachPair for_each_pair, UserGraph& graph)
+{
+    graph.offsets.assign(num_users + 1, 0);
+    bool ok = for_each_pair([&](uint64_t pair, uint64_t)
+    {
+        graph.offsets[(pair >> 32) + 1]++;
+        graph.offsets[uint32_t(pair) + 1]++;
+    });
+    if (!ok) return false;
+
+    for (size_t u = 0; u < num_users; u++)
+    {
+        graph.offsets[u + 1] += graph.offsets[u];
+    }
+    graph.neighbors.resize(graph.offsets[num_users]);
+    graph.co_reviews.resize(graph.offsets[num_users]);
+
+    vector<uint64_t> cursor(graph.offsets.begin(), graph.offsets.end() - 1);
+    return for_each_pair([&](uint64_t pair, uint64_t count)
+    {
+        uint32_t u = pair >> 32, v = uint32_t(pair);
+        graph.neighbors[cursor[u]] = v;
+        graph.co_reviews[cursor[u]++] = count;
+        graph.neighbors[cursor[v]] = u;
+        graph.co_reviews[cursor[v]++] = count;
+    });
+}
+
+}
+
+
+bool build_user_graph(const ReviewerIndex& index, size_t num_users, const UserGraphOptions& options, UserGraph& graph, UserGraphStats& stats)
+{
+    stats = UserGraphStats();
+    size_t capacity = max<size_t>(1, options.memory_budget / sizeof(uint64_t));
+    vector<uint64_t> pairs;
+    pairs.reserve(min<size_t>(capacity, size_t(1) << 20));
+    vector<FILE*> runs;
+    bool ok = true;
+
+    vector<uint32_t> sample;
+    mt19937 random;
+    size_t num_products = index.offsets.empty() ? 0 : index.offsets.size() - 1;
+    for (size_t product = 0; product < num_products && ok; product++)
+    {
+        const uint32_t* reviewers = index.begin(product);
+        size_t count = index.count(product);
+
+        // popular products contribute a fixed size sample of their reviewers
+        if (options.reviewer_cap > 0 && count > options.reviewer_cap)
+        {
+            sample.assign(reviewers, reviewers + count);
+            random.seed(options.seed + product);
+            for (size_t i = 0; i < options.reviewer_cap; i++)
+            {
+                swap(sample[i], sample[uniform_int_distribution<size_t>(i, count - 1)(random)]);
+            }
+            sort(sample.begin(), sample.begin() + options.reviewer_cap);
+            reviewers = sample.data();
+            count = options.reviewer_cap;
+            stats.capped_products++;
+        }
+
+        for (size_t i = 0; i < count && ok; i++)
+        {
+            for (size_t j = i + 1; j < count; j++)
+            {
+                if (pairs.size() == capacity)
+                {
+                    FILE* run = spill_run(pairs);
+                    if (run == nullptr)
+                    {
+                        ok = false;
+                        break;
+                    }
+                    runs.push_back(run);
+                }
+                pairs.push_back(pack(reviewers[i], reviewers[j]));
+            }
+        }
+        stats.pairs += count > 1 ? uint64_t(count) * (count - 1) / 2 : 0;
+    }
+
+    if (ok && runs.empty())
+    {
+        // everything fit in the budget, merge straight from memory
+        sort(pairs.begin(), pairs.end());
+        ok = fill_user_graph(num_users, [&](auto visit) { scan_sorted_pairs(pairs, visit); return true; }, graph);
+    }
+    else if (ok)
+    {
+        if (!pairs.empty())
+        {
+            FILE* run = spill_run(pairs);
+            ok = run != nullptr;
+            if (ok) runs.push_back(run);
+        }
+        vector<uint64_t>().swap(pairs);
+
+        if (ok)
+        {
+            size_t read_records = max(MIN_READ_RECORDS, options.memory_budget / sizeof(EdgeRecord) / runs.size());
+            vector<RunReader> readers;
+            for (FILE* run : runs)
+            {
+                readers.emplace_back(run, read_records);
+            }
+            ok = fill_user_graph(num_users, [&](auto visit) { return merge_runs(readers, visit); }, graph);
+        }
+    }
+
+    stats.runs = runs.size();
+    for (FILE* run : runs)
+    {
+        fclose(run);
+    }
+    return ok;
+}
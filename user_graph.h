@@ -0,0 +1,54 @@
+#ifndef USER_GRAPH_H
+#define USER_GRAPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "edge_weights.h"
+
+
+/* Undirected user-user graph: two users are connected if they reviewed at
+ * least one product in common, and the edge counts how many. Stored in
+ * compressed sparse row form with both directions of every edge, each row
+ * sorted by neighbor id. */
+struct UserGraph
+{
+    std::vector<uint64_t> offsets;    // num_users + 1
+    std::vector<uint32_t> neighbors;
+    std::vector<uint32_t> co_reviews; // products reviewed by both users
+
+    size_t num_users() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t num_edges() const { return neighbors.size() / 2; }
+    uint64_t begin(uint32_t user) const { return offsets[user]; }
+    uint64_t end(uint32_t user) const { return offsets[user + 1]; }
+};
+
+
+struct UserGraphOptions
+{
+    size_t memory_budget = size_t(256) << 20;  // bytes of reviewer pairs held before a run is spilled
+    size_t reviewer_cap = 1000;                // products with more reviewers use a sample of this many (0: no cap)
+    uint32_t seed = 224;                       // sampling seed, the same seed gives the same graph
+};
+
+
+struct UserGraphStats
+{
+    uint64_t pairs = 0;              // reviewer pairs generated
+    size_t capped_products = 0;      // products whose reviewers were sampled
+    size_t runs = 0;                 // sorted runs spilled to disk (0: everything fit in memory)
+};
+
+
+/* Replaces group_user_co_reviews + make_user_graph. Every reviewer pair of
+ * every product is appended to a buffer; whenever the buffer reaches the
+ * memory budget it is sorted, collapsed into (pair, count) records and
+ * written to a temporary file as a run. The runs are then merged twice, once
+ * to count degrees and once to fill the graph, so only the finished graph
+ * and one read buffer per run have to fit in memory. The index has to come
+ * from the review maps, as group_user_co_reviews reads them. Returns false
+ * if a run could not be written or read back. */
+bool build_user_graph(const ReviewerIndex& index, size_t num_users, const UserGraphOptions& options, UserGraph& graph, UserGraphStats& stats);
+
+#endif